@@ -8,6 +8,10 @@ import { IFlowmeterSensor } from '../types/flowmeter-sensor';
 
 let demoModeData: { sensors: ISensor[], speed: number } = { sensors: [], speed: 0 };
 
+// Pushed data older than this is considered lost and /data is polled instead.
+const PUSHED_DATA_MAX_AGE = 3000;
+const SOCKET_RECONNECT_INTERVAL = 5000;
+
 export type DataFecherServiceEvents = 'onDataFetched';
 
 export interface IDataFecherService extends IBaseService<DataFecherServiceEvents> {
@@ -20,6 +24,29 @@ export interface IDataFecherService extends IBaseService<DataFecherServiceEvents
 }
 
 export class DataFecherService extends BaseService<DataFecherServiceEvents> implements IDataFecherService {
+    private socket: WebSocket | null = null;
+    private lastSocketAttempt = 0;
+    private lastPushedData: any = null;
+    private lastPushedDataTimestamp = 0;
+
+    // Keeps a connection to the main module's push stream, so fetchData can use the
+    // latest snapshot it sent instead of making an HTTP request.
+    private ensureSocket = (apiBaseUri: string) => {
+        if (this.socket !== null || Date.now() - this.lastSocketAttempt < SOCKET_RECONNECT_INTERVAL) return;
+
+        this.lastSocketAttempt = Date.now();
+
+        const socket = new WebSocket(`${apiBaseUri.replace(/^http/, 'ws')}/ws/data`);
+        socket.onmessage = (event) => {
+            this.lastPushedData = JSON.parse(event.data);
+            this.lastPushedDataTimestamp = Date.now();
+        };
+        socket.onclose = () => {
+            if (this.socket === socket) this.socket = null;
+        };
+        this.socket = socket;
+    };
+
     public fetchData = async (): Promise<ESPData> => {
         return new Promise(async (resolve, reject) => {
             const isDemoMode = SettingsService.getSettingOrDefault('demoMode', false);
@@ -102,8 +129,13 @@ export class DataFecherService extends BaseService<DataFecherServiceEvents> impl
 
             const ApiBaseUri = SettingsService.getSettingOrDefault('apiBaseUrl', 'http://localhost:3000');
 
+            this.ensureSocket(ApiBaseUri);
+
             try {
-                const response = await axios.get(`${ApiBaseUri}/data`, { timeout: 10000 });
+                const isPushedDataFresh = this.lastPushedData !== null && Date.now() - this.lastPushedDataTimestamp < PUSHED_DATA_MAX_AGE;
+                const response = isPushedDataFresh
+                    ? { data: this.lastPushedData }
+                    : await axios.get(`${ApiBaseUri}/data`, { timeout: 10000 });
 
                 const shouldSimulateSpeed = SettingsService.getShouldSimulateSpeed();
                 const simulatedSpeed = (SettingsService.getSimulatedSpeed()) / 3.6;
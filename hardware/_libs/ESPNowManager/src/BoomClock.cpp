@@ -0,0 +1,56 @@
+#include "BoomClock.h"
+
+BoomClock::BoomClock()
+{
+}
+
+void BoomClock::reset()
+{
+    synchronized = false;
+    hasDrift = false;
+    drift = 0;
+    lastResidual = 0;
+}
+
+void BoomClock::onBeacon(int64_t localTime, int64_t boomTime)
+{
+    if (synchronized)
+    {
+        const int64_t residual = boomTime - toBoomTime(localTime);
+        if (localTime > lastLocalTime && residual <= BOOM_CLOCK_MAX_RESIDUAL && residual >= -BOOM_CLOCK_MAX_RESIDUAL)
+        {
+            lastResidual = residual;
+            lastBoomTime = toBoomTime(localTime) + residual / (1 << BOOM_CLOCK_OFFSET_SHIFT);
+            lastLocalTime = localTime;
+
+            const int64_t baseline = localTime - anchorLocalTime;
+            if (baseline >= BOOM_CLOCK_DRIFT_BASELINE)
+            {
+                const int64_t measured = (boomTime - anchorBoomTime - baseline) * 1000000000 / baseline;
+                if (measured >= -BOOM_CLOCK_MAX_DRIFT && measured <= BOOM_CLOCK_MAX_DRIFT)
+                {
+                    drift = hasDrift ? drift + ((int32_t)measured - drift) / (1 << BOOM_CLOCK_DRIFT_SHIFT) : (int32_t)measured;
+                    hasDrift = true;
+                }
+
+                anchorLocalTime = localTime;
+                anchorBoomTime = boomTime;
+            }
+            return;
+        }
+
+        reset();
+    }
+
+    lastLocalTime = localTime;
+    lastBoomTime = boomTime;
+    anchorLocalTime = localTime;
+    anchorBoomTime = boomTime;
+    synchronized = true;
+}
+
+int64_t BoomClock::toBoomTime(int64_t localTime)
+{
+    const int64_t elapsed = localTime - lastLocalTime;
+    return lastBoomTime + elapsed + elapsed * drift / 1000000000;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+
+// A beacon off the prediction by more than this (us) is a clock step (main module reboot), start over.
+#define BOOM_CLOCK_MAX_RESIDUAL 5000
+// Weight of a new beacon in the offset, as a right shift (1/2). Smooths the receive jitter out.
+#define BOOM_CLOCK_OFFSET_SHIFT 1
+// Drift is measured between beacons at least this far apart (us), so the
+// receive jitter weighs little next to the elapsed time.
+#define BOOM_CLOCK_DRIFT_BASELINE 10000000
+// Weight of a new drift measurement, as a right shift (1/4).
+#define BOOM_CLOCK_DRIFT_SHIFT 2
+// Drift measurements beyond this (parts per billion) are discarded, crystals are within +-100 ppm.
+#define BOOM_CLOCK_MAX_DRIFT 200000
+
+/*
+ * Maps the local clock of a secondary module to the boom time, the esp_timer
+ * of the main module, from the SAMPLE_LATCH broadcasts it receives.
+ *
+ * A broadcast reaches every secondary in the same transmission, so the
+ * propagation delay is common to the whole boom and left out: secondaries
+ * agree with each other to the receive jitter, and with the main module to
+ * that constant delay. The offset follows every beacon and the drift is
+ * measured over a long baseline, so the prediction stays close when a
+ * beacon or two is missed.
+ *
+ * Depends only on the C standard library so it can be built on the host.
+ */
+class BoomClock
+{
+public:
+    BoomClock();
+
+private:
+    bool synchronized = false;
+    bool hasDrift = false;
+    // Reference point of the mapping, moved on every beacon.
+    int64_t lastLocalTime = 0;
+    int64_t lastBoomTime = 0;
+    // Beacon the next drift measurement is taken from.
+    int64_t anchorLocalTime = 0;
+    int64_t anchorBoomTime = 0;
+    // Boom clock rate relative to the local one, in parts per billion.
+    int32_t drift = 0;
+    // Difference between the last beacon and the prediction, in microseconds.
+    int32_t lastResidual = 0;
+
+public:
+    /*
+     * Feeds a beacon: boomTime when the main module transmitted a frame,
+     * localTime as stamped by this module when it received that frame.
+     */
+    void onBeacon(int64_t localTime, int64_t boomTime);
+    void reset();
+
+    bool isSynchronized() { return synchronized; }
+    int64_t toBoomTime(int64_t localTime);
+
+    int64_t getOffset() { return lastBoomTime - lastLocalTime; }
+    int32_t getDrift() { return drift; }
+    int32_t getLastResidual() { return lastResidual; }
+};
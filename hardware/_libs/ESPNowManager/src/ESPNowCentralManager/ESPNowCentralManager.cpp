@@ -1,10 +1,14 @@
 #include "ESPNowCentralManager.h"
+#include <algorithm>
 
 ESPNowCentralManager::ESPNowCentralManager(bool debug) : ESPNowManager(debug)
 {
     preferences = new Preferences();
     preferences->begin("espnow", false);
 
+    // SAMPLE_LATCH goes to the whole boom at once. Registered before the slaves so a full peer table cannot leave it out.
+    addPeer(BROADCAST_MAC_ADDRESS);
+
     loadSlaves();
 
     registerCallback(
@@ -23,8 +27,11 @@ void ESPNowCentralManager::onPairRequestReceived(const uint8_t *mac_addr, const
     macAddress_t macAddress;
     memcpy(macAddress, mac_addr, sizeof(macAddress_t));
 
+    const uint8_t channelCount = data_len >= (int)sizeof(pair_request) ? reinterpret_cast<const pair_request *>(data)->channelCount : 0;
+
     if (instance->isSlave(macAddress))
     {
+        instance->setSlaveChannelCount(instance->getSlaveIndex(macAddress), channelCount);
         instance->confirmPairing(macAddress);
         return;
     }
@@ -34,7 +41,11 @@ void ESPNowCentralManager::onPairRequestReceived(const uint8_t *mac_addr, const
         return;
     }
 
-    instance->addSlave(macAddress);
+    // Left unanswered, the slave keeps asking and pairs once a slot is freed.
+    if (!instance->addSlave(macAddress, channelCount))
+    {
+        return;
+    }
 
     instance->confirmPairing(macAddress);
 }
@@ -53,8 +64,15 @@ bool ESPNowCentralManager::isSlave(const macAddress_t mac_addr)
 
 void ESPNowCentralManager::confirmPairing(const macAddress_t mac_addr)
 {
-    uint8_t *buffer = (uint8_t *)malloc(0);
-    sendBuffer(mac_addr, PAIR_REQUEST + 0x80, buffer, 0);
+    if (!isSlave(mac_addr))
+    {
+        return;
+    }
+
+    // Slots follow the slave list, which only ever grows at the end until every slave is removed.
+    // Reliable, a lost response is retransmitted within milliseconds instead of waiting for the next pairing request.
+    const struct_pair_response response = {PAIR_REQUEST + 0x80, 1, getSlaveIndex(mac_addr)};
+    sendReliable(mac_addr, PAIR_REQUEST + 0x80, reinterpret_cast<const uint8_t *>(&response), sizeof(response), nullptr, 0);
 }
 
 uint8_t ESPNowCentralManager::getSlaveIndex(const macAddress_t mac_addr)
@@ -69,25 +87,41 @@ uint8_t ESPNowCentralManager::getSlaveIndex(const macAddress_t mac_addr)
     return -1;
 }
 
-void ESPNowCentralManager::addSlave(const macAddress_t mac_addr)
+bool ESPNowCentralManager::addSlave(const macAddress_t mac_addr, uint8_t channelCount)
 {
     if (isSlave(mac_addr))
     {
-        return;
+        return true;
+    }
+
+    if (getSlavesCount() >= ESPNOW_MAX_SLAVES || addPeer(mac_addr) != ESP_OK)
+    {
+        return false;
     }
 
     macAddress_t *newSlaves = (macAddress_t *)realloc(this->slaves, sizeof(macAddress_t) * (getSlavesCount() + 1));
     if (newSlaves == nullptr)
     {
-        return;
+        removePeer(mac_addr);
+        return false;
     }
     this->slaves = newSlaves;
+
+    uint8_t *newSlavesChannelCount = (uint8_t *)realloc(this->slavesChannelCount, getSlavesCount() + 1);
+    if (newSlavesChannelCount == nullptr)
+    {
+        removePeer(mac_addr);
+        return false;
+    }
+    this->slavesChannelCount = newSlavesChannelCount;
+
     memcpy(&this->slaves[getSlavesCount()], mac_addr, sizeof(macAddress_t));
+    this->slavesChannelCount[getSlavesCount()] = channelCount;
     this->slavesCount++;
 
     saveSlaves();
 
-    addPeer(mac_addr);
+    return true;
 }
 
 void ESPNowCentralManager::removeSlave(const macAddress_t mac_addr)
@@ -100,8 +134,10 @@ void ESPNowCentralManager::removeSlave(const macAddress_t mac_addr)
             for (int j = i; j < getSlavesCount() - 1; j++)
             {
                 memcpy(&this->slaves[j], &this->slaves[j + 1], sizeof(macAddress_t));
+                this->slavesChannelCount[j] = this->slavesChannelCount[j + 1];
             }
             this->slaves = (macAddress_t *)realloc(this->slaves, sizeof(macAddress_t) * (getSlavesCount() - 1));
+            this->slavesChannelCount = (uint8_t *)realloc(this->slavesChannelCount, getSlavesCount() - 1);
             this->slavesCount--;
 
             saveSlaves();
@@ -120,23 +156,38 @@ void ESPNowCentralManager::loadSlaves()
         return;
     }
 
-    this->slavesCount = this->preferences->getUInt("slavesCount", 0);
-    if (this->slavesCount == 0)
+    const uint32_t savedSlavesCount = this->preferences->getUInt("slavesCount", 0);
+    if (savedSlavesCount == 0)
     {
         return;
     }
 
-    this->slaves = (macAddress_t *)malloc(sizeof(macAddress_t) * this->slavesCount);
-    this->preferences->getBytes("slaves", (uint8_t *)this->slaves, sizeof(macAddress_t) * this->slavesCount);
-    for (int i = 0; i < this->slavesCount; i++)
+    this->slaves = (macAddress_t *)malloc(sizeof(macAddress_t) * savedSlavesCount);
+    this->preferences->getBytes("slaves", (uint8_t *)this->slaves, sizeof(macAddress_t) * savedSlavesCount);
+    this->slavesCount = std::min<uint32_t>(savedSlavesCount, ESPNOW_MAX_SLAVES);
+
+    // Slaves saved before channel counts were advertised stay unknown until they pair again.
+    this->slavesChannelCount = (uint8_t *)calloc(savedSlavesCount, 1);
+    if (this->preferences->getBytesLength("slavesChannels") == savedSlavesCount)
     {
-        addPeer(this->slaves[i]);
+        this->preferences->getBytes("slavesChannels", this->slavesChannelCount, savedSlavesCount);
+    }
+
+    // Slaves past a full peer table are left out, and dropped from the saved list on its next save.
+    for (uint8_t i = 0; i < this->slavesCount; i++)
+    {
+        if (addPeer(this->slaves[i]) != ESP_OK)
+        {
+            this->slavesCount = i;
+            break;
+        }
     }
 }
 
 void ESPNowCentralManager::saveSlaves()
 {
     this->preferences->putBytes("slaves", (uint8_t *)this->slaves, sizeof(macAddress_t) * getSlavesCount());
+    this->preferences->putBytes("slavesChannels", this->slavesChannelCount, getSlavesCount());
     this->preferences->putUInt("slavesCount", getSlavesCount());
 }
 
@@ -182,6 +233,23 @@ std::string ESPNowCentralManager::getSlaveMacAddress(uint8_t index)
     return std::string(buffer);
 }
 
+uint8_t ESPNowCentralManager::getSlaveChannelCount(uint8_t index)
+{
+    return slavesChannelCount[index];
+}
+
+void ESPNowCentralManager::setSlaveChannelCount(uint8_t index, uint8_t channelCount)
+{
+    // Older secondaries do not advertise it, keep what we know.
+    if (channelCount == 0 || this->slavesChannelCount[index] == channelCount)
+    {
+        return;
+    }
+
+    this->slavesChannelCount[index] = channelCount;
+    saveSlaves();
+}
+
 void ESPNowCentralManager::removeAllSlaves()
 {
     for (int i = 0; i < getSlavesCount(); i++)
@@ -193,6 +261,8 @@ void ESPNowCentralManager::removeAllSlaves()
     {
         free(this->slaves);
         this->slaves = nullptr;
+        free(this->slavesChannelCount);
+        this->slavesChannelCount = nullptr;
         this->slavesCount = 0;
         saveSlaves();
     }
@@ -2,6 +2,11 @@
 #include <vector>
 #include <Preferences.h>
 
+// Slaves that can be paired. The broadcast peer of SAMPLE_LATCH takes one of the ESP-NOW peer slots.
+#ifndef ESPNOW_MAX_SLAVES
+#define ESPNOW_MAX_SLAVES (ESP_NOW_MAX_TOTAL_PEER_NUM - 1)
+#endif
+
 class ESPNowCentralManager : ESPNowManager
 {
 public:
@@ -14,6 +19,8 @@ private:
     bool isParingEnabled = false;
 
     macAddress_t *slaves = nullptr;
+    // Flowmeters advertised by each slave when pairing, 0 if unknown.
+    uint8_t *slavesChannelCount = nullptr;
     uint8_t slavesCount = 0;
 
     static void onPairRequestReceived(const uint8_t *mac_addr, const uint8_t *data, int data_len);
@@ -23,7 +30,9 @@ private:
     void confirmPairing(const macAddress_t mac_addr);
 
     uint8_t getSlaveIndex(const macAddress_t mac_addr);
-    void addSlave(const macAddress_t mac_addr);
+    // Returns false if the slave could not be stored or its peer registered, e.g. with ESPNOW_MAX_SLAVES paired already.
+    bool addSlave(const macAddress_t mac_addr, uint8_t channelCount);
+    void setSlaveChannelCount(uint8_t index, uint8_t channelCount);
     void removeSlave(const macAddress_t mac_addr);
     void loadSlaves();
     void saveSlaves();
@@ -37,6 +46,7 @@ public:
     void getSlaveMacAddress(uint8_t index, macAddress_t &mac_addr);
     void getSlaveMacAddress(uint8_t index, uint8_t *mac_addr);
     std::string getSlaveMacAddress(uint8_t index);
+    uint8_t getSlaveChannelCount(uint8_t index);
     void removeAllSlaves();
     bool isPairingEnabled();
 };
\ No newline at end of file
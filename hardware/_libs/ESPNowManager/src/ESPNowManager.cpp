@@ -1,10 +1,20 @@
 #include "ESPNowManager.h"
 #include <WiFi.h>
+#include <algorithm>
 
 ESPNowManager *ESPNowManager::instance = nullptr;
 
-ESPNowManager::ESPNowManager(bool debug)
+ESPNowManager::ESPNowManager(bool debug) : ESPNowManager(debug, true)
 {
+}
+
+ESPNowManager::ESPNowManager(bool debug, bool isOnDriver) : isOnDriver(isOnDriver)
+{
+    if (isOnDriver)
+    {
+        capture = TrafficCapture::getInstance();
+    }
+
     // if (WiFi.getMode() == WIFI_AP)
     // {
     //     WiFi.mode(WIFI_AP_STA);
@@ -14,17 +24,55 @@ ESPNowManager::ESPNowManager(bool debug)
     //     WiFi.mode(WIFI_STA);
     // }
 
-    WiFi.mode(WIFI_AP_STA);
+    if (isOnDriver)
+    {
+        WiFi.mode(WIFI_AP_STA);
+    }
+
+    for (uint8_t i = 0; i < ESPNOW_MESSAGE_METRICS_SLOTS; i++)
+    {
+        sentCounts[i].store(0, std::memory_order_relaxed);
+        sendErrorCounts[i].store(0, std::memory_order_relaxed);
+        receivedCounts[i].store(0, std::memory_order_relaxed);
+        droppedCounts[i].store(0, std::memory_order_relaxed);
+    }
+
+    memset(reliableMessages, 0, sizeof(reliableMessages));
+    memset(reliablePeers, 0, sizeof(reliablePeers));
+    reliableSession = (uint16_t)esp_random();
+
+    if (isOnDriver)
+    {
+        esp_now_init();
+    }
 
-    esp_now_init();
+    xTaskCreatePinnedToCore(
+        ESPNowManager::dispatcherTaskFunction,
+        "espnow_dispatch",
+        ESPNOW_DISPATCHER_TASK_STACK_SIZE,
+        this,
+        ESPNOW_DISPATCHER_TASK_PRIORITY,
+        &dispatcherTask,
+        ESPNOW_DISPATCHER_TASK_CORE);
+
+    if (!isOnDriver)
+    {
+        return;
+    }
 
     esp_now_register_recv_cb([](const uint8_t *mac_addr, const uint8_t *dataBuffer, int len)
                              { ESPNowManager::getInstance()->onReceiveData(mac_addr, dataBuffer, len); });
+
+    esp_now_register_send_cb([](const uint8_t *mac_addr, esp_now_send_status_t status)
+                             { ESPNowManager::getInstance()->onDataSent(mac_addr, status); });
 }
 
 ESPNowManager::~ESPNowManager()
 {
-    esp_now_deinit();
+    if (isOnDriver)
+    {
+        esp_now_deinit();
+    }
 }
 
 ESPNowManager *ESPNowManager::getInstance()
@@ -38,12 +86,174 @@ ESPNowManager *ESPNowManager::getInstance()
 
 void ESPNowManager::onReceiveData(const uint8_t *mac_addr, const uint8_t *dataBuffer, int len)
 {
-    if (debugMode)
-        Serial.printf("Received message of type %d from %02X:%02X:%02X:%02X:%02X:%02X\n", dataBuffer[0], mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]);
+    if (len >= 1 && capture != nullptr)
+    {
+        capture->recordFrame(CAPTURE_RECORD_RECEIVED, mac_addr, dataBuffer, len);
+    }
+
+    const uint32_t head = receiveQueueHead.load(std::memory_order_relaxed);
+    const uint32_t depth = head - receiveQueueTail.load(std::memory_order_acquire);
+
+    if (len < 1 || len > ESP_NOW_MAX_DATA_LEN || depth >= ESPNOW_RECEIVE_QUEUE_SIZE)
+    {
+        receiveQueueDropCount++;
+        if (len >= 1)
+        {
+            droppedCounts[getMessageMetricsSlot(dataBuffer[0])].fetch_add(1, std::memory_order_relaxed);
+        }
+        return;
+    }
+
+    received_frame &frame = receiveQueue[head & (ESPNOW_RECEIVE_QUEUE_SIZE - 1)];
+    frame.timestamp = esp_timer_get_time();
+    memcpy(frame.macAddress, mac_addr, sizeof(macAddress_t));
+    memcpy(frame.data, dataBuffer, len);
+    frame.length = len;
+
+    receiveQueueHead.store(head + 1, std::memory_order_release);
+
+    if (depth + 1 > receiveQueueHighWatermark)
+    {
+        receiveQueueHighWatermark = depth + 1;
+    }
+
+    if (dispatcherTask != nullptr)
+    {
+        xTaskNotifyGive(dispatcherTask);
+    }
+}
+
+void ESPNowManager::onDataSent(const uint8_t *mac_addr, esp_now_send_status_t status)
+{
+    if (status == ESP_NOW_SEND_SUCCESS)
+    {
+        deliveredCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+        deliveryFailedCount.fetch_add(1, std::memory_order_relaxed);
+
+        // The peer did not get a frame even after the MAC retries, retransmit
+        // what it still has to acknowledge without waiting for the timers.
+        // Messages sent once go right away, retransmitted ones keep half their
+        // backoff so an unreachable peer does not use up the retries at once.
+        const int64_t now = esp_timer_get_time();
+        bool hasReliableMessage = false;
+        portENTER_CRITICAL(&reliableMux);
+        for (reliable_message &message : reliableMessages)
+        {
+            if (!message.isUsed || memcmp(message.address, mac_addr, sizeof(macAddress_t)) != 0)
+            {
+                continue;
+            }
+
+            int64_t retransmitTime = now;
+            if (message.retransmitCount > 0)
+            {
+                retransmitTime = std::max(now, message.retransmitTime - ((int64_t)ESPNOW_RELIABLE_RETRANSMIT_TIMEOUT << (message.retransmitCount - 1)));
+            }
+            if (retransmitTime < message.retransmitTime)
+            {
+                message.retransmitTime = retransmitTime;
+                hasReliableMessage = true;
+            }
+        }
+        portEXIT_CRITICAL(&reliableMux);
+
+        if (hasReliableMessage && dispatcherTask != nullptr)
+        {
+            xTaskNotifyGive(dispatcherTask);
+        }
+    }
+
+    if (memcmp(mac_addr, BROADCAST_MAC_ADDRESS, sizeof(macAddress_t)) != 0)
+    {
+        return;
+    }
+
+    const int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&broadcastSentMux);
+    broadcastSentTimestamp = now;
+    portEXIT_CRITICAL(&broadcastSentMux);
+}
 
-    const uint8_t messageType = dataBuffer[0];
+int64_t ESPNowManager::getBroadcastSentTimestamp()
+{
+    portENTER_CRITICAL(&broadcastSentMux);
+    const int64_t timestamp = broadcastSentTimestamp;
+    portEXIT_CRITICAL(&broadcastSentMux);
+
+    return timestamp;
+}
+
+void ESPNowManager::dispatcherTaskFunction(void *arg)
+{
+    ESPNowManager *manager = static_cast<ESPNowManager *>(arg);
+    TickType_t wait = portMAX_DELAY;
+
+    // Woken by every received frame and reliable message sent, or by the next retransmit due.
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, wait);
+
+        const int64_t start = esp_timer_get_time();
+        manager->dispatchReceivedFrames();
+        wait = manager->retransmitReliableMessages();
+        manager->dispatcherLoad.add(esp_timer_get_time() - start);
+    }
+}
+
+void ESPNowManager::dispatchReceivedFrames()
+{
+    uint32_t tail = receiveQueueTail.load(std::memory_order_relaxed);
+
+    while (true)
+    {
+        const uint32_t head = receiveQueueHead.load(std::memory_order_acquire);
+        if (tail == head)
+        {
+            return;
+        }
+
+        const uint32_t batchEnd = head - tail > ESPNOW_DISPATCH_BATCH_SIZE ? tail + ESPNOW_DISPATCH_BATCH_SIZE : head;
+        for (; tail != batchEnd; tail++)
+        {
+            const received_frame &frame = receiveQueue[tail & (ESPNOW_RECEIVE_QUEUE_SIZE - 1)];
+            const uint8_t messageType = frame.data[0];
+
+            if (debugMode)
+                Serial.printf("Received message of type %d from %02X:%02X:%02X:%02X:%02X:%02X\n", messageType, frame.macAddress[0], frame.macAddress[1], frame.macAddress[2], frame.macAddress[3], frame.macAddress[4], frame.macAddress[5]);
+
+            dispatchedFrameTimestamp = frame.timestamp;
 
-    callOnReceiveCallbacks(messageType, mac_addr, (uint8_t *)dataBuffer + 1, len - 1);
+            const uint32_t latency = (uint32_t)(esp_timer_get_time() - frame.timestamp);
+            portENTER_CRITICAL(&dispatchLatencyMux);
+            dispatchLatencyHistogram.add(latency);
+            portEXIT_CRITICAL(&dispatchLatencyMux);
+
+            if (messageType == RELIABLE_MESSAGE)
+            {
+                // Counted under the type it carries.
+                onReliableMessage(frame.macAddress, frame.data + 1, frame.length - 1);
+            }
+            else
+            {
+                if (messageType == RELIABLE_MESSAGE + 0x80)
+                {
+                    onReliableAck(frame.macAddress, frame.data + 1, frame.length - 1);
+                }
+                else
+                {
+                    callOnReceiveCallbacks(messageType, frame.macAddress, frame.data + 1, frame.length - 1);
+                }
+                receivedCounts[getMessageMetricsSlot(messageType)].fetch_add(1, std::memory_order_relaxed);
+            }
+            dispatchedFrameCount++;
+        }
+
+        // Release the whole batch to the driver side at once.
+        receiveQueueTail.store(tail, std::memory_order_release);
+    }
 }
 
 void ESPNowManager::callOnReceiveCallbacks(uint8_t messageType, const uint8_t *mac_addr, const uint8_t *dataBuffer, int len)
@@ -55,39 +265,398 @@ void ESPNowManager::callOnReceiveCallbacks(uint8_t messageType, const uint8_t *m
     }
 }
 
-void ESPNowManager::addPeer(const uint8_t *mac_addr)
+esp_err_t ESPNowManager::addPeer(const uint8_t *mac_addr)
 {
+    if (!isOnDriver)
+    {
+        return ESP_OK;
+    }
+
     esp_now_del_peer(mac_addr);
 
     esp_now_peer_info_t peer;
     memset(&peer, 0, sizeof(esp_now_peer_info_t));
     memcpy(peer.peer_addr, mac_addr, sizeof(uint8_t[6]));
-    esp_now_add_peer(&peer);
+    return esp_now_add_peer(&peer);
 }
 
 void ESPNowManager::removePeer(const uint8_t *mac_addr)
 {
-    esp_now_del_peer(mac_addr);
+    if (isOnDriver)
+    {
+        esp_now_del_peer(mac_addr);
+    }
 }
 
-void ESPNowManager::sendBuffer(const uint8_t *address, uint8_t messageType, const uint8_t *buffer, size_t size)
+reliable_peer &ESPNowManager::getReliablePeer(const uint8_t *mac_addr)
 {
-    uint8_t *newBuffer = new uint8_t[size + 1];
-    newBuffer[0] = messageType;
-    memcpy(newBuffer + 1, buffer, size);
-    esp_now_send(reinterpret_cast<const uint8_t *>(address), newBuffer, size + 1);
-    delete[] newBuffer;
+    const macAddressKey_t macKey = macAddressToKey(mac_addr);
+    const unsigned long now = millis();
+
+    // The least recent peer makes room, preferably one with nothing in flight.
+    reliable_peer *leastRecentPeer = &reliablePeers[0];
+    reliable_peer *leastRecentIdlePeer = nullptr;
+    for (reliable_peer &peer : reliablePeers)
+    {
+        if (peer.macKey == macKey)
+        {
+            peer.lastUseTimestamp = now;
+            return peer;
+        }
+        if (peer.lastUseTimestamp < leastRecentPeer->lastUseTimestamp)
+        {
+            leastRecentPeer = &peer;
+        }
+        if ((leastRecentIdlePeer == nullptr || peer.lastUseTimestamp < leastRecentIdlePeer->lastUseTimestamp) && !hasReliableMessageInFlight(peer.macKey))
+        {
+            leastRecentIdlePeer = &peer;
+        }
+    }
+
+    reliable_peer *newPeer = leastRecentIdlePeer != nullptr ? leastRecentIdlePeer : leastRecentPeer;
+    memset(newPeer, 0, sizeof(reliable_peer));
+    newPeer->macKey = macKey;
+    // A peer evicted and used again in the same session must not repeat the
+    // sequences the receiver still remembers, start somewhere else.
+    newPeer->sentSequence = (uint16_t)esp_random();
+    newPeer->lastUseTimestamp = now;
+    return *newPeer;
+}
+
+bool ESPNowManager::hasReliableMessageInFlight(macAddressKey_t macKey)
+{
+    for (const reliable_message &message : reliableMessages)
+    {
+        if (message.isUsed && macAddressToKey(message.address) == macKey)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ESPNowManager::acceptReliableSequence(reliable_peer &peer, uint16_t session, uint16_t sequence)
+{
+    if (!peer.hasReceived || peer.receivedSession != session)
+    {
+        peer.hasReceived = true;
+        peer.receivedSession = session;
+        peer.receivedSequence = sequence;
+        peer.receivedBitmap = 1;
+        return true;
+    }
+
+    const int16_t distance = (int16_t)(sequence - peer.receivedSequence);
+    if (distance > 0)
+    {
+        peer.receivedBitmap = distance < ESPNOW_RELIABLE_DUPLICATE_WINDOW ? (peer.receivedBitmap << distance) | 1 : 1;
+        peer.receivedSequence = sequence;
+        return true;
+    }
+
+    // Retransmits stop long before a copy could fall this far behind, the sender started over.
+    const uint16_t age = (uint16_t)-distance;
+    if (age >= ESPNOW_RELIABLE_DUPLICATE_WINDOW)
+    {
+        peer.receivedSequence = sequence;
+        peer.receivedBitmap = 1;
+        return true;
+    }
+
+    const uint32_t bit = (uint32_t)1 << age;
+    if (peer.receivedBitmap & bit)
+    {
+        return false;
+    }
+    peer.receivedBitmap |= bit;
+    return true;
+}
+
+void ESPNowManager::onReliableMessage(const uint8_t *mac_addr, const uint8_t *data, int len)
+{
+    if (len < (int)sizeof(reliable_header))
+    {
+        receivedCounts[getMessageMetricsSlot(RELIABLE_MESSAGE)].fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    reliable_header header;
+    memcpy(&header, data, sizeof(reliable_header));
+
+    portENTER_CRITICAL(&reliableMux);
+    const bool isNew = acceptReliableSequence(getReliablePeer(mac_addr), header.session, header.sequence);
+    if (!isNew)
+    {
+        reliableDuplicateCount++;
+    }
+    portEXIT_CRITICAL(&reliableMux);
+
+    receivedCounts[getMessageMetricsSlot(isNew ? header.messageType : (uint8_t)RELIABLE_MESSAGE)].fetch_add(1, std::memory_order_relaxed);
+    if (isNew)
+    {
+        callOnReceiveCallbacks(header.messageType, mac_addr, data + sizeof(reliable_header), len - sizeof(reliable_header));
+    }
+
+    // Acknowledged once handled, so the callbacks can add the sender as a peer first
+    // (pairing). Every copy is acknowledged, the previous acknowledgement may be the one lost.
+    const reliable_ack ack = {header.session, header.sequence};
+    sendBuffer(mac_addr, RELIABLE_MESSAGE + 0x80, reinterpret_cast<const uint8_t *>(&ack), sizeof(ack));
+}
+
+void ESPNowManager::onReliableAck(const uint8_t *mac_addr, const uint8_t *data, int len)
+{
+    if (len < (int)sizeof(reliable_ack))
+    {
+        return;
+    }
+
+    reliable_ack ack;
+    memcpy(&ack, data, sizeof(reliable_ack));
+
+    // Acknowledgements of a previous boot, or of a message already completed, are ignored.
+    portENTER_CRITICAL(&reliableMux);
+    for (reliable_message &message : reliableMessages)
+    {
+        if (ack.session == reliableSession && message.isUsed && message.sequence == ack.sequence && memcmp(message.address, mac_addr, sizeof(macAddress_t)) == 0)
+        {
+            message.isUsed = false;
+            reliableDeliveredCount++;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&reliableMux);
+}
+
+TickType_t ESPNowManager::retransmitReliableMessages()
+{
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    macAddress_t address;
+    uint8_t messageType;
+    uint8_t length;
+
+    // One message at a time, the frame is sent outside the critical section.
+    while (true)
+    {
+        const int64_t now = esp_timer_get_time();
+        int64_t nextRetransmitTime = INT64_MAX;
+        bool isDue = false;
+
+        portENTER_CRITICAL(&reliableMux);
+        for (reliable_message &message : reliableMessages)
+        {
+            if (!message.isUsed)
+            {
+                continue;
+            }
+
+            if (message.retransmitTime > now)
+            {
+                nextRetransmitTime = std::min(nextRetransmitTime, message.retransmitTime);
+                continue;
+            }
+
+            if (message.retransmitCount >= ESPNOW_RELIABLE_MAX_RETRANSMITS)
+            {
+                message.isUsed = false;
+                reliableFailedCount++;
+                continue;
+            }
+
+            message.retransmitCount++;
+            message.retransmitTime = now + ((int64_t)ESPNOW_RELIABLE_RETRANSMIT_TIMEOUT << message.retransmitCount);
+            reliableRetransmitCount++;
+
+            memcpy(address, message.address, sizeof(macAddress_t));
+            messageType = message.messageType;
+            length = message.length;
+            memcpy(frame, message.frame, length);
+            isDue = true;
+            break;
+        }
+        portEXIT_CRITICAL(&reliableMux);
+
+        if (!isDue)
+        {
+            if (nextRetransmitTime == INT64_MAX)
+            {
+                return portMAX_DELAY;
+            }
+            return std::max<TickType_t>(pdMS_TO_TICKS((nextRetransmitTime - now + 999) / 1000), 1);
+        }
+
+        sendFrame(address, messageType, frame, length);
+    }
+}
+
+void ESPNowManager::copyDispatchLatency(latency_histogram &histogram)
+{
+    portENTER_CRITICAL(&dispatchLatencyMux);
+    histogram = dispatchLatencyHistogram;
+    portEXIT_CRITICAL(&dispatchLatencyMux);
+}
+
+uint8_t ESPNowManager::getReliableInFlightCount()
+{
+    uint8_t count = 0;
+
+    portENTER_CRITICAL(&reliableMux);
+    for (const reliable_message &message : reliableMessages)
+    {
+        count += message.isUsed ? 1 : 0;
+    }
+    portEXIT_CRITICAL(&reliableMux);
+
+    return count;
+}
+
+bool ESPNowManager::sendBuffer(const uint8_t *address, uint8_t messageType, const uint8_t *buffer, size_t size)
+{
+    return sendBuffer(address, messageType, buffer, size, nullptr, 0);
+}
+
+bool ESPNowManager::sendBuffer(const uint8_t *address, uint8_t messageType, const uint8_t *header, size_t headerSize, const uint8_t *payload, size_t payloadSize)
+{
+    const size_t frameSize = 1 + headerSize + payloadSize;
+    if (frameSize > ESP_NOW_MAX_DATA_LEN)
+    {
+        return false;
+    }
+
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    frame[0] = messageType;
+    if (headerSize > 0)
+    {
+        memcpy(frame + 1, header, headerSize);
+    }
+    if (payloadSize > 0)
+    {
+        memcpy(frame + 1 + headerSize, payload, payloadSize);
+    }
+
+    return sendFrame(address, messageType, frame, frameSize);
+}
+
+bool ESPNowManager::sendReliable(const uint8_t *address, uint8_t messageType, const uint8_t *header, size_t headerSize, const uint8_t *payload, size_t payloadSize)
+{
+    const size_t frameSize = 1 + sizeof(reliable_header) + headerSize + payloadSize;
+    if (frameSize > ESP_NOW_MAX_DATA_LEN)
+    {
+        return false;
+    }
+
+    // Assembled first, only the sequence number is filled in under the lock.
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    reliable_header reliableHeader = {reliableSession, 0, messageType};
+    frame[0] = RELIABLE_MESSAGE;
+    if (headerSize > 0)
+    {
+        memcpy(frame + 1 + sizeof(reliable_header), header, headerSize);
+    }
+    if (payloadSize > 0)
+    {
+        memcpy(frame + 1 + sizeof(reliable_header) + headerSize, payload, payloadSize);
+    }
+
+    portENTER_CRITICAL(&reliableMux);
+    reliable_message *message = nullptr;
+    for (reliable_message &candidate : reliableMessages)
+    {
+        if (!candidate.isUsed)
+        {
+            message = &candidate;
+            break;
+        }
+    }
+
+    if (message == nullptr)
+    {
+        reliableWindowFullCount++;
+        portEXIT_CRITICAL(&reliableMux);
+        return false;
+    }
+
+    reliable_peer &peer = getReliablePeer(address);
+    peer.sentSequence++;
+    reliableHeader.sequence = peer.sentSequence;
+    memcpy(frame + 1, &reliableHeader, sizeof(reliable_header));
+
+    message->isUsed = true;
+    memcpy(message->address, address, sizeof(macAddress_t));
+    message->sequence = reliableHeader.sequence;
+    message->messageType = messageType;
+    message->retransmitCount = 0;
+    message->retransmitTime = esp_timer_get_time() + ESPNOW_RELIABLE_RETRANSMIT_TIMEOUT;
+    message->length = frameSize;
+    memcpy(message->frame, frame, frameSize);
+    portEXIT_CRITICAL(&reliableMux);
+
+    // A refused frame is retransmitted like a lost one.
+    sendFrame(address, messageType, frame, frameSize);
+
+    // Let the dispatcher arm the retransmit timer.
+    if (dispatcherTask != nullptr)
+    {
+        xTaskNotifyGive(dispatcherTask);
+    }
+
+    return true;
+}
+
+bool ESPNowManager::sendFrame(const uint8_t *address, uint8_t messageType, const uint8_t *frame, size_t size)
+{
+    const esp_err_t result = transmit(address, frame, size);
+    if (capture != nullptr)
+    {
+        capture->recordFrame(CAPTURE_RECORD_SENT, address, frame, size);
+    }
+
+    const uint8_t slot = getMessageMetricsSlot(messageType);
+    sentCounts[slot].fetch_add(1, std::memory_order_relaxed);
+    if (result != ESP_OK)
+    {
+        sendErrorCounts[slot].fetch_add(1, std::memory_order_relaxed);
+    }
 
     if (debugMode)
         Serial.printf("Sent message of type %d to %02X:%02X:%02X:%02X:%02X:%02X\n", messageType, address[0], address[1], address[2], address[3], address[4], address[5]);
+
+    return result == ESP_OK;
+}
+
+esp_err_t ESPNowManager::transmit(const uint8_t *address, const uint8_t *frame, size_t size)
+{
+    return esp_now_send(address, frame, size);
+}
+
+uint8_t ESPNowManager::getMessageMetricsSlot(uint8_t messageType)
+{
+    const uint8_t base = messageType & 0x80 ? ESPNOW_MESSAGE_METRICS_RESPONSE_SLOT : 0;
+    // Types below PAIR_REQUEST wrap around and land in the last slot too.
+    const uint8_t index = (uint8_t)((messageType & 0x7F) - PAIR_REQUEST);
+    return base + std::min<uint8_t>(index, ESPNOW_MESSAGE_METRICS_RESPONSE_SLOT - 1);
+}
+
+void ESPNowManager::copyMessageMetrics(espnow_message_metrics *output)
+{
+    for (uint8_t i = 0; i < ESPNOW_MESSAGE_METRICS_SLOTS; i++)
+    {
+        const uint8_t index = i % ESPNOW_MESSAGE_METRICS_RESPONSE_SLOT;
+        const uint8_t base = i < ESPNOW_MESSAGE_METRICS_RESPONSE_SLOT ? 0 : 0x80;
+
+        output[i].messageType = index == ESPNOW_MESSAGE_METRICS_RESPONSE_SLOT - 1 ? 0 : base + PAIR_REQUEST + index;
+        output[i].sent = sentCounts[i].load(std::memory_order_relaxed);
+        output[i].sendErrors = sendErrorCounts[i].load(std::memory_order_relaxed);
+        output[i].received = receivedCounts[i].load(std::memory_order_relaxed);
+        output[i].dropped = droppedCounts[i].load(std::memory_order_relaxed);
+    }
 }
 
-void ESPNowManager::registerCallback(uint8_t messageType, esp_now_recv_cb_t callback)
+void ESPNowManager::registerCallback(uint8_t messageType, espnow_recv_callback_t callback)
 {
     onReceiveCallbacks.insert({messageType, callback});
 }
 
-void ESPNowManager::unregisterCallback(uint8_t messageType, esp_now_recv_cb_t callback)
+void ESPNowManager::unregisterCallback(uint8_t messageType, espnow_recv_callback_t callback)
 {
     // auto it = onReceiveCallbacks.find({messageType, callback});
     // if (it != onReceiveCallbacks.end())
@@ -1,38 +1,310 @@
 #pragma once
 
 #include "esp_now_types.h"
+#include "LatencyHistogram.h"
+#include "TaskLoad.h"
+#include "TrafficCapture.h"
 #include <map>
 #include <vector>
+#include <functional>
+#include <atomic>
 #include <esp_now.h>
+#include <esp_timer.h>
 #include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Number of received frames buffered between the Wi-Fi driver and the dispatcher task. Must be a power of two.
+#ifndef ESPNOW_RECEIVE_QUEUE_SIZE
+#define ESPNOW_RECEIVE_QUEUE_SIZE 32
+#endif
+
+// Frames handled by the dispatcher before their queue slots are released.
+#ifndef ESPNOW_DISPATCH_BATCH_SIZE
+#define ESPNOW_DISPATCH_BATCH_SIZE 8
+#endif
+
+#ifndef ESPNOW_DISPATCHER_TASK_PRIORITY
+#define ESPNOW_DISPATCHER_TASK_PRIORITY 5
+#endif
+
+// Applications pin it next to the Wi-Fi driver task (core 0) and away from slow work, see the main module.
+#ifndef ESPNOW_DISPATCHER_TASK_CORE
+#define ESPNOW_DISPATCHER_TASK_CORE tskNO_AFFINITY
+#endif
+
+#define ESPNOW_DISPATCHER_TASK_STACK_SIZE 4096
+
+// Slots of the per message type counters: the requests from PAIR_REQUEST on,
+// then their responses (+ 0x80). The last slot of each half counts any other type.
+#define ESPNOW_MESSAGE_METRICS_SLOTS 16
+#define ESPNOW_MESSAGE_METRICS_RESPONSE_SLOT 8
+
+// Reliable messages awaiting their acknowledgement, over all peers. Sending more fails until one completes.
+// Enough for a command to every peer ESP-NOW can hold at once.
+#ifndef ESPNOW_RELIABLE_WINDOW_SIZE
+#define ESPNOW_RELIABLE_WINDOW_SIZE 24
+#endif
+
+// Peers whose sequence numbers are tracked, the least recently used is forgotten past it.
+#ifndef ESPNOW_RELIABLE_MAX_PEERS
+#define ESPNOW_RELIABLE_MAX_PEERS 24
+#endif
+
+// First retransmit timeout of a reliable message (us), doubled on every retransmit.
+#define ESPNOW_RELIABLE_RETRANSMIT_TIMEOUT 20000
+// Retransmits before a reliable message is given up.
+#define ESPNOW_RELIABLE_MAX_RETRANSMITS 5
+// Received sequence numbers remembered per peer behind the highest one, for duplicate suppression.
+#define ESPNOW_RELIABLE_DUPLICATE_WINDOW 32
 
 const macAddress_t BROADCAST_MAC_ADDRESS = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
+// Handler of a message type, see ESPNowManager::registerCallback(). Members register it as a lambda capturing this.
+typedef std::function<void(const uint8_t *mac_addr, const uint8_t *data, int data_len)> espnow_recv_callback_t;
+
+typedef struct received_frame
+{
+    macAddress_t macAddress;
+    uint8_t length;
+    // esp_timer_get_time() when the driver handed the frame over.
+    int64_t timestamp;
+    uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} received_frame;
+
+/*
+ * Counters of one message type since boot, see ESPNowManager::copyMessageMetrics().
+ */
+typedef struct espnow_message_metrics
+{
+    uint8_t messageType;
+    // Frames handed to esp_now_send(), and the ones it refused.
+    uint32_t sent;
+    uint32_t sendErrors;
+    // Frames dispatched to the callbacks, and the ones dropped before (queue full).
+    uint32_t received;
+    uint32_t dropped;
+} espnow_message_metrics;
+
+/*
+ * Sequence numbers of a peer of the reliable channel, both ways.
+ */
+typedef struct reliable_peer
+{
+    macAddressKey_t macKey;
+    // Last sequence number sent to the peer, random when the peer is added.
+    uint16_t sentSequence;
+    // Session of the peer, highest sequence number received from it, and a
+    // bitmap of the ones received behind it (bit i is receivedSequence - i).
+    bool hasReceived;
+    uint16_t receivedSession;
+    uint16_t receivedSequence;
+    uint32_t receivedBitmap;
+    // millis() of the last use, the least recent peer without messages in flight makes room for a new one.
+    unsigned long lastUseTimestamp;
+} reliable_peer;
+
+/*
+ * A reliable message waiting for its acknowledgement, kept whole for the retransmits.
+ */
+typedef struct reliable_message
+{
+    bool isUsed;
+    macAddress_t address;
+    uint16_t sequence;
+    uint8_t messageType;
+    uint8_t retransmitCount;
+    // esp_timer_get_time() of the next retransmit.
+    int64_t retransmitTime;
+    uint8_t length;
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+} reliable_message;
+
 class ESPNowManager
 {
 public:
     ESPNowManager(bool debug = false);
-    ~ESPNowManager();
+    virtual ~ESPNowManager();
 
     static ESPNowManager *getInstance();
 
 protected:
     static ESPNowManager *instance;
 
-private:
-    std::multimap<uint8_t, esp_now_recv_cb_t> onReceiveCallbacks;
+    /*
+     * A manager off the ESP-NOW driver, for a node simulated on the host: it
+     * neither initializes nor registers with the driver, its transmit() puts
+     * the frames on the air and its owner feeds onReceiveData() and
+     * onDataSent() with what the radio delivers.
+     */
+    ESPNowManager(bool debug, bool isOnDriver);
+
+    // Hands a frame to the radio, esp_now_send() unless off the driver.
+    virtual esp_err_t transmit(const uint8_t *address, const uint8_t *frame, size_t size);
 
     void onReceiveData(const uint8_t *mac_addr, const uint8_t *dataBuffer, int len);
+    void onDataSent(const uint8_t *mac_addr, esp_now_send_status_t status);
+
+    // Runs the callbacks of messageType on a frame body, as the dispatcher task does.
     void callOnReceiveCallbacks(uint8_t messageType, const uint8_t *mac_addr, const uint8_t *dataBuffer, int len);
 
+private:
+    bool isOnDriver = true;
+    std::multimap<uint8_t, espnow_recv_callback_t> onReceiveCallbacks;
+
+    /*
+     * Frames are copied into this fixed ring by the Wi-Fi driver task (the only
+     * writer of receiveQueueHead) and handled by the dispatcher task (the only
+     * writer of receiveQueueTail), so callbacks never run in the driver context.
+     */
+    received_frame receiveQueue[ESPNOW_RECEIVE_QUEUE_SIZE];
+    std::atomic<uint32_t> receiveQueueHead{0};
+    std::atomic<uint32_t> receiveQueueTail{0};
+    uint32_t receiveQueueHighWatermark = 0;
+    uint32_t receiveQueueDropCount = 0;
+    uint32_t dispatchedFrameCount = 0;
+    int64_t dispatchedFrameTimestamp = 0;
+
+    // Written by the Wi-Fi driver task when a broadcast leaves the radio.
+    int64_t broadcastSentTimestamp = 0;
+    portMUX_TYPE broadcastSentMux = portMUX_INITIALIZER_UNLOCKED;
+
+    TaskHandle_t dispatcherTask = nullptr;
+    task_load dispatcherLoad;
+    // Time frames waited in the queue before being dispatched (us), guarded by dispatchLatencyMux.
+    latency_histogram dispatchLatencyHistogram = {};
+    portMUX_TYPE dispatchLatencyMux = portMUX_INITIALIZER_UNLOCKED;
+
+    /*
+     * Traffic counters, bumped from the sending tasks, the Wi-Fi driver task
+     * and the dispatcher. Relaxed atomics keep them a single instruction, so
+     * they stay on in production.
+     */
+    std::atomic<uint32_t> sentCounts[ESPNOW_MESSAGE_METRICS_SLOTS];
+    std::atomic<uint32_t> sendErrorCounts[ESPNOW_MESSAGE_METRICS_SLOTS];
+    std::atomic<uint32_t> receivedCounts[ESPNOW_MESSAGE_METRICS_SLOTS];
+    std::atomic<uint32_t> droppedCounts[ESPNOW_MESSAGE_METRICS_SLOTS];
+    // Outcome reported by the driver for the frames sent, acknowledged or not.
+    std::atomic<uint32_t> deliveredCount{0};
+    std::atomic<uint32_t> deliveryFailedCount{0};
+
+    // Every frame in and out goes through it, it only records once started. Null off the driver.
+    TrafficCapture *capture = nullptr;
+
+    static uint8_t getMessageMetricsSlot(uint8_t messageType);
+
+    /*
+     * Reliable channel, see sendReliable(). Messages and peers are fixed
+     * tables guarded by reliableMux: the sending tasks add messages, the
+     * dispatcher task retransmits and completes them and the Wi-Fi driver
+     * task brings retransmits forward when the radio reports a failure.
+     */
+    uint16_t reliableSession = 0;
+    reliable_message reliableMessages[ESPNOW_RELIABLE_WINDOW_SIZE];
+    reliable_peer reliablePeers[ESPNOW_RELIABLE_MAX_PEERS];
+    portMUX_TYPE reliableMux = portMUX_INITIALIZER_UNLOCKED;
+    uint32_t reliableDeliveredCount = 0;
+    uint32_t reliableFailedCount = 0;
+    uint32_t reliableRetransmitCount = 0;
+    uint32_t reliableDuplicateCount = 0;
+    uint32_t reliableWindowFullCount = 0;
+
+    // Peer entry of a MAC address, taking the least recently used idle one if it is new. Called under reliableMux.
+    reliable_peer &getReliablePeer(const uint8_t *mac_addr);
+    bool hasReliableMessageInFlight(macAddressKey_t macKey);
+    // Whether a sequence number of the peer was not received yet, remembering it. Called under reliableMux.
+    bool acceptReliableSequence(reliable_peer &peer, uint16_t session, uint16_t sequence);
+    void onReliableMessage(const uint8_t *mac_addr, const uint8_t *data, int len);
+    void onReliableAck(const uint8_t *mac_addr, const uint8_t *data, int len);
+    // Retransmits the messages due and gives up the ones out of retries. Returns the ticks until the next one is due.
+    TickType_t retransmitReliableMessages();
+
+    // Sends a whole frame, counting it under messageType.
+    bool sendFrame(const uint8_t *address, uint8_t messageType, const uint8_t *frame, size_t size);
+
+    static void dispatcherTaskFunction(void *arg);
+    void dispatchReceivedFrames();
+
     bool debugMode = false;
 
 protected:
-    void addPeer(const uint8_t *mac_addr);
+    // ESP_ERR_ESPNOW_FULL once ESP_NOW_MAX_TOTAL_PEER_NUM peers are registered.
+    esp_err_t addPeer(const uint8_t *mac_addr);
     void removePeer(const uint8_t *mac_addr);
 
 public:
-    void sendBuffer(const uint8_t *address, uint8_t messageType, const uint8_t *buffer, size_t size);
-    void registerCallback(uint8_t messageType, esp_now_recv_cb_t callback);
-    void unregisterCallback(uint8_t messageType, esp_now_recv_cb_t callback);
+    /*
+     * Sends messageType followed by buffer. The frame is assembled on the stack,
+     * so sending never touches the heap.
+     *
+     * @return false if the frame does not fit in ESP_NOW_MAX_DATA_LEN or esp_now_send() fails
+     */
+    bool sendBuffer(const uint8_t *address, uint8_t messageType, const uint8_t *buffer, size_t size);
+
+    /*
+     * Sends messageType followed by header and payload, without copying them
+     * into an intermediate heap buffer first.
+     */
+    bool sendBuffer(const uint8_t *address, uint8_t messageType, const uint8_t *header, size_t headerSize, const uint8_t *payload, size_t payloadSize);
+
+    /*
+     * Sends messageType followed by header and payload over the reliable
+     * channel, for configuration and commands: it is retransmitted until the
+     * peer acknowledges it, and the peer dispatches it once whatever the
+     * number of copies it got. Messages to a peer may be dispatched out of
+     * order. The peer must run an ESPNowManager, and the address must be a
+     * unicast one.
+     *
+     * @return false if the frame does not fit or ESPNOW_RELIABLE_WINDOW_SIZE messages are in flight already
+     */
+    bool sendReliable(const uint8_t *address, uint8_t messageType, const uint8_t *header, size_t headerSize, const uint8_t *payload, size_t payloadSize);
+
+    uint32_t getReceiveQueueDepth() { return receiveQueueHead.load() - receiveQueueTail.load(); }
+    uint32_t getReceiveQueueHighWatermark() { return receiveQueueHighWatermark; }
+    // Frames dropped because the receive queue was full or they were malformed.
+    uint32_t getReceiveQueueDropCount() { return receiveQueueDropCount; }
+    uint32_t getDispatchedFrameCount() { return dispatchedFrameCount; }
+
+    /*
+     * Copies the counters of every message type, ESPNOW_MESSAGE_METRICS_SLOTS
+     * entries. The last slot of the requests and of the responses has
+     * messageType 0, it sums the types without a slot of their own.
+     */
+    void copyMessageMetrics(espnow_message_metrics *output);
+    // Frames the peer acknowledged, and the ones it never did. Broadcasts always count as delivered.
+    uint32_t getDeliveredCount() { return deliveredCount.load(std::memory_order_relaxed); }
+    uint32_t getDeliveryFailedCount() { return deliveryFailedCount.load(std::memory_order_relaxed); }
+
+    TaskHandle_t getDispatcherTask() { return dispatcherTask; }
+    const task_load &getDispatcherLoad() { return dispatcherLoad; }
+    /*
+     * Time from the driver handing each frame over to its callbacks starting,
+     * which grows if the dispatcher waits behind other work of its core.
+     */
+    void copyDispatchLatency(latency_histogram &histogram);
+
+    // Outcome of the reliable messages since boot.
+    uint32_t getReliableDeliveredCount() { return reliableDeliveredCount; }
+    uint32_t getReliableFailedCount() { return reliableFailedCount; }
+    uint32_t getReliableRetransmitCount() { return reliableRetransmitCount; }
+    // Copies received again and not dispatched.
+    uint32_t getReliableDuplicateCount() { return reliableDuplicateCount; }
+    // Messages refused because the window was full.
+    uint32_t getReliableWindowFullCount() { return reliableWindowFullCount; }
+    uint8_t getReliableInFlightCount();
+
+    /*
+     * Receive time of the frame being dispatched (esp_timer_get_time()), for
+     * callbacks that need it without the dispatcher latency.
+     */
+    int64_t getReceiveTimestamp() { return dispatchedFrameTimestamp; }
+
+    /*
+     * esp_timer_get_time() when the last broadcast was actually transmitted,
+     * after any wait for the channel. 0 before the first one.
+     */
+    int64_t getBroadcastSentTimestamp();
+
+    void registerCallback(uint8_t messageType, espnow_recv_callback_t callback);
+    void unregisterCallback(uint8_t messageType, espnow_recv_callback_t callback);
 };
\ No newline at end of file
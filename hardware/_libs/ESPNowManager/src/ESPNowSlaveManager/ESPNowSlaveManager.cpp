@@ -6,16 +6,18 @@ ESPNowSlaveManager::ESPNowSlaveManager() : ESPNowManager()
 {
 }
 
+ESPNowSlaveManager::ESPNowSlaveManager(bool isOnDriver) : ESPNowManager(false, isOnDriver)
+{
+}
+
 ESPNowSlaveManager::~ESPNowSlaveManager()
 {
 }
 
-void ESPNowSlaveManager::broadcastPairingRequest()
+void ESPNowSlaveManager::broadcastPairingRequest(uint8_t channelCount)
 {
-    uint8_t bufferSize = sizeof(uint8_t);
-    uint8_t *buffer = (uint8_t *)malloc(bufferSize);
-    buffer[0] = PAIR_REQUEST;
-    sendBuffer(BROADCAST_MAC_ADDRESS, PAIR_REQUEST, buffer, bufferSize);
+    const pair_request request = {PAIR_REQUEST, channelCount};
+    sendBuffer(BROADCAST_MAC_ADDRESS, PAIR_REQUEST, reinterpret_cast<const uint8_t *>(&request), sizeof(request));
 }
 
 bool ESPNowSlaveManager::isServerAddressSet()
@@ -35,9 +37,11 @@ void ESPNowSlaveManager::getMacAddress(uint8_t *baseMac)
 
 void ESPNowSlaveManager::onPairResponseReceived(const uint8_t *mac_addr, const uint8_t *data, int data_len)
 {
+    slotIndex = data_len >= (int)sizeof(struct_pair_response) ? reinterpret_cast<const struct_pair_response *>(data)->slotIndex : NO_RESPONSE_SLOT;
+
     macAddress_t macAddress;
     memcpy(macAddress, mac_addr, sizeof(macAddress_t));
-    static_cast<ESPNowSlaveManager *>(ESPNowManager::getInstance())->setServerAddress(macAddress);
+    setServerAddress(macAddress);
 }
 
 ESPNowSlaveManager *ESPNowSlaveManager::getInstance()
@@ -56,11 +60,12 @@ void ESPNowSlaveManager::setServerAddress(const macAddress_t &address)
     addPeer(serverAddress);
 }
 
-void ESPNowSlaveManager::beginPairing()
+void ESPNowSlaveManager::beginPairing(uint8_t channelCount)
 {
     setServerAddress(BROADCAST_MAC_ADDRESS);
 
-    esp_now_recv_cb_t callback = ESPNowSlaveManager::onPairResponseReceived;
+    const espnow_recv_callback_t callback = [this](const uint8_t *mac_addr, const uint8_t *data, int data_len)
+    { onPairResponseReceived(mac_addr, data, data_len); };
 
     registerCallback(
         PAIR_REQUEST + 0x80, callback);
@@ -71,7 +76,7 @@ void ESPNowSlaveManager::beginPairing()
 
     while (!isServerAddressSet())
     {
-        broadcastPairingRequest();
+        broadcastPairingRequest(channelCount);
         delay(500);
     }
 
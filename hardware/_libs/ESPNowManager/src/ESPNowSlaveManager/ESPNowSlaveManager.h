@@ -6,20 +6,32 @@ public:
     ESPNowSlaveManager();
     ~ESPNowSlaveManager();
 
+protected:
+    // Off the ESP-NOW driver, see ESPNowManager.
+    explicit ESPNowSlaveManager(bool isOnDriver);
+
 private:
     macAddress_t macAddress = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
     macAddress_t serverAddress = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    uint8_t slotIndex = NO_RESPONSE_SLOT;
 
-    void broadcastPairingRequest();
+    void broadcastPairingRequest(uint8_t channelCount);
     void getServerAddress(macAddress_t &address);
     void getMacAddress(uint8_t *baseMac);
 
-    static void onPairResponseReceived(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+    void onPairResponseReceived(const uint8_t *mac_addr, const uint8_t *data, int data_len);
 
 public:
     static ESPNowSlaveManager *getInstance();
 
     bool isServerAddressSet();
     void setServerAddress(const macAddress_t &address);
-    void beginPairing();
+    // Response slot assigned by the main module when pairing, NO_RESPONSE_SLOT if none.
+    uint8_t getSlotIndex() { return slotIndex; }
+    /*
+     * Broadcasts pairing requests until a main module answers, advertising
+     * channelCount flowmeters so the main module can lay out its nozzles
+     * before the first data response.
+     */
+    void beginPairing(uint8_t channelCount);
 };
\ No newline at end of file
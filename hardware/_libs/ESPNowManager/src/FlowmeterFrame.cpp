@@ -0,0 +1,304 @@
+#include "FlowmeterFrame.h"
+#include <string.h>
+
+size_t FlowmeterFrame::writeVarint(uint8_t *buffer, size_t bufferSize, uint32_t value)
+{
+    size_t size = 0;
+    do
+    {
+        if (size >= bufferSize)
+        {
+            return 0;
+        }
+
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        if (value != 0)
+        {
+            byte |= 0x80;
+        }
+        buffer[size++] = byte;
+    } while (value != 0);
+
+    return size;
+}
+
+size_t FlowmeterFrame::readVarint(const uint8_t *buffer, size_t len, uint32_t &value)
+{
+    value = 0;
+    for (size_t i = 0; i < len && i < 5; i++)
+    {
+        // The fifth byte only has the top 4 bits of a uint32 left, anything above is over-long or overflows.
+        if (i == 4 && buffer[i] > 0x0F)
+        {
+            return 0;
+        }
+        value |= (uint32_t)(buffer[i] & 0x7F) << (7 * i);
+        if ((buffer[i] & 0x80) == 0)
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+uint32_t FlowmeterFrame::getCountRate(uint32_t pulseCount, uint16_t countWindow)
+{
+    return (uint64_t)pulseCount * 1000000 / countWindow;
+}
+
+size_t FlowmeterFrame::encode(uint8_t *buffer, size_t bufferSize, uint16_t session, uint32_t sequence, const flowmeters_data &data, const flowmeter_sample_info *sample)
+{
+    const bool hasRates = data.flowmetersRate != nullptr && data.flowmetersRateConfidence != nullptr;
+
+    // Rates are the first thing to drop when a large module does not fit in one frame.
+    const size_t size = encode(buffer, bufferSize, session, sequence, data, sample, hasRates);
+    if (size > 0 || !hasRates)
+    {
+        return size;
+    }
+    return encode(buffer, bufferSize, session, sequence, data, sample, false);
+}
+
+size_t FlowmeterFrame::encode(uint8_t *buffer, size_t bufferSize, uint16_t session, uint32_t sequence, const flowmeters_data &data, const flowmeter_sample_info *sample, bool withRates)
+{
+    if (data.flowmeterCount > UINT8_MAX)
+    {
+        return 0;
+    }
+
+    const uint8_t channelCount = data.flowmeterCount;
+    const size_t bitmapSize = CHANNEL_BITMAP_SIZE(channelCount);
+
+    if (bufferSize < 2)
+    {
+        return 0;
+    }
+    buffer[0] = FLOWMETER_FRAME_VERSION;
+    buffer[1] = withRates ? FLOWMETER_FRAME_FLAG_RATE : 0;
+    size_t offset = 2;
+
+    size_t written = writeVarint(buffer + offset, bufferSize - offset, sequence);
+    if (written == 0 || offset + written + 2 > bufferSize)
+    {
+        return 0;
+    }
+    offset += written;
+
+    buffer[offset++] = session & 0xFF;
+    buffer[offset++] = session >> 8;
+
+    if (sample != nullptr)
+    {
+        buffer[1] |= FLOWMETER_FRAME_FLAG_SAMPLE | (sample->isLatched ? FLOWMETER_FRAME_FLAG_LATCHED : 0);
+
+        written = writeVarint(buffer + offset, bufferSize - offset, sample->id);
+        if (written == 0)
+        {
+            return 0;
+        }
+        offset += written;
+
+        written = writeVarint(buffer + offset, bufferSize - offset, sample->time);
+        if (written == 0)
+        {
+            return 0;
+        }
+        offset += written;
+    }
+
+    if (offset + 1 + bitmapSize > bufferSize)
+    {
+        return 0;
+    }
+
+    buffer[offset++] = channelCount;
+    uint8_t *bitmap = buffer + offset;
+    memset(bitmap, 0, bitmapSize);
+    offset += bitmapSize;
+
+    uint8_t *rateBitmap = nullptr;
+    if (withRates)
+    {
+        written = writeVarint(buffer + offset, bufferSize - offset, data.countWindow);
+        if (written == 0 || offset + written + bitmapSize > bufferSize)
+        {
+            return 0;
+        }
+        offset += written;
+
+        rateBitmap = buffer + offset;
+        memset(rateBitmap, 0, bitmapSize);
+        offset += bitmapSize;
+    }
+
+    for (uint8_t i = 0; i < channelCount; i++)
+    {
+        if (data.flowmetersPulseCount[i] == 0 && data.flowmetersLastPulseAge[i] == 0 &&
+            (!withRates || (data.flowmetersRate[i] == 0 && data.flowmetersRateConfidence[i] == 0)))
+        {
+            continue;
+        }
+        bitmap[i / 8] |= 1 << (i % 8);
+
+        written = writeVarint(buffer + offset, bufferSize - offset, data.flowmetersPulseCount[i]);
+        if (written == 0)
+        {
+            return 0;
+        }
+        offset += written;
+
+        written = writeVarint(buffer + offset, bufferSize - offset, data.flowmetersLastPulseAge[i]);
+        if (written == 0)
+        {
+            return 0;
+        }
+        offset += written;
+
+        if (!withRates || (data.countWindow != 0 && data.flowmetersRateConfidence[i] == UINT8_MAX &&
+                           data.flowmetersRate[i] == getCountRate(data.flowmetersPulseCount[i], data.countWindow)))
+        {
+            continue;
+        }
+        rateBitmap[i / 8] |= 1 << (i % 8);
+
+        written = writeVarint(buffer + offset, bufferSize - offset, data.flowmetersRate[i]);
+        if (written == 0 || offset + written >= bufferSize)
+        {
+            return 0;
+        }
+        offset += written;
+        buffer[offset++] = data.flowmetersRateConfidence[i];
+    }
+
+    return offset;
+}
+
+bool FlowmeterFrame::decode(const uint8_t *buffer, size_t len, flowmeter_frame_header &header, const flowmeters_data &data, uint8_t maxChannels)
+{
+    if (len < 2 || buffer[0] != FLOWMETER_FRAME_VERSION)
+    {
+        return false;
+    }
+    header.version = buffer[0];
+    header.flags = buffer[1];
+    size_t offset = 2;
+
+    size_t read = readVarint(buffer + offset, len - offset, header.sequence);
+    if (read == 0 || offset + read + 2 >= len)
+    {
+        return false;
+    }
+    offset += read;
+
+    header.session = buffer[offset] | (buffer[offset + 1] << 8);
+    offset += 2;
+
+    memset(&header.sample, 0, sizeof(header.sample));
+    if (header.flags & FLOWMETER_FRAME_FLAG_SAMPLE)
+    {
+        read = readVarint(buffer + offset, len - offset, header.sample.id);
+        if (read == 0)
+        {
+            return false;
+        }
+        offset += read;
+
+        read = readVarint(buffer + offset, len - offset, header.sample.time);
+        if (read == 0 || offset + read >= len)
+        {
+            return false;
+        }
+        offset += read;
+
+        header.sample.isLatched = header.flags & FLOWMETER_FRAME_FLAG_LATCHED;
+    }
+
+    header.channelCount = buffer[offset++];
+    const size_t bitmapSize = CHANNEL_BITMAP_SIZE(header.channelCount);
+    if (header.channelCount > maxChannels || offset + bitmapSize > len)
+    {
+        return false;
+    }
+    const uint8_t *bitmap = buffer + offset;
+    offset += bitmapSize;
+
+    const bool hasRates = header.flags & FLOWMETER_FRAME_FLAG_RATE;
+    uint32_t countWindow = 0;
+    const uint8_t *rateBitmap = nullptr;
+    if (hasRates)
+    {
+        read = readVarint(buffer + offset, len - offset, countWindow);
+        if (read == 0 || countWindow > UINT16_MAX || offset + read + bitmapSize > len)
+        {
+            return false;
+        }
+        offset += read;
+
+        rateBitmap = buffer + offset;
+        offset += bitmapSize;
+    }
+    const bool isValidateOnly = data.flowmetersPulseCount == nullptr || data.flowmetersLastPulseAge == nullptr;
+    const bool wantsRates = !isValidateOnly && data.flowmetersRate != nullptr && data.flowmetersRateConfidence != nullptr;
+
+    for (uint8_t i = 0; i < header.channelCount; i++)
+    {
+        uint32_t count = 0;
+        uint32_t age = 0;
+        uint32_t rate = 0;
+        uint8_t confidence = 0;
+
+        if (bitmap[i / 8] & (1 << (i % 8)))
+        {
+            read = readVarint(buffer + offset, len - offset, count);
+            if (read == 0 || count > UINT16_MAX)
+            {
+                return false;
+            }
+            offset += read;
+
+            read = readVarint(buffer + offset, len - offset, age);
+            if (read == 0)
+            {
+                return false;
+            }
+            offset += read;
+
+            if (hasRates && (rateBitmap[i / 8] & (1 << (i % 8))))
+            {
+                read = readVarint(buffer + offset, len - offset, rate);
+                if (read == 0 || offset + read >= len)
+                {
+                    return false;
+                }
+                offset += read;
+                confidence = buffer[offset++];
+            }
+            else if (hasRates && countWindow != 0)
+            {
+                rate = getCountRate(count, countWindow);
+                confidence = UINT8_MAX;
+            }
+        }
+        else if (hasRates && (rateBitmap[i / 8] & (1 << (i % 8))))
+        {
+            // A rate without its channel.
+            return false;
+        }
+
+        if (isValidateOnly)
+        {
+            continue;
+        }
+
+        data.flowmetersPulseCount[i] = count;
+        data.flowmetersLastPulseAge[i] = age;
+        if (wantsRates)
+        {
+            data.flowmetersRate[i] = rate;
+            data.flowmetersRateConfidence[i] = confidence;
+        }
+    }
+
+    return offset == len;
+}
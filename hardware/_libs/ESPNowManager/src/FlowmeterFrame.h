@@ -0,0 +1,46 @@
+#pragma once
+
+#include "esp_now_types.h"
+#include <stddef.h>
+
+/*
+ * Encoder and decoder of the flowmeter data response frame described in
+ * esp_now_types.h. Depends only on the C standard library so it can be built
+ * on the host.
+ */
+class FlowmeterFrame
+{
+public:
+    /*
+     * Encodes the flowmeters data into buffer. Rates are included when data
+     * has them and they fit, otherwise the frame carries counts and ages only.
+     * Rates that getCountRate() gives back from the count and data.countWindow
+     * with full confidence are not written. The sample is optional, for
+     * senders without a boom time.
+     *
+     * @return the frame size, or 0 if it does not fit in bufferSize
+     */
+    static size_t encode(uint8_t *buffer, size_t bufferSize, uint16_t session, uint32_t sequence, const flowmeters_data &data, const flowmeter_sample_info *sample = nullptr);
+
+    /*
+     * Decodes a frame into the arrays of data, writing at most maxChannels
+     * entries. Null arrays are skipped, rates are set to 0 when the frame has
+     * none and to the count rate for the channels in count mode. With null
+     * count and age arrays the frame is only validated, so a caller can size
+     * the destination from header.channelCount first.
+     *
+     * @return false if the frame is truncated, malformed, of an unknown version
+     *         or has more than maxChannels channels
+     */
+    static bool decode(const uint8_t *buffer, size_t len, flowmeter_frame_header &header, const flowmeters_data &data, uint8_t maxChannels);
+
+    // Rate in millihertz of pulseCount pulses over countWindow milliseconds, as the count mode of the estimator.
+    static uint32_t getCountRate(uint32_t pulseCount, uint16_t countWindow);
+
+    static size_t writeVarint(uint8_t *buffer, size_t bufferSize, uint32_t value);
+    // Returns the bytes read, 0 if the varint is truncated or does not fit in 32 bits.
+    static size_t readVarint(const uint8_t *buffer, size_t len, uint32_t &value);
+
+private:
+    static size_t encode(uint8_t *buffer, size_t bufferSize, uint16_t session, uint32_t sequence, const flowmeters_data &data, const flowmeter_sample_info *sample, bool withRates);
+};
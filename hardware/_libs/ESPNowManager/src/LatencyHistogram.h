@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Buckets of a latency_histogram. In microseconds the last one starts at 8.4 s.
+#define LATENCY_HISTOGRAM_BUCKETS 24
+
+/*
+ * Histogram of durations with power of two buckets: bucket i counts the
+ * values in [2^i, 2^(i+1)), bucket 0 also counts 0 and the last one
+ * everything above. Adding a value is a couple of instructions, so it can
+ * stay on in production. Not synchronized, callers guard it like the data
+ * it sits next to.
+ */
+typedef struct latency_histogram
+{
+    uint32_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+    uint64_t total;
+
+    void add(uint32_t value)
+    {
+        const uint8_t bucket = value > 1 ? 31 - __builtin_clz(value) : 0;
+        buckets[bucket < LATENCY_HISTOGRAM_BUCKETS ? bucket : LATENCY_HISTOGRAM_BUCKETS - 1]++;
+        count++;
+        total += value;
+        if (value > max)
+        {
+            max = value;
+        }
+    }
+
+    // Buckets up to the last one holding a value, to keep the serialized form short.
+    uint8_t getUsedBuckets() const
+    {
+        uint8_t used = LATENCY_HISTOGRAM_BUCKETS;
+        while (used > 0 && buckets[used - 1] == 0)
+        {
+            used--;
+        }
+        return used;
+    }
+} latency_histogram;
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+
+/*
+ * Time a task spent working, accumulated around each unit of work it does
+ * between two waits. It is wall time, so it also counts any preemption by
+ * higher priority tasks of the same core: an upper bound of the CPU used.
+ * Written by the task only, readable from any task.
+ */
+typedef struct task_load
+{
+    // Microseconds working since boot, and units of work done.
+    std::atomic<uint64_t> busyTime{0};
+    std::atomic<uint32_t> runCount{0};
+
+    void add(int64_t duration)
+    {
+        busyTime.store(busyTime.load(std::memory_order_relaxed) + duration, std::memory_order_relaxed);
+        runCount.store(runCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+} task_load;
@@ -0,0 +1,251 @@
+#include "TrafficCapture.h"
+#include "FlowmeterFrame.h"
+
+TrafficCapture *TrafficCapture::getInstance()
+{
+    // The first caller may be any of the recording tasks, the static is only ever constructed once.
+    static TrafficCapture capture;
+    return &capture;
+}
+
+bool TrafficCapture::start(const uint8_t *metadata, size_t metadataSize)
+{
+    this->stop();
+
+    if (this->ring == nullptr)
+    {
+        this->ring = static_cast<uint8_t *>(malloc(TRAFFIC_CAPTURE_BUFFER_SIZE));
+        if (this->ring == nullptr)
+        {
+            return false;
+        }
+    }
+
+    portENTER_CRITICAL(&mux);
+    this->tail = 0;
+    this->used = 0;
+    this->startTime = esp_timer_get_time();
+    this->lastTime = this->startTime;
+    this->recordCount = 0;
+    this->droppedCount = 0;
+    this->metadataSize = std::min<size_t>(metadataSize, TRAFFIC_CAPTURE_MAX_METADATA_SIZE);
+    memcpy(this->metadata, metadata, this->metadataSize);
+    portEXIT_CRITICAL(&mux);
+
+    this->isRecording.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+void TrafficCapture::stop()
+{
+    this->isRecording.store(false, std::memory_order_relaxed);
+}
+
+void TrafficCapture::clear()
+{
+    this->stop();
+
+    portENTER_CRITICAL(&mux);
+    uint8_t *freed = this->ring;
+    this->ring = nullptr;
+    this->used = 0;
+    this->recordCount = 0;
+    this->metadataSize = 0;
+    portEXIT_CRITICAL(&mux);
+
+    free(freed);
+}
+
+void TrafficCapture::recordFrame(capture_record_kind kind, const uint8_t *mac, const uint8_t *data, size_t len)
+{
+    if (!this->isStarted() || len > TRAFFIC_CAPTURE_MAX_PAYLOAD)
+    {
+        return;
+    }
+
+    this->append(kind, mac, data, len);
+}
+
+void TrafficCapture::recordGps(const uint8_t *data, size_t len)
+{
+    if (!this->isStarted())
+    {
+        return;
+    }
+
+    for (size_t offset = 0; offset < len; offset += TRAFFIC_CAPTURE_MAX_PAYLOAD)
+    {
+        this->append(CAPTURE_RECORD_GPS, nullptr, data + offset, std::min<size_t>(len - offset, TRAFFIC_CAPTURE_MAX_PAYLOAD));
+    }
+}
+
+void TrafficCapture::append(uint8_t kind, const uint8_t *mac, const uint8_t *data, size_t len)
+{
+    // Everything but the time delta is laid out before taking the lock.
+    uint8_t record[TRAFFIC_CAPTURE_MAX_RECORD_SIZE];
+    const size_t deltaOffset = 1;
+    const size_t deltaMaxSize = 5;
+    size_t bodySize = 0;
+    uint8_t body[sizeof(macAddress_t) + 2];
+    if (mac != nullptr)
+    {
+        memcpy(body, mac, sizeof(macAddress_t));
+        bodySize += sizeof(macAddress_t);
+    }
+    bodySize += FlowmeterFrame::writeVarint(body + bodySize, sizeof(body) - bodySize, len);
+
+    portENTER_CRITICAL(&mux);
+    if (!this->isStarted() || this->ring == nullptr)
+    {
+        portEXIT_CRITICAL(&mux);
+        return;
+    }
+
+    // Nothing is ever recorded hours apart, a longer gap is only shortened.
+    const int64_t now = esp_timer_get_time();
+    const uint32_t delta = (uint32_t)std::min<int64_t>(std::max<int64_t>(now - this->lastTime, 0), UINT32_MAX);
+    this->lastTime += delta;
+
+    record[0] = kind;
+    size_t size = deltaOffset + FlowmeterFrame::writeVarint(record + deltaOffset, deltaMaxSize, delta);
+    memcpy(record + size, body, bodySize);
+    size += bodySize;
+    memcpy(record + size, data, len);
+    size += len;
+
+    while (TRAFFIC_CAPTURE_BUFFER_SIZE - this->used < size)
+    {
+        this->dropOldest();
+    }
+
+    const size_t head = (this->tail + this->used) % TRAFFIC_CAPTURE_BUFFER_SIZE;
+    const size_t firstPart = std::min<size_t>(size, TRAFFIC_CAPTURE_BUFFER_SIZE - head);
+    memcpy(this->ring + head, record, firstPart);
+    memcpy(this->ring, record + firstPart, size - firstPart);
+    this->used += size;
+    this->recordCount++;
+    portEXIT_CRITICAL(&mux);
+}
+
+void TrafficCapture::dropOldest()
+{
+    // Enough of the record to find its size.
+    uint8_t header[1 + 5 + sizeof(macAddress_t) + 2];
+    const size_t headerSize = std::min<size_t>(sizeof(header), this->used);
+    this->copyFromRing(0, header, headerSize);
+
+    uint32_t delta = 0;
+    uint32_t length = 0;
+    size_t size = 1;
+    size += FlowmeterFrame::readVarint(header + size, headerSize - size, delta);
+    if (header[0] != CAPTURE_RECORD_GPS)
+    {
+        size += sizeof(macAddress_t);
+    }
+    const size_t lengthSize = size < headerSize ? FlowmeterFrame::readVarint(header + size, headerSize - size, length) : 0;
+
+    // A record that cannot be parsed means a corrupt ring, start over.
+    if (lengthSize == 0 || size + lengthSize + length > this->used)
+    {
+        this->tail = 0;
+        this->used = 0;
+        this->startTime = this->lastTime;
+        this->droppedCount += this->recordCount;
+        this->recordCount = 0;
+        return;
+    }
+    size += lengthSize + length;
+
+    this->tail = (this->tail + size) % TRAFFIC_CAPTURE_BUFFER_SIZE;
+    this->used -= size;
+    this->startTime += delta;
+    this->recordCount--;
+    this->droppedCount++;
+}
+
+void TrafficCapture::copyFromRing(size_t offset, uint8_t *output, size_t len)
+{
+    const size_t start = (this->tail + offset) % TRAFFIC_CAPTURE_BUFFER_SIZE;
+    const size_t firstPart = std::min<size_t>(len, TRAFFIC_CAPTURE_BUFFER_SIZE - start);
+    memcpy(output, this->ring + start, firstPart);
+    memcpy(output + firstPart, this->ring, len - firstPart);
+}
+
+uint32_t TrafficCapture::getRecordCount()
+{
+    portENTER_CRITICAL(&mux);
+    const uint32_t count = this->recordCount;
+    portEXIT_CRITICAL(&mux);
+
+    return count;
+}
+
+uint32_t TrafficCapture::getDroppedCount()
+{
+    portENTER_CRITICAL(&mux);
+    const uint32_t count = this->droppedCount;
+    portEXIT_CRITICAL(&mux);
+
+    return count;
+}
+
+size_t TrafficCapture::getUsedSize()
+{
+    portENTER_CRITICAL(&mux);
+    const size_t size = this->used;
+    portEXIT_CRITICAL(&mux);
+
+    return size;
+}
+
+size_t TrafficCapture::getFileSize()
+{
+    portENTER_CRITICAL(&mux);
+    const size_t size = sizeof(capture_header) + this->metadataSize + this->used;
+    portEXIT_CRITICAL(&mux);
+
+    return size;
+}
+
+size_t TrafficCapture::readFile(uint8_t *buffer, size_t maxLen, size_t index)
+{
+    portENTER_CRITICAL(&mux);
+    capture_header header;
+    memcpy(header.magic, TRAFFIC_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = TRAFFIC_CAPTURE_VERSION;
+    header.reserved = 0;
+    header.metadataSize = this->metadataSize;
+    header.droppedRecords = this->droppedCount;
+    header.recordsSize = this->used;
+    header.startTime = this->startTime;
+
+    // The file is the header, the metadata and the ring from its oldest record, read piece by piece.
+    size_t written = 0;
+    const size_t metadataOffset = sizeof(capture_header);
+    const size_t recordsOffset = metadataOffset + this->metadataSize;
+    const size_t fileSize = recordsOffset + this->used;
+    while (written < maxLen && index < fileSize)
+    {
+        size_t count;
+        if (index < metadataOffset)
+        {
+            count = std::min(maxLen - written, metadataOffset - index);
+            memcpy(buffer + written, reinterpret_cast<const uint8_t *>(&header) + index, count);
+        }
+        else if (index < recordsOffset)
+        {
+            count = std::min(maxLen - written, recordsOffset - index);
+            memcpy(buffer + written, this->metadata + index - metadataOffset, count);
+        }
+        else
+        {
+            count = std::min(maxLen - written, fileSize - index);
+            this->copyFromRing(index - recordsOffset, buffer + written, count);
+        }
+        written += count;
+        index += count;
+    }
+    portEXIT_CRITICAL(&mux);
+
+    return written;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "esp_now_types.h"
+#include <Arduino.h>
+#include <atomic>
+#include <esp_now.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+
+// RAM of the ring, allocated by the first capture and kept until clear().
+#ifndef TRAFFIC_CAPTURE_BUFFER_SIZE
+#define TRAFFIC_CAPTURE_BUFFER_SIZE 65536
+#endif
+
+#define TRAFFIC_CAPTURE_VERSION 1
+// Application data stored ahead of the records, see start().
+#define TRAFFIC_CAPTURE_MAX_METADATA_SIZE 512
+// Longest payload of a record, longer GPS reads are split.
+#define TRAFFIC_CAPTURE_MAX_PAYLOAD 256
+// Kind, time delta, MAC address, length and payload.
+#define TRAFFIC_CAPTURE_MAX_RECORD_SIZE (1 + 5 + sizeof(macAddress_t) + 2 + TRAFFIC_CAPTURE_MAX_PAYLOAD)
+
+enum capture_record_kind
+{
+    CAPTURE_RECORD_RECEIVED = 1,
+    CAPTURE_RECORD_SENT,
+    CAPTURE_RECORD_GPS,
+};
+
+/*
+ * Capture file, as downloaded:
+ *
+ *   capture_header
+ *   uint8_t metadata[metadataSize]
+ *   records, recordsSize bytes, oldest first:
+ *     uint8_t  kind           capture_record_kind
+ *     varint   delta          microseconds since the previous record, or since startTime for the first
+ *     with CAPTURE_RECORD_RECEIVED and CAPTURE_RECORD_SENT:
+ *       uint8_t mac[6]        peer the frame came from or went to
+ *     varint   length
+ *     uint8_t  data[length]   the whole ESP-NOW frame, or the bytes read from the GPS UART
+ *
+ * Varints are those of FlowmeterFrame. Times are esp_timer_get_time() of
+ * the recording module.
+ */
+typedef struct capture_header
+{
+    // TRAFFIC_CAPTURE_MAGIC.
+    char magic[4];
+    uint8_t version;
+    uint8_t reserved;
+    uint16_t metadataSize;
+    // Records overwritten because the ring was full, the capture holds the latest ones.
+    uint32_t droppedRecords;
+    uint32_t recordsSize;
+    int64_t startTime;
+} __attribute__((packed)) capture_header;
+
+#define TRAFFIC_CAPTURE_MAGIC "DFCP"
+
+/*
+ * Records the ESP-NOW frames and GPS bytes going through the module into a
+ * RAM ring, so a field problem can be downloaded and replayed on the host
+ * (see the simulator).
+ *
+ * Recording is off until start(). Records are short and taken from the
+ * Wi-Fi callbacks, the senders and the GPS task alike, so they are appended
+ * under a spinlock. Once the ring is full the oldest records make room for
+ * the new ones.
+ */
+class TrafficCapture
+{
+private:
+    TrafficCapture() {}
+
+    std::atomic<bool> isRecording{false};
+
+    uint8_t *ring = nullptr;
+    // Oldest record and bytes in use, the next record goes right after them.
+    size_t tail = 0;
+    size_t used = 0;
+    // Time the oldest record counts its delta from, and time of the newest record.
+    int64_t startTime = 0;
+    int64_t lastTime = 0;
+    uint32_t recordCount = 0;
+    uint32_t droppedCount = 0;
+
+    uint8_t metadata[TRAFFIC_CAPTURE_MAX_METADATA_SIZE];
+    uint16_t metadataSize = 0;
+
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+    void append(uint8_t kind, const uint8_t *mac, const uint8_t *data, size_t len);
+    void dropOldest();
+    void copyFromRing(size_t offset, uint8_t *output, size_t len);
+
+public:
+    static TrafficCapture *getInstance();
+
+    /*
+     * Empties the ring and starts recording. metadata, up to
+     * TRAFFIC_CAPTURE_MAX_METADATA_SIZE bytes, is kept ahead of the records
+     * for whoever replays them. Returns false if the ring cannot be allocated.
+     */
+    bool start(const uint8_t *metadata, size_t metadataSize);
+    // Stops recording, the records stay until the next start() or clear().
+    void stop();
+    // Stops recording and frees the ring.
+    void clear();
+    bool isStarted() { return isRecording.load(std::memory_order_relaxed); }
+
+    // Frame received from or sent to mac, no-ops while not recording.
+    void recordFrame(capture_record_kind kind, const uint8_t *mac, const uint8_t *data, size_t len);
+    // Bytes read from the GPS UART.
+    void recordGps(const uint8_t *data, size_t len);
+
+    /*
+     * Size of the capture file, and up to maxLen bytes of it from index, for
+     * a chunked download. Stop the capture first, the file would shift while
+     * it is read otherwise.
+     */
+    size_t getFileSize();
+    size_t readFile(uint8_t *buffer, size_t maxLen, size_t index);
+
+    // Records in the ring, and the ones overwritten since start().
+    uint32_t getRecordCount();
+    uint32_t getDroppedCount();
+    size_t getUsedSize();
+};
@@ -4,17 +4,48 @@
 
 typedef uint8_t macAddress_t[6];
 
+// A MAC address packed into the low 48 bits of an integer, for allocation-free lookups.
+typedef uint64_t macAddressKey_t;
+
+inline macAddressKey_t macAddressToKey(const uint8_t *mac_addr)
+{
+    return ((macAddressKey_t)mac_addr[0] << 40) | ((macAddressKey_t)mac_addr[1] << 32) | ((macAddressKey_t)mac_addr[2] << 24) |
+           ((macAddressKey_t)mac_addr[3] << 16) | ((macAddressKey_t)mac_addr[4] << 8) | (macAddressKey_t)mac_addr[5];
+}
+
+/*
+ * Payload of PAIR_REQUEST. Secondaries advertise how many flowmeters they
+ * carry, older ones only send msgType (channelCount then reads as 0).
+ */
+typedef struct pair_request
+{
+    uint8_t msgType;
+    uint8_t channelCount;
+} pair_request;
+
+/*
+ * Payload of PAIR_REQUEST + 0x80. slotIndex is the index of the secondary in
+ * the slave list of the main module, which sets when it answers a
+ * SAMPLE_LATCH. Older main modules send an empty response.
+ */
 typedef struct struct_pair_response
 {
     uint8_t msgType;
     uint8_t success;
+    uint8_t slotIndex;
 } struct_pair_response;
 
+// Slot index of a secondary paired with a main module that assigns none.
+#define NO_RESPONSE_SLOT 0xFF
+
 enum MessageType
 {
     PAIR_REQUEST = 0X10,
     FLOWMETER_DATA_REQUEST,
     SET_REFRESH_RATE,
+    SAMPLE_LATCH,
+    METRICS_REQUEST,
+    RELIABLE_MESSAGE,
 };
 
 enum moduleType
@@ -33,11 +64,172 @@ typedef unsigned short flowmeter_data_t;
 
 typedef struct flowmeters_data
 {
-    uint8_t flowmeterCount;
+    uint16_t flowmeterCount;
     flowmeter_data_t *flowmetersPulseCount;
     unsigned long *flowmetersLastPulseAge;
+    // Period-based rate estimate in millihertz and its confidence (0-255).
+    // Both null when the sender has no estimate.
+    uint32_t *flowmetersRate;
+    uint8_t *flowmetersRateConfidence;
+    // Window in milliseconds the pulse counts were taken over, 0 if unknown.
+    // Rates equal to the count over it are left out of the frame.
+    uint16_t countWindow;
 } flowmeters_data;
 
+/*
+ * Flowmeter data response frame (FLOWMETER_DATA_REQUEST + 0x80).
+ *
+ *   uint8_t  version        FLOWMETER_FRAME_VERSION
+ *   uint8_t  flags          FLOWMETER_FRAME_FLAG_*
+ *   varint   sequence       incremented by the secondary on every response
+ *   uint16_t session        drawn at random when the secondary boots, little endian
+ *   with FLOWMETER_FRAME_FLAG_SAMPLE:
+ *     varint sampleId       sample requested by the main module
+ *     varint sampleTime     boom time of the sample, low 32 bits of microseconds
+ *   uint8_t  channelCount   number of flowmeters of the secondary
+ *   uint8_t  bitmap[]       CHANNEL_BITMAP_SIZE(channelCount) bytes, bit i set when channel i follows
+ *   with FLOWMETER_FRAME_FLAG_RATE:
+ *     varint  countWindow   milliseconds, 0 when every rate is explicit
+ *     uint8_t rateBitmap[]  CHANNEL_BITMAP_SIZE(channelCount) bytes, bit i set when the rate of channel i follows
+ *   for each channel present in the bitmap:
+ *     varint pulseCount
+ *     varint lastPulseAge   milliseconds
+ *     when present in rateBitmap:
+ *       varint  rate        millihertz
+ *       uint8_t confidence  0-255
+ *
+ * Channels missing from the bitmap have never pulsed (all fields are 0).
+ * Channels missing from rateBitmap are in count mode: their rate is
+ * pulseCount * 1000000 / countWindow millihertz with confidence 255, which
+ * is what most channels report on a steady boom.
+ * A new session tells the main module the secondary restarted and counts its
+ * sequence from 0 again, so its responses are not taken for duplicates.
+ * Varints are unsigned LEB128: 7 bits per byte, least significant group first.
+ */
+#define FLOWMETER_FRAME_VERSION 3
+#define FLOWMETER_FRAME_MAX_SIZE 249
+
+#define FLOWMETER_FRAME_FLAG_RATE 0x01
+#define FLOWMETER_FRAME_FLAG_SAMPLE 0x02
+// Counts were latched when the SAMPLE_LATCH broadcast arrived, not when the request did.
+#define FLOWMETER_FRAME_FLAG_LATCHED 0x04
+
+/*
+ * When the counts of a response were taken, in boom time.
+ */
+typedef struct flowmeter_sample_info
+{
+    uint32_t id;
+    uint32_t time;
+    bool isLatched;
+} flowmeter_sample_info;
+
+typedef struct flowmeter_frame_header
+{
+    uint8_t version;
+    uint8_t flags;
+    uint32_t sequence;
+    uint16_t session;
+    // Zeroed without FLOWMETER_FRAME_FLAG_SAMPLE.
+    flowmeter_sample_info sample;
+    uint8_t channelCount;
+} flowmeter_frame_header;
+
+/*
+ * SAMPLE_LATCH payload, broadcast by the main module at the start of every
+ * acquisition cycle. Every secondary latches its counts when it arrives, so
+ * the whole boom is sampled at the same instant whatever the order and the
+ * retries of the data requests.
+ *
+ * It also keeps the secondaries on the boom time (esp_timer of the main
+ * module). The time a latch is queued can be milliseconds off from when it
+ * is transmitted, so the exact transmit time of the previous latch follows
+ * in the next one and the secondaries pair it with the time they received
+ * that previous latch.
+ *
+ * With a slotDuration, the latch is also the data request of the cycle: the
+ * secondary at slotIndex answers slotIndex * slotDuration microseconds after
+ * receiving it, so the responses follow each other instead of contending
+ * for the channel. A unicast FLOWMETER_DATA_REQUEST, carrying the uint32_t
+ * sampleId it collects, retries a secondary whose slot went by unanswered.
+ */
+typedef struct sample_latch
+{
+    uint32_t sampleId;
+    // Boom time the latch was queued, the reference of the sample delays.
+    int64_t boomTime;
+    // Boom time latch sampleId - 1 was transmitted, 0 if unknown.
+    int64_t previousSentTime;
+    // Microseconds between two response slots, 0 to wait for the data request.
+    uint16_t slotDuration;
+} __attribute__((packed)) sample_latch;
+
+/*
+ * SET_REFRESH_RATE payload.
+ *
+ *   uint16_t refreshRate    milliseconds, little endian
+ *   uint8_t  channelCount   number of channels covered by the bitmap
+ *   uint8_t  bitmap[]       CHANNEL_BITMAP_SIZE(channelCount) bytes, bit i set when channel i takes the new rate
+ */
+#define SET_REFRESH_RATE_HEADER_SIZE 3
+
+// Bytes of a bitmap with one bit per channel, as used by the frames above.
+#define CHANNEL_BITMAP_SIZE(channelCount) (((channelCount) + 7) / 8)
+
+/*
+ * RELIABLE_MESSAGE payload: this header followed by the payload of a message
+ * of messageType, which the receiver dispatches as if it came alone. The
+ * receiver acknowledges every copy with RELIABLE_MESSAGE + 0x80 carrying a
+ * reliable_ack, and dispatches a sequence number of a session only once.
+ *
+ * sequence is counted per peer by the sender. session is drawn at random
+ * when the sender boots, so a rebooted sender starting over from sequence 1
+ * is not taken for a duplicate.
+ */
+typedef struct reliable_header
+{
+    uint16_t session;
+    uint16_t sequence;
+    uint8_t messageType;
+} __attribute__((packed)) reliable_header;
+
+typedef struct reliable_ack
+{
+    uint16_t session;
+    uint16_t sequence;
+} __attribute__((packed)) reliable_ack;
+
+/*
+ * Payload of METRICS_REQUEST + 0x80, the counters of a secondary module. The
+ * header is followed by channelCount uint32_t, the rate in millihertz the
+ * pulse interrupt of each flowmeter fired at since the previous report.
+ * METRICS_REQUEST itself carries nothing.
+ */
+typedef struct secondary_metrics
+{
+    // Milliseconds since boot.
+    uint32_t uptime;
+    // Bytes of heap free now, at the lowest since boot, and in the largest free block.
+    uint32_t freeHeap;
+    uint32_t minFreeHeap;
+    uint32_t largestFreeBlock;
+    // Lowest free stack since boot of the loop and ESP-NOW dispatcher tasks, in bytes.
+    uint32_t loopStackHighWatermark;
+    uint32_t dispatcherStackHighWatermark;
+    // Longest loop() since the previous report, in microseconds.
+    uint32_t loopMaxDuration;
+    // Totals of ESPNowManager since boot, see espnow_message_metrics.
+    uint32_t framesSent;
+    uint32_t sendErrors;
+    uint32_t framesDelivered;
+    uint32_t deliveryFailures;
+    uint32_t framesReceived;
+    uint32_t framesDropped;
+    uint8_t channelCount;
+} __attribute__((packed)) secondary_metrics;
+
+#define SECONDARY_METRICS_MAX_CHANNELS 32
+
 typedef struct secondary_module_data_request
 {
     uint8_t msgType;
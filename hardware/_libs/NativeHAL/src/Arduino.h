@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <functional>
+#include "WString.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+#define IRAM_ATTR
+
+#define LOW 0x0
+#define HIGH 0x1
+
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+
+#define SERIAL_8N1 0x800001c
+
+#define PI 3.1415926535897932384626433832795
+#define HALF_PI 1.5707963267948966192313216916398
+#define TWO_PI 6.283185307179586476925286766559
+#define DEG_TO_RAD 0.017453292519943295769236907684886
+#define RAD_TO_DEG 57.295779513082320876798154814105
+
+#define radians(deg) ((deg) * DEG_TO_RAD)
+#define degrees(rad) ((rad) * RAD_TO_DEG)
+#define sq(x) ((x) * (x))
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+// Seeded once, so a run is reproducible.
+uint32_t esp_random();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+#define digitalPinToInterrupt(p) (p)
+void attachInterruptArg(uint8_t pin, void (*handler)(void *), void *arg, int mode);
+void detachInterrupt(uint8_t pin);
+
+class Print
+{
+public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t value) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            write(buffer[i]);
+        }
+        return size;
+    }
+
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    size_t print(const char *value);
+    size_t print(const String &value) { return print(value.c_str()); }
+    size_t println(const char *value = "");
+    size_t println(const String &value) { return println(value.c_str()); }
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    size_t readBytes(uint8_t *buffer, size_t length)
+    {
+        size_t count = 0;
+        while (count < length && available() > 0)
+        {
+            buffer[count++] = read();
+        }
+        return count;
+    }
+};
+
+/*
+ * UART fake. Received bytes come from NativeHAL::injectSerial(), written bytes
+ * go to the hook set with NativeHAL::setSerialTxHook() (UART 0 prints to stdout).
+ */
+class HardwareSerial : public Stream
+{
+public:
+    HardwareSerial(int uart);
+
+    void begin(unsigned long baud, uint32_t config = SERIAL_8N1, int8_t rxPin = -1, int8_t txPin = -1);
+    void end() {}
+    void updateBaudRate(unsigned long baud);
+    unsigned long baudRate() { return baud; }
+    void onReceive(std::function<void(void)> callback, bool onlyOnTimeout = false);
+    size_t setRxBufferSize(size_t size) { return size; }
+    void flush() {}
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write(uint8_t value) override;
+    using Print::write;
+
+    operator bool() const { return true; }
+
+private:
+    int uart;
+    unsigned long baud = 0;
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,276 @@
+#include "ESPAsyncWebServer.h"
+
+static std::vector<AsyncWebServer *> servers;
+
+AsyncWebServerRequest::AsyncWebServerRequest(AsyncWebServer *server, WebRequestMethod method, const String &url, const std::map<String, String> &params)
+{
+    this->server = server;
+    this->requestMethod = method;
+    this->requestUrl = url;
+    for (const auto &param : params)
+    {
+        this->params.emplace_back(param.first, param.second);
+    }
+}
+
+bool AsyncWebServerRequest::hasParam(const char *name, bool post, bool file) const
+{
+    return getParam(name, post, file) != nullptr;
+}
+
+const AsyncWebParameter *AsyncWebServerRequest::getParam(const char *name, bool post, bool file) const
+{
+    for (const AsyncWebParameter &param : params)
+    {
+        if (param.name() == name)
+        {
+            return &param;
+        }
+    }
+    return nullptr;
+}
+
+void AsyncWebServerRequest::send(int code, const char *contentType, const String &content)
+{
+    if (answered)
+    {
+        return;
+    }
+
+    answered = true;
+    responseCode = code;
+    responseBody = content;
+
+    if (paused)
+    {
+        server->release(this);
+    }
+}
+
+void AsyncWebServerRequest::send(const char *contentType, size_t len, AwsResponseFiller callback)
+{
+    // Small chunks, as the TCP window would take them.
+    String content;
+    uint8_t chunk[1436];
+    while (content.length() < len)
+    {
+        const size_t filled = callback(chunk, std::min(sizeof(chunk), len - content.length()), content.length());
+        if (filled == 0)
+        {
+            break;
+        }
+        content.concat(reinterpret_cast<const char *>(chunk), filled);
+    }
+
+    send(200, contentType, content);
+}
+
+void AsyncWebServerRequest::sendChunked(const char *contentType, AwsResponseFiller callback)
+{
+    // A chunk is what is left of the TCP window after the chunk header and trailer.
+    String content;
+    uint8_t chunk[1436 - 8];
+    while (true)
+    {
+        const size_t filled = callback(chunk, sizeof(chunk), content.length());
+        if (filled == 0)
+        {
+            break;
+        }
+        content.concat(reinterpret_cast<const char *>(chunk), filled);
+    }
+
+    send(200, contentType, content);
+}
+
+AsyncWebServerRequestPtr AsyncWebServerRequest::pause()
+{
+    if (!paused)
+    {
+        paused = true;
+        server->pausedRequests.push_back(shared_from_this());
+    }
+    return weak_from_this();
+}
+
+void AsyncWebServerRequest::abort()
+{
+    if (paused)
+    {
+        server->release(this);
+    }
+}
+
+void AsyncWebSocketClient::close()
+{
+    server->close(clientId);
+}
+
+void AsyncWebSocketClient::text(const char *message, size_t len)
+{
+    if (onMessage)
+    {
+        onMessage((const uint8_t *)message, len);
+    }
+}
+
+AsyncWebSocketClient *AsyncWebSocket::client(uint32_t id)
+{
+    for (auto &client : clients)
+    {
+        if (client->id() == id)
+        {
+            return client.get();
+        }
+    }
+    return nullptr;
+}
+
+bool AsyncWebSocket::text(uint32_t id, const char *message, size_t len)
+{
+    AsyncWebSocketClient *client = this->client(id);
+    if (client == nullptr)
+    {
+        return false;
+    }
+
+    client->text(message, len);
+    return true;
+}
+
+bool AsyncWebSocket::text(uint32_t id, AsyncWebSocketSharedBuffer buffer)
+{
+    return text(id, (const char *)buffer->data(), buffer->size());
+}
+
+void AsyncWebSocket::textAll(const char *message, size_t len)
+{
+    for (auto &client : clients)
+    {
+        client->text(message, len);
+    }
+}
+
+void AsyncWebSocket::close(uint32_t id)
+{
+    for (auto it = clients.begin(); it != clients.end(); ++it)
+    {
+        if ((*it)->id() == id)
+        {
+            std::unique_ptr<AsyncWebSocketClient> client = std::move(*it);
+            clients.erase(it);
+            if (eventHandler)
+            {
+                eventHandler(this, client.get(), WS_EVT_DISCONNECT, nullptr, nullptr, 0);
+            }
+            return;
+        }
+    }
+}
+
+uint32_t AsyncWebSocket::connect(const std::map<String, String> &params, std::function<void(const uint8_t *data, size_t len)> onMessage)
+{
+    const uint32_t id = nextClientId++;
+    clients.emplace_back(new AsyncWebSocketClient(this, id));
+    clients.back()->onMessage = onMessage;
+
+    // The upgrade request carries the query parameters of the connection.
+    AsyncWebServerRequest request(nullptr, HTTP_GET, socketUrl, params);
+    if (eventHandler)
+    {
+        eventHandler(this, clients.back().get(), WS_EVT_CONNECT, &request, nullptr, 0);
+    }
+
+    return client(id) != nullptr ? id : 0;
+}
+
+AsyncWebServer::AsyncWebServer(uint16_t port)
+{
+    this->port = port;
+    servers.push_back(this);
+}
+
+AsyncWebServer::~AsyncWebServer()
+{
+    for (auto it = servers.begin(); it != servers.end(); ++it)
+    {
+        if (*it == this)
+        {
+            servers.erase(it);
+            break;
+        }
+    }
+}
+
+AsyncWebServer *AsyncWebServer::getServer(uint16_t port)
+{
+    for (AsyncWebServer *server : servers)
+    {
+        if (server->port == port)
+        {
+            return server;
+        }
+    }
+    return nullptr;
+}
+
+AsyncCallbackWebHandler &AsyncWebServer::on(const char *uri, WebRequestMethod method, ArRequestHandlerFunction onRequest)
+{
+    AsyncCallbackWebHandler *handler = new AsyncCallbackWebHandler();
+    handler->url = uri;
+    handler->method = method;
+    handler->onRequest = onRequest;
+
+    callbackHandlers.emplace_back(handler);
+    handlers.push_back(handler);
+    return *handler;
+}
+
+AsyncWebHandler &AsyncWebServer::addHandler(AsyncWebHandler *handler)
+{
+    handlers.push_back(handler);
+    return *handler;
+}
+
+std::shared_ptr<AsyncWebServerRequest> AsyncWebServer::request(WebRequestMethod method, const char *url, const std::map<String, String> &params)
+{
+    std::shared_ptr<AsyncWebServerRequest> request = std::make_shared<AsyncWebServerRequest>(this, method, url, params);
+
+    for (auto &handler : callbackHandlers)
+    {
+        if (handler->url == url && (handler->method & method))
+        {
+            handler->onRequest(request.get());
+            return request;
+        }
+    }
+
+    request->send(404);
+    return request;
+}
+
+AsyncWebSocket *AsyncWebServer::getWebSocket(const char *url)
+{
+    for (AsyncWebHandler *handler : handlers)
+    {
+        AsyncWebSocket *socket = dynamic_cast<AsyncWebSocket *>(handler);
+        if (socket != nullptr && socket->url() == url)
+        {
+            return socket;
+        }
+    }
+    return nullptr;
+}
+
+void AsyncWebServer::release(AsyncWebServerRequest *request)
+{
+    for (auto it = pausedRequests.begin(); it != pausedRequests.end(); ++it)
+    {
+        if (it->get() == request)
+        {
+            std::shared_ptr<AsyncWebServerRequest> released = std::move(*it);
+            pausedRequests.erase(it);
+            return;
+        }
+    }
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+/*
+ * ESPAsyncWebServer fake. There is no socket: the simulation calls request()
+ * and connect() on the server to run the handlers the firmware registered.
+ */
+
+typedef enum
+{
+    HTTP_GET = 0b00000001,
+    HTTP_POST = 0b00000010,
+    HTTP_DELETE = 0b00000100,
+    HTTP_PUT = 0b00001000,
+    HTTP_ANY = 0b01111111,
+} WebRequestMethod;
+
+class AsyncWebServerRequest;
+typedef std::weak_ptr<AsyncWebServerRequest> AsyncWebServerRequestPtr;
+typedef std::function<void(AsyncWebServerRequest *request)> ArRequestHandlerFunction;
+typedef std::function<size_t(uint8_t *buffer, size_t maxLen, size_t index)> AwsResponseFiller;
+
+class AsyncWebParameter
+{
+public:
+    AsyncWebParameter(const String &name, const String &value) : parameterName(name), parameterValue(value) {}
+
+    const String &name() const { return parameterName; }
+    const String &value() const { return parameterValue; }
+
+private:
+    String parameterName;
+    String parameterValue;
+};
+
+class AsyncWebServer;
+
+class AsyncWebServerRequest : public std::enable_shared_from_this<AsyncWebServerRequest>
+{
+public:
+    AsyncWebServerRequest(AsyncWebServer *server, WebRequestMethod method, const String &url, const std::map<String, String> &params);
+
+    WebRequestMethod method() const { return requestMethod; }
+    const String &url() const { return requestUrl; }
+
+    bool hasParam(const char *name, bool post = false, bool file = false) const;
+    const AsyncWebParameter *getParam(const char *name, bool post = false, bool file = false) const;
+
+    void send(int code, const char *contentType = "", const String &content = String());
+    void send(int code, const String &contentType, const String &content = String()) { send(code, contentType.c_str(), content); }
+    // Response of len bytes with code 200, pulled from the filler like AsyncTCP would.
+    void send(const char *contentType, size_t len, AwsResponseFiller callback);
+    // Chunked response with code 200, pulled from the filler until it returns 0.
+    void sendChunked(const char *contentType, AwsResponseFiller callback);
+
+    AsyncWebServerRequestPtr pause();
+    bool isPaused() const { return paused; }
+    void abort();
+
+    // Simulation side: state of the response.
+    bool isAnswered() const { return answered; }
+    int getResponseCode() const { return responseCode; }
+    const String &getResponseBody() const { return responseBody; }
+
+private:
+    AsyncWebServer *server;
+    WebRequestMethod requestMethod;
+    String requestUrl;
+    std::vector<AsyncWebParameter> params;
+
+    bool paused = false;
+    bool answered = false;
+    int responseCode = 0;
+    String responseBody;
+};
+
+class AsyncWebHandler
+{
+public:
+    virtual ~AsyncWebHandler() {}
+};
+
+class AsyncCallbackWebHandler : public AsyncWebHandler
+{
+public:
+    String url;
+    WebRequestMethod method;
+    ArRequestHandlerFunction onRequest;
+};
+
+typedef enum
+{
+    WS_EVT_CONNECT,
+    WS_EVT_DISCONNECT,
+    WS_EVT_PING,
+    WS_EVT_PONG,
+    WS_EVT_ERROR,
+    WS_EVT_DATA
+} AwsEventType;
+
+typedef std::shared_ptr<std::vector<uint8_t>> AsyncWebSocketSharedBuffer;
+
+class AsyncWebSocket;
+
+class AsyncWebSocketClient
+{
+public:
+    AsyncWebSocketClient(AsyncWebSocket *server, uint32_t id) : server(server), clientId(id) {}
+
+    uint32_t id() const { return clientId; }
+    void close();
+    bool canSend() const { return true; }
+
+    void text(const char *message, size_t len);
+    void text(const String &message) { text(message.c_str(), message.length()); }
+
+    std::function<void(const uint8_t *data, size_t len)> onMessage;
+
+private:
+    AsyncWebSocket *server;
+    uint32_t clientId;
+};
+
+typedef std::function<void(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)> AwsEventHandler;
+
+class AsyncWebSocket : public AsyncWebHandler
+{
+public:
+    AsyncWebSocket(const String &url) : socketUrl(url) {}
+
+    const String &url() const { return socketUrl; }
+    void onEvent(AwsEventHandler handler) { eventHandler = handler; }
+
+    AsyncWebSocketClient *client(uint32_t id);
+    size_t count() const { return clients.size(); }
+    void cleanupClients(uint16_t maxClients = 8) {}
+    bool availableForWrite(uint32_t id) { return client(id) != nullptr; }
+    bool availableForWriteAll() { return true; }
+
+    bool text(uint32_t id, const char *message, size_t len);
+    bool text(uint32_t id, AsyncWebSocketSharedBuffer buffer);
+    void textAll(const char *message, size_t len);
+    void textAll(const String &message) { textAll(message.c_str(), message.length()); }
+    void close(uint32_t id);
+
+    /*
+     * Simulation side: opens a client connection with the given query
+     * parameters. Messages sent to it are passed to onMessage.
+     */
+    uint32_t connect(const std::map<String, String> &params, std::function<void(const uint8_t *data, size_t len)> onMessage);
+    void disconnect(uint32_t id) { close(id); }
+
+private:
+    String socketUrl;
+    AwsEventHandler eventHandler;
+    std::vector<std::unique_ptr<AsyncWebSocketClient>> clients;
+    uint32_t nextClientId = 1;
+};
+
+class AsyncWebServer
+{
+public:
+    AsyncWebServer(uint16_t port);
+    ~AsyncWebServer();
+
+    void begin() { started = true; }
+    void end() { started = false; }
+
+    AsyncCallbackWebHandler &on(const char *uri, WebRequestMethod method, ArRequestHandlerFunction onRequest);
+    AsyncWebHandler &addHandler(AsyncWebHandler *handler);
+
+    /*
+     * Simulation side: runs the handler registered for url. A paused request
+     * stays alive until the firmware answers it or it is aborted.
+     */
+    std::shared_ptr<AsyncWebServerRequest> request(WebRequestMethod method, const char *url, const std::map<String, String> &params = {});
+    AsyncWebSocket *getWebSocket(const char *url);
+
+    static AsyncWebServer *getServer(uint16_t port);
+
+private:
+    friend class AsyncWebServerRequest;
+
+    uint16_t port;
+    bool started = false;
+    std::vector<std::unique_ptr<AsyncCallbackWebHandler>> callbackHandlers;
+    std::vector<AsyncWebHandler *> handlers;
+    std::vector<std::shared_ptr<AsyncWebServerRequest>> pausedRequests;
+
+    void release(AsyncWebServerRequest *request);
+};
+
+class DefaultHeaders
+{
+public:
+    static DefaultHeaders &Instance()
+    {
+        static DefaultHeaders instance;
+        return instance;
+    }
+
+    void addHeader(const char *name, const char *value) { headers[name] = value; }
+
+private:
+    std::map<String, String> headers;
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include "WString.h"
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+/*
+ * FS fake, the file API of LittleFS. Files live in memory for the lifetime
+ * of the process, see LittleFS.h.
+ */
+namespace fs
+{
+    struct FileImpl;
+
+    enum SeekMode
+    {
+        SeekSet = 0,
+        SeekCur = 1,
+        SeekEnd = 2,
+    };
+
+    class File
+    {
+    public:
+        File(std::shared_ptr<FileImpl> impl = nullptr) : impl(impl) {}
+
+        size_t write(uint8_t value) { return write(&value, 1); }
+        size_t write(const uint8_t *buffer, size_t size);
+        int available();
+        int read();
+        size_t read(uint8_t *buffer, size_t size);
+        void flush() {}
+        bool seek(uint32_t position, SeekMode mode = SeekSet);
+        size_t position() const;
+        size_t size() const;
+        void close();
+        operator bool() const;
+
+        const char *path() const;
+        // Last component of the path.
+        const char *name() const;
+        bool isDirectory() const;
+        // Next entry of a directory, in name order. An invalid File after the last one.
+        File openNextFile(const char *mode = FILE_READ);
+        void rewindDirectory();
+
+    private:
+        std::shared_ptr<FileImpl> impl;
+    };
+
+    class FS
+    {
+    public:
+        File open(const char *path, const char *mode = FILE_READ, const bool create = false);
+        File open(const String &path, const char *mode = FILE_READ, const bool create = false) { return open(path.c_str(), mode, create); }
+        bool exists(const char *path);
+        bool remove(const char *path);
+        bool rename(const char *pathFrom, const char *pathTo);
+        bool mkdir(const char *path);
+        bool rmdir(const char *path);
+    };
+}
+
+using fs::File;
+using fs::FS;
+using fs::SeekMode;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
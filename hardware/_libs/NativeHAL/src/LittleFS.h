@@ -0,0 +1,26 @@
+#pragma once
+
+#include "FS.h"
+
+// The spiffs partition of the default ESP32 partition table (0x160000), which LittleFS mounts.
+#define NATIVE_LITTLEFS_SIZE 1441792
+#define NATIVE_LITTLEFS_BLOCK_SIZE 4096
+
+/*
+ * LittleFS fake. Every file takes whole blocks, and writes fail once the
+ * blocks are all used, like the real one.
+ */
+namespace fs
+{
+    class LittleFSFS : public FS
+    {
+    public:
+        bool begin(bool formatOnFail = false, const char *basePath = "/littlefs", uint8_t maxOpenFiles = 10, const char *partitionLabel = "spiffs");
+        void end() {}
+        bool format();
+        size_t totalBytes();
+        size_t usedBytes();
+    };
+}
+
+extern fs::LittleFSFS LittleFS;
@@ -0,0 +1,1384 @@
+#include "NativeHAL.h"
+#include "RadioBus.h"
+#include <Arduino.h>
+#include <Preferences.h>
+#include <LittleFS.h>
+#include <WiFi.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <stdarg.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Scheduler.
+ *
+ * Every blocking FreeRTOS call registers its wake-up condition and waits for
+ * notifyWaiters() to find it holds. The simulation is idle when no task is
+ * running and no registered condition holds, which is what waitForIdleTasks()
+ * waits for.
+ */
+
+struct native_task
+{
+    std::string name;
+    TaskFunction_t function;
+    void *parameters;
+    uint32_t stackDepth;
+    UBaseType_t priority;
+    uint32_t notifyCount = 0;
+    bool deleted = false;
+};
+
+struct native_semaphore
+{
+    UBaseType_t count;
+    UBaseType_t maxCount;
+};
+
+struct native_queue
+{
+    UBaseType_t length;
+    UBaseType_t itemSize;
+    std::deque<std::vector<uint8_t>> items;
+};
+
+struct native_timer
+{
+    esp_timer_cb_t callback;
+    void *arg;
+    const NativeHAL::local_clock *clock;
+    bool active = false;
+    uint64_t due = 0;
+    uint64_t period = 0;
+};
+
+typedef struct blocked_wait
+{
+    const std::function<bool()> *ready;
+    uint64_t deadline;
+    // Each task waits on its own, so a change only wakes the tasks it unblocks.
+    std::condition_variable *condition;
+} blocked_wait;
+
+static std::mutex schedulerMutex;
+static std::condition_variable schedulerCondition;
+static std::atomic<uint64_t> clockMicros{0};
+static int runningTasks = 0;
+static std::vector<blocked_wait> blockedWaits;
+static thread_local native_task *currentTask = nullptr;
+static thread_local const NativeHAL::local_clock *currentClock = nullptr;
+
+static std::recursive_mutex criticalMutex;
+
+static std::mutex timersMutex;
+static std::vector<native_timer *> timers;
+
+static const uint64_t NO_DEADLINE = UINT64_MAX;
+
+static bool isIdle()
+{
+    if (runningTasks > 0)
+    {
+        return false;
+    }
+    for (const blocked_wait &wait : blockedWaits)
+    {
+        if ((*wait.ready)() || clockMicros.load() >= wait.deadline)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64_t ticksToDeadline(TickType_t ticks)
+{
+    return ticks == portMAX_DELAY ? NO_DEADLINE : clockMicros.load() + (uint64_t)ticks * 1000;
+}
+
+/*
+ * Wakes the loop thread, and the tasks whose condition now holds or whose
+ * deadline passed. Must be called with schedulerMutex held after any change
+ * a wait could depend on.
+ */
+static void notifyWaiters()
+{
+    schedulerCondition.notify_all();
+    for (const blocked_wait &wait : blockedWaits)
+    {
+        if ((*wait.ready)() || clockMicros.load() >= wait.deadline)
+        {
+            wait.condition->notify_one();
+        }
+    }
+}
+
+/*
+ * Waits until ready() holds or virtual time reaches deadline. Must be called
+ * with schedulerMutex held. Returns ready().
+ *
+ * The loop thread is not a task: it cannot wait for virtual time to pass, so
+ * a finite timeout expires as soon as the tasks are idle.
+ */
+static bool blockUntil(std::unique_lock<std::mutex> &lock, const std::function<bool()> &ready, uint64_t deadline)
+{
+    if (ready())
+    {
+        return true;
+    }
+
+    if (currentTask == nullptr)
+    {
+        schedulerCondition.wait(lock, [&]
+                                { return ready() || (deadline != NO_DEADLINE && isIdle()); });
+        return ready();
+    }
+
+    std::condition_variable condition;
+    blockedWaits.push_back({&ready, deadline, &condition});
+    runningTasks--;
+    notifyWaiters();
+
+    condition.wait(lock, [&]
+                   { return ready() || clockMicros.load() >= deadline; });
+
+    for (auto it = blockedWaits.begin(); it != blockedWaits.end(); ++it)
+    {
+        if (it->ready == &ready)
+        {
+            blockedWaits.erase(it);
+            break;
+        }
+    }
+    runningTasks++;
+    return ready();
+}
+
+static void setClock(uint64_t time)
+{
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    clockMicros.store(time);
+    notifyWaiters();
+}
+
+static uint64_t nextTimerDue()
+{
+    std::lock_guard<std::mutex> lock(timersMutex);
+    uint64_t next = NO_DEADLINE;
+    for (native_timer *timer : timers)
+    {
+        if (timer->active && timer->due < next)
+        {
+            next = timer->due;
+        }
+    }
+    return next;
+}
+
+static void fireDueTimers(uint64_t now)
+{
+    std::vector<native_timer *> due;
+    {
+        std::lock_guard<std::mutex> lock(timersMutex);
+        for (native_timer *timer : timers)
+        {
+            if (!timer->active || timer->due > now)
+            {
+                continue;
+            }
+
+            due.push_back(timer);
+            if (timer->period > 0)
+            {
+                timer->due += timer->period;
+            }
+            else
+            {
+                timer->active = false;
+            }
+        }
+    }
+
+    const NativeHAL::local_clock *clock = currentClock;
+    for (native_timer *timer : due)
+    {
+        currentClock = timer->clock;
+        timer->callback(timer->arg);
+    }
+    currentClock = clock;
+}
+
+// Time read by the firmware on this thread, see NativeHAL::setLocalClock().
+static int64_t getLocalTime()
+{
+    const uint64_t now = clockMicros.load();
+    if (currentClock == nullptr)
+    {
+        return (int64_t)now;
+    }
+    return currentClock->offset + (int64_t)now + (int64_t)(now * (double)currentClock->drift / 1000000);
+}
+
+namespace NativeHAL
+{
+    static std::mutex uartsMutex;
+
+    typedef struct uart_state
+    {
+        std::deque<uint8_t> received;
+        std::function<void(uint8_t)> txHook;
+        std::function<void(void)> onReceive;
+        unsigned long baud;
+    } uart_state;
+
+    static std::map<int, uart_state> uarts;
+    static bool consoleEnabled = true;
+    static uint8_t macAddress[6] = {0x24, 0x0A, 0xC4, 0x00, 0x00, 0x01};
+
+    typedef struct interrupt_handler
+    {
+        void (*handler)(void *);
+        void *arg;
+    } interrupt_handler;
+
+    static std::map<uint8_t, interrupt_handler> interruptHandlers;
+    static uint8_t pinLevels[256];
+
+    uint64_t now()
+    {
+        return clockMicros.load();
+    }
+
+    void setLocalClock(const local_clock *clock)
+    {
+        currentClock = clock;
+    }
+
+    const local_clock *getLocalClock()
+    {
+        return currentClock;
+    }
+
+    void waitForIdleTasks()
+    {
+        std::unique_lock<std::mutex> lock(schedulerMutex);
+        schedulerCondition.wait(lock, isIdle);
+    }
+
+    void advanceClock(uint64_t microseconds)
+    {
+        const uint64_t target = now() + microseconds;
+        RadioBus *bus = RadioBus::getInstance();
+
+        waitForIdleTasks();
+
+        while (true)
+        {
+            uint64_t next = std::min(nextTimerDue(), bus->getNextDeliveryTime());
+            {
+                std::lock_guard<std::mutex> lock(schedulerMutex);
+                for (const blocked_wait &wait : blockedWaits)
+                {
+                    next = std::min(next, wait.deadline);
+                }
+            }
+
+            if (next > target)
+            {
+                break;
+            }
+
+            if (next > now())
+            {
+                setClock(next);
+                waitForIdleTasks();
+            }
+
+            fireDueTimers(next);
+            bus->deliver(next);
+            waitForIdleTasks();
+        }
+
+        setClock(target);
+        waitForIdleTasks();
+    }
+
+    void triggerInterrupt(uint8_t pin)
+    {
+        auto it = interruptHandlers.find(pin);
+        if (it != interruptHandlers.end())
+        {
+            it->second.handler(it->second.arg);
+        }
+    }
+
+    void injectSerial(int uart, const uint8_t *data, size_t len)
+    {
+        std::function<void(void)> onReceive;
+        {
+            std::lock_guard<std::mutex> lock(uartsMutex);
+            uart_state &state = uarts[uart];
+            state.received.insert(state.received.end(), data, data + len);
+            onReceive = state.onReceive;
+        }
+
+        if (onReceive)
+        {
+            onReceive();
+        }
+    }
+
+    void setSerialTxHook(int uart, std::function<void(uint8_t)> hook)
+    {
+        std::lock_guard<std::mutex> lock(uartsMutex);
+        uarts[uart].txHook = hook;
+    }
+
+    unsigned long getSerialBaudRate(int uart)
+    {
+        std::lock_guard<std::mutex> lock(uartsMutex);
+        return uarts[uart].baud;
+    }
+
+    void setMacAddress(const uint8_t *mac)
+    {
+        memcpy(macAddress, mac, sizeof(macAddress));
+    }
+
+    void getMacAddress(uint8_t *mac)
+    {
+        memcpy(mac, macAddress, sizeof(macAddress));
+    }
+
+    void setConsoleEnabled(bool enabled)
+    {
+        consoleEnabled = enabled;
+    }
+}
+
+// FreeRTOS
+
+void vPortEnterCritical(portMUX_TYPE *mux)
+{
+    criticalMutex.lock();
+}
+
+void vPortExitCritical(portMUX_TYPE *mux)
+{
+    criticalMutex.unlock();
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stackDepth, void *parameters, UBaseType_t priority, TaskHandle_t *handle, BaseType_t coreId)
+{
+    native_task *task = new native_task();
+    task->name = name;
+    task->function = function;
+    task->parameters = parameters;
+    task->stackDepth = stackDepth;
+    task->priority = priority;
+
+    if (handle != nullptr)
+    {
+        *handle = task;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        runningTasks++;
+    }
+
+    const NativeHAL::local_clock *clock = currentClock;
+    std::thread([task, clock]
+                {
+        currentTask = task;
+        currentClock = clock;
+        task->function(task->parameters);
+
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        runningTasks--;
+        notifyWaiters(); })
+        .detach();
+
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stackDepth, void *parameters, UBaseType_t priority, TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(function, name, stackDepth, parameters, priority, handle, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task != nullptr && task != currentTask)
+    {
+        // Tasks are host threads and cannot be killed from outside, they stay blocked.
+        task->deleted = true;
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(schedulerMutex);
+    runningTasks--;
+    notifyWaiters();
+    schedulerCondition.wait(lock, []
+                            { return false; });
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    if (currentTask == nullptr)
+    {
+        NativeHAL::advanceClock((uint64_t)ticks * 1000);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(schedulerMutex);
+    const uint64_t deadline = ticksToDeadline(ticks);
+    const std::function<bool()> never = []
+    { return false; };
+    blockUntil(lock, never, deadline);
+}
+
+BaseType_t xTaskDelayUntil(TickType_t *previousWakeTime, TickType_t increment)
+{
+    const TickType_t wakeTime = *previousWakeTime + increment;
+    const TickType_t now = xTaskGetTickCount();
+    *previousWakeTime = wakeTime;
+
+    if ((int32_t)(wakeTime - now) <= 0)
+    {
+        return pdFALSE;
+    }
+
+    vTaskDelay(wakeTime - now);
+    return pdTRUE;
+}
+
+void vTaskDelayUntil(TickType_t *previousWakeTime, TickType_t increment)
+{
+    xTaskDelayUntil(previousWakeTime, increment);
+}
+
+TickType_t xTaskGetTickCount()
+{
+    return (TickType_t)(clockMicros.load() / 1000);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+    return currentTask;
+}
+
+const char *pcTaskGetName(TaskHandle_t task)
+{
+    if (task == nullptr)
+    {
+        task = currentTask;
+    }
+    return task != nullptr ? task->name.c_str() : "loopTask";
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    // Host threads have their own stacks, the one asked for is never touched.
+    if (task == nullptr)
+    {
+        task = currentTask;
+    }
+    return task != nullptr ? task->stackDepth : 0;
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task)
+{
+    // Recorded only, host threads all run at the same priority.
+    if (task == nullptr)
+    {
+        task = currentTask;
+    }
+    return task != nullptr ? task->priority : 1;
+}
+
+void xTaskNotifyGive(TaskHandle_t task)
+{
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    task->notifyCount++;
+    notifyWaiters();
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higherPriorityTaskWoken)
+{
+    xTaskNotifyGive(task);
+    if (higherPriorityTaskWoken != nullptr)
+    {
+        *higherPriorityTaskWoken = pdFALSE;
+    }
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait)
+{
+    native_task *task = currentTask;
+
+    std::unique_lock<std::mutex> lock(schedulerMutex);
+    const std::function<bool()> notified = [task]
+    { return task->notifyCount > 0; };
+    if (!blockUntil(lock, notified, ticksToDeadline(ticksToWait)))
+    {
+        return 0;
+    }
+
+    const uint32_t count = task->notifyCount;
+    task->notifyCount = clearCountOnExit ? 0 : count - 1;
+    return count;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+    native_queue *queue = new native_queue();
+    queue->length = length;
+    queue->itemSize = itemSize;
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    delete queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticksToWait)
+{
+    std::unique_lock<std::mutex> lock(schedulerMutex);
+    const std::function<bool()> hasSpace = [queue]
+    { return queue->items.size() < queue->length; };
+    if (!blockUntil(lock, hasSpace, ticksToDeadline(ticksToWait)))
+    {
+        return errQUEUE_FULL;
+    }
+
+    const uint8_t *bytes = static_cast<const uint8_t *>(item);
+    queue->items.emplace_back(bytes, bytes + queue->itemSize);
+    notifyWaiters();
+    return pdPASS;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item, BaseType_t *higherPriorityTaskWoken)
+{
+    if (higherPriorityTaskWoken != nullptr)
+    {
+        *higherPriorityTaskWoken = pdFALSE;
+    }
+    return xQueueSend(queue, item, 0);
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item)
+{
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    const uint8_t *bytes = static_cast<const uint8_t *>(item);
+    queue->items.clear();
+    queue->items.emplace_back(bytes, bytes + queue->itemSize);
+    notifyWaiters();
+    return pdPASS;
+}
+
+static BaseType_t queueTake(QueueHandle_t queue, void *item, TickType_t ticksToWait, bool remove)
+{
+    std::unique_lock<std::mutex> lock(schedulerMutex);
+    const std::function<bool()> hasItem = [queue]
+    { return !queue->items.empty(); };
+    if (!blockUntil(lock, hasItem, ticksToDeadline(ticksToWait)))
+    {
+        return errQUEUE_EMPTY;
+    }
+
+    memcpy(item, queue->items.front().data(), queue->itemSize);
+    if (remove)
+    {
+        queue->items.pop_front();
+        notifyWaiters();
+    }
+    return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticksToWait)
+{
+    return queueTake(queue, item, ticksToWait, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t ticksToWait)
+{
+    return queueTake(queue, item, ticksToWait, false);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    return queue->items.size();
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    queue->items.clear();
+    notifyWaiters();
+    return pdPASS;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    return new native_semaphore{1, 1};
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary()
+{
+    return new native_semaphore{0, 1};
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+    delete semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait)
+{
+    std::unique_lock<std::mutex> lock(schedulerMutex);
+    const std::function<bool()> available = [semaphore]
+    { return semaphore->count > 0; };
+    if (!blockUntil(lock, available, ticksToDeadline(ticksToWait)))
+    {
+        return pdFALSE;
+    }
+
+    semaphore->count--;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    if (semaphore->count >= semaphore->maxCount)
+    {
+        return pdFALSE;
+    }
+
+    semaphore->count++;
+    notifyWaiters();
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore, BaseType_t *higherPriorityTaskWoken)
+{
+    if (higherPriorityTaskWoken != nullptr)
+    {
+        *higherPriorityTaskWoken = pdFALSE;
+    }
+    return xSemaphoreGive(semaphore);
+}
+
+// esp_timer
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+    native_timer *timer = new native_timer();
+    timer->callback = args->callback;
+    timer->arg = args->arg;
+    timer->clock = currentClock;
+
+    std::lock_guard<std::mutex> lock(timersMutex);
+    timers.push_back(timer);
+    *handle = timer;
+    return ESP_OK;
+}
+
+static esp_err_t startTimer(esp_timer_handle_t timer, uint64_t timeout, uint64_t period)
+{
+    std::lock_guard<std::mutex> lock(timersMutex);
+    if (timer->active)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    timer->active = true;
+    timer->due = clockMicros.load() + timeout;
+    timer->period = period;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout)
+{
+    return startTimer(timer, timeout, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+    return startTimer(timer, period, period);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    std::lock_guard<std::mutex> lock(timersMutex);
+    if (!timer->active)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    timer->active = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    std::lock_guard<std::mutex> lock(timersMutex);
+    for (auto it = timers.begin(); it != timers.end(); ++it)
+    {
+        if (*it == timer)
+        {
+            timers.erase(it);
+            break;
+        }
+    }
+    delete timer;
+    return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer)
+{
+    std::lock_guard<std::mutex> lock(timersMutex);
+    return timer->active;
+}
+
+int64_t esp_timer_get_time()
+{
+    return getLocalTime();
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code)
+    {
+    case ESP_OK:
+        return "ESP_OK";
+    case ESP_FAIL:
+        return "ESP_FAIL";
+    case ESP_ERR_ESPNOW_NOT_INIT:
+        return "ESP_ERR_ESPNOW_NOT_INIT";
+    case ESP_ERR_ESPNOW_FULL:
+        return "ESP_ERR_ESPNOW_FULL";
+    case ESP_ERR_ESPNOW_NOT_FOUND:
+        return "ESP_ERR_ESPNOW_NOT_FOUND";
+    default:
+        return "ESP_ERR_UNKNOWN";
+    }
+}
+
+// Arduino
+
+unsigned long millis()
+{
+    return (unsigned long)(uint32_t)(getLocalTime() / 1000);
+}
+
+unsigned long micros()
+{
+    return (unsigned long)(uint32_t)getLocalTime();
+}
+
+uint32_t esp_random()
+{
+    static std::mt19937 random(0x5eed);
+    static std::mutex randomMutex;
+
+    std::lock_guard<std::mutex> lock(randomMutex);
+    return random();
+}
+
+void delay(uint32_t ms)
+{
+    vTaskDelay(ms);
+}
+
+void delayMicroseconds(uint32_t us)
+{
+    if (currentTask == nullptr)
+    {
+        NativeHAL::advanceClock(us);
+    }
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    NativeHAL::pinLevels[pin] = value;
+}
+
+int digitalRead(uint8_t pin)
+{
+    return NativeHAL::pinLevels[pin];
+}
+
+void attachInterruptArg(uint8_t pin, void (*handler)(void *), void *arg, int mode)
+{
+    NativeHAL::interruptHandlers[pin] = {handler, arg};
+}
+
+void detachInterrupt(uint8_t pin)
+{
+    NativeHAL::interruptHandlers.erase(pin);
+}
+
+size_t Print::printf(const char *format, ...)
+{
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    if (len < 0)
+    {
+        return 0;
+    }
+    return write((const uint8_t *)buffer, std::min<size_t>(len, sizeof(buffer) - 1));
+}
+
+size_t Print::print(const char *value)
+{
+    return write((const uint8_t *)value, strlen(value));
+}
+
+size_t Print::println(const char *value)
+{
+    return print(value) + print("\r\n");
+}
+
+HardwareSerial::HardwareSerial(int uart)
+{
+    this->uart = uart;
+}
+
+void HardwareSerial::begin(unsigned long baud, uint32_t config, int8_t rxPin, int8_t txPin)
+{
+    updateBaudRate(baud);
+}
+
+void HardwareSerial::updateBaudRate(unsigned long baud)
+{
+    this->baud = baud;
+
+    std::lock_guard<std::mutex> lock(NativeHAL::uartsMutex);
+    NativeHAL::uarts[uart].baud = baud;
+}
+
+void HardwareSerial::onReceive(std::function<void(void)> callback, bool onlyOnTimeout)
+{
+    std::lock_guard<std::mutex> lock(NativeHAL::uartsMutex);
+    NativeHAL::uarts[uart].onReceive = callback;
+}
+
+int HardwareSerial::available()
+{
+    std::lock_guard<std::mutex> lock(NativeHAL::uartsMutex);
+    return NativeHAL::uarts[uart].received.size();
+}
+
+int HardwareSerial::read()
+{
+    std::lock_guard<std::mutex> lock(NativeHAL::uartsMutex);
+    std::deque<uint8_t> &received = NativeHAL::uarts[uart].received;
+    if (received.empty())
+    {
+        return -1;
+    }
+
+    const uint8_t value = received.front();
+    received.pop_front();
+    return value;
+}
+
+int HardwareSerial::peek()
+{
+    std::lock_guard<std::mutex> lock(NativeHAL::uartsMutex);
+    std::deque<uint8_t> &received = NativeHAL::uarts[uart].received;
+    return received.empty() ? -1 : received.front();
+}
+
+size_t HardwareSerial::write(uint8_t value)
+{
+    std::function<void(uint8_t)> txHook;
+    {
+        std::lock_guard<std::mutex> lock(NativeHAL::uartsMutex);
+        txHook = NativeHAL::uarts[uart].txHook;
+    }
+
+    if (txHook)
+    {
+        txHook(value);
+    }
+    else if (uart == 0 && NativeHAL::consoleEnabled)
+    {
+        putchar(value);
+    }
+    return 1;
+}
+
+HardwareSerial Serial(0);
+
+// WiFi
+
+WiFiClass WiFi;
+
+uint8_t *WiFiClass::macAddress(uint8_t *mac)
+{
+    NativeHAL::getMacAddress(mac);
+    return mac;
+}
+
+String WiFiClass::macAddress()
+{
+    uint8_t mac[6];
+    NativeHAL::getMacAddress(mac);
+
+    char buffer[18];
+    snprintf(buffer, sizeof(buffer), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    return String(buffer);
+}
+
+esp_err_t esp_wifi_get_mac(wifi_interface_t interface, uint8_t mac[6])
+{
+    NativeHAL::getMacAddress(mac);
+    return ESP_OK;
+}
+
+// Preferences
+
+static std::mutex preferencesMutex;
+static std::map<std::string, std::map<std::string, std::vector<uint8_t>>> preferencesStore;
+
+bool Preferences::begin(const char *name, bool readOnly, const char *partitionLabel)
+{
+    this->name = name;
+    this->readOnly = readOnly;
+    this->opened = true;
+    return true;
+}
+
+void Preferences::end()
+{
+    this->opened = false;
+}
+
+bool Preferences::clear()
+{
+    std::lock_guard<std::mutex> lock(preferencesMutex);
+    if (!opened || readOnly)
+    {
+        return false;
+    }
+
+    preferencesStore[name].clear();
+    return true;
+}
+
+bool Preferences::remove(const char *key)
+{
+    std::lock_guard<std::mutex> lock(preferencesMutex);
+    if (!opened || readOnly)
+    {
+        return false;
+    }
+
+    return preferencesStore[name].erase(key) > 0;
+}
+
+bool Preferences::isKey(const char *key)
+{
+    std::lock_guard<std::mutex> lock(preferencesMutex);
+    return opened && preferencesStore[name].count(key) > 0;
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t len)
+{
+    std::lock_guard<std::mutex> lock(preferencesMutex);
+    if (!opened || readOnly)
+    {
+        return 0;
+    }
+
+    const uint8_t *bytes = static_cast<const uint8_t *>(value);
+    preferencesStore[name][key].assign(bytes, bytes + len);
+    return len;
+}
+
+size_t Preferences::getBytesLength(const char *key)
+{
+    std::lock_guard<std::mutex> lock(preferencesMutex);
+    if (!opened)
+    {
+        return 0;
+    }
+
+    auto &store = preferencesStore[name];
+    auto it = store.find(key);
+    return it == store.end() ? 0 : it->second.size();
+}
+
+size_t Preferences::getBytes(const char *key, void *buffer, size_t maxLen)
+{
+    std::lock_guard<std::mutex> lock(preferencesMutex);
+    if (!opened)
+    {
+        return 0;
+    }
+
+    auto &store = preferencesStore[name];
+    auto it = store.find(key);
+    if (it == store.end() || it->second.size() > maxLen)
+    {
+        return 0;
+    }
+
+    memcpy(buffer, it->second.data(), it->second.size());
+    return it->second.size();
+}
+
+String Preferences::getString(const char *key, const String &defaultValue)
+{
+    const size_t len = getBytesLength(key);
+    if (len == 0)
+    {
+        return defaultValue;
+    }
+
+    std::string value(len, '\0');
+    getBytes(key, &value[0], len);
+    return String(value);
+}
+
+// LittleFS
+
+fs::LittleFSFS LittleFS;
+
+namespace fs
+{
+    struct FileImpl
+    {
+        std::string path;
+        // Shared with the file system, a removed file stays readable by the handles still open.
+        std::shared_ptr<std::vector<uint8_t>> data;
+        size_t position = 0;
+        bool isWritable = false;
+        bool isAppending = false;
+        bool isDirectory = false;
+        bool isOpen = true;
+        // Last entry returned by openNextFile().
+        std::string lastChild;
+    };
+}
+
+static std::mutex fsMutex;
+static std::map<std::string, std::shared_ptr<std::vector<uint8_t>>> fsFiles;
+static std::set<std::string> fsDirectories = {"/"};
+
+static size_t getBlockCount(size_t size)
+{
+    return (size + NATIVE_LITTLEFS_BLOCK_SIZE - 1) / NATIVE_LITTLEFS_BLOCK_SIZE;
+}
+
+// Blocks in use, the two of the superblock included. Called with fsMutex held.
+static size_t getUsedBlocks()
+{
+    size_t blocks = 2;
+    for (const auto &file : fsFiles)
+    {
+        blocks += std::max<size_t>(1, getBlockCount(file.second->size()));
+    }
+    return blocks + fsDirectories.size() - 1;
+}
+
+static std::string getParentPath(const std::string &path)
+{
+    const size_t slash = path.rfind('/');
+    return slash == 0 || slash == std::string::npos ? "/" : path.substr(0, slash);
+}
+
+bool fs::LittleFSFS::begin(bool formatOnFail, const char *basePath, uint8_t maxOpenFiles, const char *partitionLabel)
+{
+    return true;
+}
+
+bool fs::LittleFSFS::format()
+{
+    std::lock_guard<std::mutex> lock(fsMutex);
+    fsFiles.clear();
+    fsDirectories = {"/"};
+    return true;
+}
+
+size_t fs::LittleFSFS::totalBytes()
+{
+    return NATIVE_LITTLEFS_SIZE;
+}
+
+size_t fs::LittleFSFS::usedBytes()
+{
+    std::lock_guard<std::mutex> lock(fsMutex);
+    return getUsedBlocks() * NATIVE_LITTLEFS_BLOCK_SIZE;
+}
+
+fs::File fs::FS::open(const char *path, const char *mode, const bool create)
+{
+    std::lock_guard<std::mutex> lock(fsMutex);
+    std::shared_ptr<FileImpl> impl = std::make_shared<FileImpl>();
+    impl->path = path;
+
+    if (fsDirectories.count(path) > 0)
+    {
+        impl->isDirectory = true;
+        return File(impl);
+    }
+
+    auto it = fsFiles.find(path);
+    if (mode[0] == 'r' && mode[1] != '+')
+    {
+        if (it == fsFiles.end())
+        {
+            return File();
+        }
+        impl->data = it->second;
+        return File(impl);
+    }
+
+    if (fsDirectories.count(getParentPath(path)) == 0)
+    {
+        return File();
+    }
+
+    if (it == fsFiles.end() || mode[0] == 'w')
+    {
+        fsFiles[path] = std::make_shared<std::vector<uint8_t>>();
+        it = fsFiles.find(path);
+    }
+    impl->data = it->second;
+    impl->isWritable = true;
+    impl->isAppending = mode[0] == 'a';
+    impl->position = impl->isAppending ? impl->data->size() : 0;
+    return File(impl);
+}
+
+bool fs::FS::exists(const char *path)
+{
+    std::lock_guard<std::mutex> lock(fsMutex);
+    return fsFiles.count(path) > 0 || fsDirectories.count(path) > 0;
+}
+
+bool fs::FS::remove(const char *path)
+{
+    std::lock_guard<std::mutex> lock(fsMutex);
+    return fsFiles.erase(path) > 0;
+}
+
+bool fs::FS::rename(const char *pathFrom, const char *pathTo)
+{
+    std::lock_guard<std::mutex> lock(fsMutex);
+    auto it = fsFiles.find(pathFrom);
+    if (it == fsFiles.end() || fsDirectories.count(getParentPath(pathTo)) == 0)
+    {
+        return false;
+    }
+    fsFiles[pathTo] = it->second;
+    fsFiles.erase(pathFrom);
+    return true;
+}
+
+bool fs::FS::mkdir(const char *path)
+{
+    std::lock_guard<std::mutex> lock(fsMutex);
+    if (fsFiles.count(path) > 0 || fsDirectories.count(getParentPath(path)) == 0)
+    {
+        return false;
+    }
+    fsDirectories.insert(path);
+    return true;
+}
+
+bool fs::FS::rmdir(const char *path)
+{
+    std::lock_guard<std::mutex> lock(fsMutex);
+    const std::string prefix = std::string(path) + "/";
+    for (const auto &file : fsFiles)
+    {
+        if (file.first.compare(0, prefix.size(), prefix) == 0)
+        {
+            return false;
+        }
+    }
+    return strcmp(path, "/") != 0 && fsDirectories.erase(path) > 0;
+}
+
+size_t fs::File::write(const uint8_t *buffer, size_t size)
+{
+    if (!*this || !impl->isWritable)
+    {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(fsMutex);
+    std::vector<uint8_t> &data = *impl->data;
+    if (impl->isAppending)
+    {
+        impl->position = data.size();
+    }
+
+    const size_t end = std::max(data.size(), impl->position + size);
+    if (getUsedBlocks() + getBlockCount(end) - std::max<size_t>(1, getBlockCount(data.size())) > NATIVE_LITTLEFS_SIZE / NATIVE_LITTLEFS_BLOCK_SIZE)
+    {
+        return 0;
+    }
+
+    data.resize(end);
+    memcpy(data.data() + impl->position, buffer, size);
+    impl->position += size;
+    return size;
+}
+
+int fs::File::available()
+{
+    return *this && !impl->isDirectory ? (int)(size() - position()) : 0;
+}
+
+int fs::File::read()
+{
+    uint8_t value;
+    return read(&value, 1) == 1 ? value : -1;
+}
+
+size_t fs::File::read(uint8_t *buffer, size_t size)
+{
+    if (!*this || impl->isDirectory)
+    {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(fsMutex);
+    const std::vector<uint8_t> &data = *impl->data;
+    const size_t count = impl->position < data.size() ? std::min(size, data.size() - impl->position) : 0;
+    memcpy(buffer, data.data() + impl->position, count);
+    impl->position += count;
+    return count;
+}
+
+bool fs::File::seek(uint32_t position, SeekMode mode)
+{
+    if (!*this || impl->isDirectory)
+    {
+        return false;
+    }
+
+    const size_t base = mode == SeekSet ? 0 : mode == SeekCur ? impl->position : size();
+    if (base + position > size())
+    {
+        return false;
+    }
+    impl->position = base + position;
+    return true;
+}
+
+size_t fs::File::position() const
+{
+    return *this ? impl->position : 0;
+}
+
+size_t fs::File::size() const
+{
+    if (!*this || impl->isDirectory)
+    {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(fsMutex);
+    return impl->data->size();
+}
+
+void fs::File::close()
+{
+    if (impl != nullptr)
+    {
+        impl->isOpen = false;
+    }
+}
+
+fs::File::operator bool() const
+{
+    return impl != nullptr && impl->isOpen;
+}
+
+const char *fs::File::path() const
+{
+    return *this ? impl->path.c_str() : nullptr;
+}
+
+const char *fs::File::name() const
+{
+    return *this ? impl->path.c_str() + impl->path.rfind('/') + 1 : nullptr;
+}
+
+bool fs::File::isDirectory() const
+{
+    return *this && impl->isDirectory;
+}
+
+fs::File fs::File::openNextFile(const char *mode)
+{
+    if (!isDirectory())
+    {
+        return File();
+    }
+
+    std::string next;
+    {
+        std::lock_guard<std::mutex> lock(fsMutex);
+        const std::string prefix = impl->path == "/" ? "/" : impl->path + "/";
+        auto isChild = [&](const std::string &path)
+        {
+            return path.size() > prefix.size() && path.compare(0, prefix.size(), prefix) == 0 && path.find('/', prefix.size()) == std::string::npos && path > impl->lastChild;
+        };
+        for (const auto &file : fsFiles)
+        {
+            if (isChild(file.first) && (next.empty() || file.first < next))
+            {
+                next = file.first;
+            }
+        }
+        for (const std::string &directory : fsDirectories)
+        {
+            if (isChild(directory) && (next.empty() || directory < next))
+            {
+                next = directory;
+            }
+        }
+    }
+
+    if (next.empty())
+    {
+        return File();
+    }
+    impl->lastChild = next;
+    return LittleFS.open(next.c_str(), mode);
+}
+
+void fs::File::rewindDirectory()
+{
+    if (*this)
+    {
+        impl->lastChild.clear();
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+/*
+ * Control interface of the host fakes of the Arduino, ESP-IDF and FreeRTOS APIs.
+ *
+ * Time is virtual: millis(), micros() and esp_timer_get_time() only move when
+ * the simulation calls advanceClock(). FreeRTOS tasks run on host threads, and
+ * advanceClock() returns only once every task is blocked again, so a run is
+ * repeatable for a given seed.
+ */
+namespace NativeHAL
+{
+    /*
+     * Clock of a simulated node: it starts offset microseconds away from
+     * virtual time and runs drift parts per million fast or slow.
+     */
+    typedef struct local_clock
+    {
+        int64_t offset;
+        float drift;
+    } local_clock;
+
+    uint64_t now();
+
+    /*
+     * Clock millis(), micros() and esp_timer_get_time() read on the calling
+     * thread, null for virtual time. Tasks and esp_timers created meanwhile
+     * keep it, so a node run in the same process keeps its own time.
+     * Deadlines and ticks stay in virtual time.
+     */
+    void setLocalClock(const local_clock *clock);
+    const local_clock *getLocalClock();
+
+    // Moves virtual time forward, firing due esp_timers and waking delayed tasks.
+    void advanceClock(uint64_t microseconds);
+
+    // Blocks until every task waits on something that cannot happen without the caller.
+    void waitForIdleTasks();
+
+    // Runs the interrupt handler attached to pin, as if it saw an edge.
+    void triggerInterrupt(uint8_t pin);
+
+    // Appends bytes to the receive buffer of a hardware UART.
+    void injectSerial(int uart, const uint8_t *data, size_t len);
+
+    // Called with every byte written to a hardware UART.
+    void setSerialTxHook(int uart, std::function<void(uint8_t)> hook);
+
+    // Baud rate the firmware set on a hardware UART, 0 before begin().
+    unsigned long getSerialBaudRate(int uart);
+
+    // Station MAC address of the firmware node, also its address on the radio bus.
+    void setMacAddress(const uint8_t *mac);
+    void getMacAddress(uint8_t *mac);
+
+    // When false, Serial output of the firmware is discarded.
+    void setConsoleEnabled(bool enabled);
+}
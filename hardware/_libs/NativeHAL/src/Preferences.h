@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "WString.h"
+
+/*
+ * Preferences fake. Namespaces live in memory for the lifetime of the process.
+ */
+class Preferences
+{
+public:
+    bool begin(const char *name, bool readOnly = false, const char *partitionLabel = nullptr);
+    void end();
+
+    bool clear();
+    bool remove(const char *key);
+    bool isKey(const char *key);
+
+    size_t putUChar(const char *key, uint8_t value) { return putBytes(key, &value, sizeof(value)); }
+    size_t putUShort(const char *key, uint16_t value) { return putBytes(key, &value, sizeof(value)); }
+    size_t putUInt(const char *key, uint32_t value) { return putBytes(key, &value, sizeof(value)); }
+    size_t putULong(const char *key, uint32_t value) { return putBytes(key, &value, sizeof(value)); }
+    size_t putInt(const char *key, int32_t value) { return putBytes(key, &value, sizeof(value)); }
+    size_t putFloat(const char *key, float value) { return putBytes(key, &value, sizeof(value)); }
+    size_t putBool(const char *key, bool value) { return putUChar(key, value ? 1 : 0); }
+    size_t putString(const char *key, const String &value) { return putBytes(key, value.c_str(), value.size()); }
+    size_t putBytes(const char *key, const void *value, size_t len);
+
+    uint8_t getUChar(const char *key, uint8_t defaultValue = 0) { return getValue(key, defaultValue); }
+    uint16_t getUShort(const char *key, uint16_t defaultValue = 0) { return getValue(key, defaultValue); }
+    uint32_t getUInt(const char *key, uint32_t defaultValue = 0) { return getValue(key, defaultValue); }
+    uint32_t getULong(const char *key, uint32_t defaultValue = 0) { return getValue(key, defaultValue); }
+    int32_t getInt(const char *key, int32_t defaultValue = 0) { return getValue(key, defaultValue); }
+    float getFloat(const char *key, float defaultValue = 0) { return getValue(key, defaultValue); }
+    bool getBool(const char *key, bool defaultValue = false) { return getUChar(key, defaultValue ? 1 : 0) != 0; }
+    String getString(const char *key, const String &defaultValue = String());
+    size_t getBytesLength(const char *key);
+    size_t getBytes(const char *key, void *buffer, size_t maxLen);
+
+private:
+    std::string name;
+    bool readOnly = false;
+    bool opened = false;
+
+    template <typename T>
+    T getValue(const char *key, T defaultValue)
+    {
+        T value;
+        return getBytesLength(key) == sizeof(T) && getBytes(key, &value, sizeof(T)) == sizeof(T) ? value : defaultValue;
+    }
+};
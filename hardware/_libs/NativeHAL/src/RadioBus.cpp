@@ -0,0 +1,394 @@
+#include "RadioBus.h"
+#include "NativeHAL.h"
+#include <esp_now.h>
+#include <string.h>
+
+static uint64_t toKey(const uint8_t *mac)
+{
+    uint64_t key = 0;
+    for (int i = 0; i < 6; i++)
+    {
+        key = (key << 8) | mac[i];
+    }
+    return key;
+}
+
+static void fromKey(uint64_t key, uint8_t *mac)
+{
+    for (int i = 5; i >= 0; i--)
+    {
+        mac[i] = key & 0xFF;
+        key >>= 8;
+    }
+}
+
+static const uint64_t BROADCAST_KEY = 0xFFFFFFFFFFFFULL;
+
+RadioBus *RadioBus::instance = nullptr;
+
+RadioBus::RadioBus()
+{
+    config.latency = RADIO_BUS_DEFAULT_LATENCY;
+    config.jitter = RADIO_BUS_DEFAULT_JITTER;
+    config.lossRate = 0;
+    config.duplicationRate = 0;
+    config.bitrate = RADIO_BUS_DEFAULT_BITRATE;
+    config.maxPeers = ESP_NOW_MAX_TOTAL_PEER_NUM;
+    config.seed = 1;
+    random.seed(config.seed);
+}
+
+RadioBus *RadioBus::getInstance()
+{
+    if (instance == nullptr)
+    {
+        instance = new RadioBus();
+    }
+    return instance;
+}
+
+void RadioBus::configure(const radio_bus_config &config)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->config = config;
+    random.seed(config.seed);
+}
+
+void RadioBus::attach(const uint8_t *mac, ReceiveHandler onReceive, SendHandler onSent)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const uint64_t key = toKey(mac);
+    for (node &existing : nodes)
+    {
+        if (existing.key == key)
+        {
+            existing.onReceive = onReceive;
+            existing.onSent = onSent;
+            return;
+        }
+    }
+    nodes.push_back({key, onReceive, onSent});
+}
+
+void RadioBus::detach(const uint8_t *mac)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const uint64_t key = toKey(mac);
+    for (auto it = nodes.begin(); it != nodes.end(); ++it)
+    {
+        if (it->key == key)
+        {
+            nodes.erase(it);
+            return;
+        }
+    }
+}
+
+uint32_t RadioBus::getAirtime(size_t len, bool acknowledged)
+{
+    uint64_t airtime = RADIO_BUS_DIFS_TIME + RADIO_BUS_PREAMBLE_TIME + (uint64_t)(RADIO_BUS_FRAME_OVERHEAD + len) * 8 * 1000000 / config.bitrate;
+    if (acknowledged)
+    {
+        airtime += RADIO_BUS_SIFS_TIME + RADIO_BUS_PREAMBLE_TIME + (uint64_t)RADIO_BUS_ACK_SIZE * 8 * 1000000 / config.bitrate;
+    }
+    return airtime;
+}
+
+bool RadioBus::draw(float probability)
+{
+    return probability > 0 && std::uniform_real_distribution<float>(0, 1)(random) < probability;
+}
+
+void RadioBus::send(const uint8_t *from, const uint8_t *to, const uint8_t *data, size_t len)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const uint64_t fromKey = toKey(from);
+    const uint64_t toKey = ::toKey(to);
+    const bool isBroadcast = toKey == BROADCAST_KEY;
+    const uint32_t airtime = getAirtime(len, !isBroadcast);
+
+    // The channel carries one frame at a time.
+    const uint64_t start = std::max(NativeHAL::now(), channelFreeTime);
+    channelFreeTime = start + airtime;
+
+    stats.framesSent++;
+    stats.bytesSent += len;
+    stats.airtime += airtime;
+
+    bool reported = false;
+    for (const node &receiver : nodes)
+    {
+        if (receiver.key == fromKey || (!isBroadcast && receiver.key != toKey))
+        {
+            continue;
+        }
+
+        in_flight_frame frame;
+        frame.arrival = channelFreeTime + config.latency + (config.jitter > 0 ? random() % config.jitter : 0);
+        frame.order = sendOrder++;
+        frame.from = fromKey;
+        frame.to = receiver.key;
+        frame.delivered = !draw(config.lossRate);
+        frame.reportsStatus = !isBroadcast;
+        frame.data.assign(data, data + len);
+
+        if (frame.delivered && draw(config.duplicationRate))
+        {
+            in_flight_frame duplicate = frame;
+            duplicate.arrival += airtime;
+            duplicate.order = sendOrder++;
+            frame.reportsStatus = false;
+            inFlight.push(duplicate);
+            stats.framesDuplicated++;
+        }
+
+        inFlight.push(frame);
+        reported = reported || !isBroadcast;
+    }
+
+    // A unicast to an absent node or a broadcast still completes for the sender.
+    if (!reported)
+    {
+        in_flight_frame status;
+        status.arrival = channelFreeTime;
+        status.order = sendOrder++;
+        status.from = fromKey;
+        status.to = isBroadcast ? BROADCAST_KEY : toKey;
+        status.delivered = isBroadcast;
+        status.reportsStatus = true;
+        inFlight.push(status);
+    }
+}
+
+uint64_t RadioBus::getNextDeliveryTime()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return inFlight.empty() ? UINT64_MAX : inFlight.top().arrival;
+}
+
+void RadioBus::deliver(uint64_t now)
+{
+    while (true)
+    {
+        in_flight_frame frame;
+        ReceiveHandler onReceive;
+        SendHandler onSent;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (inFlight.empty() || inFlight.top().arrival > now)
+            {
+                return;
+            }
+
+            frame = inFlight.top();
+            inFlight.pop();
+
+            for (const node &candidate : nodes)
+            {
+                if (candidate.key == frame.to && !frame.data.empty())
+                {
+                    onReceive = candidate.onReceive;
+                }
+                if (candidate.key == frame.from && frame.reportsStatus)
+                {
+                    onSent = candidate.onSent;
+                }
+            }
+
+            if (!frame.data.empty())
+            {
+                if (frame.delivered && onReceive)
+                {
+                    stats.framesDelivered++;
+                }
+                else
+                {
+                    stats.framesLost++;
+                }
+            }
+        }
+
+        uint8_t mac[6];
+        if (frame.delivered && onReceive)
+        {
+            fromKey(frame.from, mac);
+            onReceive(mac, frame.data.data(), frame.data.size());
+        }
+
+        if (onSent)
+        {
+            fromKey(frame.to, mac);
+            onSent(mac, frame.delivered && (onReceive != nullptr || frame.to == BROADCAST_KEY));
+        }
+    }
+}
+
+radio_bus_stats RadioBus::getStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void RadioBus::resetStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    stats = {};
+}
+
+/*
+ * esp_now on behalf of the firmware node.
+ */
+
+static std::mutex espNowMutex;
+static bool espNowInitialized = false;
+static esp_now_recv_cb_t espNowReceiveCallback = nullptr;
+static esp_now_send_cb_t espNowSendCallback = nullptr;
+static std::vector<uint64_t> espNowPeers;
+
+static void attachFirmwareNode()
+{
+    uint8_t mac[6];
+    NativeHAL::getMacAddress(mac);
+
+    RadioBus::getInstance()->attach(
+        mac,
+        [](const uint8_t *mac, const uint8_t *data, int len)
+        {
+            esp_now_recv_cb_t callback = espNowReceiveCallback;
+            if (callback != nullptr)
+            {
+                callback(mac, data, len);
+            }
+        },
+        [](const uint8_t *mac, bool delivered)
+        {
+            esp_now_send_cb_t callback = espNowSendCallback;
+            if (callback != nullptr)
+            {
+                callback(mac, delivered ? ESP_NOW_SEND_SUCCESS : ESP_NOW_SEND_FAIL);
+            }
+        });
+}
+
+esp_err_t esp_now_init()
+{
+    std::lock_guard<std::mutex> lock(espNowMutex);
+    espNowInitialized = true;
+    attachFirmwareNode();
+    return ESP_OK;
+}
+
+esp_err_t esp_now_deinit()
+{
+    std::lock_guard<std::mutex> lock(espNowMutex);
+    espNowInitialized = false;
+    espNowPeers.clear();
+
+    uint8_t mac[6];
+    NativeHAL::getMacAddress(mac);
+    RadioBus::getInstance()->detach(mac);
+    return ESP_OK;
+}
+
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb)
+{
+    espNowReceiveCallback = cb;
+    return espNowInitialized ? ESP_OK : ESP_ERR_ESPNOW_NOT_INIT;
+}
+
+esp_err_t esp_now_unregister_recv_cb()
+{
+    espNowReceiveCallback = nullptr;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb)
+{
+    espNowSendCallback = cb;
+    return espNowInitialized ? ESP_OK : ESP_ERR_ESPNOW_NOT_INIT;
+}
+
+esp_err_t esp_now_unregister_send_cb()
+{
+    espNowSendCallback = nullptr;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer)
+{
+    std::lock_guard<std::mutex> lock(espNowMutex);
+    if (!espNowInitialized)
+    {
+        return ESP_ERR_ESPNOW_NOT_INIT;
+    }
+
+    const uint64_t key = toKey(peer->peer_addr);
+    for (uint64_t existing : espNowPeers)
+    {
+        if (existing == key)
+        {
+            return ESP_ERR_ESPNOW_EXIST;
+        }
+    }
+
+    if (espNowPeers.size() >= RadioBus::getInstance()->getConfig().maxPeers)
+    {
+        return ESP_ERR_ESPNOW_FULL;
+    }
+
+    espNowPeers.push_back(key);
+    return ESP_OK;
+}
+
+esp_err_t esp_now_del_peer(const uint8_t *peer_addr)
+{
+    std::lock_guard<std::mutex> lock(espNowMutex);
+    const uint64_t key = toKey(peer_addr);
+    for (auto it = espNowPeers.begin(); it != espNowPeers.end(); ++it)
+    {
+        if (*it == key)
+        {
+            espNowPeers.erase(it);
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_ESPNOW_NOT_FOUND;
+}
+
+bool esp_now_is_peer_exist(const uint8_t *peer_addr)
+{
+    std::lock_guard<std::mutex> lock(espNowMutex);
+    const uint64_t key = toKey(peer_addr);
+    for (uint64_t existing : espNowPeers)
+    {
+        if (existing == key)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+esp_err_t esp_now_send(const uint8_t *peer_addr, const uint8_t *data, size_t len)
+{
+    if (len == 0 || len > ESP_NOW_MAX_DATA_LEN)
+    {
+        return ESP_ERR_ESPNOW_ARG;
+    }
+
+    if (!espNowInitialized)
+    {
+        return ESP_ERR_ESPNOW_NOT_INIT;
+    }
+
+    if (!esp_now_is_peer_exist(peer_addr))
+    {
+        return ESP_ERR_ESPNOW_NOT_FOUND;
+    }
+
+    uint8_t mac[6];
+    NativeHAL::getMacAddress(mac);
+    RadioBus::getInstance()->send(mac, peer_addr, data, len);
+    return ESP_OK;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <vector>
+
+#define RADIO_BUS_DEFAULT_BITRATE 1000000
+#define RADIO_BUS_DEFAULT_LATENCY 500
+#define RADIO_BUS_DEFAULT_JITTER 200
+
+// 802.11 MAC header, ESP-NOW vendor action fields and FCS around the payload.
+#define RADIO_BUS_FRAME_OVERHEAD 39
+#define RADIO_BUS_ACK_SIZE 14
+#define RADIO_BUS_PREAMBLE_TIME 192
+#define RADIO_BUS_DIFS_TIME 50
+#define RADIO_BUS_SIFS_TIME 10
+
+typedef struct radio_bus_config
+{
+    // Driver and stack delay added after the airtime, in microseconds, plus a
+    // uniformly distributed jitter.
+    uint32_t latency;
+    uint32_t jitter;
+    // Probability that a receiver misses a frame, after the MAC-level retries.
+    float lossRate;
+    // Probability that a receiver gets a frame twice.
+    float duplicationRate;
+    uint32_t bitrate;
+    // Peers a node can register, ESP_NOW_MAX_TOTAL_PEER_NUM on real hardware.
+    uint8_t maxPeers;
+    uint32_t seed;
+} radio_bus_config;
+
+typedef struct radio_bus_stats
+{
+    uint32_t framesSent;
+    uint32_t framesDelivered;
+    uint32_t framesLost;
+    uint32_t framesDuplicated;
+    uint64_t bytesSent;
+    // Time the channel was busy, in microseconds.
+    uint64_t airtime;
+} radio_bus_stats;
+
+/*
+ * Shared ESP-NOW channel between the firmware under test and simulated nodes.
+ *
+ * Frames occupy the channel for their airtime one after the other, then reach
+ * each receiver after the configured latency unless lost. Delivery happens from
+ * NativeHAL::advanceClock() when virtual time reaches the arrival time.
+ */
+class RadioBus
+{
+public:
+    typedef std::function<void(const uint8_t *mac, const uint8_t *data, int len)> ReceiveHandler;
+    typedef std::function<void(const uint8_t *mac, bool delivered)> SendHandler;
+
+    static RadioBus *getInstance();
+
+    void configure(const radio_bus_config &config);
+    const radio_bus_config &getConfig() { return config; }
+
+    void attach(const uint8_t *mac, ReceiveHandler onReceive, SendHandler onSent = nullptr);
+    void detach(const uint8_t *mac);
+
+    /*
+     * Queues a frame from the node at from. A broadcast address reaches every
+     * other attached node. The send handler of the sender is called once the
+     * frame is delivered or lost.
+     */
+    void send(const uint8_t *from, const uint8_t *to, const uint8_t *data, size_t len);
+
+    uint64_t getNextDeliveryTime();
+    void deliver(uint64_t now);
+
+    radio_bus_stats getStats();
+    void resetStats();
+
+    // Time a frame of len bytes occupies the channel, with its acknowledgement if unicast (us).
+    uint32_t getAirtime(size_t len, bool acknowledged);
+
+private:
+    RadioBus();
+
+    static RadioBus *instance;
+
+    typedef struct node
+    {
+        uint64_t key;
+        ReceiveHandler onReceive;
+        SendHandler onSent;
+    } node;
+
+    typedef struct in_flight_frame
+    {
+        uint64_t arrival;
+        uint32_t order;
+        uint64_t from;
+        uint64_t to;
+        // Only the last copy of a frame reports the send status.
+        bool reportsStatus;
+        bool delivered;
+        std::vector<uint8_t> data;
+
+        bool operator>(const in_flight_frame &other) const
+        {
+            return arrival != other.arrival ? arrival > other.arrival : order > other.order;
+        }
+    } in_flight_frame;
+
+    std::mutex mutex;
+    radio_bus_config config;
+    radio_bus_stats stats = {};
+    std::mt19937 random;
+    std::vector<node> nodes;
+    std::priority_queue<in_flight_frame, std::vector<in_flight_frame>, std::greater<in_flight_frame>> inFlight;
+    uint32_t sendOrder = 0;
+    uint64_t channelFreeTime = 0;
+
+    bool draw(float probability);
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string>
+
+/*
+ * Arduino String on top of std::string, covering the subset the firmware uses.
+ */
+class String : public std::string
+{
+public:
+    String() {}
+    String(const char *value) : std::string(value != nullptr ? value : "") {}
+    String(const std::string &value) : std::string(value) {}
+    String(char value) : std::string(1, value) {}
+    String(int value) : std::string(std::to_string(value)) {}
+    String(unsigned int value) : std::string(std::to_string(value)) {}
+    String(long value) : std::string(std::to_string(value)) {}
+    String(unsigned long value) : std::string(std::to_string(value)) {}
+    String(float value) : std::string(std::to_string(value)) {}
+    String(double value) : std::string(std::to_string(value)) {}
+
+    unsigned int length() const { return size(); }
+    long toInt() const { return atol(c_str()); }
+    float toFloat() const { return atof(c_str()); }
+
+    int indexOf(char value, unsigned int from = 0) const
+    {
+        size_t position = find(value, from);
+        return position == npos ? -1 : (int)position;
+    }
+
+    String substring(unsigned int from) const { return String(substr(from)); }
+    String substring(unsigned int from, unsigned int to) const { return String(substr(from, to - from)); }
+
+    bool concat(const char *value, unsigned int len)
+    {
+        append(value, len);
+        return true;
+    }
+    bool concat(const char *value)
+    {
+        append(value);
+        return true;
+    }
+    bool concat(char value)
+    {
+        push_back(value);
+        return true;
+    }
+};
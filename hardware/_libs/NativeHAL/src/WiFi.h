@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include "WString.h"
+#include "esp_wifi.h"
+
+typedef enum
+{
+    WIFI_OFF = 0,
+    WIFI_STA = 1,
+    WIFI_AP = 2,
+    WIFI_AP_STA = 3
+} wifi_mode_t;
+
+class IPAddress
+{
+public:
+    IPAddress() {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : octets{a, b, c, d} {}
+
+private:
+    uint8_t octets[4] = {0, 0, 0, 0};
+};
+
+/*
+ * WiFi fake. The station MAC address is the node address on the radio bus.
+ */
+class WiFiClass
+{
+public:
+    bool mode(wifi_mode_t mode)
+    {
+        this->currentMode = mode;
+        return true;
+    }
+    wifi_mode_t getMode() { return currentMode; }
+
+    bool softAP(const char *ssid, const char *password = nullptr, int channel = 1, int hidden = 0, int maxConnections = 4) { return true; }
+    bool softAPConfig(IPAddress localIp, IPAddress gateway, IPAddress subnet) { return true; }
+    bool disconnect(bool wifiOff = false) { return true; }
+
+    uint8_t *macAddress(uint8_t *mac);
+    String macAddress();
+
+private:
+    wifi_mode_t currentMode = WIFI_OFF;
+};
+
+extern WiFiClass WiFi;
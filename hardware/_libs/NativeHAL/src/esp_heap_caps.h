@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_DEFAULT (1 << 12)
+
+/*
+ * heap_caps fake. The host heap has no meaningful size, so it reports the
+ * free DRAM of an idle ESP32 and never runs low.
+ */
+#define NATIVE_HEAP_FREE_SIZE 200000
+
+inline size_t heap_caps_get_free_size(uint32_t caps) { return NATIVE_HEAP_FREE_SIZE; }
+inline size_t heap_caps_get_minimum_free_size(uint32_t caps) { return NATIVE_HEAP_FREE_SIZE; }
+inline size_t heap_caps_get_largest_free_block(uint32_t caps) { return NATIVE_HEAP_FREE_SIZE; }
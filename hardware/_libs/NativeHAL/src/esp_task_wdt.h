@@ -0,0 +1,5 @@
+#pragma once
+
+#include "esp_err.h"
+
+inline esp_err_t esp_task_wdt_reset() { return ESP_OK; }
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef enum
+{
+    WIFI_IF_STA = 0,
+    WIFI_IF_AP
+} wifi_interface_t;
+
+typedef enum
+{
+    WIFI_PS_NONE,
+    WIFI_PS_MIN_MODEM,
+    WIFI_PS_MAX_MODEM
+} wifi_ps_type_t;
+
+typedef enum
+{
+    WIFI_SECOND_CHAN_NONE = 0,
+    WIFI_SECOND_CHAN_ABOVE,
+    WIFI_SECOND_CHAN_BELOW
+} wifi_second_chan_t;
+
+inline esp_err_t esp_wifi_set_ps(wifi_ps_type_t) { return ESP_OK; }
+inline esp_err_t esp_wifi_set_channel(uint8_t, wifi_second_chan_t) { return ESP_OK; }
+esp_err_t esp_wifi_get_mac(wifi_interface_t interface, uint8_t mac[6]);
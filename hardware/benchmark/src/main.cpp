@@ -0,0 +1,1265 @@
+#include <ArduinoJson.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+#include <FlowmeterFrame.h>
+#include <NativeHAL.h>
+#include <RadioBus.h>
+#include "Flowmeter.h"
+#include "GPSReceiver.h"
+#include "MainModule.h"
+#include "SecondaryModule.h"
+#include "DataResponse.h"
+
+/*
+ * Host benchmarks of the firmware hot paths.
+ *
+ * Usage: benchmark [--duration=ms] [--filter=prefix] [--json]
+ *
+ * Every benchmark runs for duration of wall time and reports the time and
+ * the heap allocations per operation. --filter runs only the benchmarks
+ * whose name starts with prefix. --json prints the results as a single JSON
+ * object instead of a table, to compare firmware revisions.
+ *
+ * Flowmeter: the pulse interrupt handler, then getPulseCount() and
+ * getFlowRate() once per acquisition interval of pulses, at 10 to 1000 Hz
+ * (the size). The handler does the same work whatever the rate, it is timed
+ * with the clock still. flowmeter/channel is one second of a channel at that
+ * rate, every pulse and a getPulseCount() per acquisition interval, for the
+ * ring and for the realloc list it replaced (kept below as the reference).
+ * Its rate is the pulses per second a channel could sustain if that was all
+ * the CPU did.
+ *
+ * Secondary data response: SecondaryModule answering a data request for a
+ * sample it did not latch, reading every flowmeter and encoding the frame,
+ * for secondaries of 9 and 32 flowmeters (the size) pulsing at 50 Hz. The
+ * module runs on a manager off the driver that keeps the frame unsent.
+ *
+ * ESP-NOW send: ESPNowManager::sendBuffer() with a header and a payload,
+ * for frames of 16, 128 and ESP_NOW_MAX_DATA_LEN bytes (the size), on a
+ * manager off the driver that keeps the frames unsent. Checked to send every
+ * frame without a heap allocation.
+ *
+ * Main module data responses: MainModule::onDataResponseReceived() for the
+ * response of every secondary of a cycle, then the loop() that settles the
+ * cycle and publishes the snapshot, for booms of 18, 72 and 180 nozzles (the
+ * size) on secondaries of 9. The secondaries are nodes of the NativeHAL radio
+ * bus, every cycle is checked to publish with all of them fresh.
+ * main_module/map_responses is the same cycle through the string-keyed
+ * maps the slot table replaced (kept below as the reference).
+ *
+ * Data response: the /data body written by DataResponse against the
+ * JsonDocument it replaced (kept below as the reference), for booms of 18, 54
+ * and 180 nozzles on secondaries of 9. Both are checked to carry the same
+ * values before being timed.
+ *
+ * GPS: GPSReceiver (TinyGPS++) parsing the RMC and GGA sentences of one
+ * receiver epoch.
+ *
+ * Benchmarks that need a fresh state before every operation (pulses to
+ * expire, a cycle to answer) set it up untimed and time each operation on
+ * its own, less the cost of reading the clock.
+ */
+
+#define DEFAULT_BENCHMARK_DURATION 500
+#define BENCHMARK_FLOWMETERS_PER_SECONDARY 9
+// Count window of the flowmeters, as on the secondaries.
+#define BENCHMARK_REFRESH_RATE 5000
+#define BENCHMARK_PULSE_FREQUENCY 50
+// Pins only identify the interrupt handlers on the host.
+#define BENCHMARK_FIRST_FLOWMETER_PIN 100
+#define BENCHMARK_PAIRING_TIMEOUT 1000
+
+/*
+ * Heap allocations since start, counting every operator new and, through
+ * CountingAllocator, the pools of the JsonDocuments.
+ */
+static std::atomic<uint64_t> allocationCount{0};
+
+/*
+ * Every form of new and delete is replaced and kept out of line, so GCC
+ * never pairs an inlined malloc() with a library delete and warns.
+ */
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    void *pointer = malloc(size);
+    if (pointer == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+__attribute__((noinline)) void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void *pointer) noexcept
+{
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void *pointer, size_t) noexcept
+{
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete[](void *pointer) noexcept
+{
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete[](void *pointer, size_t) noexcept
+{
+    free(pointer);
+}
+
+class CountingAllocator : public ArduinoJson::Allocator
+{
+public:
+    void *allocate(size_t size) override
+    {
+        allocationCount.fetch_add(1, std::memory_order_relaxed);
+        return malloc(size);
+    }
+
+    void deallocate(void *pointer) override
+    {
+        free(pointer);
+    }
+
+    void *reallocate(void *pointer, size_t newSize) override
+    {
+        allocationCount.fetch_add(1, std::memory_order_relaxed);
+        return realloc(pointer, newSize);
+    }
+};
+
+static CountingAllocator countingAllocator;
+
+typedef struct benchmark_result
+{
+    uint64_t operations;
+    double nanosecondsPerOperation;
+    double allocationsPerOperation;
+    size_t bytesPerOperation;
+} benchmark_result;
+
+typedef struct benchmark_record
+{
+    std::string name;
+    uint16_t size;
+    benchmark_result result;
+    // Units of rateUnit per operation, for the benchmarks that report a rate, 0 otherwise.
+    double unitsPerOperation;
+    const char *rateUnit;
+} benchmark_record;
+
+static std::string filter;
+static bool isJsonOutput = false;
+static std::vector<benchmark_record> records;
+
+// Keeps the compiler from dropping the results nothing else reads.
+static volatile uint32_t sink;
+
+// Whether --filter selects the benchmark named name, or some of the group named name.
+static bool isSelected(const char *name)
+{
+    return strncmp(name, filter.c_str(), filter.size()) == 0 || strncmp(filter.c_str(), name, strlen(name)) == 0;
+}
+
+/*
+ * Runs operation until duration (ms of wall time) elapsed. It returns the
+ * bytes it produced, the last value is reported.
+ */
+static benchmark_result runBenchmark(unsigned long duration, const std::function<size_t()> &operation)
+{
+    // Once untimed, so first use allocations do not count.
+    size_t bytes = operation();
+
+    const uint64_t allocationsStart = allocationCount.load();
+    const auto start = std::chrono::steady_clock::now();
+    const auto end = start + std::chrono::milliseconds(duration);
+
+    uint64_t operations = 0;
+    auto now = start;
+    while (now < end)
+    {
+        // Checking the clock costs about as much as a small operation, so in batches.
+        for (uint8_t i = 0; i < 16; i++)
+        {
+            bytes = operation();
+        }
+        operations += 16;
+        now = std::chrono::steady_clock::now();
+    }
+
+    benchmark_result result;
+    result.operations = operations;
+    result.nanosecondsPerOperation = std::chrono::duration<double, std::nano>(now - start).count() / operations;
+    result.allocationsPerOperation = (double)(allocationCount.load() - allocationsStart) / operations;
+    result.bytesPerOperation = bytes;
+    return result;
+}
+
+// Mean time between two reads of the clock (ns), taken out of every operation timed on its own.
+static double getClockOverhead()
+{
+    static double overhead = -1;
+    if (overhead < 0)
+    {
+        const uint32_t count = 100000;
+        const auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < count; i++)
+        {
+            std::chrono::steady_clock::now();
+        }
+        overhead = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+    }
+    return overhead;
+}
+
+/*
+ * Same, with prepare run untimed before every operation. Each operation is
+ * timed on its own, so the duration includes the time spent preparing.
+ */
+static benchmark_result runBenchmark(unsigned long duration, const std::function<void()> &prepare, const std::function<size_t()> &operation)
+{
+    const double clockOverhead = getClockOverhead();
+
+    prepare();
+    size_t bytes = operation();
+
+    const auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(duration);
+
+    uint64_t operations = 0;
+    uint64_t allocations = 0;
+    double nanoseconds = 0;
+    do
+    {
+        prepare();
+
+        const uint64_t allocationsStart = allocationCount.load();
+        const auto start = std::chrono::steady_clock::now();
+        bytes = operation();
+        const auto stop = std::chrono::steady_clock::now();
+
+        allocations += allocationCount.load() - allocationsStart;
+        nanoseconds += std::chrono::duration<double, std::nano>(stop - start).count() - clockOverhead;
+        operations++;
+    } while (std::chrono::steady_clock::now() < end);
+
+    benchmark_result result;
+    result.operations = operations;
+    result.nanosecondsPerOperation = std::max(nanoseconds / operations, 0.0);
+    result.allocationsPerOperation = (double)allocations / operations;
+    result.bytesPerOperation = bytes;
+    return result;
+}
+
+/*
+ * Reports a result, with the rate of rateUnit it comes to when the operation
+ * handles unitsPerOperation of them.
+ */
+static void reportResult(const char *name, uint16_t size, const benchmark_result &result, double unitsPerOperation = 0, const char *rateUnit = nullptr)
+{
+    if (isJsonOutput)
+    {
+        records.push_back({name, size, result, unitsPerOperation, rateUnit});
+        return;
+    }
+
+    printf("%-28s %5u %10.0f ns/op %8.1f MB/s %8.1f allocs/op %7zu bytes/op",
+           name, size, result.nanosecondsPerOperation,
+           result.bytesPerOperation * 1000.0 / result.nanosecondsPerOperation,
+           result.allocationsPerOperation, result.bytesPerOperation);
+    if (unitsPerOperation > 0)
+    {
+        printf(" %12.0f %s/s", unitsPerOperation * 1e9 / result.nanosecondsPerOperation, rateUnit);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+// Names are written as is, they never need escaping.
+static void printJsonResults(unsigned long duration)
+{
+    printf("{\"duration\":%lu,\"benchmarks\":[", duration);
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const benchmark_result &result = records[i].result;
+        printf("%s\n{\"name\":\"%s\",\"size\":%u,\"operations\":%llu,\"nsPerOp\":%.1f,\"allocsPerOp\":%.2f,\"bytesPerOp\":%zu",
+               i > 0 ? "," : "", records[i].name.c_str(), records[i].size, (unsigned long long)result.operations,
+               result.nanosecondsPerOperation, result.allocationsPerOperation, result.bytesPerOperation);
+        if (records[i].unitsPerOperation > 0)
+        {
+            printf(",\"rate\":%.0f,\"rateUnit\":\"%s/s\"", records[i].unitsPerOperation * 1e9 / result.nanosecondsPerOperation, records[i].rateUnit);
+        }
+        printf("}");
+    }
+    printf("\n]}\n");
+}
+
+// Application rate in L/ha, null when it is unknown.
+static void setApplicationRate(JsonVariant variant, uint32_t applicationRate)
+{
+    if (applicationRate == APPLICATION_RATE_UNKNOWN)
+    {
+        variant.set(nullptr);
+    }
+    else
+    {
+        variant.set(applicationRate / 1000.0f);
+    }
+}
+
+/*
+ * The /data serialization before DataResponse: a JsonDocument serialized into
+ * a String, which the response then copied.
+ */
+static void serializeWithDocument(const flowmeters_snapshot *snapshot, const gps_fix &fix, unsigned long now, String &response)
+{
+    JsonDocument doc(&countingAllocator);
+    JsonArray flowmeters = doc["flowmetersPulseCount"].to<JsonArray>();
+    JsonArray ages = doc["flowmetersLastPulseAge"].to<JsonArray>();
+    JsonArray rates = doc["flowmetersRate"].to<JsonArray>();
+    JsonArray rateConfidences = doc["flowmetersRateConfidence"].to<JsonArray>();
+    JsonArray states = doc["flowmetersState"].to<JsonArray>();
+    JsonArray flows = doc["flowmetersFlow"].to<JsonArray>();
+    JsonArray applicationRates = doc["flowmetersApplicationRate"].to<JsonArray>();
+    JsonArray volumes = doc["flowmetersVolume"].to<JsonArray>();
+    for (int i = 0; i < snapshot->data.flowmeterCount; i++)
+    {
+        flowmeters.add(snapshot->data.flowmetersPulseCount[i]);
+        ages.add(snapshot->data.flowmetersLastPulseAge[i]);
+        rates.add(snapshot->data.flowmetersRate[i] * 60 / 1000.0f);
+        rateConfidences.add(snapshot->data.flowmetersRateConfidence[i] * 100 / 255);
+        states.add(snapshot->flowmetersState[i]);
+        flows.add(snapshot->flowmetersFlow[i] * 60 / 1000000.0f);
+        setApplicationRate(applicationRates.add<JsonVariant>(), snapshot->flowmetersApplicationRate[i]);
+        volumes.add(snapshot->flowmetersVolume[i] / 1000.0f);
+    }
+
+    JsonArray sectionFlows = doc["secondaryModulesFlow"].to<JsonArray>();
+    JsonArray sectionApplicationRates = doc["secondaryModulesApplicationRate"].to<JsonArray>();
+    JsonArray sectionVolumes = doc["secondaryModulesVolume"].to<JsonArray>();
+    for (uint8_t i = 0; i < snapshot->slavesCount; i++)
+    {
+        sectionFlows.add(snapshot->slavesApplication[i].flow * 60 / 1000000.0f);
+        setApplicationRate(sectionApplicationRates.add<JsonVariant>(), snapshot->slavesApplication[i].applicationRate);
+        sectionVolumes.add(snapshot->slavesApplication[i].volume / 1000.0);
+    }
+    doc["boomFlow"] = snapshot->boomApplication.flow * 60 / 1000000.0f;
+    setApplicationRate(doc["boomApplicationRate"].to<JsonVariant>(), snapshot->boomApplication.applicationRate);
+    doc["boomVolume"] = snapshot->boomApplication.volume / 1000.0;
+
+    doc["version"] = snapshot->version;
+    doc["age"] = now - snapshot->timestamp;
+
+    JsonArray staleSecondaryModules = doc["staleSecondaryModules"].to<JsonArray>();
+    JsonArray unlatchedSecondaryModules = doc["unlatchedSecondaryModules"].to<JsonArray>();
+    JsonArray degradedSecondaryModules = doc["degradedSecondaryModules"].to<JsonArray>();
+    int32_t minSampleDelay = INT32_MAX;
+    int32_t maxSampleDelay = INT32_MIN;
+    for (uint8_t i = 0; i < snapshot->slavesCount; i++)
+    {
+        if (snapshot->slavesDegraded[i])
+        {
+            degradedSecondaryModules.add(i);
+        }
+
+        if (!snapshot->isSlaveFresh(i))
+        {
+            staleSecondaryModules.add(i);
+            continue;
+        }
+
+        if (!snapshot->slavesSampleLatched[i])
+        {
+            unlatchedSecondaryModules.add(i);
+        }
+        if (snapshot->slavesSampleDelay[i] != SAMPLE_DELAY_UNKNOWN)
+        {
+            minSampleDelay = std::min(minSampleDelay, snapshot->slavesSampleDelay[i]);
+            maxSampleDelay = std::max(maxSampleDelay, snapshot->slavesSampleDelay[i]);
+        }
+    }
+
+    doc["sampleTime"] = snapshot->sampleTime / 1000;
+    doc["sampleSpread"] = maxSampleDelay >= minSampleDelay ? maxSampleDelay - minSampleDelay : 0;
+
+    doc["speed"] = fix.speed;
+    doc["satelliteCount"] = fix.satelliteCount;
+    doc["latitude"] = fix.latitude;
+    doc["longitude"] = fix.longitude;
+    if (fix.timestamp != 0)
+    {
+        doc["gpsAge"] = now - fix.timestamp;
+    }
+    else
+    {
+        doc["gpsAge"] = nullptr;
+    }
+
+    serializeJson(doc, response);
+}
+
+/*
+ * A boom in the middle of a job: every nozzle spraying around 1.2 L/min with
+ * some spread, one stale slave and one that sampled late.
+ */
+static void fillSnapshot(flowmeters_snapshot &snapshot, uint16_t flowmeterCount)
+{
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.data.flowmetersPulseCount = snapshot.flowmetersPulseCount;
+    snapshot.data.flowmetersLastPulseAge = snapshot.flowmetersLastPulseAge;
+    snapshot.data.flowmetersRate = snapshot.flowmetersRate;
+    snapshot.data.flowmetersRateConfidence = snapshot.flowmetersRateConfidence;
+    snapshot.data.flowmeterCount = flowmeterCount;
+
+    snapshot.version = 5321;
+    snapshot.requestTimestamp = 3600000;
+    snapshot.timestamp = 3600020;
+    snapshot.sampleId = 3600;
+    snapshot.sampleTime = 3600000123;
+    snapshot.speed = 2500;
+
+    snapshot.slavesCount = (flowmeterCount + BENCHMARK_FLOWMETERS_PER_SECONDARY - 1) / BENCHMARK_FLOWMETERS_PER_SECONDARY;
+    for (uint8_t i = 0; i < snapshot.slavesCount; i++)
+    {
+        snapshot.slavesLastResponseTimestamp[i] = i == 1 ? 3590000 : 3600010;
+        snapshot.slavesFlowmeterOffset[i] = i * BENCHMARK_FLOWMETERS_PER_SECONDARY;
+        snapshot.slavesFlowmeterCount[i] = BENCHMARK_FLOWMETERS_PER_SECONDARY;
+        snapshot.slavesSampleDelay[i] = 150 + i * 3;
+        snapshot.slavesSampleLatched[i] = i != 2;
+        snapshot.slavesApplication[i].flow = 180000 + i * 17;
+        snapshot.slavesApplication[i].applicationRate = 198312 + i;
+        snapshot.slavesApplication[i].volume = 210370 + i * 1001;
+    }
+    snapshot.boomApplication.flow = 180000 * snapshot.slavesCount;
+    snapshot.boomApplication.applicationRate = 198345;
+    snapshot.boomApplication.volume = 210370ULL * snapshot.slavesCount;
+
+    for (uint16_t i = 0; i < flowmeterCount; i++)
+    {
+        snapshot.flowmetersPulseCount[i] = (flowmeter_data_t)(12000 + i * 37);
+        snapshot.flowmetersLastPulseAge[i] = 20 + i % 7;
+        snapshot.flowmetersRate[i] = 20000 + i * 13;
+        snapshot.flowmetersRateConfidence[i] = 255 - i % 40;
+        snapshot.flowmetersState[i] = i % 50 == 7 ? NOZZLE_STATE_CLOGGED : NOZZLE_STATE_OK;
+        snapshot.flowmetersFlow[i] = 20000 + i * 11;
+        snapshot.flowmetersApplicationRate[i] = i % 60 == 3 ? APPLICATION_RATE_UNKNOWN : 198000 + i * 7;
+        snapshot.flowmetersVolume[i] = 23374 + i * 5;
+    }
+}
+
+// Whether two parsed bodies have the same members with the same values, up to the float precision of the reference.
+static bool isSameValue(JsonVariantConst expected, JsonVariantConst actual)
+{
+    if (expected.is<JsonObjectConst>())
+    {
+        JsonObjectConst expectedObject = expected.as<JsonObjectConst>();
+        if (!actual.is<JsonObjectConst>() || expectedObject.size() != actual.as<JsonObjectConst>().size())
+        {
+            return false;
+        }
+        for (JsonPairConst member : expectedObject)
+        {
+            if (!isSameValue(member.value(), actual[member.key()]))
+            {
+                fprintf(stderr, "  %s differs\n", member.key().c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+    if (expected.is<JsonArrayConst>())
+    {
+        JsonArrayConst expectedArray = expected.as<JsonArrayConst>();
+        if (!actual.is<JsonArrayConst>() || expectedArray.size() != actual.as<JsonArrayConst>().size())
+        {
+            return false;
+        }
+        for (size_t i = 0; i < expectedArray.size(); i++)
+        {
+            if (!isSameValue(expectedArray[i], actual[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (expected.isNull())
+    {
+        return actual.isNull();
+    }
+    const double expectedNumber = expected.as<double>();
+    return fabs(expectedNumber - actual.as<double>()) <= std::max(1e-6, fabs(expectedNumber) * 1e-6);
+}
+
+static bool benchmarkDataResponse(unsigned long duration)
+{
+    static flowmeters_snapshot snapshot;
+
+    gps_fix fix = {};
+    fix.timestamp = 3599950;
+    fix.isValid = true;
+    fix.latitude = -22.7253124;
+    fix.longitude = -47.6492311;
+    fix.speed = 2.5f;
+    fix.satelliteCount = 11;
+    const unsigned long now = 3600100;
+
+    bool isSame = true;
+    for (uint16_t flowmeterCount : {18, 54, 180})
+    {
+        fillSnapshot(snapshot, flowmeterCount);
+
+        String reference;
+        serializeWithDocument(&snapshot, fix, now, reference);
+        std::shared_ptr<std::vector<uint8_t>> body = DataResponse::serialize(&snapshot, fix, now);
+
+        JsonDocument expected;
+        JsonDocument actual;
+        deserializeJson(expected, reference.c_str());
+        deserializeJson(actual, reinterpret_cast<const char *>(body->data()), body->size());
+        if (!isSameValue(expected.as<JsonVariantConst>(), actual.as<JsonVariantConst>()))
+        {
+            fprintf(stderr, "data response: %u nozzles, DataResponse and JsonDocument disagree\n", flowmeterCount);
+            isSame = false;
+        }
+
+        if (isSelected("data_response/document"))
+        {
+            reportResult("data_response/document", flowmeterCount, runBenchmark(duration, [&]
+                                                                               {
+                String response;
+                serializeWithDocument(&snapshot, fix, now, response);
+                // What AsyncBasicResponse kept of it.
+                String content(response);
+                return content.length(); }));
+        }
+
+        if (isSelected("data_response/writer"))
+        {
+            reportResult("data_response/writer", flowmeterCount, runBenchmark(duration, [&]
+                                                                             { return DataResponse::serialize(&snapshot, fix, now)->size(); }));
+        }
+    }
+    return isSame;
+}
+
+/*
+ * The flowmeter before the timestamp ring: a realloc'd list the interrupt
+ * handler appended to after shifting the expired pulses out of its front.
+ * Its reallocations are counted like operator new.
+ */
+class ListFlowmeter
+{
+public:
+    ListFlowmeter(unsigned short refreshRate) : refreshRate(refreshRate) {}
+    ~ListFlowmeter() { free(this->pulsesTimestamps); }
+
+    void onPulse()
+    {
+        this->removeOldPulses();
+
+        allocationCount.fetch_add(1, std::memory_order_relaxed);
+        unsigned long *newPulsesTimestamps = static_cast<unsigned long *>(realloc(this->pulsesTimestamps, (this->pulseCount + 1) * sizeof(unsigned long)));
+        if (newPulsesTimestamps != nullptr)
+        {
+            this->pulsesTimestamps = newPulsesTimestamps;
+            this->pulsesTimestamps[this->pulseCount] = millis();
+            this->pulseCount++;
+        }
+        this->lastPulseTimestamp = millis();
+    }
+
+    unsigned short getPulseCount()
+    {
+        this->removeOldPulses();
+        return this->pulseCount;
+    }
+
+private:
+    unsigned short refreshRate;
+    unsigned long lastPulseTimestamp = 0;
+    unsigned long *pulsesTimestamps = nullptr;
+    unsigned short pulseCount = 0;
+
+    void removeOldPulses()
+    {
+        const unsigned long currentTime = millis();
+        while (this->pulseCount > 0 && currentTime - this->pulsesTimestamps[0] > this->refreshRate)
+        {
+            for (unsigned short i = 0; i < this->pulseCount - 1; i++)
+            {
+                this->pulsesTimestamps[i] = this->pulsesTimestamps[i + 1];
+            }
+            this->pulseCount--;
+
+            allocationCount.fetch_add(1, std::memory_order_relaxed);
+            this->pulsesTimestamps = static_cast<unsigned long *>(realloc(this->pulsesTimestamps, this->pulseCount * sizeof(unsigned long)));
+        }
+    }
+};
+
+/*
+ * One second of virtual time of a channel pulsing at frequency (Hz), read
+ * once per acquisition interval as the secondaries do.
+ */
+template <typename FlowmeterType>
+static void runChannelSecond(FlowmeterType &flowmeter, uint32_t frequency)
+{
+    const uint64_t period = 1000000 / frequency;
+    const uint32_t pulsesPerRead = std::max<uint32_t>(frequency * DEFAULT_ACQUISITION_INTERVAL / 1000, 1);
+    for (uint32_t i = 1; i <= frequency; i++)
+    {
+        NativeHAL::advanceClock(period);
+        flowmeter.onPulse();
+        if (i % pulsesPerRead == 0)
+        {
+            sink = flowmeter.getPulseCount();
+        }
+    }
+}
+
+// Pulses at frequency (Hz) on every flowmeter for interval ms of virtual time.
+static void feedPulses(Flowmeter **flowmeters, uint8_t count, uint32_t frequency, unsigned long interval)
+{
+    const uint64_t period = 1000000 / frequency;
+    const uint64_t end = NativeHAL::now() + (uint64_t)interval * 1000;
+    while (NativeHAL::now() + period <= end)
+    {
+        NativeHAL::advanceClock(period);
+        for (uint8_t i = 0; i < count; i++)
+        {
+            flowmeters[i]->onPulse();
+        }
+    }
+    NativeHAL::advanceClock(end - NativeHAL::now());
+}
+
+static void benchmarkFlowmeter(unsigned long duration)
+{
+    if (isSelected("flowmeter/on_pulse"))
+    {
+        Flowmeter flowmeter(BENCHMARK_FIRST_FLOWMETER_PIN, BENCHMARK_REFRESH_RATE);
+        reportResult("flowmeter/on_pulse", 1, runBenchmark(duration, [&]
+                                                           {
+            flowmeter.onPulse();
+            return (size_t)0; }));
+    }
+
+    for (uint16_t frequency : {10, 50, 200, 1000})
+    {
+        // A whole count window first, so the operations see the steady state.
+        Flowmeter flowmeter(BENCHMARK_FIRST_FLOWMETER_PIN, BENCHMARK_REFRESH_RATE);
+        Flowmeter *flowmeters[] = {&flowmeter};
+        feedPulses(flowmeters, 1, frequency, BENCHMARK_REFRESH_RATE);
+
+        const std::function<void()> prepare = [&]
+        { feedPulses(flowmeters, 1, frequency, DEFAULT_ACQUISITION_INTERVAL); };
+
+        if (isSelected("flowmeter/pulse_count"))
+        {
+            reportResult("flowmeter/pulse_count", frequency, runBenchmark(duration, prepare, [&]
+                                                                          {
+                sink = flowmeter.getPulseCount();
+                return (size_t)0; }));
+        }
+
+        if (isSelected("flowmeter/flow_rate"))
+        {
+            reportResult("flowmeter/flow_rate", frequency, runBenchmark(duration, prepare, [&]
+                                                                        {
+                sink = flowmeter.getFlowRate().rate;
+                return (size_t)0; }));
+        }
+
+        // The ring already holds a whole window from above.
+        if (isSelected("flowmeter/channel/ring"))
+        {
+            reportResult("flowmeter/channel/ring", frequency, runBenchmark(duration, [&]
+                                                                           {
+                runChannelSecond(flowmeter, frequency);
+                return (size_t)0; }),
+                         frequency, "pulses");
+        }
+
+        if (isSelected("flowmeter/channel/list"))
+        {
+            ListFlowmeter listFlowmeter(BENCHMARK_REFRESH_RATE);
+            for (uint32_t second = 0; second < BENCHMARK_REFRESH_RATE / 1000; second++)
+            {
+                runChannelSecond(listFlowmeter, frequency);
+            }
+            reportResult("flowmeter/channel/list", frequency, runBenchmark(duration, [&]
+                                                                           {
+                runChannelSecond(listFlowmeter, frequency);
+                return (size_t)0; }),
+                         frequency, "pulses");
+        }
+    }
+}
+
+/*
+ * ESP-NOW manager of the secondary under benchmark: off the driver, it hands
+ * the data requests to the module as the dispatcher would and keeps the size
+ * of the response instead of sending it.
+ */
+class BenchmarkSecondaryManager : public ESPNowSlaveManager
+{
+public:
+    BenchmarkSecondaryManager() : ESPNowSlaveManager(false) {}
+
+    // Size of the response to a data request for sampleId, 0 if none was sent.
+    size_t request(const uint8_t *mac, uint32_t sampleId)
+    {
+        this->responseSize = 0;
+        callOnReceiveCallbacks(FLOWMETER_DATA_REQUEST, mac, reinterpret_cast<const uint8_t *>(&sampleId), sizeof(sampleId));
+        return this->responseSize;
+    }
+
+protected:
+    esp_err_t transmit(const uint8_t *, const uint8_t *, size_t size) override
+    {
+        this->responseSize = size;
+        return ESP_OK;
+    }
+
+private:
+    size_t responseSize = 0;
+};
+
+static void benchmarkSecondaryResponse(unsigned long duration)
+{
+    if (!isSelected("secondary/data_response"))
+    {
+        return;
+    }
+
+    const macAddress_t mainModuleMac = {0x02, 0xBE, 0x4C, 0x00, 0x01, 0x00};
+
+    for (uint8_t flowmeterCount : {9, 32})
+    {
+        uint8_t flowmeterPins[SECONDARY_MODULE_MAX_FLOWMETERS];
+        for (uint8_t i = 0; i < flowmeterCount; i++)
+        {
+            flowmeterPins[i] = BENCHMARK_FIRST_FLOWMETER_PIN + i;
+        }
+
+        // SecondaryModule cannot be deleted, both stay until the benchmark exits.
+        BenchmarkSecondaryManager *manager = new BenchmarkSecondaryManager();
+        SecondaryModule *module = new SecondaryModule(manager, flowmeterPins, flowmeterCount);
+
+        Flowmeter *flowmeters[SECONDARY_MODULE_MAX_FLOWMETERS];
+        for (uint8_t i = 0; i < flowmeterCount; i++)
+        {
+            flowmeters[i] = module->getFlowmeter(i);
+        }
+        feedPulses(flowmeters, flowmeterCount, BENCHMARK_PULSE_FREQUENCY, BENCHMARK_REFRESH_RATE);
+
+        // Requests for samples it did not latch, so each one reads every flowmeter.
+        uint32_t sampleId = 0;
+        reportResult("secondary/data_response", flowmeterCount, runBenchmark(duration, [&]
+                                                                             { feedPulses(flowmeters, flowmeterCount, BENCHMARK_PULSE_FREQUENCY, DEFAULT_ACQUISITION_INTERVAL); },
+                                                                             [&]
+                                                                             { return manager->request(mainModuleMac, ++sampleId); }));
+    }
+}
+
+/*
+ * A manager off the driver, whose frames go nowhere.
+ */
+class BenchmarkSendManager : public ESPNowManager
+{
+public:
+    BenchmarkSendManager() : ESPNowManager(false, false) {}
+
+protected:
+    esp_err_t transmit(const uint8_t *, const uint8_t *, size_t) override
+    {
+        return ESP_OK;
+    }
+};
+
+static bool benchmarkSend(unsigned long duration)
+{
+    const macAddress_t secondaryMac = {0x02, 0xBE, 0x4C, 0x00, 0x00, 0x01};
+
+    // Stays until the benchmark exits, its dispatcher task along with it.
+    BenchmarkSendManager *manager = new BenchmarkSendManager();
+    // Its first wait allocates, not to be counted against the sends.
+    NativeHAL::waitForIdleTasks();
+
+    // As a SET_REFRESH_RATE: the header, then a bitmap for the payload.
+    const uint8_t header[SET_REFRESH_RATE_HEADER_SIZE] = {0x88, 0x13, 0xFF};
+    uint8_t payload[ESP_NOW_MAX_DATA_LEN];
+    memset(payload, 0xFF, sizeof(payload));
+
+    bool isValid = true;
+    for (uint8_t frameSize : {16, 128, ESP_NOW_MAX_DATA_LEN})
+    {
+        const size_t payloadSize = frameSize - 1 - sizeof(header);
+        const benchmark_result result = runBenchmark(duration, [&]
+                                                     { return manager->sendBuffer(secondaryMac, SET_REFRESH_RATE, header, sizeof(header), payload, payloadSize) ? frameSize : 0; });
+        reportResult("espnow/send", frameSize, result);
+
+        if (result.bytesPerOperation != frameSize || result.allocationsPerOperation != 0)
+        {
+            fprintf(stderr, "espnow/send: %u byte frames not sent or allocating\n", frameSize);
+            isValid = false;
+        }
+    }
+    return isValid;
+}
+
+// Last SAMPLE_LATCH the benchmark secondaries received.
+static sample_latch lastLatch = {};
+
+static void getSecondaryMac(uint8_t index, uint8_t *mac)
+{
+    const macAddress_t address = {0x02, 0xBE, 0x4C, 0x00, 0x00, index};
+    memcpy(mac, address, sizeof(macAddress_t));
+}
+
+// Secondaries only keep the latches and acknowledge the reliable messages, their responses are built by the benchmark.
+static void onSecondaryReceive(const uint8_t *secondaryMac, const uint8_t *data, int len)
+{
+    if (len >= (int)(1 + sizeof(sample_latch)) && data[0] == SAMPLE_LATCH)
+    {
+        memcpy(&lastLatch, data + 1, sizeof(sample_latch));
+    }
+    else if (len >= (int)(1 + sizeof(reliable_header)) && data[0] == RELIABLE_MESSAGE)
+    {
+        reliable_header header;
+        memcpy(&header, data + 1, sizeof(reliable_header));
+        const reliable_ack ack = {header.session, header.sequence};
+
+        uint8_t frame[1 + sizeof(reliable_ack)];
+        frame[0] = RELIABLE_MESSAGE + 0x80;
+        memcpy(frame + 1, &ack, sizeof(reliable_ack));
+
+        macAddress_t firmwareMac;
+        NativeHAL::getMacAddress(firmwareMac);
+        RadioBus::getInstance()->send(secondaryMac, firmwareMac, frame, sizeof(frame));
+    }
+}
+
+// Pairs secondaries of BENCHMARK_FLOWMETERS_PER_SECONDARY until there are count, one at a time so they get their slot in order.
+static bool pairSecondaries(uint8_t count)
+{
+    ESPNowCentralManager *central = MainModule::getInstance()->getEspNowCentralManager();
+    central->enablePairing();
+    for (uint8_t i = central->getSlavesCount(); i < count; i++)
+    {
+        macAddress_t mac;
+        getSecondaryMac(i, mac);
+        RadioBus::getInstance()->attach(mac, [i](const uint8_t *, const uint8_t *data, int len)
+                                        {
+            macAddress_t secondaryMac;
+            getSecondaryMac(i, secondaryMac);
+            onSecondaryReceive(secondaryMac, data, len); });
+
+        uint8_t frame[1 + sizeof(pair_request)];
+        const pair_request request = {PAIR_REQUEST, BENCHMARK_FLOWMETERS_PER_SECONDARY};
+        frame[0] = PAIR_REQUEST;
+        memcpy(frame + 1, &request, sizeof(pair_request));
+        const macAddress_t broadcast = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+        RadioBus::getInstance()->send(mac, broadcast, frame, sizeof(frame));
+
+        const unsigned long start = millis();
+        while (central->getSlavesCount() <= i && millis() - start < BENCHMARK_PAIRING_TIMEOUT)
+        {
+            NativeHAL::advanceClock(1000);
+        }
+    }
+    central->disablePairing();
+
+    return central->getSlavesCount() == count;
+}
+
+/*
+ * The data responses before the slot table: the last data and response time
+ * of each secondary kept in maps keyed by its MAC address as a string, the
+ * data copied into fresh heap arrays at every response and gathered into
+ * more of them to publish. Its mallocs are counted like operator new. It
+ * only does the bookkeeping of that time, without the rates, application
+ * and nozzle states the slot table now feeds.
+ */
+class MapCentral
+{
+public:
+    MapCentral(uint8_t slaveCount)
+    {
+        this->slavesCount = slaveCount;
+        for (uint8_t i = 0; i < slaveCount; i++)
+        {
+            getSecondaryMac(i, this->slaves[i]);
+        }
+    }
+
+    ~MapCentral()
+    {
+        for (auto &entry : this->flowmetersData)
+        {
+            free(entry.second.flowmetersPulseCount);
+            free(entry.second.flowmetersLastPulseAge);
+        }
+        vSemaphoreDelete(this->flowmetersDataMutex);
+    }
+
+    void startAcquisitionCycle()
+    {
+        this->lastFlowmetersDataRequestTimestamp = millis();
+    }
+
+    void onDataResponseReceived(const uint8_t *mac_addr, const uint8_t *data, int data_len)
+    {
+        flowmeter_frame_header header;
+        flowmeter_data_t pulseCount[MAX_FLOWMETERS_PER_SECONDARY_MODULE];
+        unsigned long lastPulseAge[MAX_FLOWMETERS_PER_SECONDARY_MODULE];
+        const flowmeters_data frameData = {0, pulseCount, lastPulseAge, nullptr, nullptr, 0};
+        if (!FlowmeterFrame::decode(data, data_len, header, frameData, MAX_FLOWMETERS_PER_SECONDARY_MODULE))
+        {
+            return;
+        }
+
+        xSemaphoreTake(this->flowmetersDataMutex, portMAX_DELAY);
+        const std::string mac_addr_str = macAddressToString(mac_addr);
+        this->lastFlowmetersDataResponseTimestamps[mac_addr_str] = millis();
+
+        auto previous = this->flowmetersData.find(mac_addr_str);
+        if (previous != this->flowmetersData.end())
+        {
+            free(previous->second.flowmetersPulseCount);
+            free(previous->second.flowmetersLastPulseAge);
+        }
+
+        flowmeters_data flowmetersData = {header.channelCount, nullptr, nullptr, nullptr, nullptr, 0};
+        allocationCount.fetch_add(2, std::memory_order_relaxed);
+        flowmetersData.flowmetersPulseCount = (flowmeter_data_t *)malloc(sizeof(flowmeter_data_t) * header.channelCount);
+        flowmetersData.flowmetersLastPulseAge = (unsigned long *)malloc(sizeof(unsigned long) * header.channelCount);
+        memcpy(flowmetersData.flowmetersPulseCount, pulseCount, sizeof(flowmeter_data_t) * header.channelCount);
+        memcpy(flowmetersData.flowmetersLastPulseAge, lastPulseAge, sizeof(unsigned long) * header.channelCount);
+        this->flowmetersData[mac_addr_str] = flowmetersData;
+        xSemaphoreGive(this->flowmetersDataMutex);
+    }
+
+    // What loop() did once every secondary answered. Returns false if one had not.
+    bool publishSnapshot(flowmeters_snapshot &snapshot)
+    {
+        xSemaphoreTake(this->flowmetersDataMutex, portMAX_DELAY);
+        for (uint8_t i = 0; i < this->slavesCount; i++)
+        {
+            if (this->lastFlowmetersDataResponseTimestamps[this->getSlaveMacAddress(i)] < this->lastFlowmetersDataRequestTimestamp)
+            {
+                xSemaphoreGive(this->flowmetersDataMutex);
+                return false;
+            }
+        }
+
+        uint16_t flowmeterCount = 0;
+        for (uint8_t i = 0; i < this->slavesCount; i++)
+        {
+            flowmeterCount += this->flowmetersData[this->getSlaveMacAddress(i)].flowmeterCount;
+        }
+        allocationCount.fetch_add(2, std::memory_order_relaxed);
+        flowmeter_data_t *allPulseCount = (flowmeter_data_t *)malloc(sizeof(flowmeter_data_t) * flowmeterCount);
+        unsigned long *allLastPulseAge = (unsigned long *)malloc(sizeof(unsigned long) * flowmeterCount);
+        uint16_t index = 0;
+        for (uint8_t i = 0; i < this->slavesCount; i++)
+        {
+            const std::string slave = this->getSlaveMacAddress(i);
+            for (uint16_t j = 0; j < this->flowmetersData[slave].flowmeterCount; j++)
+            {
+                allPulseCount[index] = this->flowmetersData[slave].flowmetersPulseCount[j];
+                allLastPulseAge[index] = this->flowmetersData[slave].flowmetersLastPulseAge[j];
+                index++;
+            }
+        }
+
+        snapshot.slavesCount = std::min<uint8_t>(this->slavesCount, MAX_SECONDARY_MODULES);
+        for (uint8_t i = 0; i < snapshot.slavesCount; i++)
+        {
+            auto it = this->lastFlowmetersDataResponseTimestamps.find(this->getSlaveMacAddress(i));
+            snapshot.slavesLastResponseTimestamp[i] = it != this->lastFlowmetersDataResponseTimestamps.end() ? it->second : 0;
+        }
+        xSemaphoreGive(this->flowmetersDataMutex);
+
+        snapshot.data.flowmeterCount = std::min<uint16_t>(flowmeterCount, MAX_FLOWMETERS);
+        memcpy(snapshot.flowmetersPulseCount, allPulseCount, sizeof(flowmeter_data_t) * snapshot.data.flowmeterCount);
+        memcpy(snapshot.flowmetersLastPulseAge, allLastPulseAge, sizeof(unsigned long) * snapshot.data.flowmeterCount);
+        free(allPulseCount);
+        free(allLastPulseAge);
+
+        snapshot.requestTimestamp = this->lastFlowmetersDataRequestTimestamp;
+        snapshot.timestamp = millis();
+        snapshot.version++;
+        return true;
+    }
+
+private:
+    // The slave list of ESPNowCentralManager, which handed the addresses out as strings.
+    macAddress_t slaves[MAX_SECONDARY_MODULES];
+    uint8_t slavesCount = 0;
+    SemaphoreHandle_t flowmetersDataMutex = xSemaphoreCreateMutex();
+    unsigned long lastFlowmetersDataRequestTimestamp = 0;
+    std::map<std::string, unsigned long> lastFlowmetersDataResponseTimestamps;
+    std::map<std::string, flowmeters_data> flowmetersData;
+
+    static std::string macAddressToString(const uint8_t *mac_addr)
+    {
+        char mac_str[18] = {0};
+        snprintf(mac_str, sizeof(mac_str), "%02X:%02X:%02X:%02X:%02X:%02X", mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]);
+        return std::string(mac_str);
+    }
+
+    std::string getSlaveMacAddress(uint8_t index)
+    {
+        return macAddressToString(this->slaves[index]);
+    }
+};
+
+static bool benchmarkMainModule(unsigned long duration)
+{
+    // Not started, the benchmark runs the acquisition loop itself.
+    NativeHAL::setConsoleEnabled(false);
+    MainModule *mainModule = MainModule::getInstance();
+
+    uint32_t unpublishedCycles = 0;
+    // Up to a full boom, one peer short of the ESP-NOW limit for the latch broadcast.
+    for (uint8_t slaveCount : {2, 8, MAX_SECONDARY_MODULES})
+    {
+        if (!pairSecondaries(slaveCount))
+        {
+            fprintf(stderr, "main module: could not pair %u secondaries\n", slaveCount);
+            return false;
+        }
+
+        std::vector<std::vector<uint8_t>> frames(slaveCount, std::vector<uint8_t>(FLOWMETER_FRAME_MAX_SIZE));
+        std::vector<size_t> frameSizes(slaveCount);
+        uint32_t sampleId = 0;
+        uint32_t sequence = 0;
+
+        // The operation should have published its cycle with every secondary fresh.
+        const std::function<void()> checkCycle = [&]
+        {
+            const flowmeters_snapshot *snapshot = mainModule->acquireSnapshot();
+            bool isPublished = snapshot->sampleId == sampleId && snapshot->slavesCount == slaveCount;
+            for (uint8_t i = 0; i < snapshot->slavesCount; i++)
+            {
+                isPublished = isPublished && snapshot->isSlaveFresh(i);
+            }
+            mainModule->releaseSnapshot(snapshot);
+            unpublishedCycles += isPublished ? 0 : 1;
+        };
+
+        // The response of every secondary to the latest latch.
+        const std::function<void()> encodeFrames = [&]
+        {
+            flowmeter_data_t pulseCount[BENCHMARK_FLOWMETERS_PER_SECONDARY];
+            unsigned long lastPulseAge[BENCHMARK_FLOWMETERS_PER_SECONDARY];
+            uint32_t rate[BENCHMARK_FLOWMETERS_PER_SECONDARY];
+            uint8_t rateConfidence[BENCHMARK_FLOWMETERS_PER_SECONDARY];
+            for (uint8_t i = 0; i < slaveCount; i++)
+            {
+                for (uint8_t j = 0; j < BENCHMARK_FLOWMETERS_PER_SECONDARY; j++)
+                {
+                    pulseCount[j] = 240 + (sequence + i * 7 + j * 3) % 16;
+                    lastPulseAge[j] = 10 + j;
+                    rate[j] = 48000 + (i * 13 + j * 101) % 4000;
+                    rateConfidence[j] = 230 + j;
+                }
+                const flowmeters_data data = {BENCHMARK_FLOWMETERS_PER_SECONDARY, pulseCount, lastPulseAge, rate, rateConfidence, 0};
+                const flowmeter_sample_info sample = {sampleId, (uint32_t)lastLatch.boomTime + 150 + i * 3, true};
+                frameSizes[i] = FlowmeterFrame::encode(frames[i].data(), frames[i].size(), 1, sequence, data, &sample);
+            }
+            sequence++;
+        };
+
+        const std::function<void()> prepare = [&]
+        {
+            if (sampleId != 0)
+            {
+                checkCycle();
+            }
+
+            // Next cycle, up to its latch reaching the secondaries.
+            NativeHAL::advanceClock((uint64_t)mainModule->getAcquisitionInterval() * 1000);
+            const uint32_t previousSampleId = lastLatch.sampleId;
+            mainModule->loop();
+            for (uint8_t i = 0; i < 100 && lastLatch.sampleId == previousSampleId; i++)
+            {
+                NativeHAL::advanceClock(100);
+            }
+            sampleId = lastLatch.sampleId;
+
+            encodeFrames();
+        };
+
+        if (isSelected("main_module/data_responses"))
+        {
+            reportResult("main_module/data_responses", slaveCount * BENCHMARK_FLOWMETERS_PER_SECONDARY, runBenchmark(duration, prepare, [&]
+                                                                                                                 {
+                size_t bytes = 0;
+                for (uint8_t i = 0; i < slaveCount; i++)
+                {
+                    macAddress_t mac;
+                    getSecondaryMac(i, mac);
+                    MainModule::onDataResponseReceived(mac, frames[i].data(), frameSizes[i]);
+                    bytes += frameSizes[i];
+                }
+                mainModule->loop();
+                return bytes; }));
+            checkCycle();
+        }
+
+        if (isSelected("main_module/map_responses"))
+        {
+            MapCentral mapCentral(slaveCount);
+            static flowmeters_snapshot mapSnapshot;
+            const std::function<void()> prepareMap = [&]
+            {
+                NativeHAL::advanceClock((uint64_t)mainModule->getAcquisitionInterval() * 1000);
+                mapCentral.startAcquisitionCycle();
+                encodeFrames();
+            };
+
+            reportResult("main_module/map_responses", slaveCount * BENCHMARK_FLOWMETERS_PER_SECONDARY, runBenchmark(duration, prepareMap, [&]
+                                                                                                                   {
+                size_t bytes = 0;
+                for (uint8_t i = 0; i < slaveCount; i++)
+                {
+                    macAddress_t mac;
+                    getSecondaryMac(i, mac);
+                    mapCentral.onDataResponseReceived(mac, frames[i].data(), frameSizes[i]);
+                    bytes += frameSizes[i];
+                }
+                unpublishedCycles += mapCentral.publishSnapshot(mapSnapshot) ? 0 : 1;
+                return bytes; }));
+        }
+    }
+
+    if (unpublishedCycles > 0)
+    {
+        fprintf(stderr, "main module: %u cycles not published with every secondary fresh\n", unpublishedCycles);
+        return false;
+    }
+    return true;
+}
+
+// Builds an NMEA sentence from its fields, with its checksum.
+static std::string buildNmeaSentence(const char *fields)
+{
+    uint8_t checksum = 0;
+    for (const char *character = fields; *character != '\0'; character++)
+    {
+        checksum ^= *character;
+    }
+
+    char sentence[128];
+    snprintf(sentence, sizeof(sentence), "$%s*%02X\r\n", fields, checksum);
+    return sentence;
+}
+
+static bool benchmarkGps(unsigned long duration)
+{
+    if (!isSelected("gps/epoch"))
+    {
+        return true;
+    }
+
+    // One epoch of a receiver configured by GPS, RMC and GGA only.
+    const std::string epoch =
+        buildNmeaSentence("GPRMC,123519.00,A,2243.51874,S,04738.95386,W,4.860,77.52,171026,,,A") +
+        buildNmeaSentence("GPGGA,123519.00,2243.51874,S,04738.95386,W,1,11,0.9,545.4,M,-5.6,M,,");
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(epoch.data());
+
+    GPSReceiver receiver;
+    gps_fix fix = {};
+    unsigned long now = 1000;
+    if (!receiver.feed(data, epoch.size(), now, fix) || !fix.isValid || fix.satelliteCount != 11)
+    {
+        fprintf(stderr, "gps: the epoch does not give a valid fix\n");
+        return false;
+    }
+
+    reportResult("gps/epoch", epoch.size(), runBenchmark(duration, [&]
+                                                         {
+        receiver.feed(data, epoch.size(), now++, fix);
+        return epoch.size(); }));
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long duration = DEFAULT_BENCHMARK_DURATION;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--duration=", 11) == 0)
+        {
+            duration = strtoul(argv[i] + 11, nullptr, 10);
+        }
+        else if (strncmp(argv[i], "--filter=", 9) == 0)
+        {
+            filter = argv[i] + 9;
+        }
+        else if (strcmp(argv[i], "--json") == 0)
+        {
+            isJsonOutput = true;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (!isJsonOutput)
+    {
+        printf("%-28s %5s\n", "benchmark", "size");
+    }
+
+    bool isValid = true;
+    if (isSelected("flowmeter"))
+    {
+        benchmarkFlowmeter(duration);
+    }
+    if (isSelected("secondary"))
+    {
+        benchmarkSecondaryResponse(duration);
+    }
+    if (isSelected("espnow/send"))
+    {
+        isValid = benchmarkSend(duration) && isValid;
+    }
+    if (isSelected("data_response"))
+    {
+        isValid = benchmarkDataResponse(duration) && isValid;
+    }
+    if (isSelected("gps"))
+    {
+        isValid = benchmarkGps(duration) && isValid;
+    }
+    // Last, it leaves the firmware tasks running.
+    if (isSelected("main_module"))
+    {
+        isValid = benchmarkMainModule(duration) && isValid;
+    }
+
+    if (isJsonOutput)
+    {
+        printJsonResults(duration);
+    }
+
+    // Task threads never return, skip the static destructors they could be using.
+    fflush(stdout);
+    _Exit(isValid ? 0 : 1);
+}
@@ -0,0 +1,59 @@
+#include "ApplicationMeter.h"
+#include <algorithm>
+
+ApplicationMeter::ApplicationMeter()
+{
+}
+
+ApplicationMeter::~ApplicationMeter()
+{
+}
+
+void ApplicationMeter::updateSection(nozzle_application_state *states, const nozzle_calibration *calibrations, const uint32_t *rates, uint8_t count, uint32_t speed, uint32_t interval, section_application &section)
+{
+    interval = std::min<uint32_t>(interval, APPLICATION_METER_MAX_INTERVAL);
+    memset(&section, 0, sizeof(section));
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        nozzle_application_state &state = states[i];
+        const uint32_t pulsesPerCubicMeter = calibrations[i].pulsesPerCubicMeter != 0 ? calibrations[i].pulsesPerCubicMeter : APPLICATION_METER_DEFAULT_PULSES_PER_CUBIC_METER;
+        const uint16_t spacing = calibrations[i].spacing != 0 ? calibrations[i].spacing : APPLICATION_METER_DEFAULT_SPACING;
+
+        // mHz / (pulses / m3) is 1e-3 m3/s, so 1e6 uL/s.
+        state.flow = (uint32_t)std::min<uint64_t>((uint64_t)rates[i] * 1000000 / pulsesPerCubicMeter, UINT32_MAX);
+        state.applicationRate = getApplicationRate(state.flow, spacing, speed);
+
+        // mHz * us / (pulses / m3) is 1e-9 m3, so 1e-3 mL.
+        const uint64_t pulsesPerKiloMilliliter = (uint64_t)pulsesPerCubicMeter * 1000;
+        const uint64_t volume = (uint64_t)rates[i] * interval + state.volumeRemainder;
+        state.volume = state.volume + (uint32_t)(volume / pulsesPerKiloMilliliter);
+        state.volumeRemainder = volume % pulsesPerKiloMilliliter;
+
+        section.flow = section.flow + state.flow;
+        section.width = section.width + spacing;
+        section.volume = section.volume + state.volume;
+    }
+
+    section.applicationRate = getApplicationRate(section.flow, section.width, speed);
+}
+
+void ApplicationMeter::addSection(section_application &boom, const section_application &section, uint32_t speed)
+{
+    boom.flow = boom.flow + section.flow;
+    boom.width = boom.width + section.width;
+    boom.volume = boom.volume + section.volume;
+    boom.applicationRate = getApplicationRate(boom.flow, boom.width, speed);
+}
+
+uint32_t ApplicationMeter::getApplicationRate(uint32_t flow, uint32_t width, uint32_t speed)
+{
+    if (speed < APPLICATION_METER_MIN_SPEED || width == 0)
+    {
+        return APPLICATION_RATE_UNKNOWN;
+    }
+
+    // uL/s over mm * mm/s is 1e-6 L per 1e-10 ha, so 1e4 L/ha or 1e7 mL/ha.
+    const uint64_t applicationRate = (uint64_t)flow * 10000000 / ((uint64_t)width * speed);
+    return (uint32_t)std::min<uint64_t>(applicationRate, APPLICATION_RATE_UNKNOWN - 1);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Calibration of a nozzle that was never calibrated: 1000 pulses per litre,
+// nozzles every 500 mm.
+#define APPLICATION_METER_DEFAULT_PULSES_PER_CUBIC_METER 1000000
+#define APPLICATION_METER_DEFAULT_SPACING 500
+
+// Under this speed (mm/s) the application rate is unknown rather than huge.
+#define APPLICATION_METER_MIN_SPEED 300
+// A GPS fix older than this (ms) gives no speed.
+#define APPLICATION_METER_MAX_FIX_AGE 2000
+// Longest time integrated at once (us), a longer gap between cycles is not sprayed volume we know of.
+#define APPLICATION_METER_MAX_INTERVAL 5000000
+
+// Application rate of a section or nozzle that cannot tell, see APPLICATION_METER_MIN_SPEED.
+#define APPLICATION_RATE_UNKNOWN UINT32_MAX
+
+/*
+ * Calibration of one nozzle, set from the app by global nozzle number.
+ */
+typedef struct nozzle_calibration
+{
+    // Pulses of the flowmeter per cubic meter, so per 1000 litres.
+    uint32_t pulsesPerCubicMeter;
+    // Width of the strip the nozzle sprays, in millimeters.
+    uint16_t spacing;
+} nozzle_calibration;
+
+/*
+ * Application of one nozzle. Kept in a boom array next to the data of the
+ * nozzle, so it moves with the slice of its secondary module.
+ */
+typedef struct nozzle_application_state
+{
+    // Flow in microlitres per second.
+    uint32_t flow;
+    // Millilitres per hectare, APPLICATION_RATE_UNKNOWN if it cannot tell.
+    uint32_t applicationRate;
+    // Millilitres sprayed since the last reset, and the fraction of a
+    // millilitre carried over, in pulses per 1000 s times microseconds.
+    uint32_t volume;
+    uint64_t volumeRemainder;
+} nozzle_application_state;
+
+/*
+ * Application of a section (the nozzles of a secondary module), or of the boom.
+ */
+typedef struct section_application
+{
+    // Microlitres per second, millimeters and millilitres per hectare.
+    uint32_t flow;
+    uint32_t width;
+    uint32_t applicationRate;
+    // Millilitres sprayed since the last reset.
+    uint64_t volume;
+} section_application;
+
+/*
+ * Turns the flow rates reported by the secondaries into flow, application
+ * rate and sprayed volume, one section at a time at the end of each
+ * acquisition cycle.
+ *
+ * Everything is integer: rates come in mHz, speed in mm/s and time in us.
+ * The volume is integrated incrementally and keeps the remainder of each
+ * division, so it does not drift however short the cycles are.
+ */
+class ApplicationMeter
+{
+public:
+    ApplicationMeter();
+    ~ApplicationMeter();
+
+    /*
+     * Updates a section from the rates (mHz) of its nozzles, sampled interval
+     * microseconds after the previous cycle, at speed mm/s (0 if unknown).
+     * states and calibrations point to the first nozzle of the section.
+     * Returns the totals of the section.
+     */
+    void updateSection(nozzle_application_state *states, const nozzle_calibration *calibrations, const uint32_t *rates, uint8_t count, uint32_t speed, uint32_t interval, section_application &section);
+
+    // Adds a section to the boom totals, whose application rate is then computed at speed.
+    void addSection(section_application &boom, const section_application &section, uint32_t speed);
+
+    // Millilitres per hectare of flow (uL/s) sprayed over width (mm) at speed (mm/s).
+    static uint32_t getApplicationRate(uint32_t flow, uint32_t width, uint32_t speed);
+};
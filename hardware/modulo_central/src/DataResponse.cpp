@@ -0,0 +1,266 @@
+#include "DataResponse.h"
+#include "MainModule.h"
+
+std::atomic<size_t> DataResponse::lastSize{0};
+std::shared_ptr<std::vector<uint8_t>> DataResponse::pool[DATA_RESPONSE_POOL_SIZE];
+portMUX_TYPE DataResponse::poolMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Application rate in L/ha, null when it is unknown.
+static void writeApplicationRate(JsonWriter &writer, uint32_t applicationRate)
+{
+    if (applicationRate == APPLICATION_RATE_UNKNOWN)
+    {
+        writer.null();
+    }
+    else
+    {
+        writer.fixed(applicationRate, 3);
+    }
+}
+
+void DataResponse::write(JsonWriter &writer, const flowmeters_snapshot *snapshot, const gps_fix &fix, unsigned long now)
+{
+    const uint16_t count = snapshot->data.flowmeterCount;
+
+    writer.beginObject();
+
+    writer.key("flowmetersPulseCount");
+    writer.beginArray();
+    for (uint16_t i = 0; i < count; i++)
+    {
+        writer.value(snapshot->data.flowmetersPulseCount[i]);
+    }
+    writer.endArray();
+
+    writer.key("flowmetersLastPulseAge");
+    writer.beginArray();
+    for (uint16_t i = 0; i < count; i++)
+    {
+        writer.value(snapshot->data.flowmetersLastPulseAge[i]);
+    }
+    writer.endArray();
+
+    // Pulses per minute (from millihertz) and confidence in percent, from the period estimator of the secondaries.
+    writer.key("flowmetersRate");
+    writer.beginArray();
+    for (uint16_t i = 0; i < count; i++)
+    {
+        writer.fixed((long long)snapshot->data.flowmetersRate[i] * 6, 2);
+    }
+    writer.endArray();
+
+    writer.key("flowmetersRateConfidence");
+    writer.beginArray();
+    for (uint16_t i = 0; i < count; i++)
+    {
+        writer.value(snapshot->data.flowmetersRateConfidence[i] * 100 / 255);
+    }
+    writer.endArray();
+
+    // NozzleState of each nozzle, see /alerts for the changes.
+    writer.key("flowmetersState");
+    writer.beginArray();
+    for (uint16_t i = 0; i < count; i++)
+    {
+        writer.value(snapshot->flowmetersState[i]);
+    }
+    writer.endArray();
+
+    // Flow in L/min (from microlitres per second), application rate in L/ha
+    // and volume sprayed since /reset_volume in litres (from millilitres).
+    writer.key("flowmetersFlow");
+    writer.beginArray();
+    for (uint16_t i = 0; i < count; i++)
+    {
+        writer.fixed((long long)snapshot->flowmetersFlow[i] * 6, 5);
+    }
+    writer.endArray();
+
+    writer.key("flowmetersApplicationRate");
+    writer.beginArray();
+    for (uint16_t i = 0; i < count; i++)
+    {
+        writeApplicationRate(writer, snapshot->flowmetersApplicationRate[i]);
+    }
+    writer.endArray();
+
+    writer.key("flowmetersVolume");
+    writer.beginArray();
+    for (uint16_t i = 0; i < count; i++)
+    {
+        writer.fixed(snapshot->flowmetersVolume[i], 3);
+    }
+    writer.endArray();
+
+    // The same per secondary module (section) and for the whole boom.
+    writer.key("secondaryModulesFlow");
+    writer.beginArray();
+    for (uint8_t i = 0; i < snapshot->slavesCount; i++)
+    {
+        writer.fixed((long long)snapshot->slavesApplication[i].flow * 6, 5);
+    }
+    writer.endArray();
+
+    writer.key("secondaryModulesApplicationRate");
+    writer.beginArray();
+    for (uint8_t i = 0; i < snapshot->slavesCount; i++)
+    {
+        writeApplicationRate(writer, snapshot->slavesApplication[i].applicationRate);
+    }
+    writer.endArray();
+
+    writer.key("secondaryModulesVolume");
+    writer.beginArray();
+    for (uint8_t i = 0; i < snapshot->slavesCount; i++)
+    {
+        writer.fixed(snapshot->slavesApplication[i].volume, 3);
+    }
+    writer.endArray();
+
+    writer.key("boomFlow");
+    writer.fixed((long long)snapshot->boomApplication.flow * 6, 5);
+    writer.key("boomApplicationRate");
+    writeApplicationRate(writer, snapshot->boomApplication.applicationRate);
+    writer.key("boomVolume");
+    writer.fixed(snapshot->boomApplication.volume, 3);
+
+    writer.key("version");
+    writer.value(snapshot->version);
+    writer.key("age");
+    writer.value(now - snapshot->timestamp);
+
+    // Fresh slaves that sampled on their data request instead of the latch broadcast, and slaves that
+    // stopped answering and are only probed once per cycle (see /link_stats).
+    int32_t minSampleDelay = INT32_MAX;
+    int32_t maxSampleDelay = INT32_MIN;
+    writer.key("staleSecondaryModules");
+    writer.beginArray();
+    for (uint8_t i = 0; i < snapshot->slavesCount; i++)
+    {
+        if (!snapshot->isSlaveFresh(i))
+        {
+            writer.value(i);
+        }
+        else if (snapshot->slavesSampleDelay[i] != SAMPLE_DELAY_UNKNOWN)
+        {
+            minSampleDelay = std::min(minSampleDelay, snapshot->slavesSampleDelay[i]);
+            maxSampleDelay = std::max(maxSampleDelay, snapshot->slavesSampleDelay[i]);
+        }
+    }
+    writer.endArray();
+
+    writer.key("unlatchedSecondaryModules");
+    writer.beginArray();
+    for (uint8_t i = 0; i < snapshot->slavesCount; i++)
+    {
+        if (snapshot->isSlaveFresh(i) && !snapshot->slavesSampleLatched[i])
+        {
+            writer.value(i);
+        }
+    }
+    writer.endArray();
+
+    writer.key("degradedSecondaryModules");
+    writer.beginArray();
+    for (uint8_t i = 0; i < snapshot->slavesCount; i++)
+    {
+        if (snapshot->slavesDegraded[i])
+        {
+            writer.value(i);
+        }
+    }
+    writer.endArray();
+
+    // Boom time of the sample in milliseconds, and how far apart the fresh slaves sampled in microseconds.
+    writer.key("sampleTime");
+    writer.value(snapshot->sampleTime / 1000);
+    writer.key("sampleSpread");
+    writer.value(maxSampleDelay >= minSampleDelay ? maxSampleDelay - minSampleDelay : 0);
+
+    // Speed in m/s, position in degrees to about a centimeter.
+    writer.key("speed");
+    writer.rounded(fix.speed, 3);
+    writer.key("satelliteCount");
+    writer.value(fix.satelliteCount);
+    writer.key("latitude");
+    writer.rounded(fix.latitude, 7);
+    writer.key("longitude");
+    writer.rounded(fix.longitude, 7);
+    // Milliseconds since the fix was read, null before the first one.
+    writer.key("gpsAge");
+    if (fix.timestamp != 0)
+    {
+        writer.value(now - fix.timestamp);
+    }
+    else
+    {
+        writer.null();
+    }
+
+    writer.endObject();
+}
+
+std::shared_ptr<std::vector<uint8_t>> DataResponse::takeBuffer(size_t size)
+{
+    std::shared_ptr<std::vector<uint8_t>> buffer;
+    int8_t emptySlot = -1;
+
+    // Claimed under the lock: the copy taken here keeps the other serializing task off the same slot.
+    portENTER_CRITICAL(&poolMux);
+    for (uint8_t i = 0; i < DATA_RESPONSE_POOL_SIZE; i++)
+    {
+        if (pool[i] && pool[i].use_count() == 1)
+        {
+            buffer = pool[i];
+            break;
+        }
+        if (!pool[i] && emptySlot < 0)
+        {
+            emptySlot = i;
+        }
+    }
+    portEXIT_CRITICAL(&poolMux);
+
+    if (!buffer)
+    {
+        // Allocated out of the critical section, then kept in the empty slot unless the other task filled it meanwhile.
+        buffer = std::make_shared<std::vector<uint8_t>>(size);
+        if (emptySlot >= 0)
+        {
+            portENTER_CRITICAL(&poolMux);
+            if (!pool[emptySlot])
+            {
+                pool[emptySlot] = buffer;
+            }
+            portEXIT_CRITICAL(&poolMux);
+        }
+        return buffer;
+    }
+
+    // Pairs with the release of the last holder, whose reads of the previous body come before our writes.
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    // Within the capacity of the previous bodies this does not allocate.
+    buffer->resize(size);
+    return buffer;
+}
+
+std::shared_ptr<std::vector<uint8_t>> DataResponse::serialize(const flowmeters_snapshot *snapshot, const gps_fix &fix, unsigned long now)
+{
+    std::shared_ptr<std::vector<uint8_t>> response = takeBuffer(lastSize.load(std::memory_order_relaxed) + DATA_RESPONSE_SIZE_MARGIN);
+    JsonWriter writer(reinterpret_cast<char *>(response->data()), response->size());
+    write(writer, snapshot, fix, now);
+
+    // Grew past the margin (more nozzles or longer numbers), written again at the size it needs.
+    if (writer.isTruncated())
+    {
+        response->resize(writer.getLength());
+        writer = JsonWriter(reinterpret_cast<char *>(response->data()), response->size());
+        write(writer, snapshot, fix, now);
+    }
+
+    // Shrinking keeps the allocation, the margin stays unused at the end.
+    response->resize(writer.getLength());
+    lastSize.store(writer.getLength(), std::memory_order_relaxed);
+    return response;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "JsonWriter.h"
+#include "GPSReceiver.h"
+#include <freertos/FreeRTOS.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Room left for the body to grow over the previous one, so it is nearly always written once (bytes).
+#define DATA_RESPONSE_SIZE_MARGIN 256
+// Bodies that can be held at once (HTTP responses in flight and web socket queues) without allocating.
+#define DATA_RESPONSE_POOL_SIZE 8
+
+struct flowmeters_snapshot;
+
+/*
+ * Body of the /data responses and /ws/data pushes, written field by field from
+ * a snapshot with a JsonWriter. Values are in the units of the app: the
+ * integer units of the snapshot are scaled by powers of ten, so every value is
+ * exact. Only depends on the snapshot, so it can be benchmarked on the host.
+ */
+class DataResponse
+{
+private:
+    // Size of the last body, which the next one is allocated for.
+    static std::atomic<size_t> lastSize;
+    // Bodies reused once nothing but the pool holds them, with their control blocks.
+    static std::shared_ptr<std::vector<uint8_t>> pool[DATA_RESPONSE_POOL_SIZE];
+    static portMUX_TYPE poolMux;
+
+    // A body of the pool nobody holds, allocated on its first use. Falls back to a new one when all are held.
+    static std::shared_ptr<std::vector<uint8_t>> takeBuffer(size_t size);
+
+public:
+    /*
+     * Writes the body for the given fix and millis(). The same arguments
+     * always write the same bytes.
+     */
+    static void write(JsonWriter &writer, const flowmeters_snapshot *snapshot, const gps_fix &fix, unsigned long now);
+
+    /*
+     * Returns the body in a buffer of the pool, sized after the previous body.
+     * Should it not fit, the body is written again into a buffer of the size
+     * the first pass counted, which the pool keeps. Shared so the web socket
+     * queues and the HTTP response can hold it without copies; the buffer goes
+     * back to the pool when the last of them drops it.
+     */
+    static std::shared_ptr<std::vector<uint8_t>> serialize(const flowmeters_snapshot *snapshot, const gps_fix &fix, unsigned long now);
+};
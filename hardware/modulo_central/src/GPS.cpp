@@ -9,42 +9,199 @@ GPS::GPS()
 
 GPS::~GPS()
 {
-    delete gps;
+    delete receiver;
     delete gpsSerial;
 }
 
 void GPS::setup()
 {
-    gps = new TinyGPSPlus();
+    memset(&fix, 0, sizeof(fix));
+
+    receiver = new GPSReceiver();
     gpsSerial = new HardwareSerial(1);
 
-    gpsSerial->begin(GPS_BAUD, SERIAL_8N1, 25, 26);
+    xTaskCreatePinnedToCore(
+        GPS::taskFunction,
+        "gps",
+        GPS_TASK_STACK_SIZE,
+        this,
+        GPS_TASK_PRIORITY,
+        &task,
+        GPS_TASK_CORE);
 }
 
-void GPS::loop()
+void GPS::taskFunction(void *arg)
 {
-    while (gpsSerial->available() > 0)
+    GPS *gps = static_cast<GPS *>(arg);
+
+    gps->configure();
+
+    while (true)
+    {
+        gps->waitForData(GPS_READ_TIMEOUT);
+
+        const int64_t start = esp_timer_get_time();
+        gps->read();
+        gps->load.add(esp_timer_get_time() - start);
+    }
+}
+
+void GPS::configure()
+{
+    gpsSerial->setRxBufferSize(GPS_RX_BUFFER_SIZE);
+    gpsSerial->begin(GPS_BAUD, SERIAL_8N1, GPS_RX_PIN, GPS_TX_PIN);
+
+    // Called from the UART event task on a full FIFO or a pause in the data.
+    TaskHandle_t gpsTask = xTaskGetCurrentTaskHandle();
+    gpsSerial->onReceive([gpsTask]()
+                         { xTaskNotifyGive(gpsTask); });
+
+    uint8_t message[32];
+
+    if (!this->waitForSentence(GPS_DETECT_TIMEOUT))
+    {
+        gpsSerial->updateBaudRate(GPS_DEFAULT_BAUD);
+        gpsSerial->write(message, GPSReceiver::buildPortConfiguration(message, sizeof(message), GPS_BAUD));
+        gpsSerial->flush();
+        delay(GPS_BAUD_SWITCH_DELAY);
+        gpsSerial->updateBaudRate(GPS_BAUD);
+    }
+    this->baudRate = GPS_BAUD;
+
+    // RMC and GGA carry everything we use, the rest would only eat the UART.
+    const uint8_t disabledSentences[] = {UBX_NMEA_GLL, UBX_NMEA_GSA, UBX_NMEA_GSV, UBX_NMEA_VTG};
+    for (uint8_t nmeaId : disabledSentences)
     {
-        gps->encode(gpsSerial->read());
+        this->sendConfiguration(message, GPSReceiver::buildMessageRate(message, sizeof(message), nmeaId, 0));
     }
+    this->sendConfiguration(message, GPSReceiver::buildMessageRate(message, sizeof(message), UBX_NMEA_RMC, 1));
+    this->sendConfiguration(message, GPSReceiver::buildMessageRate(message, sizeof(message), UBX_NMEA_GGA, 1));
+
+    if (this->sendConfiguration(message, GPSReceiver::buildRateConfiguration(message, sizeof(message), GPS_MEASUREMENT_PERIOD)))
+    {
+        this->measurementPeriod = GPS_MEASUREMENT_PERIOD;
+    }
+    else if (this->sendConfiguration(message, GPSReceiver::buildRateConfiguration(message, sizeof(message), GPS_FALLBACK_MEASUREMENT_PERIOD)))
+    {
+        this->measurementPeriod = GPS_FALLBACK_MEASUREMENT_PERIOD;
+    }
+}
+
+void GPS::waitForData(unsigned long timeout)
+{
+    if (gpsSerial->available() == 0)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeout));
+    }
+}
+
+bool GPS::read()
+{
+    uint8_t buffer[GPS_READ_BUFFER_SIZE];
+    bool hasRead = false;
+
+    int available = gpsSerial->available();
+    while (available > 0)
+    {
+        const size_t len = gpsSerial->readBytes(buffer, std::min<int>(available, sizeof(buffer)));
+        hasRead = hasRead || len > 0;
+        this->capture->recordGps(buffer, len);
+
+        gps_fix newFix;
+        if (this->receiver->feed(buffer, len, millis(), newFix))
+        {
+            this->publishFix(newFix);
+        }
+
+        available = gpsSerial->available();
+    }
+
+    return hasRead;
+}
+
+bool GPS::waitForSentence(unsigned long timeout)
+{
+    const uint32_t sentenceCount = this->receiver->getSentenceCount();
+    const unsigned long start = millis();
+
+    while (this->receiver->getSentenceCount() == sentenceCount && millis() - start < timeout)
+    {
+        this->waitForData(timeout - (millis() - start));
+        this->read();
+    }
+
+    return this->receiver->getSentenceCount() != sentenceCount;
+}
+
+bool GPS::sendConfiguration(const uint8_t *message, size_t size)
+{
+    const uint32_t ackCount = this->receiver->getAckCount();
+    gpsSerial->write(message, size);
+
+    const unsigned long start = millis();
+    while (millis() - start < GPS_ACK_TIMEOUT)
+    {
+        this->waitForData(GPS_ACK_TIMEOUT - (millis() - start));
+        this->read();
+
+        // Acknowledgements come in the order of the messages, only ours can be new.
+        if (this->receiver->getAckCount() != ackCount)
+        {
+            const ubx_ack ack = this->receiver->getLastAck();
+            return ack.messageClass == message[2] && ack.messageId == message[3] && ack.isAcknowledged;
+        }
+    }
+
+    return false;
+}
+
+void GPS::publishFix(const gps_fix &fix)
+{
+    const uint32_t sequence = this->fixSequence.load(std::memory_order_relaxed);
+
+    this->fixSequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    this->fix = fix;
+    this->fixSequence.store(sequence + 2, std::memory_order_release);
+}
+
+void GPS::getFix(gps_fix &fix)
+{
+    uint32_t before;
+    uint32_t after;
+    do
+    {
+        before = this->fixSequence.load(std::memory_order_acquire);
+        fix = this->fix;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = this->fixSequence.load(std::memory_order_relaxed);
+    } while ((before & 1) != 0 || before != after);
 }
 
 float GPS::getSpeed()
 {
-    return gps->speed.mps();
+    gps_fix fix;
+    this->getFix(fix);
+    return fix.speed;
 }
 
 double GPS::getLatitude()
 {
-    return gps->location.lat();
+    gps_fix fix;
+    this->getFix(fix);
+    return fix.latitude;
 }
 
 double GPS::getLongitude()
 {
-    return gps->location.lng();
+    gps_fix fix;
+    this->getFix(fix);
+    return fix.longitude;
 }
 
 uint32_t GPS::getSatelliteCount()
 {
-    return gps->satellites.value();
+    gps_fix fix;
+    this->getFix(fix);
+    return fix.satelliteCount;
 }
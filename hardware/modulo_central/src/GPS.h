@@ -1,9 +1,50 @@
 #pragma once
 
-#include <TinyGPS++.h>
+#include <Arduino.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <TaskLoad.h>
+#include <TrafficCapture.h>
+#include <esp_timer.h>
+#include "GPSReceiver.h"
 
-#define GPS_BAUD 9600
+#define GPS_RX_PIN 25
+#define GPS_TX_PIN 26
 
+// Receivers start at GPS_DEFAULT_BAUD after a power cycle and are switched to
+// GPS_BAUD, which they keep while powered, so a reboot of the main module
+// alone finds them at GPS_BAUD already.
+#define GPS_DEFAULT_BAUD 9600
+#define GPS_BAUD 115200
+// Time without a sentence at GPS_BAUD before the receiver is taken to be at GPS_DEFAULT_BAUD, in ms.
+#define GPS_DETECT_TIMEOUT 1500
+// Time for the port configuration to leave at the old baud rate before switching, in ms.
+#define GPS_BAUD_SWITCH_DELAY 100
+#define GPS_ACK_TIMEOUT 250
+
+// One solution every 100 ms (10 Hz), or 200 ms (5 Hz) for receivers refusing it (NEO-6).
+#define GPS_MEASUREMENT_PERIOD 100
+#define GPS_FALLBACK_MEASUREMENT_PERIOD 200
+
+#define GPS_RX_BUFFER_SIZE 1024
+#define GPS_READ_BUFFER_SIZE 256
+// Longest wait for the UART before reading anyway, in ms.
+#define GPS_READ_TIMEOUT 100
+
+// Off the radio core, above the web server tasks so sentences never pile up in the UART.
+#define GPS_TASK_PRIORITY 4
+#define GPS_TASK_CORE 1
+#define GPS_TASK_STACK_SIZE 4096
+
+/*
+ * Reads the GPS receiver from its own task, woken by the UART, and publishes
+ * the latest fix for the other tasks.
+ *
+ * The fix is published under a sequence lock: the GPS task is the only
+ * writer, readers copy it and retry if it changed meanwhile, so they never
+ * block nor make the GPS task wait.
+ */
 class GPS
 {
     // Constructor and destructor.
@@ -12,10 +53,32 @@ public:
     ~GPS();
 
 private:
-    TinyGPSPlus *gps = nullptr;
+    GPSReceiver *receiver = nullptr;
     HardwareSerial *gpsSerial = nullptr;
+    TaskHandle_t task = nullptr;
+    task_load load;
+    // What the UART delivers is recorded along with the radio traffic, once a capture is started.
+    TrafficCapture *capture = TrafficCapture::getInstance();
+
+    uint32_t baudRate = 0;
+    // Period of the solutions once configured, 0 while unknown.
+    uint16_t measurementPeriod = 0;
+
+    // Odd while the fix is being written.
+    std::atomic<uint32_t> fixSequence{0};
+    gps_fix fix;
 
     void setup();
+    static void taskFunction(void *arg);
+
+    void configure();
+    // Reads what the UART received, returns false if there was nothing.
+    bool read();
+    void waitForData(unsigned long timeout);
+    bool waitForSentence(unsigned long timeout);
+    // Sends a UBX configuration message, true once the receiver acknowledged it.
+    bool sendConfiguration(const uint8_t *message, size_t size);
+    void publishFix(const gps_fix &fix);
 
 public:
     static GPS *instance;
@@ -29,10 +92,19 @@ public:
         return instance;
     };
     static bool hasInstance() { return instance != nullptr; };
-    void loop();
+
+    /*
+     * Copies the latest fix. Never blocks, callable from any task.
+     */
+    void getFix(gps_fix &fix);
 
     float getSpeed();
     double getLatitude();
     double getLongitude();
     uint32_t getSatelliteCount();
-};
\ No newline at end of file
+
+    uint32_t getBaudRate() { return baudRate; }
+    uint16_t getMeasurementPeriod() { return measurementPeriod; }
+    TaskHandle_t getTask() { return task; }
+    const task_load &getLoad() { return load; }
+};
@@ -0,0 +1,247 @@
+#include "GPSReceiver.h"
+
+GPSReceiver::GPSReceiver()
+{
+    memset(&fix, 0, sizeof(fix));
+    memset(&lastAck, 0, sizeof(lastAck));
+}
+
+GPSReceiver::~GPSReceiver()
+{
+}
+
+bool GPSReceiver::feed(const uint8_t *data, size_t len, unsigned long now, gps_fix &fix)
+{
+    bool isUpdated = false;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (this->feedUbx(data[i]))
+        {
+            continue;
+        }
+
+        if (this->gps.encode((char)data[i]))
+        {
+            isUpdated = this->updateFix(now) || isUpdated;
+        }
+    }
+
+    if (isUpdated)
+    {
+        fix = this->fix;
+    }
+    return isUpdated;
+}
+
+bool GPSReceiver::updateFix(unsigned long now)
+{
+    bool isUpdated = false;
+
+    // RMC brings position, speed and course, GGA position, satellites and HDOP.
+    if (this->gps.location.isUpdated())
+    {
+        this->fix.isValid = this->gps.location.isValid();
+        this->fix.latitude = this->gps.location.lat();
+        this->fix.longitude = this->gps.location.lng();
+        isUpdated = true;
+    }
+    if (this->gps.speed.isUpdated())
+    {
+        this->fix.speed = this->gps.speed.mps();
+        isUpdated = true;
+    }
+    if (this->gps.course.isUpdated())
+    {
+        this->fix.course = this->gps.course.deg();
+    }
+    if (this->gps.satellites.isUpdated())
+    {
+        this->fix.satelliteCount = this->gps.satellites.value();
+    }
+    if (this->gps.hdop.isUpdated())
+    {
+        this->fix.hdop = this->gps.hdop.hdop();
+    }
+    // Only RMC has the date, a receiver without a fix sends it empty.
+    if (this->gps.date.isUpdated() && this->gps.date.isValid() && this->gps.time.isValid() && this->gps.date.year() >= 2000)
+    {
+        this->fix.utcTime = toUnixTime(this->gps.date.year(), this->gps.date.month(), this->gps.date.day(),
+                                       this->gps.time.hour(), this->gps.time.minute(), this->gps.time.second());
+    }
+
+    if (isUpdated)
+    {
+        this->fix.timestamp = now;
+    }
+    return isUpdated;
+}
+
+uint32_t GPSReceiver::toUnixTime(uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minute, uint8_t second)
+{
+    // Days since 1970-01-01 of the civil date, counting years from March so the leap day comes last.
+    const uint32_t shiftedYear = month <= 2 ? year - 1 : year;
+    const uint32_t era = shiftedYear / 400;
+    const uint32_t yearOfEra = shiftedYear - era * 400;
+    const uint32_t dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    const uint32_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    const uint32_t days = era * 146097 + dayOfEra - 719468;
+
+    return days * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+bool GPSReceiver::feedUbx(uint8_t value)
+{
+    if (this->ubxPosition == 0)
+    {
+        // NMEA is plain ASCII, the first sync char never shows up in a sentence.
+        if (value != UBX_SYNC_CHAR_1)
+        {
+            return false;
+        }
+        this->ubxPosition = 1;
+        return true;
+    }
+
+    if (this->ubxPosition == 1)
+    {
+        if (value != UBX_SYNC_CHAR_2)
+        {
+            this->ubxPosition = 0;
+            return false;
+        }
+        this->ubxPosition = 2;
+        this->ubxLength = 0;
+        this->ubxChecksumA = 0;
+        this->ubxChecksumB = 0;
+        return true;
+    }
+
+    const uint16_t position = this->ubxPosition++;
+
+    // Class, id and length, then the payload, all covered by the checksum.
+    if (position < 6 + this->ubxLength)
+    {
+        this->ubxChecksumA = this->ubxChecksumA + value;
+        this->ubxChecksumB = this->ubxChecksumB + this->ubxChecksumA;
+    }
+
+    if (position < 6)
+    {
+        this->ubxHeader[position - 2] = value;
+        if (position == 5)
+        {
+            this->ubxLength = this->ubxHeader[2] | (this->ubxHeader[3] << 8);
+            if (this->ubxLength > UBX_MAX_FRAME_LENGTH)
+            {
+                this->ubxPosition = 0;
+            }
+        }
+        return true;
+    }
+
+    if (position < 6 + this->ubxLength)
+    {
+        if (position - 6 < UBX_MAX_PAYLOAD)
+        {
+            this->ubxPayload[position - 6] = value;
+        }
+        return true;
+    }
+
+    if (position == 6 + this->ubxLength)
+    {
+        if (value != this->ubxChecksumA)
+        {
+            this->ubxPosition = 0;
+        }
+        return true;
+    }
+
+    this->ubxPosition = 0;
+    if (value == this->ubxChecksumB)
+    {
+        this->onUbxFrame();
+    }
+    return true;
+}
+
+void GPSReceiver::onUbxFrame()
+{
+    this->ubxFrameCount++;
+
+    const uint8_t messageClass = this->ubxHeader[0];
+    const uint8_t messageId = this->ubxHeader[1];
+    if (messageClass == UBX_CLASS_ACK && this->ubxLength == 2)
+    {
+        this->lastAck.messageClass = this->ubxPayload[0];
+        this->lastAck.messageId = this->ubxPayload[1];
+        this->lastAck.isAcknowledged = messageId == UBX_ID_ACK_ACK;
+        this->ackCount++;
+    }
+}
+
+size_t GPSReceiver::buildUbx(uint8_t *buffer, size_t bufferSize, uint8_t messageClass, uint8_t messageId, const uint8_t *payload, uint16_t payloadSize)
+{
+    const size_t size = UBX_FRAME_OVERHEAD + payloadSize;
+    if (size > bufferSize)
+    {
+        return 0;
+    }
+
+    buffer[0] = UBX_SYNC_CHAR_1;
+    buffer[1] = UBX_SYNC_CHAR_2;
+    buffer[2] = messageClass;
+    buffer[3] = messageId;
+    buffer[4] = payloadSize & 0xFF;
+    buffer[5] = payloadSize >> 8;
+    memcpy(buffer + 6, payload, payloadSize);
+
+    // 8-bit Fletcher over class, id, length and payload.
+    uint8_t checksumA = 0;
+    uint8_t checksumB = 0;
+    for (size_t i = 2; i < size - 2; i++)
+    {
+        checksumA = checksumA + buffer[i];
+        checksumB = checksumB + checksumA;
+    }
+    buffer[6 + payloadSize] = checksumA;
+    buffer[7 + payloadSize] = checksumB;
+
+    return size;
+}
+
+size_t GPSReceiver::buildPortConfiguration(uint8_t *buffer, size_t bufferSize, uint32_t baudRate)
+{
+    uint8_t payload[20];
+    memset(payload, 0, sizeof(payload));
+
+    payload[0] = 1; // UART1
+    // Mode: 8 data bits, no parity, 1 stop bit.
+    payload[4] = 0xD0;
+    payload[5] = 0x08;
+    payload[8] = baudRate & 0xFF;
+    payload[9] = (baudRate >> 8) & 0xFF;
+    payload[10] = (baudRate >> 16) & 0xFF;
+    payload[11] = baudRate >> 24;
+    // In: UBX, NMEA and RTCM. Out: UBX and NMEA.
+    payload[12] = 0x07;
+    payload[14] = 0x03;
+
+    return buildUbx(buffer, bufferSize, UBX_CLASS_CFG, UBX_ID_CFG_PRT, payload, sizeof(payload));
+}
+
+size_t GPSReceiver::buildRateConfiguration(uint8_t *buffer, size_t bufferSize, uint16_t measurementPeriod)
+{
+    // Measurement period, one navigation solution per measurement, aligned to GPS time.
+    const uint8_t payload[6] = {(uint8_t)(measurementPeriod & 0xFF), (uint8_t)(measurementPeriod >> 8), 1, 0, 1, 0};
+
+    return buildUbx(buffer, bufferSize, UBX_CLASS_CFG, UBX_ID_CFG_RATE, payload, sizeof(payload));
+}
+
+size_t GPSReceiver::buildMessageRate(uint8_t *buffer, size_t bufferSize, uint8_t nmeaId, uint8_t rate)
+{
+    const uint8_t payload[3] = {UBX_NMEA_CLASS, nmeaId, rate};
+
+    return buildUbx(buffer, bufferSize, UBX_CLASS_CFG, UBX_ID_CFG_MSG, payload, sizeof(payload));
+}
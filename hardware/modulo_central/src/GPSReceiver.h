@@ -0,0 +1,127 @@
+#pragma once
+
+#include <TinyGPS++.h>
+
+// UBX protocol of u-blox receivers, used to configure them.
+#define UBX_SYNC_CHAR_1 0xB5
+#define UBX_SYNC_CHAR_2 0x62
+#define UBX_CLASS_ACK 0x05
+#define UBX_ID_ACK_NAK 0x00
+#define UBX_ID_ACK_ACK 0x01
+#define UBX_CLASS_CFG 0x06
+#define UBX_ID_CFG_PRT 0x00
+#define UBX_ID_CFG_MSG 0x01
+#define UBX_ID_CFG_RATE 0x08
+// Sync chars, class, id, length and checksum around the payload.
+#define UBX_FRAME_OVERHEAD 8
+// Largest payload this parser keeps, the ACK ones are 2 bytes. Longer frames
+// are skipped, and a length above UBX_MAX_FRAME_LENGTH is a false sync.
+#define UBX_MAX_PAYLOAD 8
+#define UBX_MAX_FRAME_LENGTH 512
+
+// NMEA sentences as ids of the standard NMEA message class (0xF0) in CFG-MSG.
+#define UBX_NMEA_CLASS 0xF0
+#define UBX_NMEA_GGA 0x00
+#define UBX_NMEA_GLL 0x01
+#define UBX_NMEA_GSA 0x02
+#define UBX_NMEA_GSV 0x03
+#define UBX_NMEA_RMC 0x04
+#define UBX_NMEA_VTG 0x05
+
+/*
+ * Position and speed of the boom, from the sentences of one receiver epoch.
+ */
+typedef struct gps_fix
+{
+    // millis() when the sentence that completed the fix was read, 0 if there was none yet.
+    unsigned long timestamp;
+    bool isValid;
+    double latitude;
+    double longitude;
+    // Meters per second and degrees from north.
+    float speed;
+    float course;
+    uint8_t satelliteCount;
+    float hdop;
+    // UTC of the last sentence carrying date and time, in seconds since 1970, 0 until the receiver knows it.
+    uint32_t utcTime;
+} gps_fix;
+
+/*
+ * Acknowledgement of a UBX configuration message.
+ */
+typedef struct ubx_ack
+{
+    uint8_t messageClass;
+    uint8_t messageId;
+    bool isAcknowledged;
+} ubx_ack;
+
+/*
+ * Parses the byte stream of a GPS receiver, NMEA sentences through TinyGPS++
+ * and the UBX acknowledgements interleaved with them, and builds the UBX
+ * messages that configure the receiver.
+ *
+ * Depends only on TinyGPS++, no serial port or task, so it can be fed with
+ * recorded logs on the host.
+ */
+class GPSReceiver
+{
+public:
+    GPSReceiver();
+    ~GPSReceiver();
+
+private:
+    TinyGPSPlus gps;
+    gps_fix fix;
+
+    // UBX frame being received, the NMEA parser never sees its bytes. The
+    // position counts the bytes received, 0 when outside of a frame.
+    uint16_t ubxPosition = 0;
+    uint8_t ubxHeader[4];
+    uint16_t ubxLength = 0;
+    uint8_t ubxPayload[UBX_MAX_PAYLOAD];
+    uint8_t ubxChecksumA = 0;
+    uint8_t ubxChecksumB = 0;
+
+    ubx_ack lastAck;
+    uint32_t ackCount = 0;
+    uint32_t ubxFrameCount = 0;
+
+    bool feedUbx(uint8_t value);
+    void onUbxFrame();
+    bool updateFix(unsigned long now);
+    static uint32_t toUnixTime(uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minute, uint8_t second);
+
+public:
+    /*
+     * Parses len bytes read at now (millis()). Returns true when they
+     * completed at least one sentence carrying position or speed, fix then
+     * holds the latest fix.
+     */
+    bool feed(const uint8_t *data, size_t len, unsigned long now, gps_fix &fix);
+
+    // Sentences with a valid and an invalid checksum so far.
+    uint32_t getSentenceCount() { return gps.passedChecksum(); }
+    uint32_t getFailedSentenceCount() { return gps.failedChecksum(); }
+    uint32_t getUbxFrameCount() { return ubxFrameCount; }
+
+    /*
+     * Acknowledgements are counted as they arrive, a waiting caller compares
+     * the count before and after sending and then checks the last one.
+     */
+    uint32_t getAckCount() { return ackCount; }
+    ubx_ack getLastAck() { return lastAck; }
+
+    /*
+     * Builders of UBX messages, returning the frame size or 0 if it does not
+     * fit in bufferSize.
+     */
+    static size_t buildUbx(uint8_t *buffer, size_t bufferSize, uint8_t messageClass, uint8_t messageId, const uint8_t *payload, uint16_t payloadSize);
+    // UART1 at baudRate, 8N1, UBX and NMEA in and out.
+    static size_t buildPortConfiguration(uint8_t *buffer, size_t bufferSize, uint32_t baudRate);
+    // One navigation solution every measurementPeriod milliseconds.
+    static size_t buildRateConfiguration(uint8_t *buffer, size_t bufferSize, uint16_t measurementPeriod);
+    // Output rate of an NMEA sentence on the current port, per navigation solution (0 disables it).
+    static size_t buildMessageRate(uint8_t *buffer, size_t bufferSize, uint8_t nmeaId, uint8_t rate);
+};
@@ -0,0 +1,419 @@
+#include "JobLog.h"
+#include <FlowmeterFrame.h>
+#include <esp_timer.h>
+#include <cmath>
+
+// Flags, time, UTC, position, speed and nozzle count, each at their longest, and the length ahead of them.
+#define JOB_LOG_RECORD_OVERHEAD (3 + 1 + 5 + 5 + 5 + 5 + 5 + 3)
+// Largest zigzag varint of a volume difference.
+#define JOB_LOG_VOLUME_MAX_SIZE 5
+
+static uint32_t toZigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+JobLog::JobLog(uint16_t maxNozzles)
+{
+    // Whatever the boom, a record always fits in an empty block.
+    const size_t maxBlockNozzles = (JOB_LOG_BLOCK_SIZE - sizeof(job_log_block_header) - JOB_LOG_RECORD_OVERHEAD) / JOB_LOG_VOLUME_MAX_SIZE;
+    this->maxNozzles = std::min<size_t>(maxNozzles, maxBlockNozzles);
+
+    this->lastVolume = new uint32_t[this->maxNozzles]();
+    this->record = new uint8_t[JOB_LOG_RECORD_OVERHEAD + this->maxNozzles * JOB_LOG_VOLUME_MAX_SIZE];
+
+    preferences = new Preferences();
+    preferences->begin("jobLog", false);
+}
+
+JobLog::~JobLog()
+{
+    delete[] lastVolume;
+    delete[] record;
+    delete preferences;
+}
+
+bool JobLog::begin()
+{
+    if (!LittleFS.begin(true))
+    {
+        return false;
+    }
+    if (!LittleFS.exists(JOB_LOG_DIRECTORY) && !LittleFS.mkdir(JOB_LOG_DIRECTORY))
+    {
+        return false;
+    }
+
+    this->bootId = preferences->getUInt("boot", 0) + 1;
+    preferences->putUInt("boot", this->bootId);
+
+    this->scanSegments();
+
+    xTaskCreatePinnedToCore(
+        JobLog::taskFunction,
+        "jobLog",
+        JOB_LOG_TASK_STACK_SIZE,
+        this,
+        JOB_LOG_TASK_PRIORITY,
+        &this->task,
+        JOB_LOG_TASK_CORE);
+
+    this->isMounted.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+void JobLog::getSegmentPath(uint32_t segment, char *path, size_t pathSize)
+{
+    snprintf(path, pathSize, JOB_LOG_DIRECTORY "/%08lu.log", (unsigned long)segment);
+}
+
+void JobLog::scanSegments()
+{
+    uint32_t first = 0;
+    uint32_t last = 0;
+    uint32_t totalSize = 0;
+
+    File directory = LittleFS.open(JOB_LOG_DIRECTORY);
+    File file = directory.openNextFile();
+    while (file)
+    {
+        char *end;
+        const uint32_t segment = strtoul(file.name(), &end, 10);
+        if (segment != 0 && strcmp(end, ".log") == 0)
+        {
+            first = first == 0 ? segment : std::min(first, segment);
+            last = std::max(last, segment);
+            totalSize += file.size();
+        }
+        file.close();
+        file = directory.openNextFile();
+    }
+    directory.close();
+
+    this->firstSegment.store(first, std::memory_order_relaxed);
+    this->lastSegment.store(last, std::memory_order_relaxed);
+    this->size.store(totalSize, std::memory_order_relaxed);
+}
+
+void JobLog::append(const job_log_cycle &cycle)
+{
+    if (!this->isStarted())
+    {
+        return;
+    }
+
+    // clear() throws away the block being filled too.
+    const uint32_t currentGeneration = this->generation.load(std::memory_order_relaxed);
+    if (currentGeneration != this->activeGeneration)
+    {
+        this->activeGeneration = currentGeneration;
+        this->activeSize = 0;
+        this->activeRecordCount = 0;
+        this->wasIdle = false;
+    }
+
+    if (this->activeSize != 0 && cycle.timestamp - this->blockStartTime >= JOB_LOG_FLUSH_INTERVAL)
+    {
+        this->sealBlock();
+    }
+
+    const uint16_t nozzleCount = std::min(cycle.nozzleCount, this->maxNozzles);
+    bool isIdle = cycle.speed == 0 && nozzleCount == this->lastNozzleCount;
+    for (uint16_t i = 0; i < nozzleCount && isIdle; i++)
+    {
+        isIdle = cycle.volume[i] == this->lastVolume[i];
+    }
+    if (isIdle && this->wasIdle)
+    {
+        this->idleCycleCount.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    this->wasIdle = isIdle;
+
+    const bool hasPosition = cycle.fix != nullptr && cycle.fix->isValid;
+    const int32_t latitude = hasPosition ? (int32_t)llround(cycle.fix->latitude * 1e7) : 0;
+    const int32_t longitude = hasPosition ? (int32_t)llround(cycle.fix->longitude * 1e7) : 0;
+
+    uint8_t length[3];
+    size_t recordSize = 0;
+    size_t lengthSize = 0;
+    if (this->activeSize != 0)
+    {
+        recordSize = this->encodeRecord(cycle, false, latitude, longitude);
+        lengthSize = FlowmeterFrame::writeVarint(length, sizeof(length), recordSize);
+        if (this->activeSize + lengthSize + recordSize > JOB_LOG_BLOCK_SIZE)
+        {
+            this->sealBlock();
+        }
+    }
+    // A full block starts over with the absolute values.
+    if (this->activeSize == 0)
+    {
+        this->startBlock(cycle.timestamp);
+        recordSize = this->encodeRecord(cycle, true, latitude, longitude);
+        lengthSize = FlowmeterFrame::writeVarint(length, sizeof(length), recordSize);
+    }
+
+    uint8_t *block = this->blocks[this->activeBlock];
+    memcpy(block + this->activeSize, length, lengthSize);
+    memcpy(block + this->activeSize + lengthSize, this->record, recordSize);
+    this->activeSize += lengthSize + recordSize;
+    this->activeRecordCount++;
+    this->recordCount.fetch_add(1, std::memory_order_relaxed);
+
+    this->lastRecordTime = cycle.timestamp;
+    if (hasPosition)
+    {
+        this->lastLatitude = latitude;
+        this->lastLongitude = longitude;
+    }
+    this->lastNozzleCount = nozzleCount;
+    memcpy(this->lastVolume, cycle.volume, nozzleCount * sizeof(uint32_t));
+    this->hasBlockUtc = this->hasBlockUtc || (record[0] & JOB_LOG_RECORD_UTC);
+}
+
+size_t JobLog::encodeRecord(const job_log_cycle &cycle, bool isFirst, int32_t latitude, int32_t longitude)
+{
+    const size_t maxSize = JOB_LOG_RECORD_OVERHEAD + this->maxNozzles * JOB_LOG_VOLUME_MAX_SIZE;
+    const uint16_t nozzleCount = std::min(cycle.nozzleCount, this->maxNozzles);
+    const bool hasPosition = cycle.fix != nullptr && cycle.fix->isValid;
+    const bool hasUtc = (isFirst || !this->hasBlockUtc) && cycle.fix != nullptr && cycle.fix->utcTime != 0;
+
+    uint8_t flags = 0;
+    flags |= hasPosition ? JOB_LOG_RECORD_POSITION : 0;
+    flags |= hasUtc ? JOB_LOG_RECORD_UTC : 0;
+    flags |= cycle.isStale ? JOB_LOG_RECORD_STALE : 0;
+
+    size_t size = 0;
+    this->record[size++] = flags;
+    size += FlowmeterFrame::writeVarint(this->record + size, maxSize - size, cycle.timestamp - (isFirst ? this->blockStartTime : this->lastRecordTime));
+    if (hasUtc)
+    {
+        // The fix is at most a few measurement periods old, seconds are all the UTC needs.
+        const int32_t fixAge = (int32_t)(cycle.timestamp - cycle.fix->timestamp);
+        size += FlowmeterFrame::writeVarint(this->record + size, maxSize - size, cycle.fix->utcTime + fixAge / 1000);
+    }
+    if (hasPosition)
+    {
+        size += FlowmeterFrame::writeVarint(this->record + size, maxSize - size, toZigzag(latitude - (isFirst ? 0 : this->lastLatitude)));
+        size += FlowmeterFrame::writeVarint(this->record + size, maxSize - size, toZigzag(longitude - (isFirst ? 0 : this->lastLongitude)));
+    }
+    size += FlowmeterFrame::writeVarint(this->record + size, maxSize - size, cycle.speed);
+
+    size += FlowmeterFrame::writeVarint(this->record + size, maxSize - size, nozzleCount);
+    for (uint16_t i = 0; i < nozzleCount; i++)
+    {
+        const uint32_t previous = !isFirst && i < this->lastNozzleCount ? this->lastVolume[i] : 0;
+        size += FlowmeterFrame::writeVarint(this->record + size, maxSize - size, toZigzag((int32_t)(cycle.volume[i] - previous)));
+    }
+
+    return size;
+}
+
+void JobLog::startBlock(unsigned long timestamp)
+{
+    this->activeSize = sizeof(job_log_block_header);
+    this->activeRecordCount = 0;
+    this->blockStartTime = timestamp;
+    this->hasBlockUtc = false;
+}
+
+void JobLog::sealBlock()
+{
+    if (this->activeSize == 0)
+    {
+        return;
+    }
+
+    job_log_block_header header;
+    memcpy(header.magic, JOB_LOG_MAGIC, sizeof(header.magic));
+    header.version = JOB_LOG_VERSION;
+    header.reserved = 0;
+    header.size = this->activeSize - sizeof(job_log_block_header);
+    header.recordCount = this->activeRecordCount;
+    header.bootId = this->bootId;
+    header.startTime = this->blockStartTime;
+    memcpy(this->blocks[this->activeBlock], &header, sizeof(header));
+
+    portENTER_CRITICAL(&mux);
+    const bool isWriterBusy = this->pendingSize != 0;
+    if (!isWriterBusy)
+    {
+        this->pendingSize = this->activeSize;
+        this->pendingRecordCount = this->activeRecordCount;
+        this->pendingGeneration = this->activeGeneration;
+        this->activeBlock = 1 - this->activeBlock;
+    }
+    portEXIT_CRITICAL(&mux);
+
+    if (isWriterBusy)
+    {
+        this->droppedRecordCount.fetch_add(this->activeRecordCount, std::memory_order_relaxed);
+    }
+    else
+    {
+        xTaskNotifyGive(this->task);
+    }
+
+    this->activeSize = 0;
+    this->activeRecordCount = 0;
+}
+
+void JobLog::clear()
+{
+    this->generation.fetch_add(1, std::memory_order_relaxed);
+    this->isClearRequested.store(true, std::memory_order_relaxed);
+    if (this->task != nullptr)
+    {
+        xTaskNotifyGive(this->task);
+    }
+}
+
+void JobLog::taskFunction(void *arg)
+{
+    JobLog *jobLog = static_cast<JobLog *>(arg);
+
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        const int64_t start = esp_timer_get_time();
+
+        if (jobLog->isClearRequested.exchange(false, std::memory_order_relaxed))
+        {
+            jobLog->removeAllSegments();
+        }
+
+        // The acquisition task leaves the pending block alone until its size is back to 0.
+        portENTER_CRITICAL(&jobLog->mux);
+        const size_t blockSize = jobLog->pendingSize;
+        const uint16_t records = jobLog->pendingRecordCount;
+        const uint32_t blockGeneration = jobLog->pendingGeneration;
+        const uint8_t *block = jobLog->blocks[1 - jobLog->activeBlock];
+        portEXIT_CRITICAL(&jobLog->mux);
+
+        if (blockSize != 0)
+        {
+            if (blockGeneration == jobLog->generation.load(std::memory_order_relaxed))
+            {
+                jobLog->writeBlock(block, blockSize, records);
+            }
+
+            portENTER_CRITICAL(&jobLog->mux);
+            jobLog->pendingSize = 0;
+            portEXIT_CRITICAL(&jobLog->mux);
+        }
+
+        jobLog->load.add(esp_timer_get_time() - start);
+    }
+}
+
+void JobLog::writeBlock(const uint8_t *block, size_t blockSize, uint16_t records)
+{
+    if (!this->segmentFile || this->segmentFile.size() + blockSize > JOB_LOG_SEGMENT_SIZE)
+    {
+        if (!this->openSegment(this->lastSegment.load(std::memory_order_relaxed) + 1))
+        {
+            this->writeErrorCount.fetch_add(1, std::memory_order_relaxed);
+            this->droppedRecordCount.fetch_add(records, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    const int64_t start = esp_timer_get_time();
+    const size_t written = this->segmentFile.write(block, blockSize);
+    this->segmentFile.flush();
+    const uint32_t writeTime = (uint32_t)(esp_timer_get_time() - start);
+
+    this->size.fetch_add(written, std::memory_order_relaxed);
+    if (writeTime > this->maxWriteTime.load(std::memory_order_relaxed))
+    {
+        this->maxWriteTime.store(writeTime, std::memory_order_relaxed);
+    }
+
+    if (written != blockSize)
+    {
+        // Whatever part of the block made it ends the segment, so readers never find records after a torn block.
+        this->writeErrorCount.fetch_add(1, std::memory_order_relaxed);
+        this->droppedRecordCount.fetch_add(records, std::memory_order_relaxed);
+        this->segmentFile.close();
+        return;
+    }
+    this->blocksWrittenCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool JobLog::openSegment(uint32_t segment)
+{
+    this->segmentFile.close();
+    // Room for the new segment first, a full flash may not even create the file.
+    this->removeOldSegments();
+
+    char path[32];
+    getSegmentPath(segment, path, sizeof(path));
+    this->segmentFile = LittleFS.open(path, FILE_WRITE);
+    if (!this->segmentFile)
+    {
+        return false;
+    }
+
+    this->lastSegment.store(segment, std::memory_order_relaxed);
+    if (this->firstSegment.load(std::memory_order_relaxed) == 0)
+    {
+        this->firstSegment.store(segment, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+void JobLog::removeOldSegments()
+{
+    // The last segment always stays, the log is never left empty.
+    uint32_t first = this->firstSegment.load(std::memory_order_relaxed);
+    const uint32_t last = this->lastSegment.load(std::memory_order_relaxed);
+    while (first != 0 && first < last && (this->size.load(std::memory_order_relaxed) + JOB_LOG_SEGMENT_SIZE > JOB_LOG_MAX_SIZE || LittleFS.totalBytes() - LittleFS.usedBytes() < JOB_LOG_SEGMENT_SIZE))
+    {
+        char path[32];
+        getSegmentPath(first, path, sizeof(path));
+
+        File file = LittleFS.open(path, FILE_READ);
+        if (file)
+        {
+            this->size.fetch_sub(std::min<uint32_t>(file.size(), this->size.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+            file.close();
+            LittleFS.remove(path);
+        }
+
+        first++;
+        this->firstSegment.store(first, std::memory_order_relaxed);
+    }
+}
+
+void JobLog::removeAllSegments()
+{
+    this->segmentFile.close();
+
+    const uint32_t first = this->firstSegment.load(std::memory_order_relaxed);
+    const uint32_t last = this->lastSegment.load(std::memory_order_relaxed);
+    for (uint32_t segment = first; first != 0 && segment <= last; segment++)
+    {
+        char path[32];
+        getSegmentPath(segment, path, sizeof(path));
+        LittleFS.remove(path);
+    }
+
+    // The numbers go on, a client resuming a download never mistakes a new segment for one it has.
+    this->firstSegment.store(0, std::memory_order_relaxed);
+    this->size.store(0, std::memory_order_relaxed);
+}
+
+void JobLog::getStats(job_log_stats &stats)
+{
+    stats.isMounted = this->isStarted();
+    stats.firstSegment = this->getFirstSegment();
+    stats.lastSegment = this->getLastSegment();
+    stats.size = this->size.load(std::memory_order_relaxed);
+    stats.records = this->recordCount.load(std::memory_order_relaxed);
+    stats.idleCycles = this->idleCycleCount.load(std::memory_order_relaxed);
+    stats.droppedRecords = this->droppedRecordCount.load(std::memory_order_relaxed);
+    stats.blocksWritten = this->blocksWrittenCount.load(std::memory_order_relaxed);
+    stats.writeErrors = this->writeErrorCount.load(std::memory_order_relaxed);
+    stats.maxWriteTime = this->maxWriteTime.load(std::memory_order_relaxed);
+}
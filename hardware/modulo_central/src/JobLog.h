@@ -0,0 +1,226 @@
+#pragma once
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <Preferences.h>
+#include <atomic>
+#include <esp_now_types.h>
+#include <TaskLoad.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "GPSReceiver.h"
+
+#define JOB_LOG_DIRECTORY "/job"
+#define JOB_LOG_MAGIC "DFJL"
+#define JOB_LOG_VERSION 2
+
+// Records are gathered in RAM and written a block at a time, the erase unit
+// of the flash, so LittleFS never rewrites a half-filled block.
+#define JOB_LOG_BLOCK_SIZE 4096
+// Longest time a record waits in RAM before its block is written anyway (ms),
+// what a power cut can lose.
+#define JOB_LOG_FLUSH_INTERVAL 30000
+// Segments are files of up to this many blocks, the oldest one is deleted to
+// keep the log under JOB_LOG_MAX_SIZE and a segment of the flash free.
+#define JOB_LOG_SEGMENT_BLOCKS 16
+#define JOB_LOG_SEGMENT_SIZE (JOB_LOG_SEGMENT_BLOCKS * JOB_LOG_BLOCK_SIZE)
+#ifndef JOB_LOG_MAX_SIZE
+#define JOB_LOG_MAX_SIZE (1024 * 1024)
+#endif
+
+// Writer task, see main.cpp for the layout of the tasks. Below everything
+// else of the clients core, a block waiting a while for the flash is fine.
+#define JOB_LOG_TASK_CORE 1
+#define JOB_LOG_TASK_PRIORITY 1
+#define JOB_LOG_TASK_STACK_SIZE 4096
+
+// Flags of a record.
+// Latitude and longitude follow, the GPS had a valid fix.
+#define JOB_LOG_RECORD_POSITION 0x01
+// UTC follows, in the first record of a block once the GPS knows it.
+#define JOB_LOG_RECORD_UTC 0x02
+// Some secondaries did not answer the cycle, their nozzles did not add to their volumes.
+#define JOB_LOG_RECORD_STALE 0x04
+
+/*
+ * Segment file, JOB_LOG_DIRECTORY/<segment>.log, blocks one after the other:
+ *
+ *   job_log_block_header
+ *   records, size bytes:
+ *     varint   length       bytes of the record after this field
+ *     uint8_t  flags        JOB_LOG_RECORD_*
+ *     varint   timeDelta    milliseconds since the previous record of the block, or since startTime
+ *     with JOB_LOG_RECORD_UTC:
+ *       varint utcTime      seconds since 1970 at the record
+ *     with JOB_LOG_RECORD_POSITION:
+ *       zigzag latitude     1e-7 degrees, minus the previous position of the block (0 for the first)
+ *       zigzag longitude
+ *     varint   speed        mm/s, 0 when unknown
+ *     varint   nozzleCount
+ *     zigzag   volume[nozzleCount]
+ *                           millilitres sprayed by each nozzle since the last volume reset (as
+ *                           flowmetersVolume of /data) minus the volume of the previous record
+ *                           of the block, 0 for the first record and for nozzles it did not have
+ *
+ * Varints are those of FlowmeterFrame, zigzag varints map signed values
+ * n to (n << 1) ^ (n >> 31) first. A block decodes on its own, a damaged one
+ * only loses its records. Readers skip the fields of a record past what they
+ * know with its length.
+ *
+ * The volumes are cumulative, so the difference between any two records is
+ * what was sprayed between them whatever the cycles skipped or dropped. A
+ * volume reset shows as a negative difference. Cycles that add no volume at
+ * no speed are only logged once, the time gap to the next record shows the
+ * idle stretch.
+ */
+typedef struct job_log_block_header
+{
+    // JOB_LOG_MAGIC.
+    char magic[4];
+    uint8_t version;
+    uint8_t reserved;
+    // Bytes of records after the header.
+    uint16_t size;
+    uint16_t recordCount;
+    // Boots of the main module, millis() restart at each.
+    uint32_t bootId;
+    // millis() the first record counts its time delta from.
+    uint32_t startTime;
+} __attribute__((packed)) job_log_block_header;
+
+/*
+ * What is logged of an acquisition cycle.
+ */
+typedef struct job_log_cycle
+{
+    // millis() at the start of the cycle.
+    unsigned long timestamp;
+    const gps_fix *fix;
+    // mm/s, 0 when unknown.
+    uint32_t speed;
+    uint16_t nozzleCount;
+    // Millilitres of each nozzle since the last volume reset.
+    const uint32_t *volume;
+    bool isStale;
+} job_log_cycle;
+
+/*
+ * Job log counters, for /metrics.
+ */
+typedef struct job_log_stats
+{
+    bool isMounted;
+    uint32_t firstSegment;
+    uint32_t lastSegment;
+    // Bytes on the flash, whole segments.
+    uint32_t size;
+    uint32_t records;
+    uint32_t idleCycles;
+    // Records of the blocks the writer was still busy with, and of the blocks the flash refused.
+    uint32_t droppedRecords;
+    uint32_t blocksWritten;
+    uint32_t writeErrors;
+    // Longest block write (us).
+    uint32_t maxWriteTime;
+} job_log_stats;
+
+/*
+ * Append-only log of the acquisition cycles on the LittleFS partition, so the
+ * flow history of a job survives the app and the tablet.
+ *
+ * append() runs on the acquisition task and only encodes into the RAM block,
+ * the writer task does the flash writes: a block is handed over when full or
+ * JOB_LOG_FLUSH_INTERVAL after its first record. If the writer is still busy
+ * with the previous block, the new one is dropped and counted rather than
+ * ever making the acquisition wait on the flash.
+ */
+class JobLog
+{
+public:
+    JobLog(uint16_t maxNozzles);
+    ~JobLog();
+
+private:
+    uint16_t maxNozzles;
+    Preferences *preferences = nullptr;
+    uint32_t bootId = 0;
+
+    TaskHandle_t task = nullptr;
+    task_load load;
+    std::atomic<bool> isMounted{false};
+
+    // The acquisition task fills blocks[activeBlock], the writer task writes the
+    // other one while pendingSize is not 0. Swapped under mux.
+    uint8_t blocks[2][JOB_LOG_BLOCK_SIZE];
+    uint8_t activeBlock = 0;
+    size_t activeSize = 0;
+    uint16_t activeRecordCount = 0;
+    size_t pendingSize = 0;
+    uint16_t pendingRecordCount = 0;
+    // Bumped by clear(), the blocks started before it are thrown away.
+    std::atomic<uint32_t> generation{0};
+    uint32_t activeGeneration = 0;
+    uint32_t pendingGeneration = 0;
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+    // Delta state of the active block, owned by the acquisition task.
+    unsigned long blockStartTime = 0;
+    unsigned long lastRecordTime = 0;
+    int32_t lastLatitude = 0;
+    int32_t lastLongitude = 0;
+    uint16_t lastNozzleCount = 0;
+    // Volumes of the last record, kept across blocks for the idle check.
+    uint32_t *lastVolume = nullptr;
+    bool hasBlockUtc = false;
+    bool wasIdle = false;
+    // Record being encoded, before its length is known.
+    uint8_t *record = nullptr;
+
+    // Segment being appended, owned by the writer task.
+    File segmentFile;
+    std::atomic<uint32_t> firstSegment{0};
+    std::atomic<uint32_t> lastSegment{0};
+    std::atomic<uint32_t> size{0};
+    std::atomic<bool> isClearRequested{false};
+
+    std::atomic<uint32_t> recordCount{0};
+    std::atomic<uint32_t> idleCycleCount{0};
+    std::atomic<uint32_t> droppedRecordCount{0};
+    std::atomic<uint32_t> blocksWrittenCount{0};
+    std::atomic<uint32_t> writeErrorCount{0};
+    std::atomic<uint32_t> maxWriteTime{0};
+
+    static void taskFunction(void *arg);
+
+    // Encodes the record into record, against the delta state of the active block unless it is the first.
+    size_t encodeRecord(const job_log_cycle &cycle, bool isFirst, int32_t latitude, int32_t longitude);
+    void startBlock(unsigned long timestamp);
+    // Hands the active block over to the writer task.
+    void sealBlock();
+
+    void scanSegments();
+    bool openSegment(uint32_t segment);
+    void removeOldSegments();
+    void writeBlock(const uint8_t *block, size_t blockSize, uint16_t records);
+    void removeAllSegments();
+
+public:
+    // Mounts the partition, formatting it if it cannot, and starts the writer task. False if there is no flash for the log.
+    bool begin();
+    bool isStarted() { return isMounted.load(std::memory_order_relaxed); }
+
+    // Logs an acquisition cycle. Never blocks.
+    void append(const job_log_cycle &cycle);
+
+    // Deletes every segment, when starting a new job. The deletion itself happens on the writer task.
+    void clear();
+
+    static void getSegmentPath(uint32_t segment, char *path, size_t pathSize);
+    // Segments on the flash, oldest first, none when the first is 0. Numbers only grow until a reboot finds the log empty.
+    uint32_t getFirstSegment() { return firstSegment.load(std::memory_order_relaxed); }
+    uint32_t getLastSegment() { return lastSegment.load(std::memory_order_relaxed); }
+
+    void getStats(job_log_stats &stats);
+    TaskHandle_t getTask() { return task; }
+    const task_load &getLoad() { return load; }
+};
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Deepest nesting of objects and arrays a JsonWriter keeps track of.
+#define JSON_WRITER_MAX_DEPTH 8
+
+/*
+ * Writes JSON straight into a caller buffer, without a document in between
+ * and without allocating.
+ *
+ * Like snprintf, whatever does not fit is dropped but still counted, so
+ * getLength() is the size the whole output needs. Writing once without a
+ * buffer then again into one of that size gives the output with a single
+ * exact allocation, as long as both passes write the same values.
+ *
+ * Numbers are written from integers: fixed() takes a value scaled by a power
+ * of ten, so quantities kept as integers in smaller units (millilitres,
+ * millihertz...) come out exact instead of going through a float.
+ */
+class JsonWriter
+{
+private:
+    char *buffer;
+    size_t capacity;
+    size_t length = 0;
+
+    uint8_t depth = 0;
+    // Whether the container at each depth already has a member, so the next one needs a comma.
+    bool hasMember[JSON_WRITER_MAX_DEPTH + 1] = {};
+    // A key was just written, its value goes without a comma.
+    bool isAfterKey = false;
+
+    void write(char character)
+    {
+        if (this->length < this->capacity)
+        {
+            this->buffer[this->length] = character;
+        }
+        this->length++;
+    }
+
+    void write(const char *text, size_t textLength)
+    {
+        if (this->length < this->capacity)
+        {
+            memcpy(this->buffer + this->length, text, std::min(textLength, this->capacity - this->length));
+        }
+        this->length += textLength;
+    }
+
+    // Comma before every member but the first of its container.
+    void beginValue()
+    {
+        if (this->isAfterKey)
+        {
+            this->isAfterKey = false;
+            return;
+        }
+        if (this->hasMember[this->depth])
+        {
+            this->write(',');
+        }
+        this->hasMember[this->depth] = true;
+    }
+
+    void writeUnsigned(unsigned long long value)
+    {
+        char digits[20];
+        uint8_t count = 0;
+        do
+        {
+            digits[sizeof(digits) - ++count] = '0' + value % 10;
+            value /= 10;
+        } while (value != 0);
+        this->write(digits + sizeof(digits) - count, count);
+    }
+
+    void open(char character)
+    {
+        this->beginValue();
+        this->write(character);
+        this->depth++;
+        this->hasMember[this->depth] = false;
+    }
+
+    void close(char character)
+    {
+        this->depth--;
+        this->write(character);
+    }
+
+public:
+    // Without a buffer it only counts, see getLength().
+    JsonWriter(char *buffer = nullptr, size_t capacity = 0) : buffer(buffer), capacity(capacity) {}
+
+    // Bytes written, or that would have been written with room enough.
+    size_t getLength() const { return this->length; }
+    bool isTruncated() const { return this->length > this->capacity; }
+
+    void beginObject() { this->open('{'); }
+    void endObject() { this->close('}'); }
+    void beginArray() { this->open('['); }
+    void endArray() { this->close(']'); }
+
+    // Member name of the object being written. Names are written as is, they are never escaped.
+    void key(const char *name)
+    {
+        this->beginValue();
+        this->write('"');
+        this->write(name, strlen(name));
+        this->write("\":", 2);
+        this->isAfterKey = true;
+    }
+
+    // Every integer type, whatever the width of long on the target.
+    void value(unsigned long long value)
+    {
+        this->beginValue();
+        this->writeUnsigned(value);
+    }
+
+    void value(long long value)
+    {
+        this->beginValue();
+        if (value < 0)
+        {
+            this->write('-');
+        }
+        this->writeUnsigned(value < 0 ? -(unsigned long long)value : (unsigned long long)value);
+    }
+
+    void value(unsigned long value) { this->value((unsigned long long)value); }
+    void value(unsigned int value) { this->value((unsigned long long)value); }
+    void value(long value) { this->value((long long)value); }
+    void value(int value) { this->value((long long)value); }
+
+    /*
+     * Writes value / 10^decimals, without the trailing zeros of the fraction:
+     * fixed(1250, 3) writes 1.25 and fixed(2000, 3) writes 2.
+     */
+    void fixed(long long value, uint8_t decimals)
+    {
+        this->beginValue();
+        if (value < 0)
+        {
+            this->write('-');
+        }
+        const unsigned long long magnitude = value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+
+        unsigned long long scale = 1;
+        for (uint8_t i = 0; i < decimals; i++)
+        {
+            scale *= 10;
+        }
+        this->writeUnsigned(magnitude / scale);
+
+        unsigned long long fraction = magnitude % scale;
+        if (fraction == 0)
+        {
+            return;
+        }
+        while (fraction % 10 == 0)
+        {
+            fraction /= 10;
+            decimals--;
+        }
+
+        char digits[20];
+        for (uint8_t i = decimals; i > 0; i--)
+        {
+            digits[i - 1] = '0' + fraction % 10;
+            fraction /= 10;
+        }
+        this->write('.');
+        this->write(digits, decimals);
+    }
+
+    // A floating point value rounded to the given decimals, see fixed().
+    void rounded(double value, uint8_t decimals)
+    {
+        double scale = 1;
+        for (uint8_t i = 0; i < decimals; i++)
+        {
+            scale *= 10;
+        }
+        this->fixed(llround(value * scale), decimals);
+    }
+
+    void null()
+    {
+        this->beginValue();
+        this->write("null", 4);
+    }
+};
@@ -1,24 +1,90 @@
 #include "MainModule.h"
-#include <esp_task_wdt.h>
+#include "GPS.h"
+#include <new>
 
 MainModule *MainModule::instance = nullptr;
 
+// The boom arrays and the snapshots sized for MAX_FLOWMETERS make the module
+// tens of kilobytes, too much to ask of the heap in one block, so it lives
+// in .bss. Constructed on first use like the other singletons, never destroyed.
+alignas(MainModule) static uint8_t instanceStorage[sizeof(MainModule)];
+
 MainModule *MainModule::getInstance()
 {
     if (instance == nullptr)
     {
-        instance = new MainModule();
+        instance = new (instanceStorage) MainModule();
     }
     return instance;
 }
 
 MainModule::MainModule()
 {
+    preferences = new Preferences();
+    preferences->begin("main", false);
+
+    acquisitionInterval = preferences->getUShort("acqInterval", DEFAULT_ACQUISITION_INTERVAL);
+
+    memset(slaves, 0, sizeof(slaves));
+    memset(boomPulseCount, 0, sizeof(boomPulseCount));
+    memset(boomLastPulseAge, 0, sizeof(boomLastPulseAge));
+    memset(boomFlowRate, 0, sizeof(boomFlowRate));
+    memset(boomFlowRateConfidence, 0, sizeof(boomFlowRateConfidence));
+    memset(boomNozzleState, 0, sizeof(boomNozzleState));
+    memset(boomNozzleApplication, 0, sizeof(boomNozzleApplication));
+    memset(&boomApplication, 0, sizeof(boomApplication));
+    memset(&loopHistogram, 0, sizeof(loopHistogram));
+    memset(&cycleHistogram, 0, sizeof(cycleHistogram));
+
+    loadCalibrations();
+
+    memset(snapshots, 0, sizeof(snapshots));
+    for (flowmeters_snapshot &snapshot : snapshots)
+    {
+        snapshot.data.flowmetersPulseCount = snapshot.flowmetersPulseCount;
+        snapshot.data.flowmetersLastPulseAge = snapshot.flowmetersLastPulseAge;
+        snapshot.data.flowmetersRate = snapshot.flowmetersRate;
+        snapshot.data.flowmetersRateConfidence = snapshot.flowmetersRateConfidence;
+    }
+
     ESPNowManager::getInstance()->registerCallback(
         FLOWMETER_DATA_REQUEST + 0x80,
         MainModule::onDataResponseReceived);
 
+    ESPNowManager::getInstance()->registerCallback(
+        METRICS_REQUEST + 0x80,
+        MainModule::onMetricsReceived);
+
+    ESPNowManager::getInstance()->registerCallback(
+        PAIR_REQUEST,
+        MainModule::onPairRequestReceived);
+}
+
+void MainModule::begin()
+{
+    // Acquisition goes on without the log if the flash cannot hold one, /metrics tells.
+    this->jobLog->begin();
     this->webServer->start();
+
+    xTaskCreatePinnedToCore(
+        MainModule::acquisitionTaskFunction,
+        "acquisition",
+        ACQUISITION_TASK_STACK_SIZE,
+        this,
+        ACQUISITION_TASK_PRIORITY,
+        &this->acquisitionTask,
+        ACQUISITION_TASK_CORE);
+}
+
+void MainModule::acquisitionTaskFunction(void *arg)
+{
+    MainModule *mainModule = static_cast<MainModule *>(arg);
+
+    while (true)
+    {
+        mainModule->loop();
+        ulTaskNotifyTake(pdTRUE, ACQUISITION_TASK_PERIOD);
+    }
 }
 
 MainModule::~MainModule()
@@ -31,226 +97,820 @@ ESPNowCentralManager *MainModule::getEspNowCentralManager()
     return this->espNowCentralManager;
 }
 
-void MainModule::onDataResponseReceived(const uint8_t *mac_addr, const uint8_t *data, int data_len)
+NozzleMonitor *MainModule::getNozzleMonitor()
+{
+    return this->nozzleMonitor;
+}
+
+uint8_t MainModule::copyLinkStats(request_link_stats *output, uint8_t maxCount)
+{
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    const uint8_t count = std::min(this->slavesCount, maxCount);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        this->requestScheduler->getStats(this->slaves[i].link, output[i]);
+    }
+    xSemaphoreGive(flowmetersDataMutex);
+
+    return count;
+}
+
+uint8_t MainModule::copySlaveMetrics(secondary_module_metrics *output, uint8_t maxCount)
+{
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    const uint8_t count = std::min(this->slavesCount, maxCount);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        output[i] = this->slaves[i].metrics;
+    }
+    xSemaphoreGive(flowmetersDataMutex);
+
+    return count;
+}
+
+void MainModule::copyLoopMetrics(latency_histogram &loop, latency_histogram &cycle)
+{
+    portENTER_CRITICAL(&metricsMux);
+    loop = this->loopHistogram;
+    cycle = this->cycleHistogram;
+    portEXIT_CRITICAL(&metricsMux);
+}
+
+void MainModule::onMetricsReceived(const uint8_t *mac_addr, const uint8_t *data, int data_len)
 {
     MainModule *instance = MainModule::getInstance();
 
-    macAddress_t senderAddress;
-    memcpy(senderAddress, mac_addr, sizeof(macAddress_t));
+    if (data_len < (int)sizeof(secondary_metrics))
+    {
+        return;
+    }
+
+    secondary_metrics metrics;
+    memcpy(&metrics, data, sizeof(secondary_metrics));
+    if (metrics.channelCount > MAX_FLOWMETERS_PER_SECONDARY_MODULE || data_len < (int)(sizeof(secondary_metrics) + sizeof(uint32_t) * metrics.channelCount))
+    {
+        return;
+    }
+
+    xSemaphoreTake(instance->flowmetersDataMutex, portMAX_DELAY);
+    const int slot = instance->getSlaveSlot(macAddressToKey(mac_addr));
+    if (slot >= 0)
+    {
+        secondary_module_metrics &slaveMetrics = instance->slaves[slot].metrics;
+        slaveMetrics.timestamp = millis();
+        slaveMetrics.metrics = metrics;
+        memcpy(slaveMetrics.pulseRates, data + sizeof(secondary_metrics), sizeof(uint32_t) * metrics.channelCount);
+    }
+    xSemaphoreGive(instance->flowmetersDataMutex);
+}
 
-    flowmeters_data flowmetersData;
-    flowmetersData.flowmeterCount = data[0];
-    // Allocate and copy pulse counts
-    flowmetersData.flowmetersPulseCount = (flowmeter_data_t *)malloc(sizeof(flowmeter_data_t) * flowmetersData.flowmeterCount);
-    memcpy(flowmetersData.flowmetersPulseCount, &data[1], sizeof(flowmeter_data_t) * flowmetersData.flowmeterCount);
+void MainModule::onPairRequestReceived(const uint8_t *mac_addr, const uint8_t *data, int data_len)
+{
+    MainModule *instance = MainModule::getInstance();
+
+    // A paired slave only asks again after restarting, its next response starts a new sequence.
+    xSemaphoreTake(instance->flowmetersDataMutex, portMAX_DELAY);
+    const int slot = instance->getSlaveSlot(macAddressToKey(mac_addr));
+    if (slot >= 0)
+    {
+        instance->slaves[slot].hasSequence = false;
+    }
+    xSemaphoreGive(instance->flowmetersDataMutex);
+}
+
+void MainModule::onDataResponseReceived(const uint8_t *mac_addr, const uint8_t *data, int data_len)
+{
+    MainModule *instance = MainModule::getInstance();
+    const int64_t receiveTimestamp = ESPNowManager::getInstance()->getReceiveTimestamp();
 
-    // After the pulse counts, the secondary sends last pulse ages (unsigned long per flowmeter)
-    flowmetersData.flowmetersLastPulseAge = (unsigned long *)malloc(sizeof(unsigned long) * flowmetersData.flowmeterCount);
-    const uint8_t *agesSrc = &data[1 + sizeof(flowmeter_data_t) * flowmetersData.flowmeterCount];
-    memcpy(flowmetersData.flowmetersLastPulseAge, agesSrc, sizeof(unsigned long) * flowmetersData.flowmeterCount);
+    // Validate first, the slice is only written with a frame known to be good.
+    flowmeter_frame_header header;
+    const flowmeters_data validateOnly = {0, nullptr, nullptr, nullptr, nullptr, 0};
+    if (!FlowmeterFrame::decode(data, data_len, header, validateOnly, MAX_FLOWMETERS_PER_SECONDARY_MODULE))
+    {
+        return;
+    }
 
-    instance->setLastFlowmeterDataResponseTimestamp(senderAddress, millis());
-    instance->registerFlowmetersData(senderAddress, flowmetersData);
+    const macAddressKey_t macKey = macAddressToKey(mac_addr);
 
-    if (instance->wasAllFlowmetersDataReceived())
+    xSemaphoreTake(instance->flowmetersDataMutex, portMAX_DELAY);
+    const int slot = instance->getSlaveSlot(macKey);
+    if (slot >= 0)
     {
-        flowmeters_data allFlowmetersData;
-        instance->getLastFlowmeterData(&allFlowmetersData);
-        instance->callGetFlowmetersDataCallbacks(allFlowmetersData);
-        instance->setLastFlowmetersDataRequestTimestamp(0);
-        for (auto &pair : instance->flowmetersData)
+        secondary_module_state &slave = instance->slaves[slot];
+
+        // A repeated frame would count its pulses into the nozzle states twice.
+        // A new session is a restarted secondary counting from 0 again.
+        const int32_t distance = (int32_t)(header.sequence - slave.lastSequence);
+        if (slave.hasSequence && header.session == slave.lastSession && distance <= 0 && distance > -DATA_RESPONSE_SEQUENCE_WINDOW)
         {
-            free(pair.second.flowmetersPulseCount);
-            if(pair.second.flowmetersLastPulseAge != nullptr) {
-                free(pair.second.flowmetersLastPulseAge);
-            }
+            instance->duplicateResponseCount.fetch_add(1, std::memory_order_relaxed);
+            xSemaphoreGive(instance->flowmetersDataMutex);
+            return;
         }
-        instance->flowmetersData.clear();
-        free(allFlowmetersData.flowmetersPulseCount);
-        if(allFlowmetersData.flowmetersLastPulseAge != nullptr) {
-            free(allFlowmetersData.flowmetersLastPulseAge);
+        slave.lastSequence = header.sequence;
+        slave.lastSession = header.session;
+        slave.hasSequence = true;
+
+        if (slave.flowmeterCount != header.channelCount)
+        {
+            instance->resizeSlaveSlice(slot, header.channelCount);
+        }
+
+        if (slave.flowmeterCount == header.channelCount)
+        {
+            const flowmeters_data slice = {
+                slave.flowmeterCount,
+                &instance->boomPulseCount[slave.flowmeterOffset],
+                &instance->boomLastPulseAge[slave.flowmeterOffset],
+                &instance->boomFlowRate[slave.flowmeterOffset],
+                &instance->boomFlowRateConfidence[slave.flowmeterOffset],
+                0,
+            };
+            FlowmeterFrame::decode(data, data_len, header, slice, slave.flowmeterCount);
+            const unsigned long now = millis();
+
+            // Without a sample id the response is taken as the answer to the current request.
+            const bool isCurrent = !(header.flags & FLOWMETER_FRAME_FLAG_SAMPLE) || header.sample.id == instance->sampleId;
+            // A late or repeated answer to an earlier latch still carries newer counts, but does not settle this cycle.
+            if (isCurrent)
+            {
+                const bool hasSample = header.flags & FLOWMETER_FRAME_FLAG_SAMPLE;
+                slave.lastResponseTimestamp = now;
+                slave.sampleDelay = hasSample ? (int32_t)(header.sample.time - (uint32_t)instance->sampleTime) : SAMPLE_DELAY_UNKNOWN;
+                slave.isSampleLatched = hasSample && header.sample.isLatched;
+            }
+
+            // Frames only grow with the counts, start from the first one seen rather than the worst case.
+            instance->largestResponseSize = instance->hasResponseSize ? std::max<uint8_t>(instance->largestResponseSize, data_len) : data_len;
+            instance->hasResponseSize = true;
+
+            instance->requestScheduler->onResponse(slave.link, receiveTimestamp, isCurrent);
+
+            // Alerts follow the radio, not the acquisition cycle or the app polling.
+            instance->nozzleMonitor->updateSection(
+                &instance->boomNozzleState[slave.flowmeterOffset],
+                slice.flowmetersRate,
+                slice.flowmetersRateConfidence,
+                slave.flowmeterCount,
+                slave.flowmeterOffset,
+                now);
         }
     }
+    xSemaphoreGive(instance->flowmetersDataMutex);
 
-    free(flowmetersData.flowmetersPulseCount);
-    if(flowmetersData.flowmetersLastPulseAge != nullptr) {
-        free(flowmetersData.flowmetersLastPulseAge);
+    // So the cycle settles as soon as the last slave answered, rather than on the next tick.
+    if (instance->acquisitionTask != nullptr)
+    {
+        xTaskNotifyGive(instance->acquisitionTask);
     }
 }
 
-void MainModule::getFlowmetersData(std::function<void(flowmeters_data)> callback)
+void MainModule::syncSlaves()
 {
-    this->addGetFlowmetersDataCallback(callback);
-    this->setLastFlowmetersDataRequestTimestamp(millis());
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+
+    const uint8_t newSlavesCount = std::min<uint8_t>(espNowCentralManager->getSlavesCount(), MAX_SECONDARY_MODULES);
 
-    if (espNowCentralManager->getSlavesCount() == 0)
+    // Slots past the new count are gone along with their slices.
+    if (newSlavesCount < this->slavesCount)
     {
-        flowmeters_data data;
-        data.flowmeterCount = 0;
-        data.flowmetersPulseCount = nullptr;
-        data.flowmetersLastPulseAge = nullptr;
-        callGetFlowmetersDataCallbacks(data);
-        return;
+        this->boomFlowmeterCount = this->slaves[newSlavesCount].flowmeterOffset;
+        memset(&this->slaves[newSlavesCount], 0, sizeof(secondary_module_state) * (this->slavesCount - newSlavesCount));
+    }
+    for (uint8_t i = this->slavesCount; i < newSlavesCount; i++)
+    {
+        memset(&this->slaves[i], 0, sizeof(secondary_module_state));
+        this->slaves[i].flowmeterOffset = this->boomFlowmeterCount;
     }
+    this->slavesCount = newSlavesCount;
 
-    while (getPendingFlowmetersDataCount() > 0)
+    for (uint8_t i = 0; i < this->slavesCount; i++)
     {
-        for (int i = 0; i < espNowCentralManager->getSlavesCount(); i++)
-        {
-            uint8_t *mac_addr = (uint8_t *)malloc(6);
-            espNowCentralManager->getSlaveMacAddress(i, mac_addr);
+        macAddress_t mac_addr;
+        espNowCentralManager->getSlaveMacAddress(i, static_cast<uint8_t *>(mac_addr));
 
-            if (this->lastFlowmetersDataRequestTimestamp < this->lastFlowmetersDataResponseTimestamps[macAddressToString(mac_addr)])
+        const macAddressKey_t macKey = macAddressToKey(mac_addr);
+        const uint8_t advertisedCount = std::min<uint8_t>(espNowCentralManager->getSlaveChannelCount(i), MAX_FLOWMETERS_PER_SECONDARY_MODULE);
+        if (this->slaves[i].macKey == macKey)
+        {
+            if (this->slaves[i].flowmeterCount == 0 && advertisedCount > 0)
             {
-                continue;
+                this->resizeSlaveSlice(i, advertisedCount);
             }
+            continue;
+        }
+
+        // A different slave now owns this slot (pairing or removal), forget the old
+        // data. The slice takes the channel count advertised when pairing, so its
+        // nozzles are addressable before it answers, and follows its responses after.
+        this->resizeSlaveSlice(i, 0);
+
+        const uint16_t flowmeterOffset = this->slaves[i].flowmeterOffset;
+        memset(&this->slaves[i], 0, sizeof(secondary_module_state));
+        this->slaves[i].macKey = macKey;
+        memcpy(this->slaves[i].macAddress, mac_addr, sizeof(macAddress_t));
+        this->slaves[i].flowmeterOffset = flowmeterOffset;
+
+        this->resizeSlaveSlice(i, advertisedCount);
+    }
+
+    xSemaphoreGive(flowmetersDataMutex);
+}
+
+// Moves the tailCount entries at oldEnd to newEnd, zeroing the entries a growing slice gains.
+template <typename T>
+static void shiftSlices(T *boomArray, uint16_t oldEnd, uint16_t newEnd, uint16_t tailCount)
+{
+    memmove(&boomArray[newEnd], &boomArray[oldEnd], sizeof(T) * tailCount);
+    if (newEnd > oldEnd)
+    {
+        memset(&boomArray[oldEnd], 0, sizeof(T) * (newEnd - oldEnd));
+    }
+}
+
+void MainModule::resizeSlaveSlice(uint8_t slot, uint8_t flowmeterCount)
+{
+    secondary_module_state &slave = this->slaves[slot];
+
+    const uint16_t available = MAX_FLOWMETERS - (this->boomFlowmeterCount - slave.flowmeterCount);
+    flowmeterCount = std::min<uint16_t>(flowmeterCount, available);
 
-            uint8_t messageType = FLOWMETER_DATA_REQUEST;
-            uint8_t *buffer = nullptr;
+    const uint16_t oldEnd = slave.flowmeterOffset + slave.flowmeterCount;
+    const uint16_t newEnd = slave.flowmeterOffset + flowmeterCount;
+    const uint16_t tailCount = this->boomFlowmeterCount - oldEnd;
 
-            // Serial.printf("Requesting data from %02X:%02X:%02X:%02X:%02X:%02X\n", mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]);
-            ESPNowManager::getInstance()->sendBuffer(mac_addr, messageType, buffer, 0);
-            free(mac_addr);
+    shiftSlices(this->boomPulseCount, oldEnd, newEnd, tailCount);
+    shiftSlices(this->boomLastPulseAge, oldEnd, newEnd, tailCount);
+    shiftSlices(this->boomFlowRate, oldEnd, newEnd, tailCount);
+    shiftSlices(this->boomFlowRateConfidence, oldEnd, newEnd, tailCount);
+    shiftSlices(this->boomNozzleState, oldEnd, newEnd, tailCount);
+    shiftSlices(this->boomNozzleApplication, oldEnd, newEnd, tailCount);
+
+    for (uint8_t i = slot + 1; i < this->slavesCount; i++)
+    {
+        this->slaves[i].flowmeterOffset = this->slaves[i].flowmeterOffset + newEnd - oldEnd;
+    }
+
+    slave.flowmeterCount = flowmeterCount;
+    this->boomFlowmeterCount = this->boomFlowmeterCount + newEnd - oldEnd;
+}
+
+bool MainModule::getNozzleLocation(uint16_t nozzle, uint8_t &slot, uint8_t &channel)
+{
+    // Slices are laid out in slot order, find the last slave starting at or before the nozzle.
+    uint8_t low = 0;
+    uint8_t high = this->slavesCount;
+    while (low < high)
+    {
+        const uint8_t middle = (low + high) / 2;
+        if (this->slaves[middle].flowmeterOffset <= nozzle)
+        {
+            low = middle + 1;
         }
+        else
+        {
+            high = middle;
+        }
+    }
 
-        esp_task_wdt_reset();
-        delay(250);
+    if (low == 0)
+    {
+        return false;
     }
+
+    const secondary_module_state &slave = this->slaves[low - 1];
+    if (nozzle >= slave.flowmeterOffset + slave.flowmeterCount)
+    {
+        return false;
+    }
+
+    slot = low - 1;
+    channel = nozzle - slave.flowmeterOffset;
+    return true;
 }
 
-void MainModule::setRefreshRate(unsigned short refreshRate, std::vector<uint8_t> flowmeterIndexes)
+int MainModule::getSlaveSlot(macAddressKey_t macKey)
 {
-    uint8_t flowmeterIndexesBySlave[espNowCentralManager->getSlavesCount()][9];
+    for (uint8_t i = 0; i < this->slavesCount; i++)
+    {
+        if (this->slaves[i].macKey == macKey)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void MainModule::startAcquisitionCycle()
+{
+    this->syncSlaves();
+
+    this->setLastFlowmetersDataRequestTimestamp(millis());
+    this->isAcquisitionInProgress = true;
+    this->isAcquisitionCycleEnded = false;
+
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    this->responseSlotDuration = this->isResponseSlotsEnabled ? DATA_RESPONSE_SLOT_GUARD + DATA_RESPONSE_BYTE_TIME * (DATA_RESPONSE_FRAME_OVERHEAD + this->largestResponseSize) : 0;
+    xSemaphoreGive(flowmetersDataMutex);
+
+    this->broadcastSampleLatch();
+    this->cycleStartTime = this->sampleTime;
+
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < this->slavesCount; i++)
+    {
+        this->requestScheduler->startRequest(this->slaves[i].link);
+        // The latch requests every slave at once, a slave is only asked again once its slot went by.
+        if (this->responseSlotDuration != 0)
+        {
+            this->requestScheduler->onBroadcastSent(this->slaves[i].link, this->sampleTime + (int64_t)i * this->responseSlotDuration);
+        }
+    }
+    xSemaphoreGive(flowmetersDataMutex);
+
+    this->sendFlowmetersDataRequests();
+}
+
+void MainModule::broadcastSampleLatch()
+{
+    // The latch is our only broadcast, a transmission after the previous latch was queued is that latch.
+    const int64_t sentTimestamp = ESPNowManager::getInstance()->getBroadcastSentTimestamp();
+    const int64_t previousSentTime = this->sampleId != 0 && sentTimestamp >= this->sampleTime ? sentTimestamp : 0;
+
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    // 0 is what older main modules implicitly ask for, never use it.
+    this->sampleId = this->sampleId + 1 == 0 ? 1 : this->sampleId + 1;
+    this->sampleTime = esp_timer_get_time();
+    const sample_latch latch = {this->sampleId, this->sampleTime, previousSentTime, this->responseSlotDuration};
+    xSemaphoreGive(flowmetersDataMutex);
+
+    // Unacknowledged: a secondary that misses it samples on the request and says so.
+    ESPNowManager::getInstance()->sendBuffer(BROADCAST_MAC_ADDRESS, SAMPLE_LATCH, reinterpret_cast<const uint8_t *>(&latch), sizeof(latch));
+}
+
+void MainModule::sendFlowmetersDataRequests()
+{
+    macAddress_t macAddresses[MAX_SECONDARY_MODULES];
+    uint8_t count = 0;
 
-    for(int i = 0; i < flowmeterIndexes.size(); i++)
+    const int64_t now = esp_timer_get_time();
+
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < this->slavesCount; i++)
     {
-        uint8_t index = flowmeterIndexes[i] % 9;
-        uint8_t slave = flowmeterIndexes[i] / 9;
-        if(slave < espNowCentralManager->getSlavesCount())
+        if (this->requestScheduler->isRequestDue(this->slaves[i].link, now))
         {
-            flowmeterIndexesBySlave[slave][index] = 1;
+            this->requestScheduler->onRequestSent(this->slaves[i].link, now);
+            memcpy(macAddresses[count++], this->slaves[i].macAddress, sizeof(macAddress_t));
         }
     }
+    xSemaphoreGive(flowmetersDataMutex);
 
-    // Send flowmeter irefreshrate followed by the indexes to each slave. Each slave can handle up to 9 flowmeters. The indexes are represented by 9 bits.
-    for (int i = 0; i < espNowCentralManager->getSlavesCount(); i++)
+    for (uint8_t i = 0; i < count; i++)
     {
-        uint8_t *mac_addr = (uint8_t *)malloc(6);
-        espNowCentralManager->getSlaveMacAddress(i, mac_addr);
+        ESPNowManager::getInstance()->sendBuffer(macAddresses[i], FLOWMETER_DATA_REQUEST, reinterpret_cast<const uint8_t *>(&this->sampleId), sizeof(this->sampleId));
+    }
+}
+
+bool MainModule::isAcquisitionCycleSettled()
+{
+    const int64_t now = esp_timer_get_time();
 
-        uint8_t messageType = SET_REFRESH_RATE;
-        uint8_t *buffer = (uint8_t *)malloc(sizeof(unsigned short) + 9);
-        memcpy(buffer, &refreshRate, sizeof(unsigned short));
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    bool isSettled = true;
+    for (uint8_t i = 0; i < this->slavesCount && isSettled; i++)
+    {
+        isSettled = this->wasFlowmetersDataReceived(i) || this->requestScheduler->hasGivenUp(this->slaves[i].link, now);
+    }
+    xSemaphoreGive(flowmetersDataMutex);
 
-        for(int j = 0; j < 9; j++)
+    return isSettled;
+}
+
+void MainModule::endAcquisitionCycle()
+{
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < this->slavesCount; i++)
+    {
+        this->requestScheduler->endCycle(this->slaves[i].link);
+    }
+    xSemaphoreGive(flowmetersDataMutex);
+
+    this->updateApplication();
+}
+
+void MainModule::updateApplication()
+{
+    gps_fix fix;
+    GPS::getInstance()->getFix(fix);
+    const bool hasSpeed = fix.isValid && fix.timestamp != 0 && millis() - fix.timestamp <= APPLICATION_METER_MAX_FIX_AGE;
+    const uint32_t speed = hasSpeed ? (uint32_t)(fix.speed * 1000) : 0;
+
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    // The rates of a cycle stand for the interval before it, the first cycle included.
+    const int64_t elapsed = this->lastApplicationTime != 0 ? this->sampleTime - this->lastApplicationTime : (int64_t)this->acquisitionInterval * 1000;
+    const uint32_t interval = (uint32_t)std::min<int64_t>(elapsed, APPLICATION_METER_MAX_INTERVAL);
+    this->lastApplicationTime = this->sampleTime;
+
+    memset(&this->boomApplication, 0, sizeof(this->boomApplication));
+    for (uint8_t i = 0; i < this->slavesCount; i++)
+    {
+        // A slave that did not answer keeps its last flow, and sprays nothing we know of meanwhile.
+        secondary_module_state &slave = this->slaves[i];
+        if (this->wasFlowmetersDataReceived(i))
         {
-            buffer[sizeof(unsigned short) + j] = flowmeterIndexesBySlave[i][j];
+            this->applicationMeter->updateSection(
+                &this->boomNozzleApplication[slave.flowmeterOffset],
+                &this->calibrations[slave.flowmeterOffset],
+                &this->boomFlowRate[slave.flowmeterOffset],
+                slave.flowmeterCount,
+                speed,
+                interval,
+                slave.application);
         }
+        this->applicationMeter->addSection(this->boomApplication, slave.application, speed);
+    }
+    this->applicationSpeed = speed;
+    xSemaphoreGive(flowmetersDataMutex);
+}
+
+bool MainModule::publishSnapshot()
+{
+    portENTER_CRITICAL(&snapshotMux);
+    const uint8_t backIndex = 1 - this->publishedSnapshotIndex;
+    const bool isBackBufferFree = this->snapshotReaders[backIndex] == 0;
+    portEXIT_CRITICAL(&snapshotMux);
 
-        ESPNowManager::getInstance()->sendBuffer(mac_addr, messageType, buffer, sizeof(unsigned short) + 9);
-        free(buffer);
-        free(mac_addr);
+    // A reader still holds the previous snapshot, try again on the next loop.
+    if (!isBackBufferFree)
+    {
+        return false;
+    }
+
+    flowmeters_snapshot *snapshot = &this->snapshots[backIndex];
+
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    snapshot->slavesCount = this->slavesCount;
+    for (uint8_t i = 0; i < snapshot->slavesCount; i++)
+    {
+        snapshot->slavesLastResponseTimestamp[i] = this->slaves[i].lastResponseTimestamp;
+        snapshot->slavesFlowmeterOffset[i] = this->slaves[i].flowmeterOffset;
+        snapshot->slavesFlowmeterCount[i] = this->slaves[i].flowmeterCount;
+        snapshot->slavesSampleDelay[i] = this->slaves[i].sampleDelay;
+        snapshot->slavesSampleLatched[i] = this->slaves[i].isSampleLatched;
+        snapshot->slavesDegraded[i] = this->slaves[i].link.isDegraded;
+        snapshot->slavesApplication[i] = this->slaves[i].application;
     }
+    snapshot->boomApplication = this->boomApplication;
+    snapshot->speed = this->applicationSpeed;
+    snapshot->sampleId = this->sampleId;
+    snapshot->sampleTime = this->sampleTime;
+
+    snapshot->data.flowmeterCount = this->boomFlowmeterCount;
+    memcpy(snapshot->flowmetersPulseCount, this->boomPulseCount, sizeof(flowmeter_data_t) * this->boomFlowmeterCount);
+    memcpy(snapshot->flowmetersLastPulseAge, this->boomLastPulseAge, sizeof(unsigned long) * this->boomFlowmeterCount);
+    memcpy(snapshot->flowmetersRate, this->boomFlowRate, sizeof(uint32_t) * this->boomFlowmeterCount);
+    memcpy(snapshot->flowmetersRateConfidence, this->boomFlowRateConfidence, sizeof(uint8_t) * this->boomFlowmeterCount);
+    for (uint16_t i = 0; i < this->boomFlowmeterCount; i++)
+    {
+        snapshot->flowmetersState[i] = this->boomNozzleState[i].state;
+        snapshot->flowmetersFlow[i] = this->boomNozzleApplication[i].flow;
+        snapshot->flowmetersApplicationRate[i] = this->boomNozzleApplication[i].applicationRate;
+        snapshot->flowmetersVolume[i] = this->boomNozzleApplication[i].volume;
+    }
+    xSemaphoreGive(flowmetersDataMutex);
+
+    snapshot->requestTimestamp = this->lastFlowmetersDataRequestTimestamp;
+    snapshot->timestamp = millis();
+    snapshot->version = ++this->snapshotVersion;
+
+    portENTER_CRITICAL(&snapshotMux);
+    this->publishedSnapshotIndex = backIndex;
+    portEXIT_CRITICAL(&snapshotMux);
+
+    return true;
 }
 
-void MainModule::addGetFlowmetersDataCallback(std::function<void(flowmeters_data)> callback)
+void MainModule::logCycle()
 {
-    getFlowmetersDataCallbacks.push_back(callback);
+    // Only this task rewrites snapshots, the published one is safe to read without acquiring it.
+    const flowmeters_snapshot *snapshot = &this->snapshots[this->publishedSnapshotIndex];
+
+    bool isStale = false;
+    for (uint8_t i = 0; i < snapshot->slavesCount && !isStale; i++)
+    {
+        isStale = !snapshot->isSlaveFresh(i);
+    }
+
+    gps_fix fix;
+    GPS::getInstance()->getFix(fix);
+
+    job_log_cycle cycle;
+    cycle.timestamp = snapshot->requestTimestamp;
+    cycle.fix = &fix;
+    cycle.speed = snapshot->speed;
+    cycle.nozzleCount = snapshot->data.flowmeterCount;
+    cycle.volume = snapshot->flowmetersVolume;
+    cycle.isStale = isStale;
+    this->jobLog->append(cycle);
 }
 
-void MainModule::callGetFlowmetersDataCallbacks(flowmeters_data data)
+const flowmeters_snapshot *MainModule::acquireSnapshot()
 {
-    for (auto &callback : getFlowmetersDataCallbacks)
+    portENTER_CRITICAL(&snapshotMux);
+    const uint8_t index = this->publishedSnapshotIndex;
+    this->snapshotReaders[index]++;
+    portEXIT_CRITICAL(&snapshotMux);
+
+    return &this->snapshots[index];
+}
+
+void MainModule::releaseSnapshot(const flowmeters_snapshot *snapshot)
+{
+    portENTER_CRITICAL(&snapshotMux);
+    this->snapshotReaders[snapshot - this->snapshots]--;
+    portEXIT_CRITICAL(&snapshotMux);
+}
+
+void MainModule::sendMetricsRequests()
+{
+    macAddress_t macAddresses[MAX_SECONDARY_MODULES];
+
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    const uint8_t count = this->slavesCount;
+    for (uint8_t i = 0; i < count; i++)
     {
-        callback(data);
+        memcpy(macAddresses[i], this->slaves[i].macAddress, sizeof(macAddress_t));
     }
+    xSemaphoreGive(flowmetersDataMutex);
 
-    getFlowmetersDataCallbacks.clear();
+    for (uint8_t i = 0; i < count; i++)
+    {
+        ESPNowManager::getInstance()->sendBuffer(macAddresses[i], METRICS_REQUEST, nullptr, 0);
+    }
 }
 
-void MainModule::setLastFlowmetersDataRequestTimestamp(unsigned long timestamp)
+void MainModule::checkStaleSlaves()
 {
-    this->lastFlowmetersDataRequestTimestamp = timestamp;
+    const unsigned long now = millis();
+
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < this->slavesCount; i++)
+    {
+        const secondary_module_state &slave = this->slaves[i];
+        this->nozzleMonitor->checkSectionStale(&this->boomNozzleState[slave.flowmeterOffset], slave.flowmeterCount, slave.flowmeterOffset, slave.lastResponseTimestamp, now);
+    }
+    xSemaphoreGive(flowmetersDataMutex);
 }
 
-void MainModule::setLastFlowmeterDataResponseTimestamp(const macAddress_t mac_addr, unsigned long timestamp)
+void MainModule::setAcquisitionInterval(unsigned short interval)
 {
-    std::string mac_addr_str = macAddressToString(mac_addr);
-    this->lastFlowmetersDataResponseTimestamps[mac_addr_str] = timestamp;
+    this->acquisitionInterval = std::max<unsigned short>(interval, MIN_ACQUISITION_INTERVAL);
+    preferences->putUShort("acqInterval", this->acquisitionInterval);
 }
 
-void MainModule::registerFlowmetersData(const macAddress_t mac_addr, flowmeters_data data)
+unsigned short MainModule::getAcquisitionInterval()
 {
-    std::string mac_addr_str = macAddressToString(mac_addr);
+    return this->acquisitionInterval;
+}
+
+void MainModule::setResponseSlotsEnabled(bool enabled)
+{
+    this->isResponseSlotsEnabled = enabled;
+}
 
-    flowmeters_data flowmetersData;
-    flowmetersData.flowmeterCount = data.flowmeterCount;
-    flowmetersData.flowmetersPulseCount = (flowmeter_data_t *)malloc(sizeof(flowmeter_data_t) * data.flowmeterCount);
-    memcpy(flowmetersData.flowmetersPulseCount, data.flowmetersPulseCount, sizeof(flowmeter_data_t) * data.flowmeterCount);
-    // Copy last pulse ages if present
-    flowmetersData.flowmetersLastPulseAge = (unsigned long *)malloc(sizeof(unsigned long) * data.flowmeterCount);
-    if(data.flowmetersLastPulseAge != nullptr) {
-        memcpy(flowmetersData.flowmetersLastPulseAge, data.flowmetersLastPulseAge, sizeof(unsigned long) * data.flowmeterCount);
-    } else {
-        // Initialize to zero if not provided
-        memset(flowmetersData.flowmetersLastPulseAge, 0, sizeof(unsigned long) * data.flowmeterCount);
+uint16_t MainModule::getResponseSlotDuration()
+{
+    return this->responseSlotDuration;
+}
+
+bool MainModule::startCapture()
+{
+    uint8_t metadata[TRAFFIC_CAPTURE_MAX_METADATA_SIZE];
+    size_t size = 0;
+
+    metadata[size++] = CAPTURE_METADATA_VERSION;
+    size += FlowmeterFrame::writeVarint(metadata + size, sizeof(metadata) - size, this->acquisitionInterval);
+    metadata[size++] = this->isResponseSlotsEnabled ? 1 : 0;
+
+    const uint8_t slavesCount = std::min<uint8_t>(this->espNowCentralManager->getSlavesCount(), (sizeof(metadata) - size - 1) / (sizeof(macAddress_t) + 1));
+    metadata[size++] = slavesCount;
+    for (uint8_t i = 0; i < slavesCount; i++)
+    {
+        this->espNowCentralManager->getSlaveMacAddress(i, metadata + size);
+        size += sizeof(macAddress_t);
+        metadata[size++] = this->espNowCentralManager->getSlaveChannelCount(i);
     }
 
-    this->flowmetersData[mac_addr_str] = flowmetersData;
+    return TrafficCapture::getInstance()->start(metadata, size);
 }
 
-bool MainModule::wasAllFlowmetersDataReceived()
+void MainModule::setRefreshRate(unsigned short refreshRate, const std::vector<uint16_t> &nozzles)
 {
-    if (espNowCentralManager->getSlavesCount() == 0)
+    uint8_t bitmaps[MAX_SECONDARY_MODULES][CHANNEL_BITMAP_SIZE(MAX_FLOWMETERS_PER_SECONDARY_MODULE)];
+    uint8_t channelCounts[MAX_SECONDARY_MODULES];
+    macAddress_t macAddresses[MAX_SECONDARY_MODULES];
+    memset(bitmaps, 0, sizeof(bitmaps));
+    memset(channelCounts, 0, sizeof(channelCounts));
+
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    const uint8_t slavesCount = this->slavesCount;
+    for (uint16_t nozzle : nozzles)
     {
-        return true;
+        uint8_t slot;
+        uint8_t channel;
+        if (this->getNozzleLocation(nozzle, slot, channel))
+        {
+            bitmaps[slot][channel / 8] |= 1 << (channel % 8);
+            // Only the channels up to the last one selected are sent.
+            channelCounts[slot] = std::max<uint8_t>(channelCounts[slot], channel + 1);
+        }
     }
+    for (uint8_t i = 0; i < slavesCount; i++)
+    {
+        memcpy(macAddresses[i], this->slaves[i].macAddress, sizeof(macAddress_t));
+    }
+    xSemaphoreGive(flowmetersDataMutex);
 
-    for (int i = 0; i < espNowCentralManager->getSlavesCount(); i++)
+    // One reliable message per slave with a selected channel, whatever the number of nozzles.
+    for (uint8_t i = 0; i < slavesCount; i++)
     {
-        std::string mac_addr_str = espNowCentralManager->getSlaveMacAddress(i);
-        unsigned long lastResponseTimestamp = this->lastFlowmetersDataResponseTimestamps[mac_addr_str];
-        if (lastResponseTimestamp < this->lastFlowmetersDataRequestTimestamp)
+        if (channelCounts[i] == 0)
         {
-            return false;
+            continue;
         }
+
+        uint8_t header[SET_REFRESH_RATE_HEADER_SIZE];
+        header[0] = refreshRate & 0xFF;
+        header[1] = refreshRate >> 8;
+        header[2] = channelCounts[i];
+
+        ESPNowManager::getInstance()->sendReliable(macAddresses[i], SET_REFRESH_RATE, header, sizeof(header), bitmaps[i], CHANNEL_BITMAP_SIZE(channelCounts[i]));
     }
+}
 
-    return true;
+// Preferences key of a block of calibrations, NVS keys are at most 15 characters.
+static void getCalibrationKey(uint16_t block, char (&key)[16])
+{
+    snprintf(key, sizeof(key), "calib%u", block);
+}
+
+void MainModule::loadCalibrations()
+{
+    memset(this->calibrations, 0, sizeof(this->calibrations));
+
+    for (uint16_t block = 0; block < CALIBRATION_BLOCK_COUNT; block++)
+    {
+        const uint16_t first = block * CALIBRATION_BLOCK_SIZE;
+        const size_t size = sizeof(nozzle_calibration) * std::min<uint16_t>(CALIBRATION_BLOCK_SIZE, MAX_FLOWMETERS - first);
+
+        char key[16];
+        getCalibrationKey(block, key);
+        if (preferences->getBytesLength(key) == size)
+        {
+            preferences->getBytes(key, &this->calibrations[first], size);
+        }
+    }
+}
+
+void MainModule::saveCalibrationBlock(uint16_t block)
+{
+    const uint16_t first = block * CALIBRATION_BLOCK_SIZE;
+    const size_t size = sizeof(nozzle_calibration) * std::min<uint16_t>(CALIBRATION_BLOCK_SIZE, MAX_FLOWMETERS - first);
+
+    char key[16];
+    getCalibrationKey(block, key);
+    preferences->putBytes(key, &this->calibrations[first], size);
+}
+
+void MainModule::setNozzleCalibration(const std::vector<uint16_t> &nozzles, uint32_t pulsesPerCubicMeter, uint16_t spacing)
+{
+    bool isBlockChanged[CALIBRATION_BLOCK_COUNT] = {false};
+
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    for (uint16_t nozzle : nozzles)
+    {
+        if (nozzle >= MAX_FLOWMETERS)
+        {
+            continue;
+        }
+
+        nozzle_calibration &calibration = this->calibrations[nozzle];
+        const nozzle_calibration previous = calibration;
+        if (pulsesPerCubicMeter != 0)
+        {
+            calibration.pulsesPerCubicMeter = pulsesPerCubicMeter;
+        }
+        if (spacing != 0)
+        {
+            calibration.spacing = spacing;
+        }
+
+        if (calibration.pulsesPerCubicMeter != previous.pulsesPerCubicMeter || calibration.spacing != previous.spacing)
+        {
+            isBlockChanged[nozzle / CALIBRATION_BLOCK_SIZE] = true;
+        }
+    }
+    xSemaphoreGive(flowmetersDataMutex);
+
+    // Calibrations are only written from the web server, no need to hold the mutex through the flash writes.
+    for (uint16_t block = 0; block < CALIBRATION_BLOCK_COUNT; block++)
+    {
+        if (isBlockChanged[block])
+        {
+            saveCalibrationBlock(block);
+        }
+    }
 }
 
-void MainModule::getLastFlowmeterData(flowmeters_data *result)
+// Fills the fields the app never set.
+static void applyCalibrationDefaults(nozzle_calibration &calibration)
 {
-    result->flowmeterCount = 0;
-    for (int i = 0; i < espNowCentralManager->getSlavesCount(); i++)
+    if (calibration.pulsesPerCubicMeter == 0)
+    {
+        calibration.pulsesPerCubicMeter = APPLICATION_METER_DEFAULT_PULSES_PER_CUBIC_METER;
+    }
+    if (calibration.spacing == 0)
     {
-        std::string mac_addr_str = espNowCentralManager->getSlaveMacAddress(i);
-        result->flowmeterCount += this->flowmetersData[mac_addr_str].flowmeterCount;
+        calibration.spacing = APPLICATION_METER_DEFAULT_SPACING;
     }
-    result->flowmetersPulseCount = (flowmeter_data_t *)malloc(sizeof(flowmeter_data_t) * result->flowmeterCount);
-    result->flowmetersLastPulseAge = (unsigned long *)malloc(sizeof(unsigned long) * result->flowmeterCount);
+}
 
-    int index = 0;
-    for (int i = 0; i < espNowCentralManager->getSlavesCount(); i++)
+nozzle_calibration MainModule::getNozzleCalibration(uint16_t nozzle)
+{
+    nozzle_calibration calibration = {0, 0};
+
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    if (nozzle < MAX_FLOWMETERS)
     {
-        std::string mac_addr_str = espNowCentralManager->getSlaveMacAddress(i);
-        for (int j = 0; j < this->flowmetersData[mac_addr_str].flowmeterCount; j++)
+        calibration = this->calibrations[nozzle];
+    }
+    xSemaphoreGive(flowmetersDataMutex);
+
+    applyCalibrationDefaults(calibration);
+    return calibration;
+}
+
+uint16_t MainModule::copyNozzleCalibrations(nozzle_calibration *output, uint16_t maxCount)
+{
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    const uint16_t count = std::min(this->boomFlowmeterCount, maxCount);
+    memcpy(output, this->calibrations, count * sizeof(nozzle_calibration));
+    xSemaphoreGive(flowmetersDataMutex);
+
+    for (uint16_t i = 0; i < count; i++)
+    {
+        applyCalibrationDefaults(output[i]);
+    }
+    return count;
+}
+
+void MainModule::resetVolume()
+{
+    xSemaphoreTake(flowmetersDataMutex, portMAX_DELAY);
+    for (uint16_t i = 0; i < this->boomFlowmeterCount; i++)
+    {
+        this->boomNozzleApplication[i].volume = 0;
+        this->boomNozzleApplication[i].volumeRemainder = 0;
+    }
+    for (uint8_t i = 0; i < this->slavesCount; i++)
+    {
+        this->slaves[i].application.volume = 0;
+    }
+    this->boomApplication.volume = 0;
+    xSemaphoreGive(flowmetersDataMutex);
+}
+
+void MainModule::setLastFlowmetersDataRequestTimestamp(unsigned long timestamp)
+{
+    this->lastFlowmetersDataRequestTimestamp = timestamp;
+}
+
+bool MainModule::wasFlowmetersDataReceived(uint8_t slot)
+{
+    return this->slaves[slot].lastResponseTimestamp != 0 && this->slaves[slot].lastResponseTimestamp >= this->lastFlowmetersDataRequestTimestamp;
+}
+
+bool MainModule::wasAllFlowmetersDataReceived()
+{
+    for (uint8_t i = 0; i < this->slavesCount; i++)
+    {
+        if (!this->wasFlowmetersDataReceived(i))
         {
-            result->flowmetersPulseCount[index] = this->flowmetersData[mac_addr_str].flowmetersPulseCount[j];
-            result->flowmetersLastPulseAge[index] = this->flowmetersData[mac_addr_str].flowmetersLastPulseAge[j];
-            index++;
+            return false;
         }
     }
+
+    return true;
 }
 
 int MainModule::getPendingFlowmetersDataCount()
 {
     int count = 0;
-    for (int i = 0; i < espNowCentralManager->getSlavesCount(); i++)
+    for (uint8_t i = 0; i < this->slavesCount; i++)
     {
-        std::string mac_addr_str = espNowCentralManager->getSlaveMacAddress(i);
-        unsigned long lastResponseTimestamp = this->lastFlowmetersDataResponseTimestamps[mac_addr_str];
-        if (lastResponseTimestamp < this->lastFlowmetersDataRequestTimestamp)
+        if (!this->wasFlowmetersDataReceived(i))
         {
             count++;
         }
@@ -258,13 +918,72 @@ int MainModule::getPendingFlowmetersDataCount()
     return count;
 }
 
-std::string MainModule::macAddressToString(const macAddress_t mac_addr)
+void MainModule::loop()
 {
-    char mac_str[18] = {0};
-    snprintf(mac_str, sizeof(mac_str), "%02X:%02X:%02X:%02X:%02X:%02X", mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]);
-    return std::string(mac_str);
+    const int64_t loopStart = esp_timer_get_time();
+    this->runLoop();
+    const uint32_t loopDuration = (uint32_t)(esp_timer_get_time() - loopStart);
+
+    portENTER_CRITICAL(&metricsMux);
+    this->loopHistogram.add(loopDuration);
+    portEXIT_CRITICAL(&metricsMux);
+
+    this->acquisitionLoad.add(loopDuration);
 }
 
-void MainModule::loop()
+void MainModule::runLoop()
 {
+    // Alerts are raised by the responses, the web server pushes them from its own task.
+    const uint32_t lastAlertId = this->nozzleMonitor->getLastAlertId();
+    if (lastAlertId != this->lastNotifiedAlertId)
+    {
+        this->lastNotifiedAlertId = lastAlertId;
+        this->webServer->notify(WEB_EVENT_ALERTS_RAISED);
+    }
+
+    const unsigned long now = millis();
+
+    if (!this->isAcquisitionInProgress)
+    {
+        if (now - this->lastFlowmetersDataRequestTimestamp >= this->acquisitionInterval)
+        {
+            this->startAcquisitionCycle();
+        }
+        // Between cycles, so the answers do not contend with the response slots.
+        else if (now - this->lastMetricsRequestTimestamp >= METRICS_REQUEST_INTERVAL)
+        {
+            this->lastMetricsRequestTimestamp = now;
+            this->sendMetricsRequests();
+        }
+        return;
+    }
+
+    // End the cycle with whatever arrived once every slave answered or gave up,
+    // or at the cycle deadline. Slaves that did not answer keep their last known
+    // data and are reported stale.
+    if (!this->isAcquisitionCycleEnded)
+    {
+        if (!this->isAcquisitionCycleSettled() && now - this->lastFlowmetersDataRequestTimestamp < this->acquisitionInterval)
+        {
+            this->sendFlowmetersDataRequests();
+            return;
+        }
+
+        this->endAcquisitionCycle();
+        this->checkStaleSlaves();
+        this->isAcquisitionCycleEnded = true;
+    }
+
+    // A reader still holding the back buffer only delays the publication, the cycle is not ended again.
+    if (this->publishSnapshot())
+    {
+        this->isAcquisitionInProgress = false;
+        this->logCycle();
+
+        portENTER_CRITICAL(&metricsMux);
+        this->cycleHistogram.add((uint32_t)(esp_timer_get_time() - this->cycleStartTime));
+        portEXIT_CRITICAL(&metricsMux);
+
+        this->webServer->notify(WEB_EVENT_SNAPSHOT_PUBLISHED);
+    }
 }
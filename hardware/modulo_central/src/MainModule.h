@@ -1,9 +1,162 @@
 #include <esp_now_types.h>
+#include <FlowmeterFrame.h>
 #include <Preferences.h>
 #include <esp_now.h>
 #include "MainModuleWebServer.h"
-#include <map>
+#include "NozzleMonitor.h"
+#include "ApplicationMeter.h"
+#include "RequestScheduler.h"
+#include "JobLog.h"
+#include <LatencyHistogram.h>
+#include <TaskLoad.h>
+#include <TrafficCapture.h>
 #include <ESPNowCentralManager/ESPNowCentralManager.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <atomic>
+
+// One ESP-NOW peer each, next to the broadcast peer of the latch.
+#ifndef MAX_SECONDARY_MODULES
+#define MAX_SECONDARY_MODULES ESPNOW_MAX_SLAVES
+#endif
+#define MAX_FLOWMETERS_PER_SECONDARY_MODULE 32
+#define MAX_FLOWMETERS (MAX_SECONDARY_MODULES * MAX_FLOWMETERS_PER_SECONDARY_MODULE)
+
+// Calibrations are kept in the preferences in blocks of this many nozzles, so
+// setting one nozzle rewrites its block instead of the whole boom.
+#define CALIBRATION_BLOCK_SIZE 32
+#define CALIBRATION_BLOCK_COUNT ((MAX_FLOWMETERS + CALIBRATION_BLOCK_SIZE - 1) / CALIBRATION_BLOCK_SIZE)
+
+#define DEFAULT_ACQUISITION_INTERVAL 1000
+#define MIN_ACQUISITION_INTERVAL 100
+
+// Response slots opened by the latch broadcast fit the largest data response
+// seen: 8 us per byte at the 1 Mbps ESP-NOW rate, plus the 802.11 header and
+// FCS around the frame, plus the preamble, inter-frame spaces, acknowledgement
+// and a margin for the receive jitter of the latch (us).
+#define DATA_RESPONSE_BYTE_TIME 8
+#define DATA_RESPONSE_FRAME_OVERHEAD 40
+#define DATA_RESPONSE_SLOT_GUARD 1000
+
+// Sample delay of a slave whose response carried no boom time.
+#define SAMPLE_DELAY_UNKNOWN INT32_MIN
+
+// Data responses of the same session up to this many sequences behind the
+// last one applied are duplicates or reordered copies and are dropped.
+// Further back, the secondary restarted and counts from 0 again.
+#define DATA_RESPONSE_SEQUENCE_WINDOW 64
+
+// Acquisition task, see main.cpp for the layout of the tasks. It runs next to
+// the ESP-NOW dispatcher, below it so a frame is never held up by a cycle, and
+// wakes on every data response or at least every tick.
+#define ACQUISITION_TASK_CORE 0
+#define ACQUISITION_TASK_PRIORITY 4
+#define ACQUISITION_TASK_STACK_SIZE 6144
+#define ACQUISITION_TASK_PERIOD 1
+
+// Time between two METRICS_REQUEST to the slaves (ms), sent between acquisition cycles.
+#define METRICS_REQUEST_INTERVAL 10000
+
+// Version of the metadata heading the traffic captures, see startCapture().
+#define CAPTURE_METADATA_VERSION 1
+
+/*
+ * Last counters reported by a secondary module, see secondary_metrics.
+ */
+typedef struct secondary_module_metrics
+{
+    // millis() when they arrived, 0 if the slave never reported.
+    unsigned long timestamp;
+    secondary_metrics metrics;
+    uint32_t pulseRates[MAX_FLOWMETERS_PER_SECONDARY_MODULE];
+} secondary_module_metrics;
+
+/*
+ * State of a secondary module, stored in the slot matching its index in
+ * ESPNowCentralManager. Its flowmeters occupy flowmeterCount entries of the
+ * boom arrays starting at flowmeterOffset.
+ */
+typedef struct secondary_module_state
+{
+    macAddressKey_t macKey;
+    macAddress_t macAddress;
+    // millis() of the last response to the latch of its cycle, 0 if it never answered one.
+    unsigned long lastResponseTimestamp;
+
+    uint16_t flowmeterOffset;
+    uint8_t flowmeterCount;
+
+    // Sequence of the last data response applied, see DATA_RESPONSE_SEQUENCE_WINDOW.
+    uint32_t lastSequence;
+    uint16_t lastSession;
+    bool hasSequence;
+
+    // Boom time of its last sample after the latch of that cycle, in microseconds.
+    int32_t sampleDelay;
+    bool isSampleLatched;
+
+    request_link_state link;
+    // Application of its section as of the last cycle it answered.
+    section_application application;
+    secondary_module_metrics metrics;
+} secondary_module_state;
+
+/*
+ * Result of one acquisition cycle.
+ *
+ * Snapshots are published by MainModule::loop() and are never modified while
+ * a reader holds them (see MainModule::acquireSnapshot()).
+ */
+typedef struct flowmeters_snapshot
+{
+    // Incremented on every publication, 0 means nothing was acquired yet.
+    uint32_t version;
+    // millis() when the cycle started and when it was published.
+    unsigned long requestTimestamp;
+    unsigned long timestamp;
+
+    // Sample latched by the cycle and its boom time (esp_timer_get_time()).
+    uint32_t sampleId;
+    int64_t sampleTime;
+
+    uint8_t slavesCount;
+    // millis() of the last response of each slave. A slave is fresh when it
+    // answered during this cycle, otherwise its last known data is reported.
+    unsigned long slavesLastResponseTimestamp[MAX_SECONDARY_MODULES];
+
+    // Flowmeters of the slave at each slot, as offset and count in the arrays below.
+    uint16_t slavesFlowmeterOffset[MAX_SECONDARY_MODULES];
+    uint8_t slavesFlowmeterCount[MAX_SECONDARY_MODULES];
+
+    // When each fresh slave sampled, relative to sampleTime (SAMPLE_DELAY_UNKNOWN
+    // if it could not tell), and whether it latched on the broadcast.
+    int32_t slavesSampleDelay[MAX_SECONDARY_MODULES];
+    bool slavesSampleLatched[MAX_SECONDARY_MODULES];
+    // Slaves that missed several cycles in a row and are only probed once per cycle.
+    bool slavesDegraded[MAX_SECONDARY_MODULES];
+
+    // Application of the section of each slave and of the whole boom, computed
+    // at speed (mm/s, 0 when the GPS had none). See ApplicationMeter for the units.
+    section_application slavesApplication[MAX_SECONDARY_MODULES];
+    section_application boomApplication;
+    uint32_t speed;
+
+    // Points to the arrays below, indexed by global nozzle number.
+    flowmeters_data data;
+    flowmeter_data_t flowmetersPulseCount[MAX_FLOWMETERS];
+    unsigned long flowmetersLastPulseAge[MAX_FLOWMETERS];
+    uint32_t flowmetersRate[MAX_FLOWMETERS];
+    uint8_t flowmetersRateConfidence[MAX_FLOWMETERS];
+    NozzleState flowmetersState[MAX_FLOWMETERS];
+    uint32_t flowmetersFlow[MAX_FLOWMETERS];
+    uint32_t flowmetersApplicationRate[MAX_FLOWMETERS];
+    uint32_t flowmetersVolume[MAX_FLOWMETERS];
+
+    bool isSlaveFresh(uint8_t slaveIndex) const
+    {
+        return slavesLastResponseTimestamp[slaveIndex] != 0 && slavesLastResponseTimestamp[slaveIndex] >= requestTimestamp;
+    }
+} flowmeters_snapshot;
 
 class MainModule
 {
@@ -20,36 +173,187 @@ private:
     macAddress_t macAddress = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
     MainModuleWebServer *webServer = new MainModuleWebServer("D-Flow 0001", "123456789");
     ESPNowCentralManager *espNowCentralManager = ESPNowCentralManager::getInstance();
+    NozzleMonitor *nozzleMonitor = new NozzleMonitor();
+    RequestScheduler *requestScheduler = new RequestScheduler();
+    ApplicationMeter *applicationMeter = new ApplicationMeter();
+    JobLog *jobLog = new JobLog(MAX_FLOWMETERS);
+    Preferences *preferences = nullptr;
+
+    unsigned short acquisitionInterval = DEFAULT_ACQUISITION_INTERVAL;
+    bool isAcquisitionInProgress = false;
+    // The cycle in progress was settled and integrated, only its snapshot is left to publish.
+    bool isAcquisitionCycleEnded = false;
 
-    std::vector<std::function<void(flowmeters_data)>> getFlowmetersDataCallbacks;
-    int getFlowmetersDataCallbacksCount = 0;
+    // Guards the slave table and the boom arrays below, which are written from
+    // the ESP-NOW receive callback and read by the acquisition cycle.
+    SemaphoreHandle_t flowmetersDataMutex = xSemaphoreCreateMutex();
 
     unsigned long lastFlowmetersDataRequestTimestamp = 0;
-    std::map<std::string, unsigned long> lastFlowmetersDataResponseTimestamps;
 
-    std::map<std::string, flowmeters_data> flowmetersData;
+    // Sample of the current cycle, see sample_latch.
+    uint32_t sampleId = 0;
+    int64_t sampleTime = 0;
+    // Without slots, every slave gets a unicast data request.
+    bool isResponseSlotsEnabled = true;
+    uint16_t responseSlotDuration = 0;
+    // Largest data response received, sizes the slots. Written from the receive callback.
+    uint8_t largestResponseSize = FLOWMETER_FRAME_MAX_SIZE;
+    bool hasResponseSize = false;
+    // Data responses dropped as already applied.
+    std::atomic<uint32_t> duplicateResponseCount{0};
+
+    secondary_module_state slaves[MAX_SECONDARY_MODULES];
+    uint8_t slavesCount = 0;
+
+    // Latest data of the whole boom, indexed by global nozzle number. Responses
+    // are decoded straight into the slice of their slave, so nothing is
+    // allocated or gathered per cycle.
+    flowmeter_data_t boomPulseCount[MAX_FLOWMETERS];
+    unsigned long boomLastPulseAge[MAX_FLOWMETERS];
+    uint32_t boomFlowRate[MAX_FLOWMETERS];
+    uint8_t boomFlowRateConfidence[MAX_FLOWMETERS];
+    nozzle_monitor_state boomNozzleState[MAX_FLOWMETERS];
+    nozzle_application_state boomNozzleApplication[MAX_FLOWMETERS];
+    uint16_t boomFlowmeterCount = 0;
+
+    // Calibration by global nozzle number, the way the app addresses nozzles.
+    // Unlike the arrays above it stays put when a slice is resized, and is
+    // kept in the preferences, see CALIBRATION_BLOCK_SIZE. Zeroed fields take
+    // the ApplicationMeter defaults.
+    nozzle_calibration calibrations[MAX_FLOWMETERS];
+
+    section_application boomApplication;
+    uint32_t applicationSpeed = 0;
+    // Sample time of the last cycle integrated into the volumes, 0 before the first one.
+    int64_t lastApplicationTime = 0;
+
+    // Id of the last alert the web server was told about.
+    uint32_t lastNotifiedAlertId = 0;
+
+    unsigned long lastMetricsRequestTimestamp = 0;
+    // Duration of every loop() and of every acquisition cycle from its latch to
+    // its publication (us). Guarded by metricsMux, so reading them never waits on the radio.
+    latency_histogram loopHistogram;
+    latency_histogram cycleHistogram;
+    int64_t cycleStartTime = 0;
+
+    TaskHandle_t acquisitionTask = nullptr;
+    task_load acquisitionLoad;
+    portMUX_TYPE metricsMux = portMUX_INITIALIZER_UNLOCKED;
+
+    // Double-buffered snapshots. The back buffer is only rewritten when no
+    // reader still holds it.
+    flowmeters_snapshot snapshots[2];
+    uint8_t snapshotReaders[2] = {0, 0};
+    uint8_t publishedSnapshotIndex = 0;
+    uint32_t snapshotVersion = 0;
+    portMUX_TYPE snapshotMux = portMUX_INITIALIZER_UNLOCKED;
+
+    void syncSlaves();
+    int getSlaveSlot(macAddressKey_t macKey);
+    // Slot and channel of a global nozzle number, false if no slave carries it.
+    bool getNozzleLocation(uint16_t nozzle, uint8_t &slot, uint8_t &channel);
+    // Grows or shrinks the slice of a slave, shifting the slices after it.
+    void resizeSlaveSlice(uint8_t slot, uint8_t flowmeterCount);
+
+    void loadCalibrations();
+    void saveCalibrationBlock(uint16_t block);
+
+    void startAcquisitionCycle();
+    void broadcastSampleLatch();
+    void sendFlowmetersDataRequests();
+    // Whether every slave answered or is not expected to answer any more this cycle.
+    bool isAcquisitionCycleSettled();
+    void endAcquisitionCycle();
+    void updateApplication();
+    void checkStaleSlaves();
+    bool publishSnapshot();
+    // Appends the snapshot just published to the job log.
+    void logCycle();
+    void sendMetricsRequests();
+    void runLoop();
+
+    static void acquisitionTaskFunction(void *arg);
 
 public:
     ESPNowCentralManager *getEspNowCentralManager();
+    NozzleMonitor *getNozzleMonitor();
+
+    /*
+     * Copies the request statistics of up to maxCount slaves, by slot, and
+     * returns how many were copied.
+     */
+    uint8_t copyLinkStats(request_link_stats *output, uint8_t maxCount);
+    // Same for the last counters each slave reported.
+    uint8_t copySlaveMetrics(secondary_module_metrics *output, uint8_t maxCount);
+    void copyLoopMetrics(latency_histogram &loop, latency_histogram &cycle);
+    // Task running loop(), null until begin().
+    TaskHandle_t getAcquisitionTask() { return acquisitionTask; }
+    const task_load &getAcquisitionLoad() { return acquisitionLoad; }
+    MainModuleWebServer *getWebServer() { return webServer; }
+    JobLog *getJobLog() { return jobLog; }
 
     static void onDataResponseReceived(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+    static void onPairRequestReceived(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+    static void onMetricsReceived(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+
+    /*
+     * Sets the refresh rate of the given global nozzle numbers, as indexed in
+     * the snapshots. Sends one frame to each slave carrying one of them.
+     */
+    void setRefreshRate(unsigned short refreshRate, const std::vector<uint16_t> &nozzles);
+
+    /*
+     * Sets the calibration of the given global nozzle numbers. A zero field is
+     * left as it was, so pulses per cubic meter and spacing can be set apart.
+     */
+    void setNozzleCalibration(const std::vector<uint16_t> &nozzles, uint32_t pulsesPerCubicMeter, uint16_t spacing);
+    // Calibration in use for a global nozzle number, defaults included.
+    nozzle_calibration getNozzleCalibration(uint16_t nozzle);
+    // Same for the nozzles of the boom up to maxCount, under one take of the mutex. Returns how many were copied.
+    uint16_t copyNozzleCalibrations(nozzle_calibration *output, uint16_t maxCount);
+    // Zeroes the sprayed volume of every nozzle, when starting a new job.
+    void resetVolume();
 
-    void getFlowmetersData(std::function<void(flowmeters_data)> callback);
-    void setRefreshRate(unsigned short refreshRate, std::vector<uint8_t> flowmeterIndexes);
+    void setAcquisitionInterval(unsigned short interval);
+    unsigned short getAcquisitionInterval();
 
-    void addGetFlowmetersDataCallback(std::function<void(flowmeters_data)> callback);
-    void callGetFlowmetersDataCallbacks(flowmeters_data data);
+    void setResponseSlotsEnabled(bool enabled);
+    // Spacing of the response slots of the current cycle in microseconds, 0 without slots.
+    uint16_t getResponseSlotDuration();
+    uint32_t getDuplicateResponseCount() { return duplicateResponseCount.load(std::memory_order_relaxed); }
+
+    /*
+     * Returns the latest published snapshot and keeps it from being rewritten
+     * until releaseSnapshot() is called. Never blocks and never touches the radio.
+     */
+    const flowmeters_snapshot *acquireSnapshot();
+    void releaseSnapshot(const flowmeters_snapshot *snapshot);
 
     void setLastFlowmetersDataRequestTimestamp(unsigned long timestamp);
-    void setLastFlowmeterDataResponseTimestamp(const macAddress_t mac_addr, unsigned long timestamp);
-    void registerFlowmetersData(const macAddress_t mac_addr, flowmeters_data data);
+    bool wasFlowmetersDataReceived(uint8_t slot);
     bool wasAllFlowmetersDataReceived();
 
-    void getLastFlowmeterData(flowmeters_data *result);
-
     int getPendingFlowmetersDataCount();
 
-    std::string macAddressToString(const macAddress_t mac_addr);
+    /*
+     * Starts recording the radio traffic and the GPS input, see
+     * TrafficCapture. The capture is headed with what a replay needs to set
+     * up a main module like this one:
+     *
+     *   uint8_t version              CAPTURE_METADATA_VERSION
+     *   varint  acquisitionInterval  milliseconds
+     *   uint8_t responseSlotsEnabled
+     *   uint8_t slavesCount
+     *   for each slave, by slot:
+     *     uint8_t mac[6]
+     *     uint8_t channelCount       as advertised when pairing
+     *
+     * Returns false if there is no memory for the capture.
+     */
+    bool startCapture();
 
+    // Starts the job log, the web server and the acquisition task, which calls loop() from then on.
+    void begin();
     void loop();
-};
\ No newline at end of file
+};
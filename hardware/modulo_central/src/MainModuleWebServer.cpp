@@ -1,9 +1,107 @@
 #include "MainModuleWebServer.h"
 #include "MainModule.h"
+#include "DataResponse.h"
 #include <ArduinoJson.h>
 #include <GPS.h>
-#include <esp_task_wdt.h>
 #include <WiFi.h>
+#include <esp_heap_caps.h>
+
+// Splits a comma separated list of global nozzle numbers.
+static void parseNozzleIndexes(const String &indexesStr, std::vector<uint16_t> &nozzles)
+{
+    int start = 0;
+    int end = indexesStr.indexOf(',');
+
+    while (end != -1)
+    {
+        nozzles.push_back((uint16_t)indexesStr.substring(start, end).toInt());
+        start = end + 1;
+        end = indexesStr.indexOf(',', start);
+    }
+    nozzles.push_back((uint16_t)indexesStr.substring(start).toInt()); // Add the last element
+}
+
+// Durations in microseconds. Bucket i counts the ones in [2^i, 2^(i+1)), up to the last non-empty one.
+static void serializeHistogram(JsonObject object, const latency_histogram &histogram)
+{
+    object["count"] = histogram.count;
+    object["mean"] = histogram.count != 0 ? (uint32_t)(histogram.total / histogram.count) : 0;
+    object["max"] = histogram.max;
+
+    JsonArray buckets = object["buckets"].to<JsonArray>();
+    const uint8_t usedBuckets = histogram.getUsedBuckets();
+    for (uint8_t i = 0; i < usedBuckets; i++)
+    {
+        buckets.add(histogram.buckets[i]);
+    }
+}
+
+// Name of a message type in /metrics, responses take the name of their request.
+static const char *getMessageTypeName(uint8_t messageType)
+{
+    switch (messageType & 0x7F)
+    {
+    case PAIR_REQUEST:
+        return "pair";
+    case FLOWMETER_DATA_REQUEST:
+        return "flowmeter_data";
+    case SET_REFRESH_RATE:
+        return "set_refresh_rate";
+    case SAMPLE_LATCH:
+        return "sample_latch";
+    case METRICS_REQUEST:
+        return "metrics";
+    case RELIABLE_MESSAGE:
+        return "reliable";
+    default:
+        return "other";
+    }
+}
+
+/*
+ * Lowest free stack of a task since it started in bytes, its core (null when
+ * it may run on either) and its priority. With a task_load, also its busy time
+ * and the share of its core it used since the previous /metrics, in percent.
+ * Skips tasks not created yet.
+ */
+static void addTask(JsonArray tasks, TaskHandle_t task, BaseType_t core, const task_load *load, uint64_t &lastBusyTime, int64_t elapsed)
+{
+    if (task == nullptr)
+    {
+        return;
+    }
+
+    JsonObject object = tasks.add<JsonObject>();
+    object["name"] = pcTaskGetName(task);
+    object["stackHighWatermark"] = uxTaskGetStackHighWaterMark(task);
+    if (core == 0 || core == 1)
+    {
+        object["core"] = core;
+    }
+    else
+    {
+        object["core"] = nullptr;
+    }
+    object["priority"] = uxTaskPriorityGet(task);
+
+    if (load == nullptr)
+    {
+        return;
+    }
+
+    const uint64_t busyTime = load->busyTime.load(std::memory_order_relaxed);
+    object["busyTime"] = busyTime;
+    object["runCount"] = load->runCount.load(std::memory_order_relaxed);
+    if (elapsed > 0)
+    {
+        object["cpu"] = (busyTime - lastBusyTime) * 100.0f / elapsed;
+    }
+    else
+    {
+        object["cpu"] = nullptr;
+    }
+    lastBusyTime = busyTime;
+}
 
 MainModuleWebServer::MainModuleWebServer(const char *ssid, const char *password)
 {
@@ -40,9 +138,75 @@ void MainModuleWebServer::setup()
     this->setupDefaultHeaders();
 }
 
+void MainModuleWebServer::start()
+{
+    server->begin();
+
+    xTaskCreatePinnedToCore(
+        MainModuleWebServer::publisherTaskFunction,
+        "web_publisher",
+        WEB_PUBLISHER_TASK_STACK_SIZE,
+        this,
+        WEB_PUBLISHER_TASK_PRIORITY,
+        &this->publisherTask,
+        WEB_PUBLISHER_TASK_CORE);
+}
+
+void MainModuleWebServer::notify(web_event event)
+{
+    if (xQueueSend(eventQueue, &event, 0) != pdTRUE)
+    {
+        eventDropCount.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void MainModuleWebServer::publisherTaskFunction(void *arg)
+{
+    MainModuleWebServer *webServer = static_cast<MainModuleWebServer *>(arg);
+
+    while (true)
+    {
+        web_event event;
+        xQueueReceive(webServer->eventQueue, &event, pdMS_TO_TICKS(WEB_PUBLISHER_POLL_INTERVAL));
+
+        const int64_t start = esp_timer_get_time();
+        webServer->publish();
+        webServer->publisherLoad.add(esp_timer_get_time() - start);
+    }
+}
+
+void MainModuleWebServer::publish()
+{
+    MainModule *mainModule = MainModule::getInstance();
+
+    // Alerts first, they are what the operator has to react to.
+    if (mainModule->getNozzleMonitor()->getLastAlertId() != lastPushedAlertId)
+    {
+        lastPushedAlertId = pushAlerts(lastPushedAlertId);
+    }
+
+    completePendingDataRequests();
+
+    // Several publications may have queued up meanwhile, only the latest is pushed.
+    const flowmeters_snapshot *snapshot = mainModule->acquireSnapshot();
+    if (snapshot->version != lastPushedSnapshotVersion)
+    {
+        lastPushedSnapshotVersion = snapshot->version;
+        pushSnapshot(snapshot);
+    }
+    mainModule->releaseSnapshot(snapshot);
+}
+
 void MainModuleWebServer::setupEndpoints()
 {
     server->on("/data", HTTP_GET, std::bind(&MainModuleWebServer::onDataRequest, this, std::placeholders::_1));
+    server->on("/alerts", HTTP_GET, std::bind(&MainModuleWebServer::onAlertsRequest, this, std::placeholders::_1));
+    server->on("/link_stats", HTTP_GET, std::bind(&MainModuleWebServer::onLinkStatsRequest, this, std::placeholders::_1));
+    server->on("/metrics", HTTP_GET, std::bind(&MainModuleWebServer::onMetricsRequest, this, std::placeholders::_1));
+
+    dataSocket->onEvent(std::bind(&MainModuleWebServer::onDataSocketEvent, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5, std::placeholders::_6));
+    server->addHandler(dataSocket);
+    server->addHandler(alertsSocket);
 
     server->on(
         "/get_module_mode",
@@ -106,20 +270,213 @@ void MainModuleWebServer::setupEndpoints()
             unsigned short newRate = request->getParam("refresh_rate", false)->value().toInt();
             String indexesStr = request->getParam("flowmeter_indexes", false)->value();
 
-            std::vector<uint8_t> flowmeterIndexes;
-            int start = 0;
-            int end = indexesStr.indexOf(',');
-
-            while (end != -1) {
-                flowmeterIndexes.push_back((uint8_t)indexesStr.substring(start, end).toInt());
-                start = end + 1;
-                end = indexesStr.indexOf(',', start);
-            }
-            flowmeterIndexes.push_back((uint8_t)indexesStr.substring(start).toInt()); // Add the last element
+            std::vector<uint16_t> flowmeterIndexes;
+            parseNozzleIndexes(indexesStr, flowmeterIndexes);
 
             MainModule::getInstance()->setRefreshRate(newRate, flowmeterIndexes);
 
             request->send(200); }); 
+
+    server->on(
+        "/set_acquisition_interval",
+        HTTP_POST, [](AsyncWebServerRequest *request)
+        {
+            if (!request->hasParam("interval", false))
+            {
+                request->send(400, "application/json", "{\"error\": \"Missing interval parameter\"}");
+                return;
+            }
+
+            unsigned short newInterval = request->getParam("interval", false)->value().toInt();
+            MainModule::getInstance()->setAcquisitionInterval(newInterval);
+
+            request->send(200); });
+
+    server->on(
+        "/set_calibration",
+        HTTP_POST, [](AsyncWebServerRequest *request)
+        {
+            if (!request->hasParam("flowmeter_indexes", false))
+            {
+                request->send(400, "application/json", "{\"error\": \"Missing flowmeter_indexes parameter\"}");
+                return;
+            }
+
+            if (!request->hasParam("pulses_per_liter", false) && !request->hasParam("spacing", false))
+            {
+                request->send(400, "application/json", "{\"error\": \"Missing pulses_per_liter or spacing parameter\"}");
+                return;
+            }
+
+            // Pulses per litre may have decimals, spacing is in millimeters. A missing one is left as it was.
+            const uint32_t pulsesPerCubicMeter = request->hasParam("pulses_per_liter", false) ? (uint32_t)(request->getParam("pulses_per_liter", false)->value().toFloat() * 1000 + 0.5f) : 0;
+            const uint16_t spacing = request->hasParam("spacing", false) ? (uint16_t)request->getParam("spacing", false)->value().toInt() : 0;
+
+            std::vector<uint16_t> flowmeterIndexes;
+            parseNozzleIndexes(request->getParam("flowmeter_indexes", false)->value(), flowmeterIndexes);
+
+            MainModule::getInstance()->setNozzleCalibration(flowmeterIndexes, pulsesPerCubicMeter, spacing);
+
+            request->send(200); });
+
+    server->on(
+        "/get_calibration",
+        HTTP_GET, [](AsyncWebServerRequest *request)
+        {
+            // Copied at once, the acquisition task is not held up while the JSON is built.
+            static nozzle_calibration calibrations[MAX_FLOWMETERS];
+            const uint16_t flowmeterCount = MainModule::getInstance()->copyNozzleCalibrations(calibrations, MAX_FLOWMETERS);
+
+            JsonDocument doc;
+            JsonArray pulsesPerLiter = doc["pulsesPerLiter"].to<JsonArray>();
+            JsonArray spacing = doc["spacing"].to<JsonArray>();
+            for (uint16_t i = 0; i < flowmeterCount; i++)
+            {
+                pulsesPerLiter.add(calibrations[i].pulsesPerCubicMeter / 1000.0f);
+                spacing.add(calibrations[i].spacing);
+            }
+
+            String response;
+            serializeJson(doc, response);
+            request->send(200, "application/json", response); });
+
+    server->on(
+        "/reset_volume",
+        HTTP_POST, [](AsyncWebServerRequest *request)
+        {
+            MainModule::getInstance()->resetVolume();
+            request->send(200); });
+
+    server->on(
+        "/start_capture",
+        HTTP_POST, [](AsyncWebServerRequest *request)
+        {
+            if (!MainModule::getInstance()->startCapture())
+            {
+                request->send(500, "application/json", "{\"error\": \"Not enough memory for the capture\"}");
+                return;
+            }
+            request->send(200); });
+
+    server->on(
+        "/stop_capture",
+        HTTP_POST, [](AsyncWebServerRequest *request)
+        {
+            TrafficCapture::getInstance()->stop();
+            request->send(200); });
+
+    server->on(
+        "/clear_capture",
+        HTTP_POST, [](AsyncWebServerRequest *request)
+        {
+            TrafficCapture::getInstance()->clear();
+            request->send(200); });
+
+    // The capture file, see TrafficCapture. Downloading it stops the capture so it holds still meanwhile.
+    server->on(
+        "/capture",
+        HTTP_GET, [](AsyncWebServerRequest *request)
+        {
+            TrafficCapture *capture = TrafficCapture::getInstance();
+            capture->stop();
+            request->send("application/octet-stream", capture->getFileSize(), [capture](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                          { return capture->readFile(buffer, maxLen, index); }); });
+
+    server->on(
+        "/job_log_segments",
+        HTTP_GET, [](AsyncWebServerRequest *request)
+        {
+            JobLog *jobLog = MainModule::getInstance()->getJobLog();
+            const uint32_t firstSegment = jobLog->getFirstSegment();
+            const uint32_t lastSegment = jobLog->getLastSegment();
+
+            JsonDocument doc;
+            JsonArray segments = doc["segments"].to<JsonArray>();
+            uint32_t size = 0;
+            for (uint32_t segment = firstSegment; firstSegment != 0 && segment <= lastSegment; segment++)
+            {
+                char path[32];
+                JobLog::getSegmentPath(segment, path, sizeof(path));
+                File file = LittleFS.open(path, FILE_READ);
+                if (!file)
+                {
+                    continue;
+                }
+                JsonObject object = segments.add<JsonObject>();
+                object["index"] = segment;
+                object["size"] = file.size();
+                size += file.size();
+                file.close();
+            }
+            doc["size"] = size;
+            doc["maxSize"] = JOB_LOG_MAX_SIZE;
+
+            String response;
+            serializeJson(doc, response);
+            request->send(200, "application/json", response); });
+
+    /*
+     * The job log, see JobLog, segments one after the other from the one
+     * given by from (the oldest by default) to the one being appended. Read
+     * from the flash a chunk at a time, so it never sits in RAM whole.
+     */
+    server->on(
+        "/job_log",
+        HTTP_GET, [](AsyncWebServerRequest *request)
+        {
+            JobLog *jobLog = MainModule::getInstance()->getJobLog();
+            struct job_log_download
+            {
+                uint32_t segment;
+                uint32_t lastSegment;
+                File file;
+            };
+            std::shared_ptr<job_log_download> download = std::make_shared<job_log_download>();
+            download->segment = jobLog->getFirstSegment();
+            download->lastSegment = jobLog->getLastSegment();
+            if (request->hasParam("from"))
+            {
+                download->segment = std::max<uint32_t>(download->segment, request->getParam("from")->value().toInt());
+            }
+            if (download->segment == 0)
+            {
+                download->segment = download->lastSegment + 1;
+            }
+
+            request->sendChunked("application/octet-stream", [download](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                                 {
+                size_t written = 0;
+                while (written < maxLen && download->segment <= download->lastSegment)
+                {
+                    if (!download->file)
+                    {
+                        // Segments removed meanwhile are skipped.
+                        char path[32];
+                        JobLog::getSegmentPath(download->segment, path, sizeof(path));
+                        download->file = LittleFS.open(path, FILE_READ);
+                        if (!download->file)
+                        {
+                            download->segment++;
+                            continue;
+                        }
+                    }
+
+                    const size_t count = download->file.read(buffer + written, maxLen - written);
+                    written += count;
+                    if (count == 0)
+                    {
+                        download->file.close();
+                        download->segment++;
+                    }
+                }
+                return written; }); });
+
+    server->on(
+        "/clear_job_log",
+        HTTP_POST, [](AsyncWebServerRequest *request)
+        {
+            MainModule::getInstance()->getJobLog()->clear();
+            request->send(200); });
 }
 
 void MainModuleWebServer::setupDefaultHeaders()
@@ -132,53 +489,470 @@ void MainModuleWebServer::setupDefaultHeaders()
 void MainModuleWebServer::onDataRequest(AsyncWebServerRequest *request)
 {
     MainModule *mainModule = MainModule::getInstance();
+    const int64_t startTime = esp_timer_get_time();
 
-    bool canSendResponse = false;
+    const flowmeters_snapshot *snapshot = mainModule->acquireSnapshot();
+
+    // Without "since" the client just wants the latest snapshot.
+    if (!request->hasParam("since", false) || snapshot->version > (uint32_t)request->getParam("since", false)->value().toInt())
+    {
+        sendDataResponse(request, snapshot);
+        mainModule->releaseSnapshot(snapshot);
+
+        xSemaphoreTake(pendingDataRequestsMutex, portMAX_DELAY);
+        dataWaitHistogram.add((uint32_t)(esp_timer_get_time() - startTime));
+        xSemaphoreGive(pendingDataRequestsMutex);
+        return;
+    }
 
-    mainModule->getFlowmetersData(
-        [request, &canSendResponse](flowmeters_data data)
+    unsigned long timeout = DEFAULT_DATA_REQUEST_TIMEOUT;
+    if (request->hasParam("timeout", false))
+    {
+        timeout = std::min<unsigned long>(request->getParam("timeout", false)->value().toInt(), MAX_DATA_REQUEST_TIMEOUT);
+    }
+
+    xSemaphoreTake(pendingDataRequestsMutex, portMAX_DELAY);
+    if (pendingDataRequestsCount < MAX_PENDING_DATA_REQUESTS)
+    {
+        pending_data_request &pending = pendingDataRequests[pendingDataRequestsCount++];
+        pending.request = request->pause();
+        pending.minVersion = (uint32_t)request->getParam("since", false)->value().toInt() + 1;
+        pending.deadline = millis() + timeout;
+        pending.startTime = startTime;
+        xSemaphoreGive(pendingDataRequestsMutex);
+
+        mainModule->releaseSnapshot(snapshot);
+        return;
+    }
+    dataRequestOverflowCount++;
+    xSemaphoreGive(pendingDataRequestsMutex);
+
+    // Too many clients waiting, answer with what we have instead of queueing.
+    sendDataResponse(request, snapshot);
+    mainModule->releaseSnapshot(snapshot);
+
+    xSemaphoreTake(pendingDataRequestsMutex, portMAX_DELAY);
+    dataWaitHistogram.add((uint32_t)(esp_timer_get_time() - startTime));
+    xSemaphoreGive(pendingDataRequestsMutex);
+}
+
+void MainModuleWebServer::completePendingDataRequests()
+{
+    if (pendingDataRequestsCount == 0)
+    {
+        return;
+    }
+
+    MainModule *mainModule = MainModule::getInstance();
+    const flowmeters_snapshot *snapshot = mainModule->acquireSnapshot();
+    const unsigned long now = millis();
+
+    AsyncWebServerRequestPtr readyRequests[MAX_PENDING_DATA_REQUESTS];
+    int64_t readyRequestsStartTime[MAX_PENDING_DATA_REQUESTS];
+    uint8_t readyRequestsCount = 0;
+
+    xSemaphoreTake(pendingDataRequestsMutex, portMAX_DELAY);
+    uint8_t i = 0;
+    while (i < pendingDataRequestsCount)
+    {
+        pending_data_request &pending = pendingDataRequests[i];
+        if (snapshot->version < pending.minVersion && (long)(now - pending.deadline) < 0 && !pending.request.expired())
         {
-            Serial.println("Sending data response...");
-            JsonDocument doc;
-            JsonArray flowmeters = doc["flowmetersPulseCount"].to<JsonArray>();
-            JsonArray ages = doc["flowmetersLastPulseAge"].to<JsonArray>();
-            for (int i = 0; i < data.flowmeterCount; i++)
-            {
-                flowmeters.add(data.flowmetersPulseCount[i]);
-                ages.add(data.flowmetersLastPulseAge[i]);
-            }
+            i++;
+            continue;
+        }
 
-            float speed = GPS::getInstance()->getSpeed();
-            doc["speed"] = speed;
+        readyRequestsStartTime[readyRequestsCount] = pending.startTime;
+        readyRequests[readyRequestsCount++] = std::move(pending.request);
+        pendingDataRequestsCount--;
+        if (i != pendingDataRequestsCount)
+        {
+            pending = std::move(pendingDataRequests[pendingDataRequestsCount]);
+        }
+    }
+    xSemaphoreGive(pendingDataRequestsMutex);
 
-            uint32_t satelliteCount = GPS::getInstance()->getSatelliteCount();
-            doc["satelliteCount"] = satelliteCount;
+    for (uint8_t j = 0; j < readyRequestsCount; j++)
+    {
+        // The request is gone if the client disconnected while waiting.
+        if (auto request = readyRequests[j].lock())
+        {
+            sendDataResponse(request.get(), snapshot);
+        }
+    }
 
-            doc["latitude"] = GPS::getInstance()->getLatitude();
-            doc["longitude"] = GPS::getInstance()->getLongitude();
+    mainModule->releaseSnapshot(snapshot);
 
-            String response;
-            serializeJson(doc, response);
+    const int64_t endTime = esp_timer_get_time();
+    xSemaphoreTake(pendingDataRequestsMutex, portMAX_DELAY);
+    for (uint8_t j = 0; j < readyRequestsCount; j++)
+    {
+        dataWaitHistogram.add((uint32_t)(endTime - readyRequestsStartTime[j]));
+    }
+    xSemaphoreGive(pendingDataRequestsMutex);
+}
 
-            try
-            {
+void MainModuleWebServer::sendDataResponse(AsyncWebServerRequest *request, const flowmeters_snapshot *snapshot)
+{
+    AsyncWebSocketSharedBuffer response = serializeDataResponse(snapshot);
+
+    // Sent from the buffer itself, which the filler keeps alive until AsyncTCP is done with it.
+    request->send("application/json", response->size(), [response](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                  {
+        const size_t length = std::min(maxLen, response->size() - index);
+        memcpy(buffer, response->data() + index, length);
+        return length; });
+}
 
-                if (request->client()->connected())
-                {
-                    request->send(200, "application/json", response);
-                }
-            }
-            catch (const std::exception &e)
+AsyncWebSocketSharedBuffer MainModuleWebServer::serializeDataResponse(const flowmeters_snapshot *snapshot)
+{
+    const int64_t start = esp_timer_get_time();
+
+    // One copy of the fix, so speed and position come from the same epoch.
+    gps_fix fix;
+    GPS::getInstance()->getFix(fix);
+
+    AsyncWebSocketSharedBuffer response = DataResponse::serialize(snapshot, fix, millis());
+
+    const uint32_t duration = (uint32_t)(esp_timer_get_time() - start);
+    portENTER_CRITICAL(&serializationMux);
+    serializationHistogram.add(duration);
+    portEXIT_CRITICAL(&serializationMux);
+
+    return response;
+}
+
+void MainModuleWebServer::onDataSocketEvent(AsyncWebSocket *socket, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
+{
+    if (type == WS_EVT_CONNECT)
+    {
+        AsyncWebServerRequest *request = static_cast<AsyncWebServerRequest *>(arg);
+
+        xSemaphoreTake(dataSocketSubscribersMutex, portMAX_DELAY);
+        if (dataSocketSubscribersCount >= MAX_DATA_SOCKET_CLIENTS)
+        {
+            xSemaphoreGive(dataSocketSubscribersMutex);
+            client->close();
+            return;
+        }
+
+        data_socket_subscriber &subscriber = dataSocketSubscribers[dataSocketSubscribersCount++];
+        subscriber.clientId = client->id();
+        subscriber.minInterval = request->hasParam("min_interval") ? request->getParam("min_interval")->value().toInt() : 0;
+        subscriber.lastPushTimestamp = 0;
+        xSemaphoreGive(dataSocketSubscribersMutex);
+    }
+    else if (type == WS_EVT_DISCONNECT)
+    {
+        xSemaphoreTake(dataSocketSubscribersMutex, portMAX_DELAY);
+        for (uint8_t i = 0; i < dataSocketSubscribersCount; i++)
+        {
+            if (dataSocketSubscribers[i].clientId == client->id())
             {
-                Serial.printf("Error sending response: %s\n", e.what());
+                dataSocketSubscribers[i] = dataSocketSubscribers[--dataSocketSubscribersCount];
+                break;
             }
+        }
+        xSemaphoreGive(dataSocketSubscribersMutex);
+    }
+}
 
-            canSendResponse = true;
-        });
+void MainModuleWebServer::pushSnapshot(const flowmeters_snapshot *snapshot)
+{
+    dataSocket->cleanupClients(MAX_DATA_SOCKET_CLIENTS);
 
-    while (!canSendResponse)
+    if (dataSocketSubscribersCount == 0)
     {
-        delay(10);
-        esp_task_wdt_reset();
+        return;
     }
-}
\ No newline at end of file
+
+    // Serialized once and shared by every client queue.
+    AsyncWebSocketSharedBuffer message = serializeDataResponse(snapshot);
+
+    const unsigned long now = millis();
+
+    xSemaphoreTake(dataSocketSubscribersMutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < dataSocketSubscribersCount; i++)
+    {
+        data_socket_subscriber &subscriber = dataSocketSubscribers[i];
+        if (subscriber.lastPushTimestamp != 0 && now - subscriber.lastPushTimestamp < subscriber.minInterval)
+        {
+            continue;
+        }
+
+        // Skip clients whose queue is still full instead of growing it.
+        if (!dataSocket->availableForWrite(subscriber.clientId))
+        {
+            continue;
+        }
+
+        dataSocket->text(subscriber.clientId, message);
+        subscriber.lastPushTimestamp = now;
+    }
+    xSemaphoreGive(dataSocketSubscribersMutex);
+}
+void MainModuleWebServer::onAlertsRequest(AsyncWebServerRequest *request)
+{
+    NozzleMonitor *nozzleMonitor = MainModule::getInstance()->getNozzleMonitor();
+
+    const uint32_t sinceId = request->hasParam("since", false) ? (uint32_t)request->getParam("since", false)->value().toInt() : 0;
+
+    nozzle_alert alerts[MAX_ALERTS_PER_RESPONSE];
+    const uint8_t count = nozzleMonitor->copyAlerts(sinceId, alerts, MAX_ALERTS_PER_RESPONSE);
+
+    String response;
+    serializeAlerts(alerts, count, nozzleMonitor->getLastAlertId(), response);
+
+    request->send(200, "application/json", response);
+}
+
+void MainModuleWebServer::serializeAlerts(const nozzle_alert *alerts, uint8_t count, uint32_t lastAlertId, String &response)
+{
+    const unsigned long now = millis();
+
+    JsonDocument doc;
+    doc["lastAlertId"] = lastAlertId;
+
+    JsonArray array = doc["alerts"].to<JsonArray>();
+    for (uint8_t i = 0; i < count; i++)
+    {
+        JsonObject alert = array.add<JsonObject>();
+        alert["id"] = alerts[i].id;
+        alert["age"] = now - alerts[i].timestamp;
+        alert["nozzle"] = alerts[i].nozzle;
+        alert["state"] = alerts[i].state;
+        alert["previousState"] = alerts[i].previousState;
+        // Pulses per minute, as in /data.
+        alert["rate"] = alerts[i].rate * 60 / 1000.0f;
+        alert["sectionRate"] = alerts[i].sectionRate * 60 / 1000.0f;
+    }
+
+    serializeJson(doc, response);
+}
+
+uint32_t MainModuleWebServer::pushAlerts(uint32_t sinceId)
+{
+    NozzleMonitor *nozzleMonitor = MainModule::getInstance()->getNozzleMonitor();
+
+    nozzle_alert alerts[MAX_ALERTS_PER_RESPONSE];
+    const uint8_t count = nozzleMonitor->copyAlerts(sinceId, alerts, MAX_ALERTS_PER_RESPONSE);
+    if (count == 0)
+    {
+        return sinceId;
+    }
+
+    const uint32_t lastAlertId = alerts[count - 1].id;
+
+    alertsSocket->cleanupClients(MAX_DATA_SOCKET_CLIENTS);
+    if (alertsSocket->count() == 0)
+    {
+        return lastAlertId;
+    }
+
+    String response;
+    serializeAlerts(alerts, count, lastAlertId, response);
+    alertsSocket->textAll(response);
+
+    return lastAlertId;
+}
+
+void MainModuleWebServer::onLinkStatsRequest(AsyncWebServerRequest *request)
+{
+    // Static, with the RTT histograms it does not fit the small stack of the web server task.
+    static request_link_stats stats[MAX_SECONDARY_MODULES];
+    const uint8_t count = MainModule::getInstance()->copyLinkStats(stats, MAX_SECONDARY_MODULES);
+
+    JsonDocument doc;
+    JsonArray array = doc["secondaryModules"].to<JsonArray>();
+    for (uint8_t i = 0; i < count; i++)
+    {
+        // Round trips and timeout in microseconds, counts since the slave was paired or the main module booted.
+        JsonObject link = array.add<JsonObject>();
+        link["index"] = i;
+        link["rttP50"] = stats[i].rttP50;
+        link["rttP90"] = stats[i].rttP90;
+        link["rttP99"] = stats[i].rttP99;
+        link["srtt"] = stats[i].srtt;
+        link["rto"] = stats[i].rto;
+        link["requests"] = stats[i].requestCount;
+        link["retries"] = stats[i].retryCount;
+        link["responses"] = stats[i].responseCount;
+        link["missedCycles"] = stats[i].missedCycleCount;
+        link["degraded"] = stats[i].isDegraded;
+    }
+
+    String response;
+    serializeJson(doc, response);
+
+    request->send(200, "application/json", response);
+}
+
+void MainModuleWebServer::onMetricsRequest(AsyncWebServerRequest *request)
+{
+    MainModule *mainModule = MainModule::getInstance();
+    ESPNowManager *espNowManager = ESPNowManager::getInstance();
+
+    // Everything is copied out first, the JSON is built without holding any lock.
+    latency_histogram loopHistogram;
+    latency_histogram cycleHistogram;
+    mainModule->copyLoopMetrics(loopHistogram, cycleHistogram);
+
+    xSemaphoreTake(pendingDataRequestsMutex, portMAX_DELAY);
+    const latency_histogram dataWaitHistogram = this->dataWaitHistogram;
+    const uint32_t dataRequestOverflowCount = this->dataRequestOverflowCount;
+    xSemaphoreGive(pendingDataRequestsMutex);
+
+    portENTER_CRITICAL(&serializationMux);
+    const latency_histogram serializationHistogram = this->serializationHistogram;
+    portEXIT_CRITICAL(&serializationMux);
+
+    latency_histogram dispatchLatencyHistogram;
+    espNowManager->copyDispatchLatency(dispatchLatencyHistogram);
+
+    espnow_message_metrics messageMetrics[ESPNOW_MESSAGE_METRICS_SLOTS];
+    espNowManager->copyMessageMetrics(messageMetrics);
+
+    // Static like in onLinkStatsRequest(), handlers all run on the web server task.
+    static request_link_stats stats[MAX_SECONDARY_MODULES];
+    const uint8_t count = mainModule->copyLinkStats(stats, MAX_SECONDARY_MODULES);
+    static secondary_module_metrics slaveMetrics[MAX_SECONDARY_MODULES];
+    const uint8_t metricsCount = mainModule->copySlaveMetrics(slaveMetrics, count);
+
+    // Durations in microseconds, memory in bytes, times in milliseconds since boot.
+    JsonDocument doc;
+    doc["uptime"] = millis();
+
+    JsonObject heap = doc["heap"].to<JsonObject>();
+    heap["free"] = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    heap["minFree"] = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    heap["largestFreeBlock"] = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+
+    // By core, see main.cpp. The radio path (dispatcher and acquisition) has core 0
+    // to itself, everything serializing JSON runs on core 1.
+    const int64_t now = esp_timer_get_time();
+    const int64_t elapsed = this->lastMetricsTime != 0 ? now - this->lastMetricsTime : 0;
+    this->lastMetricsTime = now;
+
+    JsonArray tasks = doc["tasks"].to<JsonArray>();
+    addTask(tasks, espNowManager->getDispatcherTask(), ESPNOW_DISPATCHER_TASK_CORE, &espNowManager->getDispatcherLoad(), this->lastTasksBusyTime[0], elapsed);
+    addTask(tasks, mainModule->getAcquisitionTask(), ACQUISITION_TASK_CORE, &mainModule->getAcquisitionLoad(), this->lastTasksBusyTime[1], elapsed);
+    GPS *gps = GPS::hasInstance() ? GPS::getInstance() : nullptr;
+    addTask(tasks, gps != nullptr ? gps->getTask() : nullptr, GPS_TASK_CORE, gps != nullptr ? &gps->getLoad() : nullptr, this->lastTasksBusyTime[2], elapsed);
+    addTask(tasks, this->publisherTask, WEB_PUBLISHER_TASK_CORE, &this->publisherLoad, this->lastTasksBusyTime[3], elapsed);
+    addTask(tasks, mainModule->getJobLog()->getTask(), JOB_LOG_TASK_CORE, &mainModule->getJobLog()->getLoad(), this->lastTasksBusyTime[4], elapsed);
+    // The web server task, which is running this handler.
+    addTask(tasks, xTaskGetCurrentTaskHandle(), CONFIG_ASYNC_TCP_RUNNING_CORE, nullptr, this->lastTasksBusyTime[5], elapsed);
+
+    serializeHistogram(doc["loop"].to<JsonObject>(), loopHistogram);
+    serializeHistogram(doc["acquisitionCycle"].to<JsonObject>(), cycleHistogram);
+
+    JsonObject dataRequests = doc["dataRequests"].to<JsonObject>();
+    serializeHistogram(dataRequests["wait"].to<JsonObject>(), dataWaitHistogram);
+    dataRequests["overflow"] = dataRequestOverflowCount;
+
+    JsonObject web = doc["web"].to<JsonObject>();
+    serializeHistogram(web["serialization"].to<JsonObject>(), serializationHistogram);
+    web["eventQueueDepth"] = uxQueueMessagesWaiting(eventQueue);
+    web["eventDrops"] = eventDropCount.load(std::memory_order_relaxed);
+
+    TrafficCapture *capture = TrafficCapture::getInstance();
+    JsonObject captureObject = doc["capture"].to<JsonObject>();
+    captureObject["recording"] = capture->isStarted();
+    captureObject["records"] = capture->getRecordCount();
+    captureObject["dropped"] = capture->getDroppedCount();
+    captureObject["size"] = capture->getFileSize();
+
+    job_log_stats jobLogStats;
+    mainModule->getJobLog()->getStats(jobLogStats);
+    JsonObject jobLog = doc["jobLog"].to<JsonObject>();
+    jobLog["mounted"] = jobLogStats.isMounted;
+    jobLog["firstSegment"] = jobLogStats.firstSegment;
+    jobLog["lastSegment"] = jobLogStats.lastSegment;
+    jobLog["size"] = jobLogStats.size;
+    jobLog["records"] = jobLogStats.records;
+    jobLog["idleCycles"] = jobLogStats.idleCycles;
+    jobLog["dropped"] = jobLogStats.droppedRecords;
+    jobLog["blocksWritten"] = jobLogStats.blocksWritten;
+    jobLog["writeErrors"] = jobLogStats.writeErrors;
+    jobLog["maxWriteTime"] = jobLogStats.maxWriteTime;
+
+    JsonObject espnow = doc["espnow"].to<JsonObject>();
+    espnow["delivered"] = espNowManager->getDeliveredCount();
+    espnow["deliveryFailed"] = espNowManager->getDeliveryFailedCount();
+    espnow["receiveQueueDepth"] = espNowManager->getReceiveQueueDepth();
+    espnow["receiveQueueHighWatermark"] = espNowManager->getReceiveQueueHighWatermark();
+    espnow["receiveQueueDrops"] = espNowManager->getReceiveQueueDropCount();
+    // Should stay well below the serialization times if the radio never waits behind them.
+    serializeHistogram(espnow["dispatchLatency"].to<JsonObject>(), dispatchLatencyHistogram);
+
+    JsonObject reliable = espnow["reliable"].to<JsonObject>();
+    reliable["delivered"] = espNowManager->getReliableDeliveredCount();
+    reliable["failed"] = espNowManager->getReliableFailedCount();
+    reliable["inFlight"] = espNowManager->getReliableInFlightCount();
+    reliable["retransmits"] = espNowManager->getReliableRetransmitCount();
+    reliable["duplicates"] = espNowManager->getReliableDuplicateCount();
+    reliable["windowFull"] = espNowManager->getReliableWindowFullCount();
+    espnow["duplicateDataResponses"] = mainModule->getDuplicateResponseCount();
+
+    JsonArray messages = espnow["messages"].to<JsonArray>();
+    for (const espnow_message_metrics &messageMetric : messageMetrics)
+    {
+        if (messageMetric.sent == 0 && messageMetric.received == 0 && messageMetric.dropped == 0)
+        {
+            continue;
+        }
+
+        JsonObject message = messages.add<JsonObject>();
+        message["type"] = messageMetric.messageType;
+        message["name"] = getMessageTypeName(messageMetric.messageType);
+        message["response"] = (messageMetric.messageType & 0x80) != 0;
+        message["sent"] = messageMetric.sent;
+        message["sendErrors"] = messageMetric.sendErrors;
+        message["received"] = messageMetric.received;
+        message["dropped"] = messageMetric.dropped;
+    }
+
+    JsonArray secondaryModules = doc["secondaryModules"].to<JsonArray>();
+    for (uint8_t i = 0; i < count; i++)
+    {
+        JsonObject secondaryModule = secondaryModules.add<JsonObject>();
+        secondaryModule["index"] = i;
+        serializeHistogram(secondaryModule["rtt"].to<JsonObject>(), stats[i].rttHistogram);
+
+        // Counters reported by the slave itself, null until it answered a METRICS_REQUEST.
+        if (i >= metricsCount || slaveMetrics[i].timestamp == 0)
+        {
+            secondaryModule["metrics"] = nullptr;
+            continue;
+        }
+
+        const secondary_metrics &metrics = slaveMetrics[i].metrics;
+        JsonObject object = secondaryModule["metrics"].to<JsonObject>();
+        object["age"] = millis() - slaveMetrics[i].timestamp;
+        object["uptime"] = metrics.uptime;
+        object["freeHeap"] = metrics.freeHeap;
+        object["minFreeHeap"] = metrics.minFreeHeap;
+        object["largestFreeBlock"] = metrics.largestFreeBlock;
+        object["loopStackHighWatermark"] = metrics.loopStackHighWatermark;
+        object["dispatcherStackHighWatermark"] = metrics.dispatcherStackHighWatermark;
+        object["loopMaxDuration"] = metrics.loopMaxDuration;
+        object["framesSent"] = metrics.framesSent;
+        object["sendErrors"] = metrics.sendErrors;
+        object["framesDelivered"] = metrics.framesDelivered;
+        object["deliveryFailures"] = metrics.deliveryFailures;
+        object["framesReceived"] = metrics.framesReceived;
+        object["framesDropped"] = metrics.framesDropped;
+
+        // Interrupts per minute of each channel since the previous report.
+        JsonArray pulseRates = object["pulseRates"].to<JsonArray>();
+        for (uint8_t j = 0; j < metrics.channelCount; j++)
+        {
+            pulseRates.add(slaveMetrics[i].pulseRates[j] * 60 / 1000.0f);
+        }
+    }
+
+    String response;
+    serializeJson(doc, response);
+
+    request->send(200, "application/json", response);
+}
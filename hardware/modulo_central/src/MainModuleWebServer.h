@@ -2,6 +2,74 @@
 
 #include <ESPAsyncWebServer.h>
 #include <esp_now_types.h>
+#include <LatencyHistogram.h>
+#include <TaskLoad.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/queue.h>
+
+#define MAX_PENDING_DATA_REQUESTS 8
+#define DEFAULT_DATA_REQUEST_TIMEOUT 2000
+#define MAX_DATA_REQUEST_TIMEOUT 10000
+
+#define MAX_DATA_SOCKET_CLIENTS 8
+
+#define MAX_ALERTS_PER_RESPONSE 32
+
+// Publisher task, see main.cpp for the layout of the tasks. It serializes the
+// pushes away from the radio core, and also wakes every poll interval (ms) to
+// expire the /data requests that timed out.
+#define WEB_PUBLISHER_TASK_CORE 1
+#define WEB_PUBLISHER_TASK_PRIORITY 2
+#define WEB_PUBLISHER_TASK_STACK_SIZE 8192
+#define WEB_PUBLISHER_POLL_INTERVAL 50
+#define WEB_EVENT_QUEUE_LENGTH 8
+
+// Task running the request handlers, set from platformio.ini. Any core by default.
+#ifndef CONFIG_ASYNC_TCP_RUNNING_CORE
+#define CONFIG_ASYNC_TCP_RUNNING_CORE -1
+#endif
+
+// Tasks listed in /metrics.
+#define METRICS_TASKS_COUNT 6
+
+struct flowmeters_snapshot;
+struct nozzle_alert;
+
+/*
+ * A /data request waiting for a snapshot newer than the one the client already has.
+ * The request is paused, so a client disconnect simply expires the pointer.
+ */
+typedef struct pending_data_request
+{
+    AsyncWebServerRequestPtr request;
+    uint32_t minVersion;
+    unsigned long deadline;
+    // esp_timer_get_time() when the request arrived.
+    int64_t startTime;
+} pending_data_request;
+
+/*
+ * What the acquisition task tells the publisher task. Only a wake-up: the
+ * publisher reads the latest snapshot and alerts itself, so a dropped event
+ * is caught up on the next one or the next poll.
+ */
+typedef enum web_event
+{
+    WEB_EVENT_SNAPSHOT_PUBLISHED,
+    WEB_EVENT_ALERTS_RAISED,
+} web_event;
+
+/*
+ * A client of the /ws/data push stream.
+ */
+typedef struct data_socket_subscriber
+{
+    uint32_t clientId;
+    // Minimum time between two pushes to this client, 0 pushes every snapshot.
+    unsigned long minInterval;
+    unsigned long lastPushTimestamp;
+} data_socket_subscriber;
 
 class MainModuleWebServer
 {
@@ -16,25 +84,99 @@ private:
     const char *password;
 
     AsyncWebServer *server = new AsyncWebServer(80);
+    AsyncWebSocket *dataSocket = new AsyncWebSocket("/ws/data");
+    // Alerts have a socket of their own, so /ws/data only ever carries snapshots.
+    AsyncWebSocket *alertsSocket = new AsyncWebSocket("/ws/alerts");
 
     std::function<ModuleMode(void)> getModuleMode;
 
+    pending_data_request pendingDataRequests[MAX_PENDING_DATA_REQUESTS];
+    uint8_t pendingDataRequestsCount = 0;
+    SemaphoreHandle_t pendingDataRequestsMutex = xSemaphoreCreateMutex();
+
+    // Time from the arrival of each /data request to its response (us), and the
+    // requests answered right away because too many were waiting. Guarded by
+    // pendingDataRequestsMutex.
+    latency_histogram dataWaitHistogram = {};
+    uint32_t dataRequestOverflowCount = 0;
+
+    data_socket_subscriber dataSocketSubscribers[MAX_DATA_SOCKET_CLIENTS];
+    uint8_t dataSocketSubscribersCount = 0;
+    SemaphoreHandle_t dataSocketSubscribersMutex = xSemaphoreCreateMutex();
+
+    QueueHandle_t eventQueue = xQueueCreate(WEB_EVENT_QUEUE_LENGTH, sizeof(web_event));
+    std::atomic<uint32_t> eventDropCount{0};
+
+    TaskHandle_t publisherTask = nullptr;
+    task_load publisherLoad;
+    // Only touched by the publisher task.
+    uint32_t lastPushedSnapshotVersion = 0;
+    uint32_t lastPushedAlertId = 0;
+
+    // Time spent serializing the /data responses and pushes, from either task (us).
+    latency_histogram serializationHistogram = {};
+    portMUX_TYPE serializationMux = portMUX_INITIALIZER_UNLOCKED;
+
+    // Busy time of each task at the previous /metrics, for its CPU usage since then.
+    int64_t lastMetricsTime = 0;
+    uint64_t lastTasksBusyTime[METRICS_TASKS_COUNT] = {};
+
 private:
     void setupEndpoints();
     void setupDefaultHeaders();
 
     void onDataRequest(AsyncWebServerRequest *request);
+    void sendDataResponse(AsyncWebServerRequest *request, const flowmeters_snapshot *snapshot);
+    // Writes the snapshot without any JSON document, into a buffer of the DataResponse pool.
+    AsyncWebSocketSharedBuffer serializeDataResponse(const flowmeters_snapshot *snapshot);
+
+    void onAlertsRequest(AsyncWebServerRequest *request);
+    void serializeAlerts(const nozzle_alert *alerts, uint8_t count, uint32_t lastAlertId, String &response);
+
+    void onLinkStatsRequest(AsyncWebServerRequest *request);
+    void onMetricsRequest(AsyncWebServerRequest *request);
+
+    void onDataSocketEvent(AsyncWebSocket *socket, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len);
+
+    static void publisherTaskFunction(void *arg);
+    // Answers the waiting /data requests and pushes what is new, on the publisher task.
+    void publish();
 
 public:
+    /*
+     * Wakes the publisher task. Never blocks: with the queue full the event is
+     * dropped and counted, the publisher is already behind and will catch up.
+     */
+    void notify(web_event event);
+
+    /*
+     * Answers the pending /data requests whose snapshot was published or whose
+     * timeout expired. Called from the publisher task.
+     */
+    void completePendingDataRequests();
+
+    /*
+     * Pushes a newly published snapshot to the /ws/data clients, honoring the
+     * min_interval each client asked for when connecting.
+     */
+    void pushSnapshot(const flowmeters_snapshot *snapshot);
+
+    /*
+     * Pushes the nozzle alerts newer than sinceId to every /ws/alerts client,
+     * right away and regardless of min_interval. Returns the id of the last
+     * alert handled.
+     */
+    uint32_t pushAlerts(uint32_t sinceId);
+
     void setGetModuleMode(std::function<ModuleMode(void)> getModuleMode)
     {
         this->getModuleMode = getModuleMode;
     }
 
-    void start()
-    {
-        server->begin();
-    }
+    // Starts serving, and the publisher task.
+    void start();
+
+    TaskHandle_t getPublisherTask() { return publisherTask; }
 
     void stop()
     {
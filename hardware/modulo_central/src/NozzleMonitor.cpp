@@ -0,0 +1,171 @@
+#include "NozzleMonitor.h"
+#include <algorithm>
+
+NozzleMonitor::NozzleMonitor()
+{
+    memset(alerts, 0, sizeof(alerts));
+}
+
+NozzleMonitor::~NozzleMonitor()
+{
+}
+
+void NozzleMonitor::updateSection(nozzle_monitor_state *states, const uint32_t *rates, const uint8_t *confidences, uint8_t count, uint16_t offset, unsigned long now)
+{
+    uint32_t sampledRates[NOZZLE_MONITOR_MAX_SECTION_SIZE];
+    uint8_t sampledCount = 0;
+
+    count = std::min<uint8_t>(count, NOZZLE_MONITOR_MAX_SECTION_SIZE);
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        nozzle_monitor_state &state = states[i];
+        if (confidences[i] >= NOZZLE_MONITOR_MIN_CONFIDENCE)
+        {
+            if (state.sampleCount == 0)
+            {
+                state.ewmaRate = rates[i];
+            }
+            else
+            {
+                const int32_t delta = (int32_t)(rates[i] - state.ewmaRate);
+                state.ewmaRate = state.ewmaRate + (delta >> NOZZLE_MONITOR_EWMA_SHIFT);
+            }
+
+            if (state.sampleCount < UINT16_MAX)
+            {
+                state.sampleCount++;
+            }
+        }
+
+        if (state.sampleCount > 0)
+        {
+            sampledRates[sampledCount++] = state.ewmaRate;
+        }
+    }
+
+    if (sampledCount == 0)
+    {
+        return;
+    }
+
+    std::nth_element(sampledRates, sampledRates + sampledCount / 2, sampledRates + sampledCount);
+    const uint32_t sectionRate = sampledRates[sampledCount / 2];
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        nozzle_monitor_state &state = states[i];
+        if (state.sampleCount == 0)
+        {
+            continue;
+        }
+
+        const NozzleState target = this->evaluate(state, sectionRate);
+        if (target == state.state)
+        {
+            state.pendingCount = 0;
+            continue;
+        }
+
+        if (target != state.pendingState)
+        {
+            state.pendingState = target;
+            state.pendingCount = 0;
+        }
+
+        // A stale nozzle that answers again is back right away, the others
+        // need a few samples in a row so a single noisy reading is not an alert.
+        if (++state.pendingCount >= NOZZLE_MONITOR_CONFIRM_SAMPLES || state.state == NOZZLE_STATE_STALE)
+        {
+            this->setState(state, offset + i, target, sectionRate, now);
+        }
+    }
+}
+
+NozzleState NozzleMonitor::evaluate(const nozzle_monitor_state &state, uint32_t sectionRate)
+{
+    // The whole section is off (boom closed, tractor stopped), nothing to compare with.
+    if (sectionRate < NOZZLE_MONITOR_MIN_SECTION_RATE)
+    {
+        return NOZZLE_STATE_OK;
+    }
+
+    const uint64_t ratio = (uint64_t)state.ewmaRate * 100 / sectionRate;
+
+    const uint64_t clogThreshold = state.state == NOZZLE_STATE_CLOGGED ? NOZZLE_MONITOR_CLOG_THRESHOLD + NOZZLE_MONITOR_HYSTERESIS : NOZZLE_MONITOR_CLOG_THRESHOLD;
+    if (ratio < clogThreshold)
+    {
+        return NOZZLE_STATE_CLOGGED;
+    }
+
+    const uint64_t overflowThreshold = state.state == NOZZLE_STATE_OVERFLOWING ? NOZZLE_MONITOR_OVERFLOW_THRESHOLD - NOZZLE_MONITOR_HYSTERESIS : NOZZLE_MONITOR_OVERFLOW_THRESHOLD;
+    if (ratio > overflowThreshold)
+    {
+        return NOZZLE_STATE_OVERFLOWING;
+    }
+
+    return NOZZLE_STATE_OK;
+}
+
+void NozzleMonitor::checkSectionStale(nozzle_monitor_state *states, uint8_t count, uint16_t offset, unsigned long lastResponseTimestamp, unsigned long now)
+{
+    if (now - lastResponseTimestamp < NOZZLE_MONITOR_STALE_TIMEOUT)
+    {
+        return;
+    }
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (states[i].sampleCount > 0 && states[i].state != NOZZLE_STATE_STALE)
+        {
+            this->setState(states[i], offset + i, NOZZLE_STATE_STALE, 0, now);
+        }
+    }
+}
+
+void NozzleMonitor::setState(nozzle_monitor_state &state, uint16_t nozzle, NozzleState newState, uint32_t sectionRate, unsigned long now)
+{
+    portENTER_CRITICAL(&alertsMux);
+    nozzle_alert &alert = this->alerts[(this->lastAlertId + 1) % NOZZLE_MONITOR_ALERT_BUFFER_SIZE];
+    alert.id = this->lastAlertId + 1;
+    alert.timestamp = now;
+    alert.nozzle = nozzle;
+    alert.state = newState;
+    alert.previousState = state.state;
+    alert.rate = state.ewmaRate;
+    alert.sectionRate = sectionRate;
+    this->lastAlertId = alert.id;
+    portEXIT_CRITICAL(&alertsMux);
+
+    state.state = newState;
+    state.pendingState = newState;
+    state.pendingCount = 0;
+}
+
+uint32_t NozzleMonitor::getLastAlertId()
+{
+    portENTER_CRITICAL(&alertsMux);
+    const uint32_t id = this->lastAlertId;
+    portEXIT_CRITICAL(&alertsMux);
+
+    return id;
+}
+
+uint8_t NozzleMonitor::copyAlerts(uint32_t sinceId, nozzle_alert *output, uint8_t maxCount)
+{
+    portENTER_CRITICAL(&alertsMux);
+    uint32_t firstId = sinceId + 1;
+    if (this->lastAlertId >= NOZZLE_MONITOR_ALERT_BUFFER_SIZE && firstId <= this->lastAlertId - NOZZLE_MONITOR_ALERT_BUFFER_SIZE)
+    {
+        firstId = this->lastAlertId - NOZZLE_MONITOR_ALERT_BUFFER_SIZE + 1;
+    }
+
+    uint8_t count = 0;
+    for (uint32_t id = firstId; id <= this->lastAlertId && count < maxCount; id++)
+    {
+        output[count++] = this->alerts[id % NOZZLE_MONITOR_ALERT_BUFFER_SIZE];
+    }
+    portEXIT_CRITICAL(&alertsMux);
+
+    return count;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+
+// Weight of a new sample in the rate average, as a right shift (1/2).
+#define NOZZLE_MONITOR_EWMA_SHIFT 1
+// Rates reported with a lower confidence are ignored.
+#define NOZZLE_MONITOR_MIN_CONFIDENCE 16
+// Below this section median rate (mHz) the section is considered off and no nozzle is flagged.
+#define NOZZLE_MONITOR_MIN_SECTION_RATE 1000
+
+// A nozzle is clogged under 70% of its section median and overflowing above 130%.
+#define NOZZLE_MONITOR_CLOG_THRESHOLD 70
+#define NOZZLE_MONITOR_OVERFLOW_THRESHOLD 130
+// Percent the rate must come back past a threshold before the alert clears.
+#define NOZZLE_MONITOR_HYSTERESIS 10
+// Consecutive samples agreeing on a new state before it is reported.
+#define NOZZLE_MONITOR_CONFIRM_SAMPLES 2
+
+// A nozzle whose secondary module did not answer for this long (ms) is stale.
+#define NOZZLE_MONITOR_STALE_TIMEOUT 3000
+
+#define NOZZLE_MONITOR_ALERT_BUFFER_SIZE 32
+// Largest section the median is computed over, matches the flowmeters of a secondary module.
+#define NOZZLE_MONITOR_MAX_SECTION_SIZE 32
+
+enum NozzleState : uint8_t
+{
+    NOZZLE_STATE_OK = 0,
+    NOZZLE_STATE_CLOGGED = 1,
+    NOZZLE_STATE_OVERFLOWING = 2,
+    NOZZLE_STATE_STALE = 3,
+};
+
+/*
+ * Rolling statistics of one nozzle. Kept in a boom array next to the data of
+ * the nozzle, so it moves with the slice of its secondary module and a zeroed
+ * entry is a nozzle that was never sampled.
+ */
+typedef struct nozzle_monitor_state
+{
+    // Average rate in mHz.
+    uint32_t ewmaRate;
+    uint16_t sampleCount;
+
+    NozzleState state;
+    // State the last samples point to and for how many samples in a row.
+    NozzleState pendingState;
+    uint8_t pendingCount;
+} nozzle_monitor_state;
+
+/*
+ * A change of state of a nozzle. Ids increase by one per alert, 0 is never used.
+ */
+typedef struct nozzle_alert
+{
+    uint32_t id;
+    // millis() when the change was detected.
+    unsigned long timestamp;
+    uint16_t nozzle;
+    NozzleState state;
+    NozzleState previousState;
+    // Average rate of the nozzle and median of its section, in mHz.
+    uint32_t rate;
+    uint32_t sectionRate;
+} nozzle_alert;
+
+/*
+ * Detects clogged, overflowing and stale nozzles incrementally, one section
+ * (the nozzles of a secondary module) at a time as its response is decoded.
+ *
+ * Each nozzle is compared to the median of its section, so a whole section
+ * slowing down with the tractor is not an alert while a single nozzle falling
+ * behind its neighbours is. Alerts are kept in a ring that readers poll by id.
+ */
+class NozzleMonitor
+{
+public:
+    NozzleMonitor();
+    ~NozzleMonitor();
+
+private:
+    nozzle_alert alerts[NOZZLE_MONITOR_ALERT_BUFFER_SIZE];
+    uint32_t lastAlertId = 0;
+    portMUX_TYPE alertsMux = portMUX_INITIALIZER_UNLOCKED;
+
+    void setState(nozzle_monitor_state &state, uint16_t nozzle, NozzleState newState, uint32_t sectionRate, unsigned long now);
+    NozzleState evaluate(const nozzle_monitor_state &state, uint32_t sectionRate);
+
+public:
+    /*
+     * Feeds the rates of a section just received. states, rates and
+     * confidences point to the first nozzle of the section, at index offset
+     * of the boom.
+     */
+    void updateSection(nozzle_monitor_state *states, const uint32_t *rates, const uint8_t *confidences, uint8_t count, uint16_t offset, unsigned long now);
+
+    /*
+     * Flags the nozzles of a section whose secondary module stopped answering.
+     */
+    void checkSectionStale(nozzle_monitor_state *states, uint8_t count, uint16_t offset, unsigned long lastResponseTimestamp, unsigned long now);
+
+    uint32_t getLastAlertId();
+
+    /*
+     * Copies up to maxCount alerts newer than sinceId, oldest first, and
+     * returns how many were copied. Alerts overwritten in the ring are skipped.
+     */
+    uint8_t copyAlerts(uint32_t sinceId, nozzle_alert *output, uint8_t maxCount);
+};
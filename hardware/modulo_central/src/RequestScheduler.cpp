@@ -0,0 +1,164 @@
+#include "RequestScheduler.h"
+#include <algorithm>
+
+RequestScheduler::RequestScheduler()
+{
+}
+
+RequestScheduler::~RequestScheduler()
+{
+}
+
+void RequestScheduler::startRequest(request_link_state &link)
+{
+    link.isPending = true;
+    link.firstSendTime = 0;
+    link.lastSendTime = 0;
+    link.retries = 0;
+}
+
+bool RequestScheduler::isRequestDue(const request_link_state &link, int64_t now)
+{
+    if (!link.isPending)
+    {
+        return false;
+    }
+
+    if (link.lastSendTime == 0)
+    {
+        return true;
+    }
+
+    return link.retries < this->getMaxRetries(link) && now - link.lastSendTime >= this->getTimeout(link);
+}
+
+void RequestScheduler::onRequestSent(request_link_state &link, int64_t now)
+{
+    if (link.lastSendTime == 0)
+    {
+        link.firstSendTime = now;
+    }
+    else
+    {
+        link.retries++;
+        link.retryCount++;
+    }
+
+    link.lastSendTime = now;
+    link.requestCount++;
+}
+
+void RequestScheduler::onBroadcastSent(request_link_state &link, int64_t slotStart)
+{
+    if (link.lastSendTime != 0)
+    {
+        return;
+    }
+
+    link.firstSendTime = slotStart;
+    link.lastSendTime = slotStart;
+}
+
+void RequestScheduler::onResponse(request_link_state &link, int64_t receiveTime, bool isCurrent)
+{
+    // Any response shows the slave is alive, even a late one.
+    link.missedCycles = 0;
+    link.isDegraded = false;
+    link.responseCount++;
+
+    if (!link.isPending || !isCurrent || link.lastSendTime == 0)
+    {
+        return;
+    }
+    link.isPending = false;
+
+    if (link.retries > 0)
+    {
+        // Which request this answers is unknown, keep the backed off timeout.
+        link.rto = this->getTimeout(link);
+        return;
+    }
+
+    if (receiveTime > link.firstSendTime)
+    {
+        this->addRttSample(link, (uint32_t)std::min<int64_t>(receiveTime - link.firstSendTime, UINT32_MAX));
+    }
+}
+
+void RequestScheduler::addRttSample(request_link_state &link, uint32_t rtt)
+{
+    if (link.srtt == 0)
+    {
+        link.srtt = rtt;
+        link.rttvar = rtt / 2;
+    }
+    else
+    {
+        const uint32_t deviation = rtt > link.srtt ? rtt - link.srtt : link.srtt - rtt;
+        link.rttvar = link.rttvar - (link.rttvar >> 2) + (deviation >> 2);
+        link.srtt = link.srtt - (link.srtt >> 3) + (rtt >> 3);
+    }
+
+    link.rto = std::min<uint32_t>(std::max<uint32_t>(link.srtt + 4 * link.rttvar, REQUEST_SCHEDULER_MIN_RTO), REQUEST_SCHEDULER_MAX_RTO);
+
+    link.rttHistory[link.rttHistoryIndex] = rtt;
+    link.rttHistoryIndex = (link.rttHistoryIndex + 1) % REQUEST_SCHEDULER_RTT_HISTORY_SIZE;
+    link.rttHistoryCount = std::min<uint8_t>(link.rttHistoryCount + 1, REQUEST_SCHEDULER_RTT_HISTORY_SIZE);
+    link.rttHistogram.add(rtt);
+}
+
+bool RequestScheduler::hasGivenUp(const request_link_state &link, int64_t now)
+{
+    return link.isPending && link.lastSendTime != 0 && link.retries >= this->getMaxRetries(link) && now - link.lastSendTime >= this->getTimeout(link);
+}
+
+void RequestScheduler::endCycle(request_link_state &link)
+{
+    if (!link.isPending)
+    {
+        return;
+    }
+    link.isPending = false;
+
+    link.missedCycleCount++;
+    if (link.missedCycles < UINT8_MAX)
+    {
+        link.missedCycles++;
+    }
+    if (link.missedCycles >= REQUEST_SCHEDULER_DEGRADED_AFTER)
+    {
+        link.isDegraded = true;
+    }
+}
+
+uint32_t RequestScheduler::getTimeout(const request_link_state &link)
+{
+    const uint32_t rto = link.rto != 0 ? link.rto : REQUEST_SCHEDULER_INITIAL_RTO;
+    return std::min<uint32_t>(rto << link.retries, REQUEST_SCHEDULER_MAX_RTO);
+}
+
+uint8_t RequestScheduler::getMaxRetries(const request_link_state &link)
+{
+    return link.isDegraded ? 0 : REQUEST_SCHEDULER_MAX_RETRIES;
+}
+
+void RequestScheduler::getStats(const request_link_state &link, request_link_stats &stats)
+{
+    uint32_t sorted[REQUEST_SCHEDULER_RTT_HISTORY_SIZE];
+    memcpy(sorted, link.rttHistory, sizeof(uint32_t) * link.rttHistoryCount);
+    std::sort(sorted, sorted + link.rttHistoryCount);
+
+    const uint8_t last = link.rttHistoryCount > 0 ? link.rttHistoryCount - 1 : 0;
+    stats.rttP50 = link.rttHistoryCount > 0 ? sorted[last * 50 / 100] : 0;
+    stats.rttP90 = link.rttHistoryCount > 0 ? sorted[last * 90 / 100] : 0;
+    stats.rttP99 = link.rttHistoryCount > 0 ? sorted[last * 99 / 100] : 0;
+
+    stats.srtt = link.srtt;
+    stats.rto = link.rto != 0 ? link.rto : REQUEST_SCHEDULER_INITIAL_RTO;
+    stats.requestCount = link.requestCount;
+    stats.retryCount = link.retryCount;
+    stats.responseCount = link.responseCount;
+    stats.missedCycleCount = link.missedCycleCount;
+    stats.isDegraded = link.isDegraded;
+    stats.rttHistogram = link.rttHistogram;
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <Arduino.h>
+#include <LatencyHistogram.h>
+
+// Retransmit timeout of a slave whose round trip was never measured, in microseconds.
+#define REQUEST_SCHEDULER_INITIAL_RTO 50000
+// Bounds of the retransmit timeout (us). The upper one also caps the backoff.
+#define REQUEST_SCHEDULER_MIN_RTO 5000
+#define REQUEST_SCHEDULER_MAX_RTO 250000
+// Retransmissions of a request within a cycle, each one waiting twice as long as the previous.
+#define REQUEST_SCHEDULER_MAX_RETRIES 3
+// Cycles in a row without a response before a slave is degraded. A degraded
+// slave gets a single request per cycle and no retransmission until it answers.
+#define REQUEST_SCHEDULER_DEGRADED_AFTER 3
+// Round trips kept per slave for the percentiles.
+#define REQUEST_SCHEDULER_RTT_HISTORY_SIZE 32
+
+/*
+ * Request state and round trip statistics of one slave. Kept in its slot of
+ * the slave table, a zeroed entry is a slave that was never requested.
+ */
+typedef struct request_link_state
+{
+    // Smoothed round trip, its mean deviation and the retransmit timeout derived
+    // from them, in microseconds. 0 until the first round trip is measured.
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint32_t rto;
+
+    // Request of the current cycle: sent at firstSendTime, last (re)sent at
+    // lastSendTime (esp_timer_get_time()), retransmitted retries times. For a
+    // broadcast request, both are the start of the response slot.
+    bool isPending;
+    int64_t firstSendTime;
+    int64_t lastSendTime;
+    uint8_t retries;
+
+    uint8_t missedCycles;
+    bool isDegraded;
+
+    // Last measured round trips, in microseconds.
+    uint32_t rttHistory[REQUEST_SCHEDULER_RTT_HISTORY_SIZE];
+    uint8_t rttHistoryCount;
+    uint8_t rttHistoryIndex;
+    // Every round trip measured since the slave took its slot.
+    latency_histogram rttHistogram;
+
+    // Totals since the slave took its slot.
+    uint32_t requestCount;
+    uint32_t retryCount;
+    uint32_t responseCount;
+    uint32_t missedCycleCount;
+} request_link_state;
+
+/*
+ * Summary of a request_link_state, small enough to be copied out for the web server.
+ */
+typedef struct request_link_stats
+{
+    // Microseconds, 0 when nothing was measured.
+    uint32_t srtt;
+    uint32_t rto;
+    uint32_t rttP50;
+    uint32_t rttP90;
+    uint32_t rttP99;
+
+    uint32_t requestCount;
+    uint32_t retryCount;
+    uint32_t responseCount;
+    uint32_t missedCycleCount;
+    bool isDegraded;
+
+    latency_histogram rttHistogram;
+} request_link_stats;
+
+/*
+ * Decides when the data request of each slave is (re)sent during an
+ * acquisition cycle.
+ *
+ * The retransmit timeout follows the measured round trip of each slave
+ * (RFC 6298): srtt + 4 * rttvar, doubled on each retransmission. Round trips
+ * of retransmitted requests are ambiguous and never measured (Karn), the
+ * backed off timeout is kept instead until a clean measurement comes. A slave
+ * that misses several cycles is degraded to one request per cycle, so a dead
+ * slave costs one frame per cycle instead of flooding the channel.
+ */
+class RequestScheduler
+{
+public:
+    RequestScheduler();
+    ~RequestScheduler();
+
+private:
+    void addRttSample(request_link_state &link, uint32_t rtt);
+
+public:
+    // Marks the request of a slave as pending at the start of a cycle.
+    void startRequest(request_link_state &link);
+
+    /*
+     * Whether the request of a slave must be sent now: the first time in the
+     * cycle, or when its timeout expired and it can still be retransmitted.
+     */
+    bool isRequestDue(const request_link_state &link, int64_t now);
+    void onRequestSent(request_link_state &link, int64_t now);
+
+    /*
+     * Records a request broadcast to the whole boom, answered in the slot of
+     * the slave starting at slotStart. Only a slot that goes by unanswered
+     * makes the request due, as a retransmission.
+     */
+    void onBroadcastSent(request_link_state &link, int64_t slotStart);
+
+    /*
+     * Records a response. receiveTime is when it was received, isCurrent
+     * whether it answers the request of the current cycle.
+     */
+    void onResponse(request_link_state &link, int64_t receiveTime, bool isCurrent);
+
+    /*
+     * Whether a pending request will not be sent again and its last timeout
+     * expired, the slave is not expected to answer this cycle.
+     */
+    bool hasGivenUp(const request_link_state &link, int64_t now);
+
+    // Closes the cycle of a slave, counting a miss if it did not answer. Does nothing when called again.
+    void endCycle(request_link_state &link);
+
+    // Time to wait for a response to the last request sent, in microseconds.
+    uint32_t getTimeout(const request_link_state &link);
+    uint8_t getMaxRetries(const request_link_state &link);
+
+    void getStats(const request_link_state &link, request_link_stats &stats);
+};
@@ -1,6 +1,37 @@
 #include "MainModule.h"
 #include "GPS.h"
 
+/*
+ * Tasks of the main module, by core and priority (higher runs first):
+ *
+ * Core 0, the radio path. Nothing on it serializes JSON, so a frame never
+ * waits behind a web client.
+ *   - Wi-Fi driver (23), which runs the ESP-NOW receive and send callbacks.
+ *     They only copy the frame into the dispatcher queue.
+ *   - ESP-NOW dispatcher (5), runs the message callbacks and the reliable
+ *     channel retransmits.
+ *   - Acquisition (4), runs MainModule::loop(): latch, requests and snapshot
+ *     publication. Woken by every data response.
+ *
+ * Core 1, the clients.
+ *   - GPS (4), parses the UART.
+ *   - AsyncTCP (3), runs the HTTP and WebSocket handlers.
+ *   - Web publisher (2), answers the waiting /data requests and pushes the
+ *     snapshots to /ws/data and the alerts to /ws/alerts.
+ *   - Job log writer (1), writes the blocks of the job log to the flash.
+ *
+ * The data path between the cores goes through bounded queues (the
+ * dispatcher queue and the web event queue, both dropping and counting when
+ * full), the snapshots and the job log blocks, which never block. The
+ * configuration and metrics handlers do take flowmetersDataMutex, which the
+ * dispatcher and the acquisition task hold while they handle a response or
+ * end a cycle: they only copy or set a few fields under it, and build their
+ * JSON or write the flash after giving it back. /metrics reports the CPU
+ * used by each task and how long frames wait for the dispatcher.
+ *
+ * The Arduino loop task is not used.
+ */
+
 MainModule *mainModule;
 GPS *gps;
 
@@ -10,10 +41,11 @@ void setup()
 
   mainModule = MainModule::getInstance();
   gps = GPS::getInstance();
+
+  mainModule->begin();
 }
 
 void loop()
 {
-  mainModule->loop();
-  gps->loop();
-}
\ No newline at end of file
+  vTaskDelete(NULL);
+}
@@ -1,85 +1,223 @@
 #include "Flowmeter.h"
+#include <algorithm>
+#include <climits>
 
 std::map<uint8_t, Flowmeter *> Flowmeter::instances;
 
+// A bounce halves a period and a missed pulse doubles it, only what is strictly in between is kept.
+static bool isPeriodAccepted(uint32_t period, uint32_t median)
+{
+    return (uint64_t)period * 2 > median && period < (uint64_t)median * 2;
+}
+
 Flowmeter::Flowmeter(uint8_t pin, unsigned short refreshRate)
 {
     this->pin = pin;
     this->refreshRate = refreshRate;
 
     pinMode(this->pin, INPUT_PULLUP);
-    attachInterruptArg(digitalPinToInterrupt(this->pin), Flowmeter::onPulseStatic, reinterpret_cast<void *>(static_cast<intptr_t>(this->pin)), RISING);
-
-    this->pulsesTimestamps = nullptr;
-    this->pulseCount = 0;
+    attachInterruptArg(digitalPinToInterrupt(this->pin), Flowmeter::onPulseStatic, this, RISING);
 
     instances[this->pin] = this;
 }
 
 Flowmeter::~Flowmeter()
 {
-    free(this->pulsesTimestamps);
+    detachInterrupt(digitalPinToInterrupt(this->pin));
+    vSemaphoreDelete(this->tailMutex);
 
     instances.erase(this->pin);
 }
 
-void Flowmeter::onPulse()
+void IRAM_ATTR Flowmeter::onPulse()
 {
     this->registerPulse();
 }
 
-void Flowmeter::onPulseStatic(void *arg)
+void IRAM_ATTR Flowmeter::onPulseStatic(void *arg)
 {
-    const uint8_t pin = (intptr_t)arg;
-    if (instances.find(pin) != instances.end())
-    {
-        instances[pin]->onPulse();
-    }
+    static_cast<Flowmeter *>(arg)->onPulse();
 }
 
-void Flowmeter::registerPulse()
+void IRAM_ATTR Flowmeter::registerPulse()
 {
-    this->removeOldPulses();
+    const unsigned long now = millis();
+    const uint32_t head = this->pulsesHead.load(std::memory_order_relaxed);
+
+    this->pulsesTimestamps[head & (FLOWMETER_PULSE_BUFFER_SIZE - 1)] = now;
+    this->pulsesHead.store(head + 1, std::memory_order_release);
 
-    unsigned long *newPulsesTimestamps = static_cast<unsigned long *>(realloc(this->pulsesTimestamps, (this->pulseCount + 1) * sizeof(unsigned long)));
-    if (newPulsesTimestamps != nullptr)
+    this->lastPulseTimestamp = now;
+
+    const uint32_t nowMicros = micros();
+    if (this->hasPulseMicros)
     {
-        this->pulsesTimestamps = newPulsesTimestamps;
-        this->pulsesTimestamps[this->pulseCount] = millis();
-        this->pulseCount++;
+        const uint32_t periodsHead = this->pulsePeriodsHead.load(std::memory_order_relaxed);
+        this->pulsePeriods[periodsHead & (FLOWMETER_PERIOD_BUFFER_SIZE - 1)] = nowMicros - this->lastPulseMicros;
+        this->pulsePeriodsHead.store(periodsHead + 1, std::memory_order_release);
     }
-    this->lastPulseTimestamp = millis();
+    this->lastPulseMicros = nowMicros;
+    this->hasPulseMicros = true;
 }
 
-void Flowmeter::removeOldPulses()
+uint32_t Flowmeter::removeOldPulses()
 {
+    xSemaphoreTake(this->tailMutex, portMAX_DELAY);
+    const uint32_t head = this->pulsesHead.load(std::memory_order_acquire);
     const unsigned long currentTime = millis();
-    while (this->pulseCount > 0 && currentTime - this->pulsesTimestamps[0] > this->refreshRate)
+
+    // The interrupt handler overwrote timestamps we had not consumed yet.
+    if (head - this->pulsesTail > FLOWMETER_PULSE_BUFFER_SIZE)
     {
-        for (unsigned short i = 0; i < this->pulseCount - 1; i++)
-        {
-            this->pulsesTimestamps[i] = this->pulsesTimestamps[i + 1];
-        }
-        this->pulseCount--;
+        this->pulsesTail = head - FLOWMETER_PULSE_BUFFER_SIZE;
+    }
 
-        unsigned long *newPulsesTimestamps = static_cast<unsigned long *>(realloc(this->pulsesTimestamps, this->pulseCount * sizeof(unsigned long)));
+    while (this->pulsesTail != head && currentTime - this->pulsesTimestamps[this->pulsesTail & (FLOWMETER_PULSE_BUFFER_SIZE - 1)] > this->refreshRate)
+    {
+        this->pulsesTail++;
+    }
 
-        this->pulsesTimestamps = newPulsesTimestamps;
+    const uint32_t count = head - this->pulsesTail;
+    const unsigned long oldestTimestamp = this->pulsesTimestamps[this->pulsesTail & (FLOWMETER_PULSE_BUFFER_SIZE - 1)];
+    xSemaphoreGive(this->tailMutex);
+
+    if (count < FLOWMETER_PULSE_BUFFER_SIZE)
+    {
+        return count;
     }
+
+    // The ring is saturated, so the oldest retained pulse is younger than the window.
+    // Extrapolate the count over the whole window from the span the ring covers.
+    const unsigned long span = currentTime - oldestTimestamp;
+    if (span == 0)
+    {
+        return count;
+    }
+    return (uint64_t)count * this->refreshRate / span;
 }
 
 unsigned short Flowmeter::getPulsesPerMinute()
 {
-    this->removeOldPulses();
+    const uint64_t pulsesPerMinute = (uint64_t)this->removeOldPulses() * 60000 / this->refreshRate;
 
-    return this->pulseCount * 60000 / this->refreshRate;
+    return pulsesPerMinute > USHRT_MAX ? USHRT_MAX : pulsesPerMinute;
 }
 
 unsigned short Flowmeter::getPulseCount()
 {
-    this->removeOldPulses();
+    const uint32_t pulseCount = this->removeOldPulses();
+
+    return pulseCount > USHRT_MAX ? USHRT_MAX : pulseCount;
+}
+
+uint8_t Flowmeter::copyPulsePeriods(uint32_t *periods, uint32_t &lastPulse)
+{
+    uint32_t head;
+    uint8_t count;
+    do
+    {
+        head = this->pulsePeriodsHead.load(std::memory_order_acquire);
+        count = std::min<uint32_t>(head, FLOWMETER_PERIOD_BUFFER_SIZE);
+        for (uint8_t i = 0; i < count; i++)
+        {
+            periods[i] = this->pulsePeriods[(head - 1 - i) & (FLOWMETER_PERIOD_BUFFER_SIZE - 1)];
+        }
+        lastPulse = this->lastPulseMicros;
+    } while (this->pulsePeriodsHead.load(std::memory_order_acquire) != head);
+
+    return count;
+}
+
+flow_rate_estimate Flowmeter::getFlowRate()
+{
+    flow_rate_estimate estimate = {0, 0, FLOW_RATE_METHOD_NONE};
+
+    uint32_t periods[FLOWMETER_PERIOD_BUFFER_SIZE];
+    uint32_t lastPulse;
+    const uint8_t periodCount = this->copyPulsePeriods(periods, lastPulse);
+    const uint32_t pulseCount = this->removeOldPulses();
+
+    if (!this->hasPulseMicros)
+    {
+        return estimate;
+    }
+
+    const uint32_t silence = micros() - lastPulse;
 
-    return this->pulseCount;
+    // Nothing during a whole window: the nozzle is stopped, and we are sure of it.
+    if (silence >= (uint32_t)this->refreshRate * 1000)
+    {
+        estimate.confidence = FLOWMETER_CONFIDENCE_MAX;
+        estimate.method = FLOW_RATE_METHOD_STOPPED;
+        return estimate;
+    }
+
+    if (periodCount == 0)
+    {
+        return estimate;
+    }
+
+    uint32_t sorted[FLOWMETER_PERIOD_BUFFER_SIZE];
+    memcpy(sorted, periods, sizeof(uint32_t) * periodCount);
+    std::nth_element(sorted, sorted + periodCount / 2, sorted + periodCount);
+    const uint32_t median = sorted[periodCount / 2];
+
+    uint64_t sum = 0;
+    uint8_t accepted = 0;
+    for (uint8_t i = 0; i < periodCount; i++)
+    {
+        if (isPeriodAccepted(periods[i], median))
+        {
+            sum += periods[i];
+            accepted++;
+        }
+    }
+    if (sum == 0)
+    {
+        return estimate;
+    }
+
+    const uint32_t mean = sum / accepted;
+    uint64_t deviation = 0;
+    for (uint8_t i = 0; i < periodCount; i++)
+    {
+        if (isPeriodAccepted(periods[i], median))
+        {
+            deviation += periods[i] > mean ? periods[i] - mean : mean - periods[i];
+        }
+    }
+    deviation /= accepted;
+
+    estimate.rate = (uint64_t)accepted * 1000000000ULL / sum;
+    estimate.method = FLOW_RATE_METHOD_PERIOD;
+
+    // Fewer periods, rejected periods and irregular periods all lower the confidence.
+    const uint32_t regularity = deviation * 2 >= mean ? 0 : FLOWMETER_CONFIDENCE_MAX - FLOWMETER_CONFIDENCE_MAX * deviation * 2 / mean;
+    estimate.confidence = regularity * accepted / FLOWMETER_PERIOD_BUFFER_SIZE;
+
+    // At steady high flow the count window is the more precise of the two.
+    const uint32_t countRate = (uint64_t)pulseCount * 1000000 / this->refreshRate;
+    if (pulseCount >= FLOWMETER_COUNT_MODE_MIN_PULSES)
+    {
+        const uint32_t difference = estimate.rate > countRate ? estimate.rate - countRate : countRate - estimate.rate;
+        if ((uint64_t)difference * 100 <= (uint64_t)countRate * FLOWMETER_COUNT_MODE_TOLERANCE)
+        {
+            estimate.rate = countRate;
+            estimate.confidence = FLOWMETER_CONFIDENCE_MAX;
+            estimate.method = FLOW_RATE_METHOD_COUNT;
+        }
+    }
+
+    // No pulse for several periods: the rate can be at most one pulse per silence.
+    if (silence > FLOWMETER_STALL_FACTOR * mean)
+    {
+        const uint32_t bound = 1000000000ULL / silence;
+        estimate.rate = std::min(estimate.rate, bound);
+        estimate.confidence = (uint64_t)estimate.confidence * FLOWMETER_STALL_FACTOR * mean / silence;
+        estimate.method = FLOW_RATE_METHOD_STALLED;
+    }
+
+    return estimate;
 }
 
 unsigned long Flowmeter::getLastPulseTimestamp()
@@ -94,11 +232,21 @@ unsigned long Flowmeter::getLastPulseAge()
     return millis() - this->lastPulseTimestamp;
 }
 
+uint32_t Flowmeter::getTotalPulseCount()
+{
+    return this->pulsesHead.load(std::memory_order_relaxed);
+}
+
 uint8_t Flowmeter::getPin()
 {
     return this->pin;
 }
 
+unsigned short Flowmeter::getRefreshRate()
+{
+    return this->refreshRate;
+}
+
 void Flowmeter::setRefreshRate(unsigned short refreshRate)
 {
     this->refreshRate = refreshRate;
@@ -1,10 +1,48 @@
 #pragma once
 
 #include <Arduino.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <map>
 
-// typedef of an array of timestamps
-typedef unsigned long *timestamp_arr_t;
+// Capacity of the pulse timestamp ring of each flowmeter. Must be a power of two.
+#ifndef FLOWMETER_PULSE_BUFFER_SIZE
+#define FLOWMETER_PULSE_BUFFER_SIZE 1024
+#endif
+
+// Inter-pulse periods kept for the period estimator. Must be a power of two.
+#ifndef FLOWMETER_PERIOD_BUFFER_SIZE
+#define FLOWMETER_PERIOD_BUFFER_SIZE 8
+#endif
+
+// The count window is preferred once it holds this many pulses and agrees
+// with the period estimate within FLOWMETER_COUNT_MODE_TOLERANCE percent.
+#define FLOWMETER_COUNT_MODE_MIN_PULSES 100
+#define FLOWMETER_COUNT_MODE_TOLERANCE 10
+
+// Silence longer than this many mean periods means the flow is slowing down or stopped.
+#define FLOWMETER_STALL_FACTOR 3
+
+#define FLOWMETER_CONFIDENCE_MAX 255
+
+enum FlowRateMethod
+{
+    FLOW_RATE_METHOD_NONE,
+    FLOW_RATE_METHOD_PERIOD,
+    FLOW_RATE_METHOD_COUNT,
+    FLOW_RATE_METHOD_STALLED,
+    FLOW_RATE_METHOD_STOPPED,
+};
+
+typedef struct flow_rate_estimate
+{
+    // Pulse frequency in millihertz.
+    uint32_t rate;
+    // 0 (no idea) to FLOWMETER_CONFIDENCE_MAX.
+    uint8_t confidence;
+    FlowRateMethod method;
+} flow_rate_estimate;
 
 class Flowmeter
 {
@@ -23,21 +61,55 @@ private:
     unsigned short refreshRate;
 
     volatile unsigned long lastPulseTimestamp = 0;
-    volatile timestamp_arr_t pulsesTimestamps = nullptr;
-    volatile unsigned short pulseCount = 0;
+
+    /*
+     * Ring of pulse timestamps, with a single producer and any number of readers.
+     *
+     * The interrupt handler is the only writer of pulsesHead and never looks at
+     * pulsesTail, overwriting the oldest timestamp when the ring is full. The
+     * readers (getPulseCount, getPulsesPerMinute and getFlowRate) move
+     * pulsesTail under tailMutex, they run on both the loop and the ESP-NOW
+     * dispatcher tasks. The handler never waits on it.
+     */
+    unsigned long pulsesTimestamps[FLOWMETER_PULSE_BUFFER_SIZE];
+    std::atomic<uint32_t> pulsesHead{0};
+    uint32_t pulsesTail = 0;
+    SemaphoreHandle_t tailMutex = xSemaphoreCreateMutex();
+
+    /*
+     * Ring of the last inter-pulse periods in microseconds, written only by the
+     * interrupt handler. Readers copy it and retry if the handler moved meanwhile.
+     */
+    uint32_t pulsePeriods[FLOWMETER_PERIOD_BUFFER_SIZE];
+    std::atomic<uint32_t> pulsePeriodsHead{0};
+    volatile uint32_t lastPulseMicros = 0;
+    volatile bool hasPulseMicros = false;
 
     static void onPulseStatic(void *arg);
 
     void registerPulse();
-    void removeOldPulses();
+    uint32_t removeOldPulses();
+    uint8_t copyPulsePeriods(uint32_t *periods, uint32_t &lastPulse);
 
 public:
     void onPulse();
     static std::map<uint8_t, Flowmeter *> instances;
     unsigned short getPulsesPerMinute();
     unsigned short getPulseCount();
+    // Pulses counted by the interrupt since boot, wrapping around. Never consumes them.
+    uint32_t getTotalPulseCount();
+
+    /*
+     * Flow rate from the last inter-pulse periods, with outliers (bounces,
+     * missed pulses) rejected around the median. Falls back to the count
+     * window when the flow is steady and fast enough for it to be more
+     * precise, and decays as soon as pulses stop arriving, so a clogged
+     * nozzle shows up within a few periods instead of a whole window.
+     */
+    flow_rate_estimate getFlowRate();
     unsigned long getLastPulseTimestamp();
     unsigned long getLastPulseAge();
     uint8_t getPin();
+    unsigned short getRefreshRate();
     void setRefreshRate(unsigned short refreshRate);
 };
\ No newline at end of file
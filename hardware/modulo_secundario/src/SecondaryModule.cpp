@@ -2,6 +2,9 @@
 #include <WiFi.h>
 #include <esp_wifi.h>
 #include <esp_now.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <algorithm>
 
 SecondaryModule *SecondaryModule::instance = nullptr;
 
@@ -9,30 +12,40 @@ SecondaryModule *SecondaryModule::getInstance()
 {
     if (instance == nullptr)
     {
-        instance = new SecondaryModule();
+        static const uint8_t flowmeterPins[] = SECONDARY_MODULE_FLOWMETER_PINS;
+        instance = new SecondaryModule(ESPNowSlaveManager::getInstance(), flowmeterPins, sizeof(flowmeterPins));
     }
     return instance;
 }
 
-SecondaryModule::SecondaryModule()
+SecondaryModule::SecondaryModule(ESPNowSlaveManager *espNowManager, const uint8_t *flowmeterPins, uint8_t flowmeterCount) : espNowManager(espNowManager)
 {
-    addFlowmeter(22, 5000);
-    addFlowmeter(14, 5000);
-    addFlowmeter(27, 5000);
-    addFlowmeter(26, 5000);
-    addFlowmeter(25, 5000);
-    addFlowmeter(33, 5000);
-    addFlowmeter(32, 5000);
-    addFlowmeter(35, 5000);
-    addFlowmeter(34, 5000);
+    for (uint8_t i = 0; i < flowmeterCount; i++)
+    {
+        addFlowmeter(flowmeterPins[i], SECONDARY_MODULE_REFRESH_RATE);
+    }
 
     espNowManager->registerCallback(
         FLOWMETER_DATA_REQUEST,
-        SecondaryModule::onDataRequest);
+        [this](const uint8_t *mac_addr, const uint8_t *incomingData, int len)
+        { this->onDataRequest(mac_addr, incomingData, len); });
 
     espNowManager->registerCallback(
         SET_REFRESH_RATE,
-        SecondaryModule::onSetRefreshRate);
+        [this](const uint8_t *mac_addr, const uint8_t *incomingData, int len)
+        { this->onSetRefreshRate(mac_addr, incomingData, len); });
+
+    espNowManager->registerCallback(
+        SAMPLE_LATCH,
+        [this](const uint8_t *mac_addr, const uint8_t *incomingData, int len)
+        { this->onSampleLatch(mac_addr, incomingData, len); });
+
+    espNowManager->registerCallback(
+        METRICS_REQUEST,
+        [this](const uint8_t *mac_addr, const uint8_t *incomingData, int len)
+        { this->onMetricsRequest(mac_addr, incomingData, len); });
+
+    memset(this->metricsPulseCount, 0, sizeof(this->metricsPulseCount));
 }
 
 SecondaryModule::~SecondaryModule()
@@ -41,53 +54,181 @@ SecondaryModule::~SecondaryModule()
 
 void SecondaryModule::onDataRequest(const uint8_t *mac_addr, const uint8_t *incomingData, int len)
 {
-    SecondaryModule *instance = SecondaryModule::getInstance();
+    // Main modules without SAMPLE_LATCH send no sample id.
+    uint32_t sampleId = 0;
+    if (len >= (int)sizeof(uint32_t))
+    {
+        memcpy(&sampleId, incomingData, sizeof(uint32_t));
+    }
 
-    macAddress_t senderAddress;
-    memcpy(senderAddress, mac_addr, sizeof(macAddress_t));
+    xSemaphoreTake(this->responseMutex, portMAX_DELAY);
+    // Asked directly, the response due in our slot would only be a duplicate.
+    portENTER_CRITICAL(&this->slotResponseMux);
+    this->isSlotResponsePending = false;
+    portEXIT_CRITICAL(&this->slotResponseMux);
 
-    flowmeters_data flowmetersData = instance->getFlowmeterData();
+    this->sendDataResponse(mac_addr, sampleId);
+    xSemaphoreGive(this->responseMutex);
+}
 
-    // Calculate response size: 1 byte for count, pulse counts, and last pulse ages
-    const size_t responseSize = sizeof(uint8_t) +
-        flowmetersData.flowmeterCount * sizeof(flowmeter_data_t) +
-        flowmetersData.flowmeterCount * sizeof(unsigned long);
+void SecondaryModule::sendDataResponse(const uint8_t *mac_addr, uint32_t sampleId)
+{
+    uint8_t responseBuffer[FLOWMETER_FRAME_MAX_SIZE];
+    size_t responseSize = 0;
 
-    uint8_t *responseBuffer = static_cast<uint8_t *>(malloc(responseSize));
-    responseBuffer[0] = flowmetersData.flowmeterCount;
+    if (this->hasLatchedSample && sampleId != 0 && this->latchedSample.id == sampleId)
+    {
+        const flowmeters_data latchedData = {this->flowmeterCount, this->latchedPulseCount, this->latchedLastPulseAge, this->latchedRate, this->latchedRateConfidence, this->latchedCountWindow};
+        responseSize = FlowmeterFrame::encode(responseBuffer, sizeof(responseBuffer), this->dataResponseSession, this->dataResponseSequence++, latchedData, &this->latchedSample);
+    }
+    else
+    {
+        // The latch was missed, sample now and say when in boom time if we can.
+        const int64_t sampleTime = esp_timer_get_time();
 
-    // Copy pulse counts
-    memcpy(responseBuffer + 1, flowmetersData.flowmetersPulseCount, flowmetersData.flowmeterCount * sizeof(flowmeter_data_t));
-    // Copy last pulse ages
-    memcpy(responseBuffer + 1 + flowmetersData.flowmeterCount * sizeof(flowmeter_data_t),
-           flowmetersData.flowmetersLastPulseAge, flowmetersData.flowmeterCount * sizeof(unsigned long));
+        flowmeter_data_t pulseCount[SECONDARY_MODULE_MAX_FLOWMETERS];
+        unsigned long lastPulseAge[SECONDARY_MODULE_MAX_FLOWMETERS];
+        uint32_t rate[SECONDARY_MODULE_MAX_FLOWMETERS];
+        uint8_t rateConfidence[SECONDARY_MODULE_MAX_FLOWMETERS];
 
-    instance->espNowManager->sendBuffer(mac_addr, FLOWMETER_DATA_REQUEST + 0x80, responseBuffer, responseSize);
+        flowmeters_data flowmetersData = {0, pulseCount, lastPulseAge, rate, rateConfidence, 0};
+        this->getFlowmeterData(flowmetersData);
 
-    free(responseBuffer);
-    free(flowmetersData.flowmetersPulseCount);
-    free(flowmetersData.flowmetersLastPulseAge);
+        const flowmeter_sample_info sample = {sampleId, (uint32_t)this->boomClock.toBoomTime(sampleTime), false};
+        const bool hasSample = sampleId != 0 && this->boomClock.isSynchronized();
+        responseSize = FlowmeterFrame::encode(responseBuffer, sizeof(responseBuffer), this->dataResponseSession, this->dataResponseSequence++, flowmetersData, hasSample ? &sample : nullptr);
+    }
+
+    if (responseSize > 0)
+    {
+        this->espNowManager->sendBuffer(mac_addr, FLOWMETER_DATA_REQUEST + 0x80, responseBuffer, responseSize);
+    }
 }
 
 void SecondaryModule::onSetRefreshRate(const uint8_t *mac_addr, const uint8_t *incomingData, int len)
 {
-    SecondaryModule *instance = SecondaryModule::getInstance();
+    if (len < SET_REFRESH_RATE_HEADER_SIZE)
+    {
+        return;
+    }
 
-    unsigned short refreshRate = *reinterpret_cast<const unsigned short *>(incomingData);
-    uint8_t flowmeterIndexes = *(incomingData + sizeof(unsigned short)); // Get the flowmeter indexes from the incoming data
+    const uint16_t refreshRate = incomingData[0] | (incomingData[1] << 8);
+    const uint8_t channelCount = incomingData[2];
+    const uint8_t *bitmap = incomingData + SET_REFRESH_RATE_HEADER_SIZE;
 
-    for (uint8_t i = 0; i < 9; i++) // Assuming 9 flowmeters
+    if (len < SET_REFRESH_RATE_HEADER_SIZE + CHANNEL_BITMAP_SIZE(channelCount))
     {
-        if (flowmeterIndexes & (1 << i)) // Check if the i-th bit is set
+        return;
+    }
+
+    // The windows change size, not while a response reads them.
+    xSemaphoreTake(this->responseMutex, portMAX_DELAY);
+    const uint8_t count = std::min(channelCount, this->getFlowmeterCount());
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (bitmap[i / 8] & (1 << (i % 8)))
         {
-            instance->setRefreshRate(refreshRate, i); // Set refresh rate for the specific flowmeter
-            // You may want to implement a method to set refresh rate for a specific flowmeter
+            this->setRefreshRate(refreshRate, i);
         }
     }
+    xSemaphoreGive(this->responseMutex);
+}
+
+void SecondaryModule::onSampleLatch(const uint8_t *mac_addr, const uint8_t *incomingData, int len)
+{
+    if (len < (int)sizeof(sample_latch))
+    {
+        return;
+    }
+
+    sample_latch latch;
+    memcpy(&latch, incomingData, sizeof(sample_latch));
+
+    // A slot response being sent from loop() finishes with the previous latch first.
+    xSemaphoreTake(this->responseMutex, portMAX_DELAY);
+
+    if (latch.previousSentTime != 0 && this->lastLatchId != 0 && this->lastLatchId + 1 == latch.sampleId)
+    {
+        this->boomClock.onBeacon(this->lastLatchReceiveTime, latch.previousSentTime);
+    }
+    this->lastLatchId = latch.sampleId;
+    this->lastLatchReceiveTime = this->espNowManager->getReceiveTimestamp();
+
+    // Slots count from when the latch was received, which is the same instant on the whole boom.
+    const uint8_t slotIndex = this->espNowManager->getSlotIndex();
+    if (latch.slotDuration != 0 && slotIndex != NO_RESPONSE_SLOT)
+    {
+        portENTER_CRITICAL(&this->slotResponseMux);
+        this->isSlotResponsePending = true;
+        this->slotResponseTime = this->lastLatchReceiveTime + (int64_t)slotIndex * latch.slotDuration;
+        memcpy(this->slotResponseAddress, mac_addr, sizeof(macAddress_t));
+        portEXIT_CRITICAL(&this->slotResponseMux);
+    }
+
+    const int64_t sampleTime = esp_timer_get_time();
+    flowmeters_data latchedData = {0, this->latchedPulseCount, this->latchedLastPulseAge, this->latchedRate, this->latchedRateConfidence, 0};
+    this->getFlowmeterData(latchedData);
+    this->latchedCountWindow = latchedData.countWindow;
+
+    // Until synchronized, the time the latch was queued is the best we know.
+    this->latchedSample.id = latch.sampleId;
+    this->latchedSample.time = this->boomClock.isSynchronized() ? (uint32_t)this->boomClock.toBoomTime(sampleTime) : (uint32_t)latch.boomTime;
+    this->latchedSample.isLatched = true;
+    this->hasLatchedSample = true;
+    xSemaphoreGive(this->responseMutex);
+}
+
+void SecondaryModule::onMetricsRequest(const uint8_t *mac_addr, const uint8_t *incomingData, int len)
+{
+    secondary_metrics metrics;
+    metrics.uptime = millis();
+    metrics.freeHeap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    metrics.minFreeHeap = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    metrics.largestFreeBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    metrics.loopStackHighWatermark = this->loopTask != nullptr ? uxTaskGetStackHighWaterMark(this->loopTask) : 0;
+    metrics.dispatcherStackHighWatermark = espNowManager->getDispatcherTask() != nullptr ? uxTaskGetStackHighWaterMark(espNowManager->getDispatcherTask()) : 0;
+    metrics.loopMaxDuration = this->loopMaxDuration.exchange(0, std::memory_order_relaxed);
+
+    espnow_message_metrics messageMetrics[ESPNOW_MESSAGE_METRICS_SLOTS];
+    espNowManager->copyMessageMetrics(messageMetrics);
+    metrics.framesSent = 0;
+    metrics.sendErrors = 0;
+    metrics.framesReceived = 0;
+    metrics.framesDropped = 0;
+    for (const espnow_message_metrics &messageMetric : messageMetrics)
+    {
+        metrics.framesSent += messageMetric.sent;
+        metrics.sendErrors += messageMetric.sendErrors;
+        metrics.framesReceived += messageMetric.received;
+        metrics.framesDropped += messageMetric.dropped;
+    }
+    metrics.framesDelivered = espNowManager->getDeliveredCount();
+    metrics.deliveryFailures = espNowManager->getDeliveryFailedCount();
+
+    // Rates over the time since the previous report, 0 on the first one.
+    const int64_t now = esp_timer_get_time();
+    const int64_t elapsed = this->metricsTimestamp != 0 ? now - this->metricsTimestamp : 0;
+    this->metricsTimestamp = now;
+
+    metrics.channelCount = std::min<uint8_t>(this->getFlowmeterCount(), SECONDARY_METRICS_MAX_CHANNELS);
+    uint32_t pulseRates[SECONDARY_METRICS_MAX_CHANNELS];
+    for (uint8_t i = 0; i < metrics.channelCount; i++)
+    {
+        const uint32_t pulseCount = this->flowmeters[i]->getTotalPulseCount();
+        pulseRates[i] = elapsed > 0 ? (uint32_t)((uint64_t)(pulseCount - this->metricsPulseCount[i]) * 1000000000 / elapsed) : 0;
+        this->metricsPulseCount[i] = pulseCount;
+    }
+
+    espNowManager->sendBuffer(mac_addr, METRICS_REQUEST + 0x80, reinterpret_cast<const uint8_t *>(&metrics), sizeof(metrics), reinterpret_cast<const uint8_t *>(pulseRates), sizeof(uint32_t) * metrics.channelCount);
 }
 
 void SecondaryModule::addFlowmeter(uint8_t pin, unsigned short refreshRate)
 {
+    if (this->flowmeterCount >= SECONDARY_MODULE_MAX_FLOWMETERS)
+    {
+        return;
+    }
+
     Flowmeter *newFlowmeter = new Flowmeter(pin, refreshRate);
 
     const uint8_t flowmeterCount = this->getFlowmeterCount();
@@ -103,32 +244,71 @@ uint8_t SecondaryModule::getFlowmeterCount()
     return this->flowmeterCount;
 }
 
-flowmeters_data SecondaryModule::getFlowmeterData()
+void SecondaryModule::getFlowmeterData(flowmeters_data &data)
 {
-    flowmeters_data data;
     data.flowmeterCount = this->flowmeterCount;
-
-    data.flowmetersPulseCount = static_cast<flowmeter_data_t *>(malloc(this->flowmeterCount * sizeof(flowmeter_data_t)));
-    data.flowmetersLastPulseAge = static_cast<unsigned long *>(malloc(this->flowmeterCount * sizeof(unsigned long)));
+    data.countWindow = this->flowmeterCount > 0 ? this->flowmeters[0]->getRefreshRate() : 0;
 
     for (uint8_t i = 0; i < this->flowmeterCount; i++)
     {
         data.flowmetersPulseCount[i] = this->flowmeters[i]->getPulseCount();
         data.flowmetersLastPulseAge[i] = this->flowmeters[i]->getLastPulseAge();
-    }
 
-    return data;
+        const flow_rate_estimate estimate = this->flowmeters[i]->getFlowRate();
+        data.flowmetersRate[i] = estimate.rate;
+        data.flowmetersRateConfidence[i] = estimate.confidence;
+    }
 }
 
 void SecondaryModule::setRefreshRate(unsigned short refreshRate, uint8_t flowmeterIndex)
 {
+    if (flowmeterIndex >= this->flowmeterCount)
+    {
+        return;
+    }
+
     this->flowmeters[flowmeterIndex]->setRefreshRate(refreshRate);
 }
 
 void SecondaryModule::loop()
 {
+    const int64_t loopStart = esp_timer_get_time();
+    if (this->loopTask == nullptr)
+    {
+        this->loopTask = xTaskGetCurrentTaskHandle();
+    }
+
     if (!espNowManager->isServerAddressSet())
     {
-        espNowManager->beginPairing();
+        espNowManager->beginPairing(this->getFlowmeterCount());
+    }
+
+    portENTER_CRITICAL(&slotResponseMux);
+    bool isSlotResponseDue = this->isSlotResponsePending && esp_timer_get_time() >= this->slotResponseTime;
+    portEXIT_CRITICAL(&slotResponseMux);
+
+    if (isSlotResponseDue)
+    {
+        // A direct request or a new latch may have come in before we got the mutex, check again under it.
+        xSemaphoreTake(responseMutex, portMAX_DELAY);
+        portENTER_CRITICAL(&slotResponseMux);
+        isSlotResponseDue = this->isSlotResponsePending && esp_timer_get_time() >= this->slotResponseTime;
+        if (isSlotResponseDue)
+        {
+            this->isSlotResponsePending = false;
+        }
+        portEXIT_CRITICAL(&slotResponseMux);
+
+        if (isSlotResponseDue)
+        {
+            this->sendDataResponse(this->slotResponseAddress, this->latchedSample.id);
+        }
+        xSemaphoreGive(responseMutex);
+    }
+
+    const uint32_t loopDuration = (uint32_t)(esp_timer_get_time() - loopStart);
+    if (loopDuration > this->loopMaxDuration.load(std::memory_order_relaxed))
+    {
+        this->loopMaxDuration.store(loopDuration, std::memory_order_relaxed);
     }
 }
@@ -1,18 +1,37 @@
 #pragma once
 
 #include <esp_now_types.h>
+#include <FlowmeterFrame.h>
+#include <BoomClock.h>
 #include "Flowmeter.h"
 #include "LedBlinker.h"
 #include <ESPNowSlaveManager/ESPNowSlaveManager.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Upper bound of the flowmeters of a module, sizes the buffers of a data response.
+#define SECONDARY_MODULE_MAX_FLOWMETERS 32
+
+// Flowmeter inputs of the board, in channel order.
+#define SECONDARY_MODULE_FLOWMETER_PINS {22, 14, 27, 26, 25, 33, 32, 35, 34}
+
+// Refresh rate of the flowmeters until the main module sets one, in milliseconds.
+#define SECONDARY_MODULE_REFRESH_RATE 5000
 
 class SecondaryModule
 {
 public:
     static SecondaryModule *getInstance();
 
-private:
-    SecondaryModule();
+    /*
+     * A module with a flowmeter on each pin, talking through espNowManager.
+     * The firmware runs the one of getInstance(), the simulator one per
+     * virtual node with a manager of its own.
+     */
+    SecondaryModule(ESPNowSlaveManager *espNowManager, const uint8_t *flowmeterPins, uint8_t flowmeterCount);
 
+private:
     ~SecondaryModule();
 
     static SecondaryModule *instance;
@@ -21,18 +40,71 @@ private:
     Flowmeter **flowmeters = nullptr;
     uint8_t flowmeterCount = 0;
 
+    /*
+     * Held by whichever task samples the flowmeters or sends a data response:
+     * the dispatcher for the latches and the direct requests, loop() for the
+     * slot responses. Guards the latched sample, the slot response address and
+     * the sequence below, and keeps the flowmeter windows to one reader at a time.
+     */
+    SemaphoreHandle_t responseMutex = xSemaphoreCreateMutex();
+    uint32_t dataResponseSequence = 0;
+    // Tells the main module the sequence started over, see FLOWMETER_FRAME_VERSION.
+    const uint16_t dataResponseSession = (uint16_t)esp_random();
+
+    // Counts latched by the last SAMPLE_LATCH, answered to the data requests
+    // of that sample (retries included) so the boom is sampled at one instant.
+    BoomClock boomClock;
+    // Receive time of the last latch, paired with its transmit time sent in the next one.
+    uint32_t lastLatchId = 0;
+    int64_t lastLatchReceiveTime = 0;
+    bool hasLatchedSample = false;
+    flowmeter_sample_info latchedSample;
+    flowmeter_data_t latchedPulseCount[SECONDARY_MODULE_MAX_FLOWMETERS];
+    unsigned long latchedLastPulseAge[SECONDARY_MODULE_MAX_FLOWMETERS];
+    uint32_t latchedRate[SECONDARY_MODULE_MAX_FLOWMETERS];
+    uint8_t latchedRateConfidence[SECONDARY_MODULE_MAX_FLOWMETERS];
+    uint16_t latchedCountWindow = 0;
+
+    // Response to the latch, due in our slot (esp_timer_get_time()). Set from
+    // the ESP-NOW callbacks and sent from loop(). The flag and time are also
+    // guarded by slotResponseMux, so loop() can poll them without the mutex.
+    bool isSlotResponsePending = false;
+    int64_t slotResponseTime = 0;
+    macAddress_t slotResponseAddress;
+    portMUX_TYPE slotResponseMux = portMUX_INITIALIZER_UNLOCKED;
+
+    // Pulse totals and esp_timer_get_time() of the previous metrics report, the
+    // pulse rates reported are the ones in between. Only touched by the dispatcher.
+    uint32_t metricsPulseCount[SECONDARY_MODULE_MAX_FLOWMETERS];
+    int64_t metricsTimestamp = 0;
+    // Longest loop() since the previous report (us), reset by the report.
+    std::atomic<uint32_t> loopMaxDuration{0};
+    TaskHandle_t loopTask = nullptr;
+
     LedBlinker *ledBlinker = nullptr;
-    ESPNowSlaveManager *espNowManager = ESPNowSlaveManager::getInstance();
+    ESPNowSlaveManager *espNowManager;
 
 private:
-    static void onDataRequest(const uint8_t *mac_addr, const uint8_t *incomingData, int len);
-    static void onSetRefreshRate(const uint8_t *mac_addr, const uint8_t *incomingData, int len);
+    void onDataRequest(const uint8_t *mac_addr, const uint8_t *incomingData, int len);
+    void onSetRefreshRate(const uint8_t *mac_addr, const uint8_t *incomingData, int len);
+    void onSampleLatch(const uint8_t *mac_addr, const uint8_t *incomingData, int len);
+    void onMetricsRequest(const uint8_t *mac_addr, const uint8_t *incomingData, int len);
+    // Answers sampleId with the latched counts when they match, or with counts taken now. Under responseMutex.
+    void sendDataResponse(const uint8_t *mac_addr, uint32_t sampleId);
     void addFlowmeter(uint8_t pin, unsigned short refreshRate);
     uint8_t getFlowmeterCount();
 
 public:
-    flowmeters_data getFlowmeterData();
+    /*
+     * Fills the arrays of data, which must hold getFlowmeterCount() entries.
+     * The count window is the refresh rate of the first flowmeter, the others
+     * send their rates in full if theirs differs.
+     */
+    void getFlowmeterData(flowmeters_data &data);
     void setRefreshRate(unsigned short refreshRate, uint8_t flowmeterIndex);
+    // Null past the last flowmeter.
+    Flowmeter *getFlowmeter(uint8_t index) { return index < this->flowmeterCount ? this->flowmeters[index] : nullptr; }
+    BoomClock &getBoomClock() { return this->boomClock; }
 
     void loop();
 };
\ No newline at end of file
@@ -0,0 +1,364 @@
+#include "CaptureReplay.h"
+#include <FlowmeterFrame.h>
+#include <MainModule.h>
+#include <NativeHAL.h>
+#include <RadioBus.h>
+#include <fstream>
+#include <iterator>
+
+bool CaptureReplay::load(const char *path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    const std::vector<uint8_t> content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    if (content.size() < sizeof(capture_header))
+    {
+        fprintf(stderr, "%s is not a capture\n", path);
+        return false;
+    }
+    memcpy(&header, content.data(), sizeof(capture_header));
+    if (memcmp(header.magic, TRAFFIC_CAPTURE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRAFFIC_CAPTURE_VERSION)
+    {
+        fprintf(stderr, "%s is not a capture of version %d\n", path, TRAFFIC_CAPTURE_VERSION);
+        return false;
+    }
+    if (content.size() < sizeof(capture_header) + header.metadataSize + header.recordsSize)
+    {
+        fprintf(stderr, "%s is truncated\n", path);
+        return false;
+    }
+
+    const uint8_t *metadata = content.data() + sizeof(capture_header);
+    if (!parseMetadata(metadata, header.metadataSize))
+    {
+        fprintf(stderr, "%s was not recorded by a main module of metadata version %d\n", path, CAPTURE_METADATA_VERSION);
+        return false;
+    }
+    if (!parseRecords(metadata + header.metadataSize, header.recordsSize))
+    {
+        fprintf(stderr, "%s has a malformed record\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+bool CaptureReplay::parseMetadata(const uint8_t *metadata, size_t size)
+{
+    // See MainModule::startCapture().
+    if (size < 1 || metadata[0] != CAPTURE_METADATA_VERSION)
+    {
+        return false;
+    }
+
+    size_t offset = 1;
+    uint32_t interval = 0;
+    const size_t intervalSize = FlowmeterFrame::readVarint(metadata + offset, size - offset, interval);
+    offset += intervalSize;
+    if (intervalSize == 0 || offset + 2 > size)
+    {
+        return false;
+    }
+    acquisitionInterval = interval;
+    responseSlotsEnabled = metadata[offset++] != 0;
+
+    const uint8_t slavesCount = metadata[offset++];
+    if (offset + slavesCount * (sizeof(macAddress_t) + 1) > size)
+    {
+        return false;
+    }
+    for (uint8_t i = 0; i < slavesCount; i++)
+    {
+        capture_slave slave;
+        memcpy(slave.mac, metadata + offset, sizeof(macAddress_t));
+        slave.channelCount = metadata[offset + sizeof(macAddress_t)];
+        offset += sizeof(macAddress_t) + 1;
+        slaves.push_back(slave);
+    }
+
+    return true;
+}
+
+bool CaptureReplay::parseRecords(const uint8_t *records, size_t size)
+{
+    int64_t time = header.startTime;
+    size_t offset = 0;
+    while (offset < size)
+    {
+        capture_record record;
+        record.kind = records[offset++];
+
+        uint32_t delta = 0;
+        const size_t deltaSize = FlowmeterFrame::readVarint(records + offset, size - offset, delta);
+        if (deltaSize == 0)
+        {
+            return false;
+        }
+        offset += deltaSize;
+        time += delta;
+        record.time = time;
+
+        memset(record.mac, 0, sizeof(macAddress_t));
+        if (record.kind != CAPTURE_RECORD_GPS)
+        {
+            if (offset + sizeof(macAddress_t) > size)
+            {
+                return false;
+            }
+            memcpy(record.mac, records + offset, sizeof(macAddress_t));
+            offset += sizeof(macAddress_t);
+        }
+
+        uint32_t length = 0;
+        const size_t lengthSize = FlowmeterFrame::readVarint(records + offset, size - offset, length);
+        if (lengthSize == 0 || offset + lengthSize + length > size || (record.kind != CAPTURE_RECORD_GPS && length == 0))
+        {
+            return false;
+        }
+        offset += lengthSize;
+        record.data.assign(records + offset, records + offset + length);
+        offset += length;
+        record.latch = (int32_t)recordedLatches.size() - 1;
+
+        switch (record.kind)
+        {
+        case CAPTURE_RECORD_RECEIVED:
+            radioRecords.push_back(std::move(record));
+            break;
+        case CAPTURE_RECORD_SENT:
+            sentFrameCount++;
+            if (record.data[0] == SAMPLE_LATCH && record.data.size() >= 1 + sizeof(sample_latch))
+            {
+                sample_latch latch;
+                memcpy(&latch, record.data.data() + 1, sizeof(sample_latch));
+                recordedLatches.push_back({latch.sampleId, latch.boomTime});
+            }
+            break;
+        case CAPTURE_RECORD_GPS:
+            gpsRecords.push_back(std::move(record));
+            break;
+        default:
+            return false;
+        }
+    }
+
+    lastTime = time;
+    return true;
+}
+
+void CaptureReplay::attach()
+{
+    NativeHAL::getMacAddress(firmwareMac);
+
+    for (size_t i = 0; i < slaves.size(); i++)
+    {
+        RadioBus::getInstance()->attach(
+            slaves[i].mac,
+            [this, i](const uint8_t *mac, const uint8_t *data, int len)
+            { this->onReceive(slaves[i].mac, data, len); });
+    }
+}
+
+void CaptureReplay::sendPairRequest(uint8_t index)
+{
+    const pair_request request = {PAIR_REQUEST, slaves[index].channelCount};
+    uint8_t frame[1 + sizeof(pair_request)];
+    frame[0] = PAIR_REQUEST;
+    memcpy(frame + 1, &request, sizeof(pair_request));
+
+    const macAddress_t broadcast = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    RadioBus::getInstance()->send(slaves[index].mac, broadcast, frame, sizeof(frame));
+}
+
+void CaptureReplay::start(int gpsUart)
+{
+    this->gpsUart = gpsUart;
+    startOffset = (int64_t)NativeHAL::now() - header.startTime;
+
+    std::lock_guard<std::mutex> lock(latchesMutex);
+    replayedLatches.clear();
+    isStarted = true;
+}
+
+void CaptureReplay::onReceive(const uint8_t *slaveMac, const uint8_t *data, int len)
+{
+    if (len < 1)
+    {
+        return;
+    }
+
+    // Every secondary gets the broadcast, the first copy is the one kept.
+    if (data[0] == SAMPLE_LATCH && len >= (int)(1 + sizeof(sample_latch)))
+    {
+        sample_latch latch;
+        memcpy(&latch, data + 1, sizeof(sample_latch));
+
+        std::lock_guard<std::mutex> lock(latchesMutex);
+        if (isStarted && (replayedLatches.empty() || replayedLatches.back().sampleId != latch.sampleId))
+        {
+            replayedLatches.push_back({latch.sampleId, latch.boomTime});
+        }
+        return;
+    }
+
+    // The reliable messages of the firmware are its own, the recorded acknowledgements cannot match them.
+    if (data[0] == RELIABLE_MESSAGE && len >= (int)(1 + sizeof(reliable_header)))
+    {
+        reliable_header reliableHeader;
+        memcpy(&reliableHeader, data + 1, sizeof(reliable_header));
+        const reliable_ack ack = {reliableHeader.session, reliableHeader.sequence};
+
+        uint8_t frame[1 + sizeof(reliable_ack)];
+        frame[0] = RELIABLE_MESSAGE + 0x80;
+        memcpy(frame + 1, &ack, sizeof(reliable_ack));
+        RadioBus::getInstance()->send(slaveMac, firmwareMac, frame, sizeof(frame));
+        stats.reliableAcksSent++;
+    }
+}
+
+size_t CaptureReplay::getReplayedLatchCount()
+{
+    std::lock_guard<std::mutex> lock(latchesMutex);
+    return replayedLatches.size();
+}
+
+bool CaptureReplay::getDueTime(const capture_record &record, int64_t &dueTime)
+{
+    if (record.latch < 0)
+    {
+        dueTime = record.time + startOffset;
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(latchesMutex);
+    if ((size_t)record.latch < replayedLatches.size())
+    {
+        dueTime = record.time + replayedLatches[record.latch].boomTime - recordedLatches[record.latch].boomTime;
+        return true;
+    }
+
+    // Where the latch would be had the firmware kept the recorded pace since its last one.
+    const size_t last = replayedLatches.size();
+    const int64_t offset = last > 0 ? replayedLatches[last - 1].boomTime - recordedLatches[last - 1].boomTime : startOffset;
+    dueTime = record.time + offset;
+    return false;
+}
+
+uint64_t CaptureReplay::loop()
+{
+    const int64_t now = NativeHAL::now();
+    uint64_t next = UINT64_MAX;
+
+    while (gpsIndex < gpsRecords.size())
+    {
+        const capture_record &record = gpsRecords[gpsIndex];
+        const int64_t dueTime = record.time + startOffset;
+        if (dueTime > now)
+        {
+            next = dueTime;
+            break;
+        }
+
+        NativeHAL::injectSerial(gpsUart, record.data.data(), record.data.size());
+        stats.gpsBytes += record.data.size();
+        gpsIndex++;
+    }
+
+    while (radioIndex < radioRecords.size())
+    {
+        const capture_record &record = radioRecords[radioIndex];
+        int64_t dueTime;
+        const bool isAligned = this->getDueTime(record, dueTime);
+        if (!isAligned)
+        {
+            dueTime += (int64_t)CAPTURE_REPLAY_LATCH_TIMEOUT_CYCLES * acquisitionInterval * 1000;
+        }
+
+        // Recorded on arrival, so sent one airtime earlier.
+        const int64_t sendTime = dueTime - RadioBus::getInstance()->getAirtime(record.data.size(), true);
+        if (sendTime > now)
+        {
+            next = std::min<uint64_t>(next, sendTime);
+            break;
+        }
+
+        stats.framesUnaligned += isAligned ? 0 : 1;
+        this->inject(record);
+        radioIndex++;
+    }
+
+    return next;
+}
+
+void CaptureReplay::inject(const capture_record &record)
+{
+    const uint8_t messageType = record.data[0];
+    if (messageType == PAIR_REQUEST || messageType == RELIABLE_MESSAGE + 0x80)
+    {
+        stats.framesSkipped++;
+        return;
+    }
+
+    std::vector<uint8_t> frame = record.data;
+    if (messageType == FLOWMETER_DATA_REQUEST + 0x80 && this->realignResponse(frame))
+    {
+        stats.responsesRealigned++;
+    }
+
+    RadioBus::getInstance()->send(record.mac, firmwareMac, frame.data(), frame.size());
+    stats.framesInjected++;
+}
+
+bool CaptureReplay::realignResponse(std::vector<uint8_t> &frame)
+{
+    // Message type, then version, flags, sequence, sample id and sample time, see FlowmeterFrame.
+    if (frame.size() < 3 || (frame[2] & FLOWMETER_FRAME_FLAG_SAMPLE) == 0)
+    {
+        return false;
+    }
+
+    size_t offset = 3;
+    uint32_t sequence;
+    uint32_t sampleId;
+    uint32_t sampleTime;
+    const size_t sequenceSize = FlowmeterFrame::readVarint(frame.data() + offset, frame.size() - offset, sequence);
+    offset += sequenceSize;
+    const size_t sampleOffset = offset;
+    const size_t idSize = sequenceSize > 0 ? FlowmeterFrame::readVarint(frame.data() + offset, frame.size() - offset, sampleId) : 0;
+    offset += idSize;
+    const size_t timeSize = idSize > 0 ? FlowmeterFrame::readVarint(frame.data() + offset, frame.size() - offset, sampleTime) : 0;
+    offset += timeSize;
+    if (timeSize == 0 || recordedLatches.empty())
+    {
+        return false;
+    }
+
+    // Sample ids follow each other from latch to latch.
+    const uint32_t index = sampleId - recordedLatches[0].sampleId;
+    capture_latch replayed;
+    {
+        std::lock_guard<std::mutex> lock(latchesMutex);
+        if (index >= recordedLatches.size() || recordedLatches[index].sampleId != sampleId || index >= replayedLatches.size())
+        {
+            return false;
+        }
+        replayed = replayedLatches[index];
+    }
+
+    uint8_t sample[10];
+    size_t sampleSize = FlowmeterFrame::writeVarint(sample, sizeof(sample), replayed.sampleId);
+    sampleSize += FlowmeterFrame::writeVarint(sample + sampleSize, sizeof(sample) - sampleSize, sampleTime + (uint32_t)(replayed.boomTime - recordedLatches[index].boomTime));
+    if (frame.size() - (offset - sampleOffset) + sampleSize > ESP_NOW_MAX_DATA_LEN)
+    {
+        return false;
+    }
+
+    frame.erase(frame.begin() + sampleOffset, frame.begin() + offset);
+    frame.insert(frame.begin() + sampleOffset, sample, sample + sampleSize);
+    return true;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <Arduino.h>
+#include <esp_now_types.h>
+#include <TrafficCapture.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A recorded frame whose latch the firmware has not sent yet waits at most
+// this many acquisition intervals past its expected time, then goes anyway.
+#define CAPTURE_REPLAY_LATCH_TIMEOUT_CYCLES 2
+
+typedef struct capture_record
+{
+    uint8_t kind;
+    // esp_timer_get_time() of the recording module.
+    int64_t time;
+    macAddress_t mac;
+    std::vector<uint8_t> data;
+    // Index of the last SAMPLE_LATCH sent before the record, -1 before the first one.
+    int32_t latch;
+} capture_record;
+
+typedef struct capture_slave
+{
+    macAddress_t mac;
+    uint8_t channelCount;
+} capture_slave;
+
+typedef struct capture_latch
+{
+    uint32_t sampleId;
+    int64_t boomTime;
+} capture_latch;
+
+typedef struct capture_replay_stats
+{
+    uint32_t framesInjected;
+    // Data responses moved onto the sample of the replayed latch they answer.
+    uint32_t responsesRealigned;
+    // Frames injected on their estimated time because the firmware did not send their latch in time.
+    uint32_t framesUnaligned;
+    // Pairing requests and acknowledgements, which the replay answers itself.
+    uint32_t framesSkipped;
+    uint32_t reliableAcksSent;
+    uint32_t gpsBytes;
+} capture_replay_stats;
+
+/*
+ * Plays a capture downloaded from a main module (see TrafficCapture and
+ * MainModule::startCapture()) back into the host build of the firmware.
+ *
+ * The recorded secondaries come back as nodes of the radio bus sending the
+ * frames the module received, and the recorded GPS bytes are fed to its
+ * UART, at their recorded times. What the module sent is not replayed, the
+ * firmware under test sends its own.
+ *
+ * Secondaries answer the SAMPLE_LATCH broadcasts, so recorded frames follow
+ * the latches rather than the capture start: the k-th recorded latch is
+ * matched with the k-th one the firmware sends, the frames after it keep
+ * their delay from it, and data responses get the sample id and boom time
+ * of the matching latch. A slower firmware thus sees its answers come later,
+ * as it would in the field, instead of getting them all stale.
+ */
+class CaptureReplay
+{
+public:
+    // Reads a capture file, false with the reason on stderr if it is not one.
+    bool load(const char *path);
+
+    // Attaches a node per recorded secondary to the radio bus, answering the firmware.
+    void attach();
+    // Sends the pairing request of the secondary at slot index, as it was paired.
+    void sendPairRequest(uint8_t index);
+
+    // Starts the timeline at the current virtual time.
+    void start(int gpsUart);
+    /*
+     * Injects every record due at the current virtual time. Returns the
+     * virtual time the next record is due, UINT64_MAX once all were injected.
+     */
+    uint64_t loop();
+    bool isFinished() { return radioIndex >= radioRecords.size() && gpsIndex >= gpsRecords.size(); }
+
+    const std::vector<capture_slave> &getSlaves() { return slaves; }
+    unsigned short getAcquisitionInterval() { return acquisitionInterval; }
+    bool isResponseSlotsEnabled() { return responseSlotsEnabled; }
+    // Time from the capture start to its last record (us).
+    int64_t getDuration() { return lastTime - header.startTime; }
+    uint32_t getDroppedRecords() { return header.droppedRecords; }
+    size_t getRecordedLatchCount() { return recordedLatches.size(); }
+    // Frames the recording module received and sent.
+    size_t getReceivedFrameCount() { return radioRecords.size(); }
+    uint32_t getSentFrameCount() { return sentFrameCount; }
+    size_t getReplayedLatchCount();
+    const capture_replay_stats &getStats() { return stats; }
+
+private:
+    capture_header header = {};
+    unsigned short acquisitionInterval = 0;
+    bool responseSlotsEnabled = true;
+    std::vector<capture_slave> slaves;
+
+    // Frames received by the recording module and GPS bytes, in recording order.
+    std::vector<capture_record> radioRecords;
+    std::vector<capture_record> gpsRecords;
+    std::vector<capture_latch> recordedLatches;
+    uint32_t sentFrameCount = 0;
+    int64_t lastTime = 0;
+
+    macAddress_t firmwareMac;
+    int gpsUart = 0;
+    // Virtual time minus recorded time, before the first latch and for the GPS.
+    int64_t startOffset = 0;
+    size_t radioIndex = 0;
+    size_t gpsIndex = 0;
+
+    // Latches the firmware sent since start(), taken from the radio bus.
+    std::mutex latchesMutex;
+    std::vector<capture_latch> replayedLatches;
+    bool isStarted = false;
+
+    capture_replay_stats stats = {};
+
+    bool parseMetadata(const uint8_t *metadata, size_t size);
+    bool parseRecords(const uint8_t *records, size_t size);
+    void onReceive(const uint8_t *slaveMac, const uint8_t *data, int len);
+    // Virtual time the record is due, false if its latch was not replayed yet and the time is an estimate.
+    bool getDueTime(const capture_record &record, int64_t &dueTime);
+    void inject(const capture_record &record);
+    // Rewrites the sample of a data response for the replayed latch, false if it answers no known latch.
+    bool realignResponse(std::vector<uint8_t> &frame);
+};
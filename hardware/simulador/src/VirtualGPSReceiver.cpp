@@ -0,0 +1,312 @@
+#include "VirtualGPSReceiver.h"
+#include <GPSReceiver.h>
+#include <NativeHAL.h>
+#include <cmath>
+#include <fstream>
+
+// Bits per byte on the wire, with start and stop bits.
+static const unsigned long UART_BITS_PER_BYTE = 10;
+static const double METERS_PER_DEGREE = 111320.0;
+static const double KNOTS_PER_MPS = 1.943844;
+
+// A byte sent at the wrong baud rate is read as some other byte.
+static uint8_t garble(uint8_t value)
+{
+    return value ^ 0x55;
+}
+
+VirtualGPSReceiver::VirtualGPSReceiver(const virtual_gps_config &config)
+{
+    this->config = config;
+    this->random.seed(config.seed);
+
+    if (!config.logPath.empty())
+    {
+        this->loadLog();
+    }
+
+    NativeHAL::setSerialTxHook(
+        config.uart,
+        [this](uint8_t value)
+        {
+            const bool isSameBaud = NativeHAL::getSerialBaudRate(this->config.uart) == this->baud.load();
+
+            std::lock_guard<std::mutex> lock(receivedMutex);
+            this->received.push_back(isSameBaud ? value : garble(value));
+        });
+}
+
+VirtualGPSReceiver::~VirtualGPSReceiver()
+{
+    NativeHAL::setSerialTxHook(config.uart, nullptr);
+}
+
+void VirtualGPSReceiver::loadLog()
+{
+    std::ifstream log(config.logPath);
+    std::string line;
+
+    // Each RMC sentence starts an epoch, whatever came before the first one belongs to it.
+    while (std::getline(log, line))
+    {
+        while (!line.empty() && (line.back() == '\r' || line.back() == '\n'))
+        {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] != '$')
+        {
+            continue;
+        }
+
+        if (logEpochs.empty() || (line.size() > 7 && line.compare(3, 4, "RMC,") == 0))
+        {
+            logEpochs.push_back("");
+        }
+        logEpochs.back() += line + "\r\n";
+    }
+
+    if (logEpochs.empty())
+    {
+        fprintf(stderr, "warning: no NMEA sentence in %s\n", config.logPath.c_str());
+    }
+}
+
+void VirtualGPSReceiver::loop()
+{
+    std::vector<uint8_t> bytes;
+    {
+        std::lock_guard<std::mutex> lock(receivedMutex);
+        bytes.swap(received);
+    }
+
+    for (uint8_t value : bytes)
+    {
+        this->parseUbx(value);
+    }
+
+    if (millis() >= nextEpochTimestamp)
+    {
+        nextEpochTimestamp = millis() + measurementPeriod;
+        this->sendEpoch();
+    }
+}
+
+void VirtualGPSReceiver::parseUbx(uint8_t value)
+{
+    const uint16_t position = ubxPosition;
+
+    if ((position == 0 && value != UBX_SYNC_CHAR_1) || (position == 1 && value != UBX_SYNC_CHAR_2))
+    {
+        ubxPosition = 0;
+        return;
+    }
+    ubxPosition++;
+
+    if (position >= 2 && position < 6)
+    {
+        ubxHeader[position - 2] = value;
+        ubxLength = ubxHeader[2] | (ubxHeader[3] << 8);
+        if (position == 5 && ubxLength > UBX_MAX_FRAME_LENGTH)
+        {
+            ubxPosition = 0;
+        }
+    }
+    else if (position >= 6 && position < 6 + ubxLength)
+    {
+        if (position - 6 < VIRTUAL_GPS_MAX_UBX_PAYLOAD)
+        {
+            ubxPayload[position - 6] = value;
+        }
+    }
+    else if (position == 7 + ubxLength)
+    {
+        // Only the checksum is left, rebuilding the frame checks it.
+        ubxPosition = 0;
+
+        uint8_t frame[UBX_FRAME_OVERHEAD + VIRTUAL_GPS_MAX_UBX_PAYLOAD];
+        const size_t size = GPSReceiver::buildUbx(frame, sizeof(frame), ubxHeader[0], ubxHeader[1], ubxPayload, ubxLength);
+        const uint8_t checksumA = size > 0 ? frame[size - 2] : 0;
+        if (size > 0 && frame[size - 1] == value && checksumA == lastChecksumA)
+        {
+            this->onUbxFrame();
+        }
+    }
+    else if (position == 6 + ubxLength)
+    {
+        lastChecksumA = value;
+    }
+}
+
+void VirtualGPSReceiver::onUbxFrame()
+{
+    if (ubxHeader[0] != UBX_CLASS_CFG)
+    {
+        return;
+    }
+
+    switch (ubxHeader[1])
+    {
+    case UBX_ID_CFG_PRT:
+    {
+        if (ubxLength < 20)
+        {
+            this->sendAck(false);
+            return;
+        }
+
+        // Acknowledged at the old baud rate, then the port switches.
+        this->sendAck(true);
+        baud = ubxPayload[8] | (ubxPayload[9] << 8) | (ubxPayload[10] << 16) | ((unsigned long)ubxPayload[11] << 24);
+        return;
+    }
+    case UBX_ID_CFG_MSG:
+    {
+        // Either one rate for the current port or one per port, UART1 being the second.
+        if ((ubxLength != 3 && ubxLength != 8) || ubxPayload[0] != UBX_NMEA_CLASS || ubxPayload[1] > UBX_NMEA_VTG)
+        {
+            this->sendAck(false);
+            return;
+        }
+
+        isSentenceEnabled[ubxPayload[1]] = (ubxLength == 3 ? ubxPayload[2] : ubxPayload[3]) != 0;
+        this->sendAck(true);
+        return;
+    }
+    case UBX_ID_CFG_RATE:
+    {
+        const uint16_t period = ubxLength >= 2 ? ubxPayload[0] | (ubxPayload[1] << 8) : 0;
+        if (period < config.minMeasurementPeriod)
+        {
+            this->sendAck(false);
+            return;
+        }
+
+        measurementPeriod = period;
+        nextEpochTimestamp = std::min(nextEpochTimestamp, millis() + measurementPeriod);
+        this->sendAck(true);
+        return;
+    }
+    default:
+        this->sendAck(true);
+        return;
+    }
+}
+
+void VirtualGPSReceiver::sendAck(bool isAcknowledged)
+{
+    const uint8_t payload[2] = {ubxHeader[0], ubxHeader[1]};
+
+    uint8_t frame[UBX_FRAME_OVERHEAD + sizeof(payload)];
+    const size_t size = GPSReceiver::buildUbx(frame, sizeof(frame), UBX_CLASS_ACK, isAcknowledged ? UBX_ID_ACK_ACK : UBX_ID_ACK_NAK, payload, sizeof(payload));
+    this->transmit(frame, size);
+}
+
+void VirtualGPSReceiver::sendEpoch()
+{
+    std::string epoch;
+
+    if (!logEpochs.empty())
+    {
+        epoch = logEpochs[logEpochIndex];
+        logEpochIndex = (logEpochIndex + 1) % logEpochs.size();
+    }
+    else
+    {
+        const unsigned long now = millis();
+        const double distance = config.speed * now / 1000.0;
+        const double courseRadians = config.course * M_PI / 180.0;
+        const double latitude = config.latitude + distance * cos(courseRadians) / METERS_PER_DEGREE;
+        const double longitude = config.longitude + distance * sin(courseRadians) / (METERS_PER_DEGREE * cos(config.latitude * M_PI / 180.0));
+
+        // Time of day counted from noon, in NMEA hhmmss.ss.
+        const unsigned long centiseconds = (now / 10) % 8640000;
+        char time[16];
+        snprintf(time, sizeof(time), "%02lu%02lu%02lu.%02lu", (12 + centiseconds / 360000) % 24, centiseconds / 6000 % 60, centiseconds / 100 % 60, centiseconds % 100);
+
+        char position[48];
+        const double absLatitude = fabs(latitude);
+        const double absLongitude = fabs(longitude);
+        snprintf(position, sizeof(position), "%02d%08.5f,%c,%03d%08.5f,%c",
+                 (int)absLatitude, (absLatitude - (int)absLatitude) * 60, latitude < 0 ? 'S' : 'N',
+                 (int)absLongitude, (absLongitude - (int)absLongitude) * 60, longitude < 0 ? 'W' : 'E');
+
+        const uint8_t satelliteCount = 8 + random() % 4;
+        char body[128];
+
+        // Sentences in the order a u-blox outputs them.
+        if (isSentenceEnabled[UBX_NMEA_RMC])
+        {
+            snprintf(body, sizeof(body), "GPRMC,%s,A,%s,%.3f,%.2f,010126,,,A", time, position, config.speed * KNOTS_PER_MPS, config.course);
+            this->appendSentence(epoch, body);
+        }
+        if (isSentenceEnabled[UBX_NMEA_VTG])
+        {
+            snprintf(body, sizeof(body), "GPVTG,%.2f,T,,M,%.3f,N,%.3f,K,A", config.course, config.speed * KNOTS_PER_MPS, config.speed * 3.6);
+            this->appendSentence(epoch, body);
+        }
+        if (isSentenceEnabled[UBX_NMEA_GGA])
+        {
+            snprintf(body, sizeof(body), "GPGGA,%s,%s,1,%02u,0.92,612.4,M,-5.1,M,,", time, position, satelliteCount);
+            this->appendSentence(epoch, body);
+        }
+        if (isSentenceEnabled[UBX_NMEA_GSA])
+        {
+            this->appendSentence(epoch, "GPGSA,A,3,02,05,07,09,13,15,18,20,,,,,1.64,0.92,1.36");
+        }
+        if (isSentenceEnabled[UBX_NMEA_GSV])
+        {
+            this->appendSentence(epoch, "GPGSV,2,1,08,02,42,075,38,05,61,213,41,07,12,320,29,09,33,146,35");
+            this->appendSentence(epoch, "GPGSV,2,2,08,13,55,004,40,15,20,251,31,18,08,098,24,20,71,302,43");
+        }
+        if (isSentenceEnabled[UBX_NMEA_GLL])
+        {
+            snprintf(body, sizeof(body), "GPGLL,%s,%s,A,A", position, time);
+            this->appendSentence(epoch, body);
+        }
+    }
+
+    // What does not fit in the period at this baud rate is lost in the receiver buffer.
+    const size_t capacity = baud.load() / UART_BITS_PER_BYTE * measurementPeriod / 1000;
+    if (epoch.size() > capacity)
+    {
+        epoch.resize(capacity);
+        truncatedEpochCount++;
+    }
+
+    epochCount++;
+    this->transmit(reinterpret_cast<const uint8_t *>(epoch.data()), epoch.size());
+}
+
+void VirtualGPSReceiver::appendSentence(std::string &epoch, const char *body)
+{
+    uint8_t checksum = 0;
+    for (const char *c = body; *c != '\0'; c++)
+    {
+        checksum ^= *c;
+    }
+
+    char suffix[8];
+    snprintf(suffix, sizeof(suffix), "*%02X\r\n", checksum);
+    epoch += '$';
+    epoch += body;
+    epoch += suffix;
+}
+
+void VirtualGPSReceiver::transmit(const uint8_t *data, size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+
+    std::vector<uint8_t> bytes(data, data + len);
+    if (NativeHAL::getSerialBaudRate(config.uart) != baud.load())
+    {
+        for (uint8_t &value : bytes)
+        {
+            value = garble(value);
+        }
+    }
+
+    NativeHAL::injectSerial(config.uart, bytes.data(), bytes.size());
+}
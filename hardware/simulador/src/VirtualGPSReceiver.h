@@ -0,0 +1,89 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#define VIRTUAL_GPS_DEFAULT_BAUD 9600
+#define VIRTUAL_GPS_DEFAULT_MEASUREMENT_PERIOD 1000
+#define VIRTUAL_GPS_MAX_UBX_PAYLOAD 32
+
+typedef struct virtual_gps_config
+{
+    // UART of the main module the receiver is wired to.
+    int uart;
+    // Shortest measurement period accepted by CFG-RATE, in ms (100 for 10 Hz receivers, 200 for a NEO-6).
+    uint16_t minMeasurementPeriod;
+    // Synthetic track: starting position, and a constant speed (m/s) and course (degrees).
+    double latitude;
+    double longitude;
+    float speed;
+    float course;
+    // NMEA log replayed instead of the synthetic track, one epoch per measurement period. Empty for none.
+    std::string logPath;
+    uint32_t seed;
+} virtual_gps_config;
+
+/*
+ * A u-blox receiver wired to a UART of the main module.
+ *
+ * It answers the UBX configuration messages the firmware sends (port, message
+ * rates and measurement rate) and outputs the enabled NMEA sentences every
+ * measurement period. Bytes crossing the UART at a baud rate different from
+ * the receiver one arrive garbled, and an epoch that does not fit in the
+ * measurement period at the current baud rate is cut short, as on the wire.
+ */
+class VirtualGPSReceiver
+{
+public:
+    VirtualGPSReceiver(const virtual_gps_config &config);
+    ~VirtualGPSReceiver();
+
+    // Handles what the firmware sent and outputs the epoch due, if any.
+    void loop();
+
+    unsigned long getBaudRate() { return baud; }
+    uint16_t getMeasurementPeriod() { return measurementPeriod; }
+    uint32_t getEpochCount() { return epochCount; }
+    // Epochs cut short because the UART could not carry them.
+    uint32_t getTruncatedEpochCount() { return truncatedEpochCount; }
+    bool isReplaying() { return !logEpochs.empty(); }
+
+private:
+    virtual_gps_config config;
+    std::mt19937 random;
+
+    std::atomic<unsigned long> baud{VIRTUAL_GPS_DEFAULT_BAUD};
+    uint16_t measurementPeriod = VIRTUAL_GPS_DEFAULT_MEASUREMENT_PERIOD;
+    // Whether each standard NMEA sentence is output, by its CFG-MSG id (GGA to VTG).
+    bool isSentenceEnabled[6] = {true, true, true, true, true, true};
+
+    unsigned long nextEpochTimestamp = 0;
+    uint32_t epochCount = 0;
+    uint32_t truncatedEpochCount = 0;
+
+    std::vector<std::string> logEpochs;
+    size_t logEpochIndex = 0;
+
+    // Bytes written by the firmware, appended from the task writing them.
+    std::mutex receivedMutex;
+    std::vector<uint8_t> received;
+
+    // UBX frame being parsed from the firmware.
+    uint16_t ubxPosition = 0;
+    uint8_t ubxHeader[4];
+    uint16_t ubxLength = 0;
+    uint8_t ubxPayload[VIRTUAL_GPS_MAX_UBX_PAYLOAD];
+    uint8_t lastChecksumA = 0;
+
+    void loadLog();
+    void parseUbx(uint8_t value);
+    void onUbxFrame();
+    void sendAck(bool isAcknowledged);
+    void sendEpoch();
+    void appendSentence(std::string &epoch, const char *body);
+    void transmit(const uint8_t *data, size_t len);
+};
@@ -0,0 +1,202 @@
+#include "VirtualSecondaryModule.h"
+#include <FlowmeterFrame.h>
+#include <RadioBus.h>
+
+// Pins only identify the interrupt handler, virtual modules share the same ones.
+static const uint8_t FIRST_FLOWMETER_PIN = 100;
+
+esp_err_t VirtualESPNowManager::transmit(const uint8_t *address, const uint8_t *frame, size_t size)
+{
+    return module->transmit(address, frame, size);
+}
+
+VirtualSecondaryModule::VirtualSecondaryModule(const uint8_t *macAddress, const virtual_secondary_config &config)
+{
+    memcpy(this->macAddress, macAddress, sizeof(macAddress_t));
+    this->config = config;
+    this->config.flowmeterCount = std::min<uint8_t>(config.flowmeterCount, SECONDARY_MODULE_MAX_FLOWMETERS);
+    this->clock = {config.clockOffset, config.clockDrift};
+    this->random.seed(config.seed);
+
+    uint8_t flowmeterPins[SECONDARY_MODULE_MAX_FLOWMETERS];
+    for (uint8_t i = 0; i < this->config.flowmeterCount; i++)
+    {
+        flowmeterPins[i] = FIRST_FLOWMETER_PIN + i;
+    }
+
+    // Built on the clock of the module, which its dispatcher task keeps.
+    NativeHAL::setLocalClock(&this->clock);
+    espNowManager = new VirtualESPNowManager(this);
+    module = new SecondaryModule(espNowManager, flowmeterPins, this->config.flowmeterCount);
+    NativeHAL::setLocalClock(nullptr);
+
+    // Called after the ones of the module, on the same frames.
+    espNowManager->registerCallback(
+        SET_REFRESH_RATE,
+        [this](const uint8_t *mac, const uint8_t *data, int len)
+        { this->onSetRefreshRate(data, len); });
+
+    espNowManager->registerCallback(
+        SAMPLE_LATCH,
+        [this](const uint8_t *mac, const uint8_t *data, int len)
+        {
+            if (len >= (int)sizeof(sample_latch))
+            {
+                memcpy(&this->lastLatchId, data, sizeof(uint32_t));
+                this->lastLatchTrueTime = NativeHAL::now();
+            }
+        });
+
+    espNowManager->registerCallback(
+        FLOWMETER_DATA_REQUEST,
+        [this](const uint8_t *mac, const uint8_t *data, int len)
+        {
+            this->requestedSampleId = 0;
+            if (len >= (int)sizeof(uint32_t))
+            {
+                memcpy(&this->requestedSampleId, data, sizeof(uint32_t));
+            }
+        });
+
+    pulsePeriods = new float[this->config.flowmeterCount];
+    nextPulseTimes = new uint64_t[this->config.flowmeterCount];
+
+    std::uniform_real_distribution<float> spread(-config.pulseFrequencySpread, config.pulseFrequencySpread);
+    for (uint8_t i = 0; i < this->config.flowmeterCount; i++)
+    {
+        const float frequency = config.pulseFrequency * (1 + spread(random));
+        pulsePeriods[i] = frequency > 0 ? 1000000.0f / frequency : 0;
+        nextPulseTimes[i] = NativeHAL::now() + (uint64_t)(pulsePeriods[i] * std::uniform_real_distribution<float>(0, 1)(random));
+    }
+
+    RadioBus::getInstance()->attach(
+        this->macAddress,
+        [this](const uint8_t *mac, const uint8_t *data, int len)
+        {
+            if (!this->powered)
+            {
+                return;
+            }
+
+            NativeHAL::setLocalClock(&this->clock);
+            this->espNowManager->receive(mac, data, len);
+            NativeHAL::setLocalClock(nullptr);
+        },
+        [this](const uint8_t *mac, bool delivered)
+        {
+            if (!this->powered)
+            {
+                return;
+            }
+
+            NativeHAL::setLocalClock(&this->clock);
+            this->espNowManager->sent(mac, delivered);
+            NativeHAL::setLocalClock(nullptr);
+        });
+}
+
+VirtualSecondaryModule::~VirtualSecondaryModule()
+{
+    RadioBus::getInstance()->detach(this->macAddress);
+
+    // The module and its manager stay, the dispatcher task still holds them.
+    delete[] pulsePeriods;
+    delete[] nextPulseTimes;
+}
+
+void VirtualSecondaryModule::setPulseFrequency(uint8_t index, float frequency)
+{
+    pulsePeriods[index] = frequency > 0 ? 1000000.0f / frequency : 0;
+    nextPulseTimes[index] = NativeHAL::now() + (uint64_t)pulsePeriods[index];
+}
+
+float VirtualSecondaryModule::getPulseFrequency(uint8_t index)
+{
+    return pulsePeriods[index] > 0 ? 1000000.0f / pulsePeriods[index] : 0;
+}
+
+float VirtualSecondaryModule::getExpectedPulseCount(uint8_t index)
+{
+    return pulsePeriods[index] > 0 ? SECONDARY_MODULE_REFRESH_RATE * 1000.0f / pulsePeriods[index] : 0;
+}
+
+void VirtualSecondaryModule::setupTaskFunction(void *arg)
+{
+    VirtualSecondaryModule *secondary = static_cast<VirtualSecondaryModule *>(arg);
+
+    // Tasks of the host may return.
+    secondary->module->loop();
+    secondary->isSetUp = true;
+}
+
+void VirtualSecondaryModule::loop()
+{
+    const uint64_t now = NativeHAL::now();
+    NativeHAL::setLocalClock(&clock);
+
+    for (uint8_t i = 0; i < config.flowmeterCount; i++)
+    {
+        if (pulsePeriods[i] <= 0)
+        {
+            continue;
+        }
+
+        // Pulses keep their period on average, with a small per-pulse jitter.
+        while (nextPulseTimes[i] <= now)
+        {
+            module->getFlowmeter(i)->onPulse();
+            nextPulseTimes[i] += (uint64_t)(pulsePeriods[i] * std::uniform_real_distribution<float>(0.95f, 1.05f)(random));
+        }
+    }
+
+    if (powered && !isStarted)
+    {
+        isStarted = true;
+        xTaskCreate(VirtualSecondaryModule::setupTaskFunction, "setup", 4096, this, 1, nullptr);
+    }
+    else if (powered && isSetUp)
+    {
+        module->loop();
+    }
+
+    NativeHAL::setLocalClock(nullptr);
+}
+
+void VirtualSecondaryModule::onSetRefreshRate(const uint8_t *data, int len)
+{
+    // Counts the flowmeters SecondaryModule::onSetRefreshRate() just set.
+    if (len < SET_REFRESH_RATE_HEADER_SIZE || len < SET_REFRESH_RATE_HEADER_SIZE + CHANNEL_BITMAP_SIZE(data[2]))
+    {
+        return;
+    }
+
+    const uint8_t *bitmap = data + SET_REFRESH_RATE_HEADER_SIZE;
+    for (uint8_t i = 0; i < std::min(data[2], config.flowmeterCount); i++)
+    {
+        if (bitmap[i / 8] & (1 << (i % 8)))
+        {
+            refreshRateUpdates++;
+        }
+    }
+}
+
+esp_err_t VirtualSecondaryModule::transmit(const uint8_t *address, const uint8_t *frame, size_t size)
+{
+    if (!powered)
+    {
+        return ESP_OK;
+    }
+
+    // The counts of a latched response were taken when the latch arrived, the others just now.
+    flowmeter_frame_header header;
+    const flowmeters_data frameOnly = {0, nullptr, nullptr, nullptr, nullptr, 0};
+    if (size > 1 && frame[0] == FLOWMETER_DATA_REQUEST + 0x80 && FlowmeterFrame::decode(frame + 1, size - 1, header, frameOnly, SECONDARY_MODULE_MAX_FLOWMETERS))
+    {
+        const bool isLatched = header.sample.isLatched && header.sample.id == lastLatchId;
+        lastSampleId = header.sample.id != 0 ? header.sample.id : requestedSampleId;
+        lastSampleTrueTime = isLatched ? lastLatchTrueTime : NativeHAL::now();
+    }
+
+    RadioBus::getInstance()->send(this->macAddress, address, frame, size);
+    return ESP_OK;
+}
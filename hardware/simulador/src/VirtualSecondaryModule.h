@@ -0,0 +1,113 @@
+#pragma once
+
+#include <Arduino.h>
+#include <esp_now_types.h>
+#include <NativeHAL.h>
+#include <SecondaryModule.h>
+#include <atomic>
+#include <random>
+
+typedef struct virtual_secondary_config
+{
+    // At most SECONDARY_MODULE_MAX_FLOWMETERS.
+    uint8_t flowmeterCount;
+    // Nominal pulse frequency of every flowmeter, in Hz. Each flowmeter gets a
+    // fixed offset of up to pulseFrequencySpread (0.1 = +-10%) around it.
+    float pulseFrequency;
+    float pulseFrequencySpread;
+    // Local clock of the module: starts clockOffset microseconds away from the
+    // main module and runs clockDrift parts per million fast or slow.
+    int64_t clockOffset;
+    float clockDrift;
+    uint32_t seed;
+} virtual_secondary_config;
+
+class VirtualSecondaryModule;
+
+/*
+ * ESP-NOW manager of a virtual secondary module: off the driver, its frames
+ * go through the radio bus of the simulation.
+ */
+class VirtualESPNowManager : public ESPNowSlaveManager
+{
+public:
+    explicit VirtualESPNowManager(VirtualSecondaryModule *module) : ESPNowSlaveManager(false), module(module) {}
+
+    // What the radio bus delivers to the module, and the outcome of what it sent.
+    void receive(const uint8_t *mac, const uint8_t *data, int len) { onReceiveData(mac, data, len); }
+    void sent(const uint8_t *mac, bool delivered) { onDataSent(mac, delivered ? ESP_NOW_SEND_SUCCESS : ESP_NOW_SEND_FAIL); }
+
+protected:
+    esp_err_t transmit(const uint8_t *address, const uint8_t *frame, size_t size) override;
+
+private:
+    VirtualSecondaryModule *module;
+};
+
+/*
+ * A secondary module living on the radio bus of the simulation.
+ *
+ * It runs the SecondaryModule firmware, on its own ESP-NOW manager and clock,
+ * and feeds its flowmeters synthetic pulse trains.
+ */
+class VirtualSecondaryModule
+{
+public:
+    VirtualSecondaryModule(const uint8_t *macAddress, const virtual_secondary_config &config);
+    ~VirtualSecondaryModule();
+
+    bool isPaired() { return espNowManager->isServerAddressSet(); }
+
+    // Feeds the pulses due up to now and runs SecondaryModule::loop().
+    void loop();
+
+    const uint8_t *getMacAddress() { return macAddress; }
+    uint8_t getFlowmeterCount() { return config.flowmeterCount; }
+    // Changes the pulse train of a flowmeter, 0 stops it (a clogged nozzle).
+    void setPulseFrequency(uint8_t index, float frequency);
+    float getPulseFrequency(uint8_t index);
+    // Pulses a flowmeter should report over its refresh window.
+    float getExpectedPulseCount(uint8_t index);
+    // A module powered off neither receives nor sends anything.
+    void setPowered(bool powered) { this->powered = powered; }
+    // Flowmeters whose refresh rate was set by the main module.
+    uint32_t getRefreshRateUpdates() { return refreshRateUpdates; }
+    // Copies of reliable messages received again and not handled.
+    uint32_t getReliableDuplicates() { return espNowManager->getReliableDuplicateCount(); }
+
+    // Simulated time the counts answered for a sample were taken, 0 if that sample was not answered last.
+    uint64_t getSampleTrueTime(uint32_t sampleId) { return lastSampleId == sampleId ? lastSampleTrueTime : 0; }
+    BoomClock &getBoomClock() { return module->getBoomClock(); }
+    float getClockDrift() { return config.clockDrift; }
+
+private:
+    friend class VirtualESPNowManager;
+
+    macAddress_t macAddress;
+    virtual_secondary_config config;
+    NativeHAL::local_clock clock;
+    std::mt19937 random;
+
+    VirtualESPNowManager *espNowManager;
+    SecondaryModule *module;
+    float *pulsePeriods;
+    uint64_t *nextPulseTimes;
+
+    bool powered = true;
+    // The first loop() pairs, which blocks, so it runs on a task of its own
+    // as setup() would. The simulation runs the following ones.
+    bool isStarted = false;
+    std::atomic<bool> isSetUp{false};
+
+    // Observed on the frames in and out, the firmware keeps no record of them.
+    uint32_t refreshRateUpdates = 0;
+    uint32_t lastLatchId = 0;
+    uint64_t lastLatchTrueTime = 0;
+    uint32_t requestedSampleId = 0;
+    uint32_t lastSampleId = 0;
+    uint64_t lastSampleTrueTime = 0;
+
+    static void setupTaskFunction(void *arg);
+    void onSetRefreshRate(const uint8_t *data, int len);
+    esp_err_t transmit(const uint8_t *address, const uint8_t *frame, size_t size);
+};
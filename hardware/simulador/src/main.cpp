@@ -0,0 +1,832 @@
+#include <NativeHAL.h>
+#include <RadioBus.h>
+#include <ESPNowManager.h>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <vector>
+#include "MainModule.h"
+#include "GPS.h"
+#include "VirtualSecondaryModule.h"
+#include "VirtualGPSReceiver.h"
+#include "CaptureReplay.h"
+#include <ArduinoJson.h>
+
+/*
+ * Runs the main module firmware against virtual secondary modules, each one
+ * running the secondary module firmware, on a simulated ESP-NOW channel and
+ * reports acquisition latency and throughput.
+ *
+ * Usage: simulador [--secondaries=N] [--flowmeters=N[,N...]] [--duration=s] [--interval=ms]
+ *                  [--frequency=Hz] [--latency=us] [--jitter=us] [--loss=p] [--duplication=p]
+ *                  [--max-peers=N] [--seed=N] [--clog-at=s] [--clock-drift=ppm]
+ *                  [--dead=N] [--unicast] [--gps-log=path] [--capture=path] [--job-log=path] [--verbose]
+ *        simulador --replay=path [--speed=x] [--loss=p] [--duplication=p] [--seed=N] [--verbose]
+ *
+ * --unicast sends one data request per secondary instead of opening response
+ * slots with the latch. --gps-log replays a recorded NMEA log through the GPS
+ * UART instead of the synthetic track. --capture records the run as the main
+ * module would (see TrafficCapture) and writes the capture file at the end.
+ * --job-log writes the job log of the run (see JobLog) as /job_log serves it.
+ *
+ * --replay plays a capture downloaded from a main module through the
+ * firmware instead of simulating secondaries, see CaptureReplay. It runs as
+ * fast as possible, or at x times real time with --speed. The radio latency
+ * is the recorded one, loss and duplication still apply on top.
+ */
+
+#define SIMULATION_STEP 1000
+#define PAIRING_TIMEOUT 10000
+#define MAX_FLOWMETER_COUNTS 8
+#define GPS_UART 1
+
+typedef struct simulation_config
+{
+    uint8_t secondaryCount;
+    // Flowmeters of each secondary, assigned in turn when several are given.
+    uint8_t flowmeterCounts[MAX_FLOWMETER_COUNTS];
+    uint8_t flowmeterCountsSize;
+    uint32_t duration;
+    unsigned short acquisitionInterval;
+    float pulseFrequency;
+    // Seconds after the start when the first nozzle clogs, 0 to never clog it.
+    uint32_t clogAt;
+    // Secondary clocks run up to this many ppm away from the main module.
+    float clockDrift;
+    // Secondaries powered off halfway through the run, the last ones paired.
+    uint8_t deadCount;
+    bool unicast;
+    const char *gpsLogPath;
+    const char *capturePath;
+    const char *jobLogPath;
+    const char *replayPath;
+    // Replay pace relative to real time, 0 for as fast as possible.
+    float replaySpeed;
+    bool verbose;
+    radio_bus_config radio;
+} simulation_config;
+
+typedef struct simulation_stats
+{
+    std::vector<unsigned long> cycleLatencies;
+    // Cycles started after the dead secondaries were powered off, and their latencies.
+    std::vector<unsigned long> deadCycleLatencies;
+    unsigned long deadTimestamp;
+    uint32_t completeCycles;
+    uint64_t freshSecondaries;
+    double pulseCountError;
+    uint32_t pulseCountSamples;
+    double rateError;
+    uint32_t rateSamples;
+
+    // Per cycle, how far apart the fresh secondaries really sampled (us), and
+    // per response, how far its reported boom time is from when it sampled.
+    std::vector<unsigned long> sampleSpreads;
+    std::vector<unsigned long> sampleTimeErrors;
+    uint32_t unlatchedSamples;
+    uint32_t samples;
+
+    // Time from the clog until the published count or rate fell under half
+    // of the flow before it, 0 while not detected.
+    unsigned long clogTimestamp;
+    float clogPreviousFrequency;
+    unsigned long clogDetectedByCount;
+    unsigned long clogDetectedByRate;
+    unsigned long clogDetectedByAlert;
+
+    // Alerts raised by the nozzle monitor, other than the expected clog.
+    uint32_t alertCount;
+    uint32_t unexpectedAlertCount;
+    uint32_t lastAlertId;
+
+    // Flowmeters the refresh rate sent after the first cycle should reach, and the frames it took.
+    uint16_t refreshRateTargets;
+    uint32_t refreshRateFrames;
+
+    uint32_t socketMessages;
+    uint64_t socketBytes;
+    uint32_t alertSocketMessages;
+
+    // Fixes published by the GPS task, and their age when a snapshot was published.
+    uint32_t gpsFixes;
+    unsigned long lastGpsFixTimestamp;
+    std::vector<unsigned long> gpsFixAges;
+
+    // Litres the virtual nozzles really sprayed since the volumes were reset.
+    double trueVolume;
+} simulation_stats;
+
+static VirtualGPSReceiver *gpsReceiver = nullptr;
+
+static bool parseOption(const char *arg, const char *name, const char **value)
+{
+    const size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+    {
+        return false;
+    }
+
+    *value = arg + len + 1;
+    return true;
+}
+
+static bool parseArguments(int argc, char **argv, simulation_config &config)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value;
+        if (parseOption(argv[i], "--secondaries", &value))
+            config.secondaryCount = std::min(atoi(value), MAX_SECONDARY_MODULES);
+        else if (parseOption(argv[i], "--flowmeters", &value))
+        {
+            config.flowmeterCountsSize = 0;
+            for (const char *count = value; count != nullptr && config.flowmeterCountsSize < MAX_FLOWMETER_COUNTS; count = strchr(count, ','))
+            {
+                count += *count == ',' ? 1 : 0;
+                config.flowmeterCounts[config.flowmeterCountsSize++] = std::min(atoi(count), SECONDARY_MODULE_MAX_FLOWMETERS);
+            }
+        }
+        else if (parseOption(argv[i], "--duration", &value))
+            config.duration = atoi(value);
+        else if (parseOption(argv[i], "--interval", &value))
+            config.acquisitionInterval = atoi(value);
+        else if (parseOption(argv[i], "--frequency", &value))
+            config.pulseFrequency = atof(value);
+        else if (parseOption(argv[i], "--latency", &value))
+            config.radio.latency = atoi(value);
+        else if (parseOption(argv[i], "--jitter", &value))
+            config.radio.jitter = atoi(value);
+        else if (parseOption(argv[i], "--loss", &value))
+            config.radio.lossRate = atof(value);
+        else if (parseOption(argv[i], "--duplication", &value))
+            config.radio.duplicationRate = atof(value);
+        else if (parseOption(argv[i], "--clog-at", &value))
+            config.clogAt = atoi(value);
+        else if (parseOption(argv[i], "--clock-drift", &value))
+            config.clockDrift = atof(value);
+        else if (parseOption(argv[i], "--dead", &value))
+            config.deadCount = atoi(value);
+        else if (parseOption(argv[i], "--max-peers", &value))
+            config.radio.maxPeers = atoi(value);
+        else if (parseOption(argv[i], "--seed", &value))
+            config.radio.seed = atoi(value);
+        else if (parseOption(argv[i], "--gps-log", &value))
+            config.gpsLogPath = value;
+        else if (parseOption(argv[i], "--capture", &value))
+            config.capturePath = value;
+        else if (parseOption(argv[i], "--job-log", &value))
+            config.jobLogPath = value;
+        else if (parseOption(argv[i], "--replay", &value))
+            config.replayPath = value;
+        else if (parseOption(argv[i], "--speed", &value))
+            config.replaySpeed = atof(value);
+        else if (strcmp(argv[i], "--unicast") == 0)
+            config.unicast = true;
+        else if (strcmp(argv[i], "--verbose") == 0)
+            config.verbose = true;
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return false;
+        }
+    }
+
+    // The main module keeps one peer for the latch broadcast.
+    if (config.secondaryCount >= config.radio.maxPeers)
+    {
+        config.secondaryCount = config.radio.maxPeers - 1;
+        fprintf(stderr, "At most %u secondaries pair with %u peers, see --max-peers\n", config.secondaryCount, config.radio.maxPeers);
+    }
+    return true;
+}
+
+static void step(std::vector<VirtualSecondaryModule *> &secondaries)
+{
+    for (VirtualSecondaryModule *secondary : secondaries)
+    {
+        secondary->loop();
+    }
+
+    gpsReceiver->loop();
+
+    NativeHAL::advanceClock(SIMULATION_STEP);
+}
+
+static bool pairSecondaries(std::vector<VirtualSecondaryModule *> &secondaries)
+{
+    ESPNowCentralManager *central = MainModule::getInstance()->getEspNowCentralManager();
+    central->enablePairing();
+
+    const unsigned long start = millis();
+    bool allPaired = false;
+    while (!allPaired && millis() - start < PAIRING_TIMEOUT)
+    {
+        step(secondaries);
+
+        allPaired = true;
+        for (VirtualSecondaryModule *secondary : secondaries)
+        {
+            allPaired = allPaired && secondary->isPaired();
+        }
+    }
+
+    central->disablePairing();
+    return allPaired;
+}
+
+static void recordSnapshot(const flowmeters_snapshot *snapshot, std::vector<VirtualSecondaryModule *> &slotSecondaries, simulation_stats &stats)
+{
+    stats.cycleLatencies.push_back(snapshot->timestamp - snapshot->requestTimestamp);
+    if (stats.deadTimestamp != 0 && snapshot->requestTimestamp >= stats.deadTimestamp)
+    {
+        stats.deadCycleLatencies.push_back(snapshot->timestamp - snapshot->requestTimestamp);
+    }
+
+    uint8_t freshCount = 0;
+    uint64_t firstSampleTime = UINT64_MAX;
+    uint64_t lastSampleTime = 0;
+    for (uint8_t i = 0; i < snapshot->slavesCount && i < slotSecondaries.size(); i++)
+    {
+        if (!snapshot->isSlaveFresh(i))
+        {
+            continue;
+        }
+        freshCount++;
+
+        VirtualSecondaryModule *secondary = slotSecondaries[i];
+
+        const uint64_t sampleTrueTime = secondary->getSampleTrueTime(snapshot->sampleId);
+        if (sampleTrueTime != 0)
+        {
+            firstSampleTime = std::min(firstSampleTime, sampleTrueTime);
+            lastSampleTime = std::max(lastSampleTime, sampleTrueTime);
+        }
+        if (sampleTrueTime != 0 && snapshot->slavesSampleDelay[i] != SAMPLE_DELAY_UNKNOWN)
+        {
+            // The main module runs on the simulation clock, so its boom time is the true time.
+            const int64_t reported = snapshot->sampleTime + snapshot->slavesSampleDelay[i];
+            stats.sampleTimeErrors.push_back(llabs(reported - (int64_t)sampleTrueTime));
+        }
+        stats.unlatchedSamples += snapshot->slavesSampleLatched[i] ? 0 : 1;
+        stats.samples++;
+        const uint16_t offset = snapshot->slavesFlowmeterOffset[i];
+        for (uint8_t j = 0; j < snapshot->slavesFlowmeterCount[i]; j++)
+        {
+            // Counts only cover a full refresh window once the flowmeters ran that long.
+            const float expected = secondary->getExpectedPulseCount(j);
+            if (expected > 0 && snapshot->requestTimestamp >= SECONDARY_MODULE_REFRESH_RATE)
+            {
+                stats.pulseCountError += fabs(snapshot->data.flowmetersPulseCount[offset + j] - expected) / expected;
+                stats.pulseCountSamples++;
+            }
+
+            const float expectedRate = secondary->getPulseFrequency(j) * 1000;
+            if (expectedRate > 0 && snapshot->data.flowmetersRateConfidence[offset + j] > 0)
+            {
+                stats.rateError += fabs(snapshot->data.flowmetersRate[offset + j] - expectedRate) / expectedRate;
+                stats.rateSamples++;
+            }
+        }
+    }
+
+    if (stats.clogTimestamp != 0 && snapshot->slavesCount > 0 && snapshot->isSlaveFresh(0) && snapshot->requestTimestamp >= stats.clogTimestamp)
+    {
+        const uint16_t clogged = snapshot->slavesFlowmeterOffset[0];
+        const unsigned long delay = snapshot->timestamp - stats.clogTimestamp;
+        if (stats.clogDetectedByCount == 0 && snapshot->data.flowmetersPulseCount[clogged] < stats.clogPreviousFrequency * SECONDARY_MODULE_REFRESH_RATE / 1000 / 2)
+        {
+            stats.clogDetectedByCount = delay;
+        }
+        if (stats.clogDetectedByRate == 0 && snapshot->data.flowmetersRate[clogged] < stats.clogPreviousFrequency * 1000 / 2)
+        {
+            stats.clogDetectedByRate = delay;
+        }
+    }
+
+    if (lastSampleTime >= firstSampleTime)
+    {
+        stats.sampleSpreads.push_back(lastSampleTime - firstSampleTime);
+    }
+
+    stats.freshSecondaries += freshCount;
+    if (freshCount == snapshot->slavesCount)
+    {
+        stats.completeCycles++;
+    }
+}
+
+static void recordAlerts(NozzleMonitor *nozzleMonitor, bool verbose, simulation_stats &stats)
+{
+    nozzle_alert alerts[NOZZLE_MONITOR_ALERT_BUFFER_SIZE];
+    const uint8_t count = nozzleMonitor->copyAlerts(stats.lastAlertId, alerts, NOZZLE_MONITOR_ALERT_BUFFER_SIZE);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        const nozzle_alert &alert = alerts[i];
+        stats.alertCount++;
+        stats.lastAlertId = alert.id;
+
+        // The clogged nozzle is the first flowmeter of slot 0, always at offset 0.
+        if (stats.clogTimestamp != 0 && alert.nozzle == 0 && alert.state == NOZZLE_STATE_CLOGGED)
+        {
+            if (stats.clogDetectedByAlert == 0)
+            {
+                stats.clogDetectedByAlert = alert.timestamp - stats.clogTimestamp;
+            }
+            continue;
+        }
+
+        stats.unexpectedAlertCount++;
+        if (verbose)
+        {
+            printf("alert %u: nozzle %u state %u -> %u, rate %u mHz, section %u mHz\n",
+                   alert.id, alert.nozzle, alert.previousState, alert.state, alert.rate, alert.sectionRate);
+        }
+    }
+}
+
+static unsigned long percentile(std::vector<unsigned long> values, float fraction)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+
+    std::sort(values.begin(), values.end());
+    return values[std::min<size_t>(values.size() - 1, values.size() * fraction)];
+}
+
+// Downloads the capture the way the app does and writes it to path.
+static void writeCapture(const char *path)
+{
+    const String body = AsyncWebServer::getServer(80)->request(HTTP_GET, "/capture")->getResponseBody();
+    std::ofstream file(path, std::ios::binary);
+    file.write(body.data(), body.size());
+
+    TrafficCapture *capture = TrafficCapture::getInstance();
+    printf("capture: %zu bytes written to %s, %u records, %u dropped by the ring\n", body.size(), path, capture->getRecordCount(), capture->getDroppedCount());
+}
+
+// Downloads the job log the way the app does and writes it to path.
+static void writeJobLog(const char *path)
+{
+    const String body = AsyncWebServer::getServer(80)->request(HTTP_GET, "/job_log")->getResponseBody();
+    std::ofstream file(path, std::ios::binary);
+    file.write(body.data(), body.size());
+
+    printf("job log: %zu bytes written to %s\n", body.size(), path);
+}
+
+static int runReplay(simulation_config &config)
+{
+    CaptureReplay replay;
+    if (!replay.load(config.replayPath))
+    {
+        return 1;
+    }
+
+    NativeHAL::setConsoleEnabled(config.verbose);
+    // The recorded arrival times already carry the radio latency.
+    config.radio.latency = 0;
+    config.radio.jitter = 0;
+    RadioBus::getInstance()->configure(config.radio);
+    replay.attach();
+
+    MainModule *mainModule = MainModule::getInstance();
+    GPS *gps = GPS::getInstance();
+    mainModule->begin();
+
+    // One at a time, so every secondary gets its recorded slot.
+    ESPNowCentralManager *central = mainModule->getEspNowCentralManager();
+    central->enablePairing();
+    for (uint8_t i = 0; i < replay.getSlaves().size(); i++)
+    {
+        replay.sendPairRequest(i);
+        const unsigned long start = millis();
+        while (central->getSlavesCount() <= i && millis() - start < PAIRING_TIMEOUT)
+        {
+            NativeHAL::advanceClock(SIMULATION_STEP);
+        }
+    }
+    central->disablePairing();
+
+    mainModule->setAcquisitionInterval(replay.getAcquisitionInterval());
+    mainModule->setResponseSlotsEnabled(replay.isResponseSlotsEnabled());
+    RadioBus::getInstance()->resetStats();
+
+    std::vector<unsigned long> cycleLatencies;
+    uint32_t completeCycles = 0;
+    uint64_t freshSecondaries = 0;
+    uint32_t gpsFixes = 0;
+    unsigned long lastGpsFixTimestamp = 0;
+
+    const flowmeters_snapshot *initialSnapshot = mainModule->acquireSnapshot();
+    uint32_t lastVersion = initialSnapshot->version;
+    mainModule->releaseSnapshot(initialSnapshot);
+
+    const uint64_t start = NativeHAL::now();
+    const auto wallStart = std::chrono::steady_clock::now();
+    replay.start(GPS_UART);
+
+    // Once the records are out, the last cycle gets one interval to complete.
+    uint64_t end = UINT64_MAX;
+    while (NativeHAL::now() < end)
+    {
+        const uint64_t next = replay.loop();
+        if (replay.isFinished() && end == UINT64_MAX)
+        {
+            end = NativeHAL::now() + (uint64_t)mainModule->getAcquisitionInterval() * 1000;
+        }
+
+        const uint64_t now = NativeHAL::now();
+        NativeHAL::advanceClock(std::max<uint64_t>(1, std::min<uint64_t>(SIMULATION_STEP, std::min(next, end) - now)));
+
+        if (config.replaySpeed > 0)
+        {
+            std::this_thread::sleep_until(wallStart + std::chrono::microseconds((uint64_t)((NativeHAL::now() - start) / config.replaySpeed)));
+        }
+
+        gps_fix fix;
+        gps->getFix(fix);
+        if (fix.timestamp != lastGpsFixTimestamp)
+        {
+            lastGpsFixTimestamp = fix.timestamp;
+            gpsFixes++;
+        }
+
+        const flowmeters_snapshot *snapshot = mainModule->acquireSnapshot();
+        if (snapshot->version != lastVersion)
+        {
+            lastVersion = snapshot->version;
+            cycleLatencies.push_back(snapshot->timestamp - snapshot->requestTimestamp);
+
+            uint8_t freshCount = 0;
+            for (uint8_t i = 0; i < snapshot->slavesCount; i++)
+            {
+                freshCount += snapshot->isSlaveFresh(i) ? 1 : 0;
+            }
+            freshSecondaries += freshCount;
+            completeCycles += freshCount == snapshot->slavesCount ? 1 : 0;
+        }
+        mainModule->releaseSnapshot(snapshot);
+    }
+
+    const double wallTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    const double duration = (NativeHAL::now() - start) / 1000000.0;
+    const size_t cycles = cycleLatencies.size();
+    const capture_replay_stats &replayStats = replay.getStats();
+    const radio_bus_stats radio = RadioBus::getInstance()->getStats();
+
+    printf("capture: %s, %.1f s, %zu frames received, %u sent, %zu latches, %u records dropped by the ring\n",
+           config.replayPath, replay.getDuration() / 1000000.0, replay.getReceivedFrameCount(), replay.getSentFrameCount(),
+           replay.getRecordedLatchCount(), replay.getDroppedRecords());
+    printf("secondaries: %u paired of %zu recorded, acquisition interval %u ms, response slots %s\n",
+           central->getSlavesCount(), replay.getSlaves().size(), replay.getAcquisitionInterval(), replay.isResponseSlotsEnabled() ? "on" : "off");
+    printf("replayed: %.1f s in %.2f s wall time, %u frames injected, %u responses realigned, %u unaligned, %u skipped, %u gps bytes\n",
+           duration, wallTime, replayStats.framesInjected, replayStats.responsesRealigned, replayStats.framesUnaligned,
+           replayStats.framesSkipped, replayStats.gpsBytes);
+    printf("firmware: %zu latches (%zu recorded), %u frames sent (%u recorded)\n",
+           replay.getReplayedLatchCount(), replay.getRecordedLatchCount(),
+           radio.framesSent - replayStats.framesInjected - replayStats.reliableAcksSent, replay.getSentFrameCount());
+    printf("cycles: %zu (%.2f/s), complete %u (%.1f%%), fresh secondaries %.2f per cycle\n",
+           cycles, duration > 0 ? cycles / duration : 0.0, completeCycles, cycles > 0 ? 100.0 * completeCycles / cycles : 0.0,
+           cycles > 0 ? freshSecondaries / (double)cycles : 0.0);
+    printf("cycle latency ms: p50 %lu, p90 %lu, p99 %lu, max %lu\n",
+           percentile(cycleLatencies, 0.5f), percentile(cycleLatencies, 0.9f), percentile(cycleLatencies, 0.99f), percentile(cycleLatencies, 1.0f));
+    printf("gps fixes: %.2f/s\n", duration > 0 ? gpsFixes / duration : 0.0);
+
+    fflush(stdout);
+    _Exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    simulation_config config;
+    config.secondaryCount = 8;
+    config.flowmeterCounts[0] = 9;
+    config.flowmeterCountsSize = 1;
+    config.duration = 60;
+    config.acquisitionInterval = DEFAULT_ACQUISITION_INTERVAL;
+    config.pulseFrequency = 50;
+    config.clogAt = 0;
+    config.clockDrift = 50;
+    config.deadCount = 0;
+    config.unicast = false;
+    config.gpsLogPath = nullptr;
+    config.capturePath = nullptr;
+    config.jobLogPath = nullptr;
+    config.replayPath = nullptr;
+    config.replaySpeed = 0;
+    config.verbose = false;
+    config.radio = RadioBus::getInstance()->getConfig();
+
+    if (!parseArguments(argc, argv, config))
+    {
+        return 1;
+    }
+
+    if (config.replayPath != nullptr)
+    {
+        return runReplay(config);
+    }
+
+    NativeHAL::setConsoleEnabled(config.verbose);
+    RadioBus::getInstance()->configure(config.radio);
+
+    std::vector<VirtualSecondaryModule *> secondaries;
+    for (uint8_t i = 0; i < config.secondaryCount; i++)
+    {
+        const macAddress_t mac = {0x24, 0x0A, 0xC4, 0x10, 0x00, (uint8_t)(i + 1)};
+
+        virtual_secondary_config secondaryConfig;
+        secondaryConfig.flowmeterCount = config.flowmeterCounts[i % config.flowmeterCountsSize];
+        secondaryConfig.pulseFrequency = config.pulseFrequency;
+        // Nozzles of a healthy boom stay within about 10% of each other.
+        secondaryConfig.pulseFrequencySpread = 0.1f;
+        secondaryConfig.seed = config.radio.seed * 1000 + i;
+        secondaryConfig.clockOffset = (int64_t)(i + 1) * 7919113;
+        secondaryConfig.clockDrift = config.clockDrift * (2.0f * i / std::max(1, config.secondaryCount - 1) - 1);
+        secondaries.push_back(new VirtualSecondaryModule(mac, secondaryConfig));
+    }
+
+    // A tractor crossing the field at 18 km/h, behind a 10 Hz receiver still at its power-on settings.
+    virtual_gps_config gpsConfig;
+    gpsConfig.uart = GPS_UART;
+    gpsConfig.minMeasurementPeriod = 100;
+    gpsConfig.latitude = -22.7253;
+    gpsConfig.longitude = -47.6492;
+    gpsConfig.speed = 5.0f;
+    gpsConfig.course = 72.0f;
+    gpsConfig.logPath = config.gpsLogPath != nullptr ? config.gpsLogPath : "";
+    gpsConfig.seed = config.radio.seed;
+    gpsReceiver = new VirtualGPSReceiver(gpsConfig);
+
+    MainModule *mainModule = MainModule::getInstance();
+    GPS *gps = GPS::getInstance();
+    // The acquisition task runs loop() from here on, as on the module.
+    mainModule->begin();
+
+    if (!pairSecondaries(secondaries))
+    {
+        printf("warning: not every secondary module paired within %d ms\n", PAIRING_TIMEOUT);
+    }
+
+    mainModule->setAcquisitionInterval(config.acquisitionInterval);
+    mainModule->setResponseSlotsEnabled(!config.unicast);
+
+    // Slots follow the pairing order, which the radio jitter shuffles.
+    std::vector<VirtualSecondaryModule *> slotSecondaries;
+    ESPNowCentralManager *central = mainModule->getEspNowCentralManager();
+    for (uint8_t i = 0; i < central->getSlavesCount(); i++)
+    {
+        macAddress_t mac;
+        central->getSlaveMacAddress(i, static_cast<uint8_t *>(mac));
+        for (VirtualSecondaryModule *secondary : secondaries)
+        {
+            if (memcmp(secondary->getMacAddress(), mac, sizeof(macAddress_t)) == 0)
+            {
+                slotSecondaries.push_back(secondary);
+            }
+        }
+    }
+
+    simulation_stats stats = {};
+
+    AsyncWebSocket *dataSocket = AsyncWebServer::getServer(80)->getWebSocket("/ws/data");
+    dataSocket->connect({}, [&stats](const uint8_t *data, size_t len)
+                        {
+        stats.socketMessages++;
+        stats.socketBytes += len; });
+    AsyncWebSocket *alertsSocket = AsyncWebServer::getServer(80)->getWebSocket("/ws/alerts");
+    alertsSocket->connect({}, [&stats](const uint8_t *data, size_t len)
+                          { stats.alertSocketMessages++; });
+
+    RadioBus::getInstance()->resetStats();
+    mainModule->resetVolume();
+    AsyncWebServer::getServer(80)->request(HTTP_POST, "/clear_job_log");
+
+    // Started the way the app does, once the secondaries are set up.
+    if (config.capturePath != nullptr)
+    {
+        AsyncWebServer::getServer(80)->request(HTTP_POST, "/start_capture");
+    }
+
+    const unsigned long start = millis();
+    const auto wallStart = std::chrono::steady_clock::now();
+    const flowmeters_snapshot *initialSnapshot = mainModule->acquireSnapshot();
+    uint32_t lastVersion = initialSnapshot->version;
+    mainModule->releaseSnapshot(initialSnapshot);
+
+    while (millis() - start < config.duration * 1000)
+    {
+        if (config.clogAt > 0 && stats.clogTimestamp == 0 && millis() - start >= config.clogAt * 1000 && !slotSecondaries.empty())
+        {
+            stats.clogTimestamp = millis();
+            stats.clogPreviousFrequency = slotSecondaries[0]->getPulseFrequency(0);
+            slotSecondaries[0]->setPulseFrequency(0, 0);
+        }
+
+        if (config.deadCount > 0 && stats.deadTimestamp == 0 && millis() - start >= config.duration * 500)
+        {
+            stats.deadTimestamp = millis();
+            for (size_t i = slotSecondaries.size() - std::min<size_t>(config.deadCount, slotSecondaries.size()); i < slotSecondaries.size(); i++)
+            {
+                slotSecondaries[i]->setPowered(false);
+            }
+        }
+
+        step(secondaries);
+
+        for (VirtualSecondaryModule *secondary : secondaries)
+        {
+            for (uint8_t i = 0; i < secondary->getFlowmeterCount(); i++)
+            {
+                stats.trueVolume += secondary->getPulseFrequency(i) * SIMULATION_STEP / 1000000.0 * 1000 / APPLICATION_METER_DEFAULT_PULSES_PER_CUBIC_METER;
+            }
+        }
+
+        gps_fix fix;
+        gps->getFix(fix);
+        if (fix.timestamp != stats.lastGpsFixTimestamp)
+        {
+            stats.lastGpsFixTimestamp = fix.timestamp;
+            stats.gpsFixes++;
+        }
+
+        const flowmeters_snapshot *snapshot = mainModule->acquireSnapshot();
+        if (snapshot->version != lastVersion)
+        {
+            lastVersion = snapshot->version;
+            recordSnapshot(snapshot, slotSecondaries, stats);
+            if (fix.timestamp != 0)
+            {
+                stats.gpsFixAges.push_back(millis() - fix.timestamp);
+            }
+
+            // Address every nozzle of the boom once, through the global numbering.
+            if (stats.refreshRateTargets == 0 && snapshot->data.flowmeterCount > 0)
+            {
+                std::vector<uint16_t> nozzles;
+                for (uint16_t i = 0; i < snapshot->data.flowmeterCount; i++)
+                {
+                    nozzles.push_back(i);
+                }
+
+                const uint32_t framesSent = RadioBus::getInstance()->getStats().framesSent;
+                mainModule->setRefreshRate(SECONDARY_MODULE_REFRESH_RATE, nozzles);
+                stats.refreshRateFrames = RadioBus::getInstance()->getStats().framesSent - framesSent;
+                stats.refreshRateTargets = snapshot->data.flowmeterCount;
+            }
+        }
+        mainModule->releaseSnapshot(snapshot);
+
+        recordAlerts(mainModule->getNozzleMonitor(), config.verbose, stats);
+    }
+
+    const double wallTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    if (config.capturePath != nullptr)
+    {
+        writeCapture(config.capturePath);
+    }
+    if (config.jobLogPath != nullptr)
+    {
+        writeJobLog(config.jobLogPath);
+    }
+    const radio_bus_stats radio = RadioBus::getInstance()->getStats();
+    ESPNowManager *espNowManager = ESPNowManager::getInstance();
+    const size_t cycles = stats.cycleLatencies.size();
+
+    uint32_t refreshRateUpdates = 0;
+    uint32_t reliableDuplicates = 0;
+    uint32_t flowmeterCount = 0;
+    float maxDriftError = 0;
+    for (VirtualSecondaryModule *secondary : secondaries)
+    {
+        refreshRateUpdates += secondary->getRefreshRateUpdates();
+        reliableDuplicates += secondary->getReliableDuplicates();
+        flowmeterCount += secondary->getFlowmeterCount();
+
+        // The boom clock runs at 1 / (1 + local drift) of the local one.
+        const float estimatedDrift = -secondary->getBoomClock().getDrift() / 1000.0f;
+        maxDriftError = std::max(maxDriftError, fabsf(estimatedDrift - secondary->getClockDrift()));
+    }
+
+    printf("secondaries: %u registered of %u, %u flowmeters\n", central->getSlavesCount(), config.secondaryCount, flowmeterCount);
+    printf("simulated: %u s, acquisition interval %u ms, response slot %u us, wall time %.2f s\n", config.duration, mainModule->getAcquisitionInterval(), mainModule->getResponseSlotDuration(), wallTime);
+    printf("cycles: %zu (%.2f/s), complete %u (%.1f%%), fresh secondaries %.2f per cycle\n",
+           cycles, cycles / (double)config.duration, stats.completeCycles, cycles > 0 ? 100.0 * stats.completeCycles / cycles : 0.0,
+           cycles > 0 ? stats.freshSecondaries / (double)cycles : 0.0);
+    printf("cycle latency ms: p50 %lu, p90 %lu, p99 %lu, max %lu\n",
+           percentile(stats.cycleLatencies, 0.5f), percentile(stats.cycleLatencies, 0.9f), percentile(stats.cycleLatencies, 0.99f), percentile(stats.cycleLatencies, 1.0f));
+    if (stats.deadTimestamp != 0)
+    {
+        printf("cycle latency ms with %u dead: p50 %lu, p90 %lu, max %lu\n", config.deadCount,
+               percentile(stats.deadCycleLatencies, 0.5f), percentile(stats.deadCycleLatencies, 0.9f), percentile(stats.deadCycleLatencies, 1.0f));
+    }
+    printf("pulse count error: %.2f%% mean over %u readings\n", stats.pulseCountSamples > 0 ? 100.0 * stats.pulseCountError / stats.pulseCountSamples : 0.0, stats.pulseCountSamples);
+    printf("rate error: %.2f%% mean over %u readings\n", stats.rateSamples > 0 ? 100.0 * stats.rateError / stats.rateSamples : 0.0, stats.rateSamples);
+    if (stats.clogTimestamp != 0)
+    {
+        printf("clog detected after: %lu ms by count, %lu ms by rate, %lu ms by alert (0 = not detected)\n",
+               stats.clogDetectedByCount, stats.clogDetectedByRate, stats.clogDetectedByAlert);
+    }
+    printf("sampling: spread us p50 %lu, max %lu; boom time error us p50 %lu, max %lu; %u of %u unlatched\n",
+           percentile(stats.sampleSpreads, 0.5f), percentile(stats.sampleSpreads, 1.0f),
+           percentile(stats.sampleTimeErrors, 0.5f), percentile(stats.sampleTimeErrors, 1.0f), stats.unlatchedSamples, stats.samples);
+    printf("clock drift estimate: max error %.2f ppm\n", maxDriftError);
+    printf("refresh rate: %u of %u flowmeters updated with %u frames\n", refreshRateUpdates, stats.refreshRateTargets, stats.refreshRateFrames);
+    printf("reliable: %u delivered, %u failed, %u in flight, %u retransmits, %u refused, %u duplicates suppressed\n",
+           espNowManager->getReliableDeliveredCount(), espNowManager->getReliableFailedCount(), espNowManager->getReliableInFlightCount(),
+           espNowManager->getReliableRetransmitCount(), espNowManager->getReliableWindowFullCount(), reliableDuplicates);
+    printf("nozzle alerts: %u, %u unexpected\n", stats.alertCount, stats.unexpectedAlertCount);
+    std::vector<request_link_stats> links(MAX_SECONDARY_MODULES);
+    links.resize(mainModule->copyLinkStats(links.data(), MAX_SECONDARY_MODULES));
+    std::vector<unsigned long> rttP50s;
+    std::vector<unsigned long> rttP99s;
+    uint32_t requests = 0;
+    uint32_t retries = 0;
+    uint8_t degraded = 0;
+    for (const request_link_stats &link : links)
+    {
+        if (link.rttP50 > 0)
+        {
+            rttP50s.push_back(link.rttP50);
+            rttP99s.push_back(link.rttP99);
+        }
+        requests += link.requestCount;
+        retries += link.retryCount;
+        degraded += link.isDegraded ? 1 : 0;
+    }
+    printf("requests: %.2f per cycle, %u retries, %u degraded; rtt us p50 %lu to %lu, p99 up to %lu across secondaries\n",
+           cycles > 0 ? requests / (double)cycles : 0.0, retries, degraded,
+           percentile(rttP50s, 0.0f), percentile(rttP50s, 1.0f), percentile(rttP99s, 1.0f));
+    printf("radio: %u frames sent, %u received, %u lost, %u duplicated, %llu bytes, channel busy %.1f%%\n",
+           radio.framesSent, radio.framesDelivered, radio.framesLost, radio.framesDuplicated, (unsigned long long)radio.bytesSent,
+           100.0 * radio.airtime / (config.duration * 1000000.0));
+    printf("espnow receive queue: high watermark %u, dropped %u, dispatched %u\n",
+           espNowManager->getReceiveQueueHighWatermark(), espNowManager->getReceiveQueueDropCount(), espNowManager->getDispatchedFrameCount());
+    printf("gps: receiver at %lu baud every %u ms (%s), %u epochs, %u cut short; firmware at %lu baud every %u ms\n",
+           gpsReceiver->getBaudRate(), gpsReceiver->getMeasurementPeriod(), gpsReceiver->isReplaying() ? "replay" : "synthetic",
+           gpsReceiver->getEpochCount(), gpsReceiver->getTruncatedEpochCount(), (unsigned long)gps->getBaudRate(), gps->getMeasurementPeriod());
+    printf("gps fixes: %.2f/s, age at publish ms p50 %lu, p90 %lu, max %lu\n",
+           stats.gpsFixes / (double)config.duration, percentile(stats.gpsFixAges, 0.5f), percentile(stats.gpsFixAges, 0.9f), percentile(stats.gpsFixAges, 1.0f));
+    // Every nozzle keeps the default calibration, so the true flow follows from the pulse frequencies.
+    double trueFlow = 0;
+    for (VirtualSecondaryModule *secondary : secondaries)
+    {
+        for (uint8_t i = 0; i < secondary->getFlowmeterCount(); i++)
+        {
+            trueFlow += secondary->getPulseFrequency(i) * 1000 / APPLICATION_METER_DEFAULT_PULSES_PER_CUBIC_METER;
+        }
+    }
+    const double trueApplicationRate = trueFlow / (gpsConfig.speed * flowmeterCount * APPLICATION_METER_DEFAULT_SPACING / 1000.0) * 10000;
+    const flowmeters_snapshot *lastSnapshot = mainModule->acquireSnapshot();
+    printf("application: boom %.2f L/min (true %.2f), %.1f L/ha (true %.1f), %.2f L sprayed (true %.2f)\n",
+           lastSnapshot->boomApplication.flow * 60 / 1000000.0, trueFlow * 60,
+           lastSnapshot->boomApplication.applicationRate != APPLICATION_RATE_UNKNOWN ? lastSnapshot->boomApplication.applicationRate / 1000.0 : 0.0, trueApplicationRate,
+           lastSnapshot->boomApplication.volume / 1000.0, stats.trueVolume);
+    mainModule->releaseSnapshot(lastSnapshot);
+    printf("websocket: %u messages, %llu bytes, %u alert messages\n", stats.socketMessages, (unsigned long long)stats.socketBytes, stats.alertSocketMessages);
+
+    // What the app would read from /metrics, with the pulse rates the secondaries reported against the true ones.
+    const String metricsBody = AsyncWebServer::getServer(80)->request(HTTP_GET, "/metrics")->getResponseBody();
+    JsonDocument metrics;
+    deserializeJson(metrics, metricsBody.c_str());
+    uint8_t reportingSecondaries = 0;
+    double reportedPulseRate = 0;
+    uint32_t rttMax = 0;
+    for (JsonObject secondary : metrics["secondaryModules"].as<JsonArray>())
+    {
+        rttMax = std::max<uint32_t>(rttMax, secondary["rtt"]["max"].as<uint32_t>());
+        if (secondary["metrics"].isNull())
+        {
+            continue;
+        }
+        reportingSecondaries++;
+        for (float pulseRate : secondary["metrics"]["pulseRates"].as<JsonArray>())
+        {
+            reportedPulseRate += pulseRate;
+        }
+    }
+    double truePulseRate = 0;
+    for (VirtualSecondaryModule *secondary : secondaries)
+    {
+        for (uint8_t i = 0; i < secondary->getFlowmeterCount(); i++)
+        {
+            truePulseRate += secondary->getPulseFrequency(i) * 60;
+        }
+    }
+    printf("metrics: %u bytes, loop max %lu us, cycle mean %lu us, rtt max %lu us, %u/%u secondaries reporting, pulses %.0f/min (true %.0f)\n",
+           metricsBody.length(), metrics["loop"]["max"].as<unsigned long>(), metrics["acquisitionCycle"]["mean"].as<unsigned long>(), (unsigned long)rttMax,
+           reportingSecondaries, (unsigned)secondaries.size(), reportedPulseRate, truePulseRate);
+    printf("tasks: dispatch latency max %lu us, serialization max %lu us, %lu web events dropped\n",
+           metrics["espnow"]["dispatchLatency"]["max"].as<unsigned long>(), metrics["web"]["serialization"]["max"].as<unsigned long>(),
+           metrics["web"]["eventDrops"].as<unsigned long>());
+    printf("job log: %lu records, %lu idle cycles skipped, %lu dropped, %lu blocks written (max %lu us), %lu bytes in flash\n",
+           metrics["jobLog"]["records"].as<unsigned long>(), metrics["jobLog"]["idleCycles"].as<unsigned long>(),
+           metrics["jobLog"]["dropped"].as<unsigned long>(), metrics["jobLog"]["blocksWritten"].as<unsigned long>(),
+           metrics["jobLog"]["maxWriteTime"].as<unsigned long>(), metrics["jobLog"]["size"].as<unsigned long>());
+
+    // Task threads never return, skip the static destructors they could be using.
+    fflush(stdout);
+    _Exit(0);
+}
@@ -0,0 +1,333 @@
+#include <unity.h>
+#include <string.h>
+#include <FlowmeterFrame.h>
+
+/*
+ * FlowmeterFrame encoding and decoding, see esp_now_types.h for the format.
+ * Run with: pio test -e native
+ */
+
+#define TEST_CHANNELS 9
+// Largest secondary, as MAX_FLOWMETERS_PER_SECONDARY_MODULE of the main module.
+#define TEST_MAX_CHANNELS 32
+// Default refresh rate of the flowmeters, in milliseconds.
+#define TEST_COUNT_WINDOW 5000
+// Boot session of the sender, both bytes set.
+#define TEST_SESSION 0xBEEF
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+typedef struct test_channels
+{
+    flowmeter_data_t pulseCount[TEST_MAX_CHANNELS];
+    unsigned long lastPulseAge[TEST_MAX_CHANNELS];
+    uint32_t rate[TEST_MAX_CHANNELS];
+    uint8_t rateConfidence[TEST_MAX_CHANNELS];
+} test_channels;
+
+static flowmeters_data getData(test_channels &channels, uint16_t count, uint16_t countWindow = 0)
+{
+    return {count, channels.pulseCount, channels.lastPulseAge, channels.rate, channels.rateConfidence, countWindow};
+}
+
+// A secondary in the middle of a job, with an idle channel whose bit stays clear.
+static void fillChannels(test_channels &channels, uint16_t count)
+{
+    memset(&channels, 0, sizeof(channels));
+    for (uint16_t i = 0; i < count; i++)
+    {
+        if (i == 4)
+        {
+            continue;
+        }
+        channels.pulseCount[i] = 240 + i * 37;
+        channels.lastPulseAge[i] = 12 + i;
+        channels.rate[i] = 48000 + i * 1001;
+        channels.rateConfidence[i] = 200 + i;
+    }
+}
+
+static void test_varint_boundaries()
+{
+    const uint32_t values[] = {0, 127, 128, 16383, 16384, UINT32_MAX};
+    const size_t sizes[] = {1, 1, 2, 2, 3, 5};
+
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+        uint8_t buffer[5];
+        TEST_ASSERT_EQUAL_UINT(sizes[i], FlowmeterFrame::writeVarint(buffer, sizeof(buffer), values[i]));
+
+        uint32_t value = 1;
+        TEST_ASSERT_EQUAL_UINT(sizes[i], FlowmeterFrame::readVarint(buffer, sizes[i], value));
+        TEST_ASSERT_EQUAL_UINT32(values[i], value);
+
+        // One byte short is refused on both sides.
+        TEST_ASSERT_EQUAL_UINT(0, FlowmeterFrame::writeVarint(buffer, sizes[i] - 1, values[i]));
+        TEST_ASSERT_EQUAL_UINT(0, FlowmeterFrame::readVarint(buffer, sizes[i] - 1, value));
+    }
+
+    // 127 and 128 are where a second byte starts.
+    uint8_t buffer[2];
+    FlowmeterFrame::writeVarint(buffer, sizeof(buffer), 127);
+    TEST_ASSERT_EQUAL_HEX8(0x7F, buffer[0]);
+    FlowmeterFrame::writeVarint(buffer, sizeof(buffer), 128);
+    TEST_ASSERT_EQUAL_HEX8(0x80, buffer[0]);
+    TEST_ASSERT_EQUAL_HEX8(0x01, buffer[1]);
+}
+
+static void test_varint_overflow()
+{
+    // UINT32_MAX is the most a fifth byte can carry.
+    const uint8_t largest[] = {0xFF, 0xFF, 0xFF, 0xFF, 0x0F};
+    uint32_t value = 0;
+    TEST_ASSERT_EQUAL_UINT(5, FlowmeterFrame::readVarint(largest, sizeof(largest), value));
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, value);
+
+    // Bits past 32, and a sixth byte, are refused rather than truncated.
+    const uint8_t overflowing[] = {0xFF, 0xFF, 0xFF, 0xFF, 0x1F};
+    TEST_ASSERT_EQUAL_UINT(0, FlowmeterFrame::readVarint(overflowing, sizeof(overflowing), value));
+    const uint8_t overLong[] = {0x80, 0x80, 0x80, 0x80, 0x80, 0x00};
+    TEST_ASSERT_EQUAL_UINT(0, FlowmeterFrame::readVarint(overLong, sizeof(overLong), value));
+
+    // So is a frame carrying one, like a truncated frame. The sequence follows the version and flags.
+    test_channels sent;
+    fillChannels(sent, TEST_CHANNELS);
+    uint8_t buffer[FLOWMETER_FRAME_MAX_SIZE];
+    const size_t size = FlowmeterFrame::encode(buffer, sizeof(buffer), TEST_SESSION, UINT32_MAX, getData(sent, TEST_CHANNELS));
+    TEST_ASSERT_GREATER_THAN(0, size);
+
+    test_channels received;
+    flowmeter_frame_header header;
+    TEST_ASSERT_TRUE(FlowmeterFrame::decode(buffer, size, header, getData(received, TEST_CHANNELS), TEST_CHANNELS));
+    buffer[2 + 4] = 0x1F;
+    TEST_ASSERT_FALSE(FlowmeterFrame::decode(buffer, size, header, getData(received, TEST_CHANNELS), TEST_CHANNELS));
+}
+
+static void test_round_trip()
+{
+    test_channels sent;
+    fillChannels(sent, TEST_CHANNELS);
+    const flowmeter_sample_info sample = {3600, 3600000123, true};
+
+    uint8_t buffer[FLOWMETER_FRAME_MAX_SIZE];
+    const size_t size = FlowmeterFrame::encode(buffer, sizeof(buffer), TEST_SESSION, 70000, getData(sent, TEST_CHANNELS), &sample);
+    TEST_ASSERT_GREATER_THAN(0, size);
+
+    test_channels received;
+    memset(&received, 0xAA, sizeof(received));
+    flowmeter_frame_header header;
+    TEST_ASSERT_TRUE(FlowmeterFrame::decode(buffer, size, header, getData(received, TEST_CHANNELS), TEST_CHANNELS));
+
+    TEST_ASSERT_EQUAL_UINT8(FLOWMETER_FRAME_VERSION, header.version);
+    TEST_ASSERT_EQUAL_UINT8(FLOWMETER_FRAME_FLAG_RATE | FLOWMETER_FRAME_FLAG_SAMPLE | FLOWMETER_FRAME_FLAG_LATCHED, header.flags);
+    TEST_ASSERT_EQUAL_UINT32(70000, header.sequence);
+    TEST_ASSERT_EQUAL_UINT16(TEST_SESSION, header.session);
+    TEST_ASSERT_EQUAL_UINT32(sample.id, header.sample.id);
+    TEST_ASSERT_EQUAL_UINT32(sample.time, header.sample.time);
+    TEST_ASSERT_TRUE(header.sample.isLatched);
+    TEST_ASSERT_EQUAL_UINT8(TEST_CHANNELS, header.channelCount);
+    for (uint8_t i = 0; i < TEST_CHANNELS; i++)
+    {
+        TEST_ASSERT_EQUAL_UINT16(sent.pulseCount[i], received.pulseCount[i]);
+        TEST_ASSERT_EQUAL_UINT32(sent.lastPulseAge[i], received.lastPulseAge[i]);
+        TEST_ASSERT_EQUAL_UINT32(sent.rate[i], received.rate[i]);
+        TEST_ASSERT_EQUAL_UINT8(sent.rateConfidence[i], received.rateConfidence[i]);
+    }
+}
+
+static void test_round_trip_without_sample_or_rates()
+{
+    test_channels sent;
+    fillChannels(sent, TEST_CHANNELS);
+    const flowmeters_data data = {TEST_CHANNELS, sent.pulseCount, sent.lastPulseAge, nullptr, nullptr, 0};
+
+    uint8_t buffer[FLOWMETER_FRAME_MAX_SIZE];
+    const size_t size = FlowmeterFrame::encode(buffer, sizeof(buffer), TEST_SESSION, 1, data);
+    TEST_ASSERT_GREATER_THAN(0, size);
+    // Well below the 55 bytes of the fixed layout it replaced, which had the same fields.
+    TEST_ASSERT_LESS_THAN(55, size);
+
+    test_channels received;
+    memset(&received, 0xAA, sizeof(received));
+    flowmeter_frame_header header;
+    TEST_ASSERT_TRUE(FlowmeterFrame::decode(buffer, size, header, getData(received, TEST_CHANNELS), TEST_CHANNELS));
+
+    TEST_ASSERT_EQUAL_UINT8(0, header.flags);
+    TEST_ASSERT_EQUAL_UINT32(0, header.sample.id);
+    for (uint8_t i = 0; i < TEST_CHANNELS; i++)
+    {
+        TEST_ASSERT_EQUAL_UINT16(sent.pulseCount[i], received.pulseCount[i]);
+        TEST_ASSERT_EQUAL_UINT32(sent.lastPulseAge[i], received.lastPulseAge[i]);
+        TEST_ASSERT_EQUAL_UINT32(0, received.rate[i]);
+        TEST_ASSERT_EQUAL_UINT8(0, received.rateConfidence[i]);
+    }
+}
+
+static void test_count_mode_rates()
+{
+    // A steady boom: every channel but one reports the rate of its count over the window.
+    test_channels sent;
+    fillChannels(sent, TEST_CHANNELS);
+    for (uint8_t i = 0; i < TEST_CHANNELS; i++)
+    {
+        if (i != 4 && i != 7)
+        {
+            sent.rate[i] = FlowmeterFrame::getCountRate(sent.pulseCount[i], TEST_COUNT_WINDOW);
+            sent.rateConfidence[i] = 255;
+        }
+    }
+    // Stopped: no pulse in the window, certain of it.
+    sent.pulseCount[8] = 0;
+    sent.lastPulseAge[8] = 9000;
+    sent.rate[8] = 0;
+    const flowmeter_sample_info sample = {3600, 3600000123, true};
+
+    uint8_t buffer[FLOWMETER_FRAME_MAX_SIZE];
+    const size_t size = FlowmeterFrame::encode(buffer, sizeof(buffer), TEST_SESSION, 70000, getData(sent, TEST_CHANNELS, TEST_COUNT_WINDOW), &sample);
+    TEST_ASSERT_GREATER_THAN(0, size);
+    // No larger than the fixed layout, rates included.
+    TEST_ASSERT_LESS_OR_EQUAL(55, size);
+    // Only channel 7 carries its rate: a varint and a confidence byte more than the same frame with every rate derived.
+    sent.rate[7] = FlowmeterFrame::getCountRate(sent.pulseCount[7], TEST_COUNT_WINDOW);
+    sent.rateConfidence[7] = 255;
+    uint8_t derived[FLOWMETER_FRAME_MAX_SIZE];
+    TEST_ASSERT_EQUAL_UINT(size - 4, FlowmeterFrame::encode(derived, sizeof(derived), TEST_SESSION, 70000, getData(sent, TEST_CHANNELS, TEST_COUNT_WINDOW), &sample));
+    sent.rate[7] = 48000 + 7 * 1001;
+    sent.rateConfidence[7] = 200 + 7;
+
+    test_channels received;
+    memset(&received, 0xAA, sizeof(received));
+    flowmeter_frame_header header;
+    TEST_ASSERT_TRUE(FlowmeterFrame::decode(buffer, size, header, getData(received, TEST_CHANNELS), TEST_CHANNELS));
+    TEST_ASSERT_EQUAL_UINT8(FLOWMETER_FRAME_FLAG_RATE | FLOWMETER_FRAME_FLAG_SAMPLE | FLOWMETER_FRAME_FLAG_LATCHED, header.flags);
+    for (uint8_t i = 0; i < TEST_CHANNELS; i++)
+    {
+        TEST_ASSERT_EQUAL_UINT16(sent.pulseCount[i], received.pulseCount[i]);
+        TEST_ASSERT_EQUAL_UINT32(sent.lastPulseAge[i], received.lastPulseAge[i]);
+        TEST_ASSERT_EQUAL_UINT32(sent.rate[i], received.rate[i]);
+        TEST_ASSERT_EQUAL_UINT8(sent.rateConfidence[i], received.rateConfidence[i]);
+    }
+
+    for (size_t len = 0; len < size; len++)
+    {
+        TEST_ASSERT_FALSE_MESSAGE(FlowmeterFrame::decode(buffer, len, header, getData(received, TEST_CHANNELS), TEST_CHANNELS), "truncated frame decoded");
+    }
+}
+
+static void test_truncated_frame()
+{
+    test_channels sent;
+    fillChannels(sent, TEST_CHANNELS);
+    const flowmeter_sample_info sample = {3600, 3600000123, true};
+
+    uint8_t buffer[FLOWMETER_FRAME_MAX_SIZE];
+    const size_t size = FlowmeterFrame::encode(buffer, sizeof(buffer), TEST_SESSION, 70000, getData(sent, TEST_CHANNELS), &sample);
+
+    // Every prefix is refused, and so is a trailing byte.
+    test_channels received;
+    flowmeter_frame_header header;
+    for (size_t len = 0; len < size; len++)
+    {
+        TEST_ASSERT_FALSE_MESSAGE(FlowmeterFrame::decode(buffer, len, header, getData(received, TEST_CHANNELS), TEST_CHANNELS), "truncated frame decoded");
+    }
+    buffer[size] = 0;
+    TEST_ASSERT_FALSE(FlowmeterFrame::decode(buffer, size + 1, header, getData(received, TEST_CHANNELS), TEST_CHANNELS));
+
+    // Encoding into a buffer too small gives nothing rather than a cut frame.
+    TEST_ASSERT_EQUAL_UINT(0, FlowmeterFrame::encode(buffer, 8, TEST_SESSION, 70000, getData(sent, TEST_CHANNELS), &sample));
+}
+
+static void test_bad_version()
+{
+    test_channels sent;
+    fillChannels(sent, TEST_CHANNELS);
+
+    uint8_t buffer[FLOWMETER_FRAME_MAX_SIZE];
+    const size_t size = FlowmeterFrame::encode(buffer, sizeof(buffer), TEST_SESSION, 1, getData(sent, TEST_CHANNELS));
+    TEST_ASSERT_GREATER_THAN(0, size);
+
+    test_channels received;
+    flowmeter_frame_header header;
+    buffer[0] = FLOWMETER_FRAME_VERSION + 1;
+    TEST_ASSERT_FALSE(FlowmeterFrame::decode(buffer, size, header, getData(received, TEST_CHANNELS), TEST_CHANNELS));
+    buffer[0] = 0;
+    TEST_ASSERT_FALSE(FlowmeterFrame::decode(buffer, size, header, getData(received, TEST_CHANNELS), TEST_CHANNELS));
+}
+
+static void test_max_channels()
+{
+    test_channels sent;
+    fillChannels(sent, TEST_CHANNELS);
+
+    uint8_t buffer[FLOWMETER_FRAME_MAX_SIZE];
+    const size_t size = FlowmeterFrame::encode(buffer, sizeof(buffer), TEST_SESSION, 1, getData(sent, TEST_CHANNELS));
+
+    // More channels than the destination holds: refused, and nothing past maxChannels is written.
+    test_channels received;
+    memset(&received, 0xAA, sizeof(received));
+    flowmeter_frame_header header;
+    TEST_ASSERT_FALSE(FlowmeterFrame::decode(buffer, size, header, getData(received, TEST_CHANNELS - 1), TEST_CHANNELS - 1));
+    TEST_ASSERT_EQUAL_UINT8(TEST_CHANNELS, header.channelCount);
+    TEST_ASSERT_EACH_EQUAL_HEX8(0xAA, reinterpret_cast<uint8_t *>(&received), sizeof(received));
+
+    // Validation only, to size the destination from the header first.
+    const flowmeters_data none = {0, nullptr, nullptr, nullptr, nullptr, 0};
+    TEST_ASSERT_TRUE(FlowmeterFrame::decode(buffer, size, header, none, UINT8_MAX));
+    TEST_ASSERT_EQUAL_UINT8(TEST_CHANNELS, header.channelCount);
+}
+
+static void test_rates_dropped_on_overflow()
+{
+    // A full module with large values does not fit with its rates.
+    test_channels sent;
+    memset(&sent, 0, sizeof(sent));
+    for (uint8_t i = 0; i < TEST_MAX_CHANNELS; i++)
+    {
+        sent.pulseCount[i] = UINT16_MAX;
+        sent.lastPulseAge[i] = 100000 + i;
+        sent.rate[i] = UINT32_MAX - i;
+        sent.rateConfidence[i] = 255;
+    }
+    const flowmeter_sample_info sample = {UINT32_MAX, UINT32_MAX, true};
+    const flowmeters_data data = getData(sent, TEST_MAX_CHANNELS);
+
+    uint8_t buffer[FLOWMETER_FRAME_MAX_SIZE];
+    const size_t size = FlowmeterFrame::encode(buffer, sizeof(buffer), TEST_SESSION, UINT32_MAX, data, &sample);
+    TEST_ASSERT_GREATER_THAN(0, size);
+    TEST_ASSERT_LESS_OR_EQUAL(FLOWMETER_FRAME_MAX_SIZE, size);
+
+    test_channels received;
+    memset(&received, 0xAA, sizeof(received));
+    flowmeter_frame_header header;
+    TEST_ASSERT_TRUE(FlowmeterFrame::decode(buffer, size, header, getData(received, TEST_MAX_CHANNELS), TEST_MAX_CHANNELS));
+    TEST_ASSERT_EQUAL_UINT8(0, header.flags & FLOWMETER_FRAME_FLAG_RATE);
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, header.sequence);
+    for (uint8_t i = 0; i < TEST_MAX_CHANNELS; i++)
+    {
+        TEST_ASSERT_EQUAL_UINT16(UINT16_MAX, received.pulseCount[i]);
+        TEST_ASSERT_EQUAL_UINT32(sent.lastPulseAge[i], received.lastPulseAge[i]);
+        TEST_ASSERT_EQUAL_UINT32(0, received.rate[i]);
+        TEST_ASSERT_EQUAL_UINT8(0, received.rateConfidence[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_varint_boundaries);
+    RUN_TEST(test_varint_overflow);
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_round_trip_without_sample_or_rates);
+    RUN_TEST(test_count_mode_rates);
+    RUN_TEST(test_truncated_frame);
+    RUN_TEST(test_bad_version);
+    RUN_TEST(test_max_channels);
+    RUN_TEST(test_rates_dropped_on_overflow);
+    return UNITY_END();
+}